@@ -0,0 +1,331 @@
+/*
+ * Per LU I/O profile
+ *
+ * Every READ/WRITE is folded into a handful of counters on the
+ * submission path: a transfer size histogram, the sequential share,
+ * an inter-arrival histogram and a coarse heatmap of the LBA space.
+ * Counters are halved every LU_AN_HALF_LIFE so that the profile
+ * follows the workload instead of its whole history. It is off until
+ * enabled with analytics=on, so other LUs don't pay for the clock read.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+#include "scsi.h"
+
+#define LU_AN_HALF_LIFE		(300ULL * 1000000)	/* usecs */
+#define LU_AN_HOT_REGIONS	8
+
+static const char *size_label[LU_AN_SIZE_BUCKETS] = {
+	"<1K", "1K", "2K", "4K", "8K", "16K",
+	"32K", "64K", "128K", "256K", "512K", "1M+",
+};
+
+static const char *gap_label[LU_AN_GAP_BUCKETS] = {
+	"<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", "1s+",
+};
+
+static const char *dir_label[LU_AN_DIRS] = {
+	"read", "write",
+};
+
+static uint64_t an_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void an_halve(uint64_t *v, size_t nr, unsigned int shift)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		v[i] = shift < 64 ? v[i] >> shift : 0;
+}
+
+#define an_halve_array(a, shift) \
+	an_halve((uint64_t *)(a), sizeof(a) / sizeof(uint64_t), shift)
+
+static void an_decay(struct lu_analytics *an, uint64_t now)
+{
+	uint64_t periods;
+
+	if (!an->decay_stamp) {
+		an->decay_stamp = now;
+		return;
+	}
+	if (now - an->decay_stamp < LU_AN_HALF_LIFE)
+		return;
+
+	periods = (now - an->decay_stamp) / LU_AN_HALF_LIFE;
+	an->decay_stamp += periods * LU_AN_HALF_LIFE;
+	if (periods > 64)
+		periods = 64;
+
+	an_halve_array(an->cmds, periods);
+	an_halve_array(an->bytes, periods);
+	an_halve_array(an->seq_cmds, periods);
+	an_halve_array(an->size_hist, periods);
+	an_halve_array(an->gap_hist, periods);
+	an_halve_array(an->heat, periods);
+}
+
+static unsigned int an_size_bucket(uint32_t len)
+{
+	unsigned int b;
+
+	if (len < 1024)
+		return 0;
+	b = 31 - __builtin_clz(len) - 9;
+	return min_t(unsigned int, b, LU_AN_SIZE_BUCKETS - 1);
+}
+
+static unsigned int an_gap_bucket(uint64_t gap)
+{
+	unsigned int b = 0;
+	uint64_t limit = 10;
+
+	while (b < LU_AN_GAP_BUCKETS - 1 && gap >= limit) {
+		limit *= 10;
+		b++;
+	}
+	return b;
+}
+
+/* the smallest region size that covers the LU in LU_AN_HEAT_BUCKETS */
+static void an_heat_resize(struct lu_analytics *an, uint64_t size)
+{
+	uint64_t top = size ? (size - 1) / LU_AN_HEAT_BUCKETS : 0;
+
+	an->heat_size = size;
+	an->heat_shift = top ? 64 - __builtin_clzll(top) : 0;
+	memset(an->heat, 0, sizeof(an->heat));
+}
+
+static void an_stream(struct lu_analytics *an, int dir, uint64_t off,
+		      uint64_t end)
+{
+	unsigned int i;
+
+	for (i = 0; i < LU_AN_STREAMS; i++) {
+		if (an->stream_end[dir][i] == off && off) {
+			an->stream_end[dir][i] = end;
+			an->seq_cmds[dir]++;
+			return;
+		}
+	}
+
+	i = an->stream_next[dir];
+	an->stream_end[dir][i] = end;
+	an->stream_next[dir] = (i + 1) % LU_AN_STREAMS;
+}
+
+void lu_analytics_record(struct scsi_cmd *cmd)
+{
+	struct scsi_lu *lu = cmd->dev;
+	struct lu_analytics *an = &lu->analytics;
+	uint64_t now, off, region;
+	uint32_t len;
+	int dir;
+
+	switch (cmd->scb[0]) {
+	case READ_6:
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		dir = LU_AN_READ;
+		len = scsi_get_in_length(cmd);
+		break;
+	case WRITE_6:
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_12:
+	case WRITE_VERIFY_16:
+		dir = LU_AN_WRITE;
+		len = scsi_get_out_length(cmd);
+		break;
+	default:
+		return;
+	}
+
+	/* commands for a missing LUN are routed to LUN 0 */
+	if (lu->lun != cmd->dev_id)
+		return;
+
+	now = an_now();
+	an_decay(an, now);
+
+	if (an->last_arrival)
+		an->gap_hist[an_gap_bucket(now - an->last_arrival)]++;
+	an->last_arrival = now;
+
+	an->cmds[dir]++;
+	an->bytes[dir] += len;
+	an->size_hist[dir][an_size_bucket(len)]++;
+
+	off = scsi_rw_offset(cmd->scb) << lu->blk_shift;
+	an_stream(an, dir, off, off + len);
+
+	if (an->heat_size != lu->size)
+		an_heat_resize(an, lu->size);
+	region = off >> an->heat_shift;
+	if (region < LU_AN_HEAT_BUCKETS)
+		an->heat[region][dir]++;
+}
+
+static unsigned int an_seq_pct(struct lu_analytics *an, int dir)
+{
+	return an->cmds[dir] ? an->seq_cmds[dir] * 100 / an->cmds[dir] : 0;
+}
+
+/* indices of the busiest regions, hottest first */
+static int an_hot_regions(struct lu_analytics *an, int *hot)
+{
+	uint64_t heat, best_heat;
+	int i, j, nr = 0, best;
+
+	while (nr < LU_AN_HOT_REGIONS) {
+		best = -1;
+		best_heat = 0;
+		for (i = 0; i < LU_AN_HEAT_BUCKETS; i++) {
+			heat = an->heat[i][LU_AN_READ] + an->heat[i][LU_AN_WRITE];
+			if (heat <= best_heat)
+				continue;
+			for (j = 0; j < nr; j++)
+				if (hot[j] == i)
+					break;
+			if (j < nr)
+				continue;
+			best = i;
+			best_heat = heat;
+		}
+		if (best < 0)
+			break;
+		hot[nr++] = best;
+	}
+
+	return nr;
+}
+
+static void an_show_text(struct lu_analytics *an, int enabled,
+			 struct concat_buf *b)
+{
+	int hot[LU_AN_HOT_REGIONS];
+	int d, i, nr;
+
+	concat_printf(b, "Enabled: %s\n", enabled ? "yes" : "no");
+	concat_printf(b, "Half-life: %llus\n", LU_AN_HALF_LIFE / 1000000);
+	for (d = 0; d < LU_AN_DIRS; d++)
+		concat_printf(b, "%s: cmds %" PRIu64 ", bytes %" PRIu64
+			      ", sequential %u%%\n", dir_label[d],
+			      an->cmds[d], an->bytes[d], an_seq_pct(an, d));
+
+	concat_printf(b, "Size histogram (read write):\n");
+	for (i = 0; i < LU_AN_SIZE_BUCKETS; i++)
+		concat_printf(b, "    %-5s %" PRIu64 " %" PRIu64 "\n",
+			      size_label[i], an->size_hist[LU_AN_READ][i],
+			      an->size_hist[LU_AN_WRITE][i]);
+
+	concat_printf(b, "Inter-arrival histogram:\n");
+	for (i = 0; i < LU_AN_GAP_BUCKETS; i++)
+		concat_printf(b, "    %-6s %" PRIu64 "\n", gap_label[i],
+			      an->gap_hist[i]);
+
+	nr = an_hot_regions(an, hot);
+	concat_printf(b, "Hot regions (offset length read write):\n");
+	for (i = 0; i < nr; i++)
+		concat_printf(b, "    %" PRIu64 " %" PRIu64 " %" PRIu64
+			      " %" PRIu64 "\n",
+			      (uint64_t)hot[i] << an->heat_shift,
+			      1ULL << an->heat_shift,
+			      an->heat[hot[i]][LU_AN_READ],
+			      an->heat[hot[i]][LU_AN_WRITE]);
+}
+
+static void an_show_json(struct lu_analytics *an, int enabled,
+			 struct concat_buf *b)
+{
+	int hot[LU_AN_HOT_REGIONS];
+	int d, i, nr;
+
+	concat_printf(b, "{\"enabled\": %s, \"half_life\": %llu",
+		      enabled ? "true" : "false", LU_AN_HALF_LIFE / 1000000);
+	for (d = 0; d < LU_AN_DIRS; d++) {
+		concat_printf(b, ", \"%s\": {\"cmds\": %" PRIu64
+			      ", \"bytes\": %" PRIu64
+			      ", \"sequential_pct\": %u, \"sizes\": {",
+			      dir_label[d], an->cmds[d], an->bytes[d],
+			      an_seq_pct(an, d));
+		for (i = 0; i < LU_AN_SIZE_BUCKETS; i++)
+			concat_printf(b, "%s\"%s\": %" PRIu64, i ? ", " : "",
+				      size_label[i], an->size_hist[d][i]);
+		concat_printf(b, "}}");
+	}
+
+	concat_printf(b, ", \"inter_arrival\": {");
+	for (i = 0; i < LU_AN_GAP_BUCKETS; i++)
+		concat_printf(b, "%s\"%s\": %" PRIu64, i ? ", " : "",
+			      gap_label[i], an->gap_hist[i]);
+
+	nr = an_hot_regions(an, hot);
+	concat_printf(b, "}, \"region_size\": %llu, \"hot_regions\": [",
+		      1ULL << an->heat_shift);
+	for (i = 0; i < nr; i++)
+		concat_printf(b, "%s{\"offset\": %" PRIu64 ", \"read\": %"
+			      PRIu64 ", \"write\": %" PRIu64 "}",
+			      i ? ", " : "",
+			      (uint64_t)hot[i] << an->heat_shift,
+			      an->heat[hot[i]][LU_AN_READ],
+			      an->heat[hot[i]][LU_AN_WRITE]);
+	concat_printf(b, "]}\n");
+}
+
+/* value is "on" or "off", turning on starts from a clean profile */
+tgtadm_err lu_analytics_enable(struct scsi_lu *lu, char *value)
+{
+	if (!strcmp(value, "on")) {
+		if (!lu->analytics_on)
+			memset(&lu->analytics, 0, sizeof(lu->analytics));
+		lu->analytics_on = 1;
+	} else if (!strcmp(value, "off"))
+		lu->analytics_on = 0;
+	else
+		return TGTADM_INVALID_REQUEST;
+
+	return TGTADM_SUCCESS;
+}
+
+/* value is "text", "json" or "reset" */
+tgtadm_err lu_analytics_show(struct scsi_lu *lu, char *value,
+			     struct concat_buf *b)
+{
+	struct lu_analytics *an = &lu->analytics;
+
+	if (!strcmp(value, "reset")) {
+		memset(an, 0, sizeof(*an));
+		return TGTADM_SUCCESS;
+	}
+
+	an_decay(an, an_now());
+	if (an->heat_size != lu->size)
+		an_heat_resize(an, lu->size);
+
+	if (!strcmp(value, "json"))
+		an_show_json(an, lu->analytics_on, b);
+	else if (!strcmp(value, "text") || !*value)
+		an_show_text(an, lu->analytics_on, b);
+	else
+		return TGTADM_INVALID_REQUEST;
+
+	return TGTADM_SUCCESS;
+}
@@ -414,6 +414,10 @@ tgtadm_err bs_thread_open(struct bs_thread_info *info, request_func_t *rfn,
 	pthread_cond_init(&info->pending_cond, NULL);
 	pthread_mutex_init(&info->pending_lock, NULL);
 
+	INIT_LIST_HEAD(&info->sync_group.waiters);
+	pthread_cond_init(&info->sync_group.cond, NULL);
+	pthread_mutex_init(&info->sync_group.lock, NULL);
+
 	for (i = 0; i < nr_threads; i++) {
 		ret = pthread_create(&info->worker_thread[i], NULL,
 				     bs_thread_worker_fn, info);
@@ -440,6 +444,8 @@ destroy_threads:
 
 	pthread_cond_destroy(&info->pending_cond);
 	pthread_mutex_destroy(&info->pending_lock);
+	pthread_cond_destroy(&info->sync_group.cond);
+	pthread_mutex_destroy(&info->sync_group.lock);
 	free(info->worker_thread);
 
 	return TGTADM_NOMEM;
@@ -456,6 +462,8 @@ void bs_thread_close(struct bs_thread_info *info)
 
 	pthread_cond_destroy(&info->pending_cond);
 	pthread_mutex_destroy(&info->pending_lock);
+	pthread_cond_destroy(&info->sync_group.cond);
+	pthread_mutex_destroy(&info->sync_group.lock);
 	free(info->worker_thread);
 }
 
@@ -477,3 +485,75 @@ int bs_thread_cmd_submit(struct scsi_cmd *cmd)
 	return 0;
 }
 
+struct bs_sync_waiter {
+	struct list_head list;
+	int done;
+	int err;
+};
+
+/*
+ * Called by workers for SYNCHRONIZE CACHE and FUA writes. Returns the
+ * result of a flush that started after the caller got here.
+ *
+ * Cancellation is held off throughout: the waiter lives on our stack
+ * and the lead flushes for the whole batch, so neither may go away
+ * half way. Every wait ends once the running flush does.
+ */
+int bs_thread_sync(struct bs_thread_info *info, sync_func_t *fn, void *arg)
+{
+	struct bs_sync_group *sg = &info->sync_group;
+	struct bs_sync_waiter w, *p, *n;
+	LIST_HEAD(batch);
+	int err, state;
+
+	w.done = 0;
+	w.err = 0;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	pthread_mutex_lock(&sg->lock);
+
+	list_add_tail(&w.list, &sg->waiters);
+	sg->requests++;
+	while (!w.done) {
+		if (sg->running) {
+			pthread_cond_wait(&sg->cond, &sg->lock);
+			continue;
+		}
+
+		/* lead: one flush for everybody queued so far */
+		list_splice_init(&sg->waiters, &batch);
+		sg->running = 1;
+		sg->syncs++;
+		pthread_mutex_unlock(&sg->lock);
+
+		err = fn(arg);
+
+		pthread_mutex_lock(&sg->lock);
+		sg->running = 0;
+		list_for_each_entry_safe(p, n, &batch, list) {
+			list_del(&p->list);
+			p->err = err;
+			p->done = 1;
+		}
+		pthread_cond_broadcast(&sg->cond);
+	}
+
+	pthread_mutex_unlock(&sg->lock);
+	pthread_setcancelstate(state, NULL);
+
+	return w.err;
+}
+
+void bs_thread_show(struct scsi_lu *lu, struct concat_buf *b)
+{
+	struct bs_sync_group *sg = &BS_THREAD_I(lu)->sync_group;
+	uint64_t requests, syncs;
+
+	pthread_mutex_lock(&sg->lock);
+	requests = sg->requests;
+	syncs = sg->syncs;
+	pthread_mutex_unlock(&sg->lock);
+
+	concat_printf(b, _TAB3 "Flushes: %" PRIu64 ", syncs: %" PRIu64 "\n",
+		      requests, syncs);
+}
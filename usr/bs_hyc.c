@@ -9,6 +9,8 @@
 #include <string.h>
 #include <sys/eventfd.h>
 #include <sys/epoll.h>
+#include <poll.h>
+#include <signal.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <pthread.h>
@@ -20,6 +22,7 @@
 #include "util.h"
 #include "parser.h"
 #include "iscsi/iscsid.h"
+#include "crc32c.h"
 
 #include "bs_hyc.h"
 
@@ -72,56 +75,3538 @@ io_type_t scsi_cmd_operation(struct scsi_cmd *cmdp)
 	return op;
 }
 
+static uint64_t __scsi_cmd_offset(struct scsi_cmd *cmdp, io_type_t op)
+{
+	switch (op) {
+	case READ:
+	case WRITE:
+	case WRITE_SAME_OP:
+		return cmdp->offset;
+	case SYNCHRONIZE_CACHE_OP:
+		return scsi_rw_offset(cmdp->scb);
+	case ABORT_TASK_OP:
+	case ABORT_TASK_SET_OP:
+	case TRUNCATE:
+	default:
+		break;
+	}
+	return 0;
+}
+
+static uint32_t __scsi_cmd_length(struct scsi_cmd *cmdp, io_type_t op)
+{
+	switch (op) {
+	case READ:
+		return scsi_get_in_length(cmdp);
+	case WRITE_SAME_OP:
+	case WRITE:
+		return scsi_get_out_transfer_len(cmdp);
+	case TRUNCATE:
+		return scsi_get_out_length(cmdp);
+	case SYNCHRONIZE_CACHE_OP:
+		return scsi_rw_count(cmdp->scb);
+	case ABORT_TASK_OP:
+	case ABORT_TASK_SET_OP:
+	default:
+		break;
+	}
+	return 0;
+}
+
+static char *__scsi_cmd_buffer(struct scsi_cmd *cmdp, io_type_t op)
+{
+	switch (op) {
+	default:
+		return NULL;
+	case READ:
+		return scsi_get_in_buffer(cmdp);
+	case WRITE:
+	case WRITE_SAME_OP:
+	case TRUNCATE:
+		return scsi_get_out_buffer(cmdp);
+	}
+}
+
 static uint64_t scsi_cmd_offset(struct scsi_cmd *cmdp)
 {
-	switch (scsi_cmd_operation(cmdp)) {
-	case READ:
-	case WRITE:
-	case WRITE_SAME_OP:
-		return cmdp->offset;
-	case SYNCHRONIZE_CACHE_OP:
-		return scsi_rw_offset(cmdp->scb);
-	case ABORT_TASK_OP:
-	case ABORT_TASK_SET_OP:
-	case TRUNCATE:
-	default:
-		break;
+	return __scsi_cmd_offset(cmdp, scsi_cmd_operation(cmdp));
+}
+
+static uint32_t scsi_cmd_length(struct scsi_cmd *cmdp)
+{
+	return __scsi_cmd_length(cmdp, scsi_cmd_operation(cmdp));
+}
+
+static char *scsi_cmd_buffer(struct scsi_cmd *cmdp)
+{
+	return __scsi_cmd_buffer(cmdp, scsi_cmd_operation(cmdp));
+}
+
+/*
+ * Local I/O workers
+ *
+ * The journal and the read cache are files opened O_DIRECT, the journal
+ * O_DSYNC too, so reads and writes of them block. They are handed to a
+ * few threads per LUN, as bs_thread does for whole commands, and their
+ * done callbacks run on the event loop once the eventfd fires. Hole
+ * punches of evicted cache blocks go the same way.
+ */
+
+enum {
+	HYC_IO_READ,
+	HYC_IO_WRITE,
+	HYC_IO_PUNCH,
+};
+
+struct hyc_io {
+	struct list_head    list;
+	struct bs_hyc_info *infop;
+	void              (*done)(struct hyc_io *iop);
+	void               *privatep;
+	int                 fd;
+	char               *bufp;
+	size_t              length;
+	off_t               offset;
+	int                 op;
+	int                 result;
+};
+
+static int hyc_rc_pio(int fd, char *bufp, size_t length, off_t offset,
+		bool write)
+{
+	ssize_t ret;
+
+	while (length) {
+		if (write)
+			ret = pwrite64(fd, bufp, length, offset);
+		else
+			ret = pread64(fd, bufp, length, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EIO;
+		bufp += ret;
+		offset += ret;
+		length -= ret;
+	}
+	return 0;
+}
+
+static void *hyc_io_worker(void *datap)
+{
+	struct bs_hyc_iopool *pool = datap;
+	struct hyc_io        *iop;
+	sigset_t              set;
+
+	sigfillset(&set);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (list_empty(&pool->pending) && !pool->stop)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (list_empty(&pool->pending))
+			break;
+		iop = list_first_entry(&pool->pending, struct hyc_io, list);
+		list_del(&iop->list);
+		pthread_mutex_unlock(&pool->lock);
+
+		if (iop->op != HYC_IO_PUNCH)
+			iop->result = hyc_rc_pio(iop->fd, iop->bufp,
+				iop->length, iop->offset, iop->op == HYC_IO_WRITE);
+		else if (unmap_file_region(iop->fd, iop->offset, iop->length))
+			iop->result = -errno;
+		else
+			iop->result = 0;
+
+		pthread_mutex_lock(&pool->lock);
+		list_add_tail(&iop->list, &pool->done);
+		eventfd_write(pool->efd, 1);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* @done runs on the event loop, @iop is freed after it returns */
+static int hyc_io_issue(struct bs_hyc_info *infop, int fd, char *bufp,
+		size_t length, off_t offset, int op,
+		void (*done)(struct hyc_io *iop), void *privatep)
+{
+	struct bs_hyc_iopool *pool = &infop->iopool;
+	struct hyc_io        *iop;
+
+	iop = malloc(sizeof(*iop));
+	if (!iop)
+		return -ENOMEM;
+	iop->infop = infop;
+	iop->done = done;
+	iop->privatep = privatep;
+	iop->fd = fd;
+	iop->bufp = bufp;
+	iop->length = length;
+	iop->offset = offset;
+	iop->op = op;
+	iop->result = 0;
+
+	pool->nr_inflight++;
+	pthread_mutex_lock(&pool->lock);
+	list_add_tail(&iop->list, &pool->pending);
+	pthread_mutex_unlock(&pool->lock);
+	pthread_cond_signal(&pool->cond);
+	return 0;
+}
+
+static void hyc_io_complete(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_iopool *pool = &infop->iopool;
+	struct hyc_io        *iop;
+	eventfd_t             count;
+	LIST_HEAD(done);
+
+	eventfd_read(pool->efd, &count);
+	pthread_mutex_lock(&pool->lock);
+	list_splice_init(&pool->done, &done);
+	pthread_mutex_unlock(&pool->lock);
+
+	while (!list_empty(&done)) {
+		iop = list_first_entry(&done, struct hyc_io, list);
+		list_del(&iop->list);
+		pool->nr_inflight--;
+		iop->done(iop);
+		free(iop);
+	}
+}
+
+static void hyc_io_handler(int fd, int events, void *datap)
+{
+	hyc_io_complete(datap);
+}
+
+/* complete everything in flight, and whatever that issues in turn */
+static void hyc_io_drain(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_iopool *pool = &infop->iopool;
+	struct pollfd         pfd;
+
+	pfd.fd = pool->efd;
+	pfd.events = POLLIN;
+	while (pool->nr_inflight) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			break;
+		hyc_io_complete(infop);
+	}
+}
+
+static int hyc_io_start(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_iopool *pool = &infop->iopool;
+	int                   i, err;
+
+	pool->efd = eventfd(0, EFD_NONBLOCK);
+	if (pool->efd < 0)
+		return -errno;
+	err = tgt_event_add(pool->efd, EPOLLIN, hyc_io_handler, infop);
+	if (err) {
+		close(pool->efd);
+		pool->efd = -1;
+		return err;
+	}
+
+	INIT_LIST_HEAD(&pool->pending);
+	INIT_LIST_HEAD(&pool->done);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->stop = false;
+	pool->nr_inflight = 0;
+	for (i = 0; i < HYC_IO_THREADS; i++) {
+		err = pthread_create(&pool->threads[i], NULL, hyc_io_worker,
+			pool);
+		if (err) {
+			eprintf("failed to create a worker thread, %s\n",
+				strerror(err));
+			break;
+		}
+	}
+	pool->nr_threads = i;
+	return pool->nr_threads ? 0 : -err;
+}
+
+/* once nothing is in flight */
+static void hyc_io_stop(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_iopool *pool = &infop->iopool;
+	int                   i;
+
+	if (pool->efd < 0)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	pool->nr_threads = 0;
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+
+	tgt_event_del(pool->efd);
+	close(pool->efd);
+	pool->efd = -1;
+}
+
+/*
+ * Local read cache
+ */
+
+#define HYC_RC_MIN_SHIFT	12
+
+struct hyc_rc_fill {
+	struct list_head  list;
+	struct scsi_cmd  *cmdp;
+	uint64_t          offset;
+	uint32_t          length;
+	bool              stale;
+};
+
+/*
+ * A cache read, write or hole punch in flight over cache blocks
+ * [first, end). The workers give no ordering between them, so nothing
+ * else writes or punches those blocks until it completes.
+ */
+struct hyc_rc_io {
+	struct list_head      list;
+	struct bs_hyc_rcache *rc;
+	struct scsi_cmd      *cmdp;		/* the READ a hit is for */
+	char                 *bufp;		/* aligned copy or bounce */
+	uint64_t              offset;
+	uint32_t              length;
+	uint64_t              first;
+	uint64_t              end;
+	uint64_t              nr_new;		/* blocks a write adds */
+	bool                  stale;
+};
+
+static int bs_hyc_cmd_submit(struct scsi_cmd *cmdp);
+static void hyc_rc_invalidate(struct bs_hyc_rcache *rc, uint64_t offset,
+		uint64_t length);
+
+static inline struct bs_hyc_info *hyc_rc_info(struct bs_hyc_rcache *rc)
+{
+	return container_of(rc, struct bs_hyc_info, rcache);
+}
+
+static bool hyc_rc_busy(struct bs_hyc_rcache *rc, uint64_t first,
+		uint64_t end)
+{
+	struct hyc_rc_io *rciop;
+
+	list_for_each_entry(rciop, &rc->ios, list) {
+		if (rciop->first < end && first < rciop->end)
+			return true;
+	}
+	return false;
+}
+
+static struct hyc_rc_io *hyc_rc_io_get(struct bs_hyc_rcache *rc,
+		uint64_t first, uint64_t end)
+{
+	struct hyc_rc_io *rciop;
+
+	rciop = zalloc(sizeof(*rciop));
+	if (!rciop)
+		return NULL;
+	rciop->rc = rc;
+	rciop->first = first;
+	rciop->end = end;
+	list_add_tail(&rciop->list, &rc->ios);
+	return rciop;
+}
+
+static void hyc_rc_io_put(struct hyc_rc_io *rciop)
+{
+	list_del(&rciop->list);
+	free(rciop->bufp);
+	free(rciop);
+}
+
+static void hyc_rc_hit_done(struct hyc_io *iop)
+{
+	struct hyc_rc_io     *rciop = iop->privatep;
+	struct bs_hyc_rcache *rc = rciop->rc;
+	struct scsi_cmd      *cmdp = rciop->cmdp;
+	uint64_t              offset = rciop->offset;
+	uint32_t              length = rciop->length;
+	int                   ret;
+
+	if (!iop->result && rciop->bufp)
+		memcpy(scsi_cmd_buffer(cmdp), rciop->bufp +
+			(offset - (rciop->first << rc->shift)), length);
+	hyc_rc_io_put(rciop);
+
+	if (!iop->result) {
+		rc->hits++;
+		rc->hit_bytes += length;
+		target_cmd_io_done(cmdp, SAM_STAT_GOOD);
+		return;
+	}
+
+	/* submit it again, it misses now and goes to stord */
+	rc->errors++;
+	hyc_rc_invalidate(rc, offset, length);
+	clear_cmd_async(cmdp);
+	ret = bs_hyc_cmd_submit(cmdp);
+	if (cmd_async(cmdp))
+		return;
+	if (ret) {
+		sense_data_build(cmdp, HARDWARE_ERROR,
+			ASC_INTERNAL_TGT_FAILURE);
+		ret = SAM_STAT_CHECK_CONDITION;
+	}
+	target_cmd_io_done(cmdp, ret);
+}
+
+/* read a READ whose blocks are all cached, it completes from hit_done */
+static int hyc_rc_hit(struct bs_hyc_rcache *rc, struct scsi_cmd *cmdp,
+		char *bufp, uint64_t offset, uint32_t length)
+{
+	struct bs_hyc_info *infop = hyc_rc_info(rc);
+	size_t              bsize = 1UL << rc->shift;
+	struct hyc_rc_io   *rciop;
+	void               *bounce;
+	size_t              size;
+	int                 err;
+
+	rciop = hyc_rc_io_get(rc, offset >> rc->shift,
+		DIV_ROUND_UP(offset + length, bsize));
+	if (!rciop)
+		return -ENOMEM;
+	rciop->cmdp = cmdp;
+	rciop->offset = offset;
+	rciop->length = length;
+
+	/* O_DIRECT wants block aligned buffers, bounce the rare unaligned one */
+	if (!(((unsigned long) bufp | offset | length) & (bsize - 1))) {
+		err = hyc_io_issue(infop, rc->fd, bufp, length, offset,
+			HYC_IO_READ, hyc_rc_hit_done, rciop);
+	} else {
+		size = (rciop->end - rciop->first) << rc->shift;
+		if (posix_memalign(&bounce, bsize, size)) {
+			hyc_rc_io_put(rciop);
+			return -ENOMEM;
+		}
+		rciop->bufp = bounce;
+		err = hyc_io_issue(infop, rc->fd, rciop->bufp, size,
+			rciop->first << rc->shift, HYC_IO_READ,
+			hyc_rc_hit_done, rciop);
+	}
+	if (err) {
+		hyc_rc_io_put(rciop);
+		return err;
+	}
+	set_cmd_async(cmdp);
+	return 0;
+}
+
+/* true if every cache block covering [offset, offset + length) is present */
+static bool hyc_rc_lookup(struct bs_hyc_rcache *rc, uint64_t offset,
+		uint32_t length)
+{
+	uint64_t first = offset >> rc->shift;
+	uint64_t last = (offset + length - 1) >> rc->shift;
+	uint64_t i;
+
+	if (last >= rc->nr_blocks)
+		return false;
+	for (i = first; i <= last; i++)
+		if (!test_bit(i, rc->present))
+			return false;
+	for (i = first; i <= last; i++)
+		set_bit(i, rc->referenced);
+	return true;
+}
+
+static void hyc_rc_drop_block(struct bs_hyc_rcache *rc, uint64_t blk)
+{
+	clear_bit(blk, rc->present);
+	clear_bit(blk, rc->referenced);
+	rc->nr_present--;
+}
+
+static void hyc_rc_punch_done(struct hyc_io *iop)
+{
+	hyc_rc_io_put(iop->privatep);
+}
+
+/* if this fails the blocks are just not given back to the filesystem */
+static void hyc_rc_punch(struct bs_hyc_rcache *rc, uint64_t first,
+		uint64_t nr)
+{
+	struct hyc_rc_io *rciop;
+
+	if (rc->dev_path)
+		return;
+	rciop = hyc_rc_io_get(rc, first, first + nr);
+	if (!rciop)
+		return;
+	if (hyc_io_issue(hyc_rc_info(rc), rc->fd, NULL, nr << rc->shift,
+			first << rc->shift, HYC_IO_PUNCH, hyc_rc_punch_done,
+			rciop))
+		hyc_rc_io_put(rciop);
+}
+
+/*
+ * CLOCK: sweep from the hand, giving referenced blocks a second chance,
+ * until @needed blocks fit. Blocks with cache I/O in flight are passed
+ * over, so give up after two rounds. Evicted runs are punched out of the
+ * sparse file so the cache does not pin local space.
+ */
+static bool hyc_rc_evict(struct bs_hyc_rcache *rc, uint64_t needed)
+{
+	uint64_t run_start = 0, run_len = 0, swept = 0;
+
+	needed += rc->nr_filling;
+	while (rc->nr_present && rc->nr_present + needed > rc->capacity) {
+		uint64_t blk = rc->hand;
+
+		if (swept++ == 2 * rc->nr_blocks)
+			break;
+		if (++rc->hand == rc->nr_blocks)
+			rc->hand = 0;
+
+		if (!(blk % BITS_PER_LONG) && !rc->present[blk / BITS_PER_LONG] &&
+				blk + BITS_PER_LONG <= rc->nr_blocks) {
+			rc->hand = blk + BITS_PER_LONG;
+			if (rc->hand == rc->nr_blocks)
+				rc->hand = 0;
+			continue;
+		}
+		if (!test_bit(blk, rc->present))
+			continue;
+		if (test_bit(blk, rc->referenced)) {
+			clear_bit(blk, rc->referenced);
+			continue;
+		}
+		if (hyc_rc_busy(rc, blk, blk + 1))
+			continue;
+
+		hyc_rc_drop_block(rc, blk);
+		rc->evicted++;
+
+		if (run_len && run_start + run_len == blk) {
+			run_len++;
+			continue;
+		}
+		if (run_len)
+			hyc_rc_punch(rc, run_start, run_len);
+		run_start = blk;
+		run_len = 1;
+	}
+	if (run_len)
+		hyc_rc_punch(rc, run_start, run_len);
+	return rc->nr_present + needed <= rc->capacity;
+}
+
+static void hyc_rc_populate_done(struct hyc_io *iop)
+{
+	struct hyc_rc_io     *rciop = iop->privatep;
+	struct bs_hyc_rcache *rc = rciop->rc;
+	uint64_t              i;
+
+	rc->nr_filling -= rciop->nr_new;
+	if (iop->result) {
+		if (!rc->errors++)
+			eprintf("read cache write failed for %s, %s\n",
+				rc->dev_path ? : "sparse file",
+				strerror(-iop->result));
+		for (i = rciop->first; i < rciop->end; i++)
+			if (test_bit(i, rc->present))
+				hyc_rc_drop_block(rc, i);
+	} else if (!rciop->stale) {
+		for (i = rciop->first; i < rciop->end; i++) {
+			if (!test_bit(i, rc->present)) {
+				set_bit(i, rc->present);
+				rc->nr_present++;
+				rc->filled++;
+			}
+		}
+	}
+	hyc_rc_io_put(rciop);
+}
+
+/* keep the whole cache blocks of a completed I/O, written from a copy */
+static void hyc_rc_populate(struct bs_hyc_rcache *rc, char *bufp,
+		uint64_t offset, uint32_t length)
+{
+	uint64_t          first = DIV_ROUND_UP(offset, 1ULL << rc->shift);
+	uint64_t          end = (offset + length) >> rc->shift;
+	struct hyc_rc_io *rciop;
+	uint64_t          i, nr_new = 0;
+	void             *copy;
+	size_t            size;
+
+	if (end > rc->nr_blocks)
+		end = rc->nr_blocks;
+	if (first >= end)
+		return;
+
+	for (i = first; i < end; i++)
+		if (!test_bit(i, rc->present))
+			nr_new++;
+	if (!nr_new)
+		return;
+	if (end - first > rc->capacity)
+		return;
+	/* an earlier write or punch of these blocks may land after ours */
+	if (hyc_rc_busy(rc, first, end))
+		return;
+
+	size = (end - first) << rc->shift;
+	if (posix_memalign(&copy, 1UL << rc->shift, size))
+		return;
+	rciop = hyc_rc_io_get(rc, first, end);
+	if (!rciop) {
+		free(copy);
+		return;
+	}
+	rciop->bufp = copy;
+	/* claimed first, the sweep must not punch them under the write */
+	if (!hyc_rc_evict(rc, nr_new)) {
+		hyc_rc_io_put(rciop);
+		return;
+	}
+	memcpy(copy, bufp + ((first << rc->shift) - offset), size);
+	rciop->nr_new = nr_new;
+	rc->nr_filling += nr_new;
+	if (hyc_io_issue(hyc_rc_info(rc), rc->fd, copy, size,
+			first << rc->shift, HYC_IO_WRITE, hyc_rc_populate_done,
+			rciop)) {
+		rc->nr_filling -= nr_new;
+		hyc_rc_io_put(rciop);
+	}
+}
+
+/*
+ * Writes change the data under any cached block they touch and under any
+ * read or write still in flight to the same range, so neither may
+ * populate the cache afterwards.
+ */
+static void hyc_rc_invalidate(struct bs_hyc_rcache *rc, uint64_t offset,
+		uint64_t length)
+{
+	struct hyc_rc_fill *fillp;
+	struct hyc_rc_io   *rciop;
+	uint64_t first, last, i;
+
+	if (!length)
+		return;
+
+	list_for_each_entry(fillp, &rc->fills, list) {
+		if (fillp->offset < offset + length &&
+				offset < fillp->offset + fillp->length)
+			fillp->stale = true;
+	}
+
+	first = offset >> rc->shift;
+	last = (offset + length - 1) >> rc->shift;
+	list_for_each_entry(rciop, &rc->ios, list) {
+		if (rciop->first <= last && first < rciop->end)
+			rciop->stale = true;
+	}
+	if (last >= rc->nr_blocks)
+		last = rc->nr_blocks - 1;
+	for (i = first; i <= last; i++) {
+		if (test_bit(i, rc->present)) {
+			hyc_rc_drop_block(rc, i);
+			rc->invalidated++;
+		}
+	}
+}
+
+static void hyc_rc_fill_start(struct bs_hyc_rcache *rc,
+		struct scsi_cmd *cmdp, uint64_t offset, uint32_t length)
+{
+	struct hyc_rc_fill *fillp;
+	bool                stale = false;
+
+	/* a READ racing a WRITE may see the data from before it */
+	list_for_each_entry(fillp, &rc->fills, list) {
+		if (fillp->offset < offset + length &&
+				offset < fillp->offset + fillp->length &&
+				scsi_cmd_operation(fillp->cmdp) == WRITE) {
+			stale = true;
+			break;
+		}
+	}
+
+	fillp = malloc(sizeof(*fillp));
+	if (!fillp)
+		return;
+	fillp->cmdp = cmdp;
+	fillp->offset = offset;
+	fillp->length = length;
+	fillp->stale = stale;
+	list_add_tail(&fillp->list, &rc->fills);
+}
+
+static struct hyc_rc_fill *hyc_rc_fill_find(struct bs_hyc_rcache *rc,
+		struct scsi_cmd *cmdp)
+{
+	struct hyc_rc_fill *fillp;
+
+	list_for_each_entry(fillp, &rc->fills, list) {
+		if (fillp->cmdp == cmdp)
+			return fillp;
+	}
+	return NULL;
+}
+
+/* called before the command is handed back to the target */
+static void hyc_rc_fill_done(struct bs_hyc_rcache *rc,
+		struct scsi_cmd *cmdp, bool good)
+{
+	struct hyc_rc_fill *fillp;
+
+	if (!rc->enabled || list_empty(&rc->fills))
+		return;
+	fillp = hyc_rc_fill_find(rc, cmdp);
+	if (!fillp)
+		return;
+	if (good && !fillp->stale)
+		hyc_rc_populate(rc, scsi_cmd_buffer(cmdp), fillp->offset,
+			fillp->length);
+	list_del(&fillp->list);
+	free(fillp);
+}
+
+static int hyc_rc_open(struct bs_hyc_info *infop, int ffd, uint64_t size)
+{
+	struct bs_hyc_rcache *rc = &infop->rcache;
+	struct scsi_lu       *lup = infop->lup;
+	uint64_t              dev_size;
+	uint32_t              blksize;
+	size_t                nr_longs;
+
+	rc->fd = ffd;
+	if (rc->dev_path) {
+		rc->fd = backed_file_open(rc->dev_path,
+			O_RDWR | O_LARGEFILE | O_DIRECT, &dev_size, &blksize);
+		if (rc->fd < 0) {
+			eprintf("Failed to open read cache %s, %m\n",
+				rc->dev_path);
+			return rc->fd;
+		}
+		if (dev_size < size) {
+			eprintf("read cache %s is smaller than the LUN\n",
+				rc->dev_path);
+			close(rc->fd);
+			rc->fd = -1;
+			return -EINVAL;
+		}
+	} else {
+		/* contents left from an earlier run are not tracked */
+		unmap_file_region(rc->fd, 0, size);
+	}
+
+	rc->shift = max_t(unsigned int, HYC_RC_MIN_SHIFT, lup->blk_shift);
+	while ((size >> rc->shift) > INT_MAX)
+		rc->shift++;
+	rc->nr_blocks = size >> rc->shift;
+	rc->capacity = rc->nr_blocks;
+	if (rc->size_mb && (rc->size_mb << 20) >> rc->shift < rc->nr_blocks)
+		rc->capacity = max_t(uint64_t, 1,
+			(rc->size_mb << 20) >> rc->shift);
+
+	nr_longs = BITS_TO_LONGS(rc->nr_blocks);
+	rc->present = calloc(nr_longs, sizeof(unsigned long));
+	rc->referenced = calloc(nr_longs, sizeof(unsigned long));
+	if (!rc->present || !rc->referenced) {
+		free(rc->present);
+		free(rc->referenced);
+		rc->present = rc->referenced = NULL;
+		if (rc->dev_path) {
+			close(rc->fd);
+			rc->fd = -1;
+		}
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void hyc_rc_close(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_rcache *rc = &infop->rcache;
+	struct hyc_rc_fill   *fillp, *nextp;
+
+	if (!rc->enabled)
+		return;
+
+	list_for_each_entry_safe(fillp, nextp, &rc->fills, list) {
+		list_del(&fillp->list);
+		free(fillp);
+	}
+	free(rc->present);
+	free(rc->referenced);
+	rc->present = rc->referenced = NULL;
+	rc->nr_present = 0;
+	rc->nr_filling = 0;
+	if (rc->dev_path && rc->fd >= 0)
+		close(rc->fd);
+	rc->fd = -1;
+}
+
+/*
+ * Internal requests
+ */
+
+static struct hyc_req *hyc_req_get(struct bs_hyc_info *infop)
+{
+	struct hyc_req *reqp;
+
+	if (list_empty(&infop->free_reqs))
+		return NULL;
+	reqp = list_first_entry(&infop->free_reqs, struct hyc_req, list);
+	list_del(&reqp->list);
+	reqp->infop = infop;
+	return reqp;
+}
+
+static void hyc_req_put(struct hyc_req *reqp)
+{
+	reqp->bufp = NULL;
+	reqp->privatep = NULL;
+	list_add(&reqp->list, &reqp->infop->free_reqs);
+}
+
+static bool hyc_req_internal(struct bs_hyc_info *infop, const void *privatep)
+{
+	const struct hyc_req *reqp = privatep;
+
+	return infop->reqs && reqp >= infop->reqs &&
+		reqp < infop->reqs + HYC_NR_REQS;
+}
+
+/* unmapped blocks only read back as zeroes with LBPRZ */
+static inline bool hyc_zero_detect(struct bs_hyc_info *infop)
+{
+	return infop->zero.enabled && infop->lup->attrs.thinprovisioning;
+}
+
+/*
+ * Write-back journal
+ *
+ * The journal file starts with a superblock block, followed by a
+ * circular data area. Every record is one header block followed by its
+ * data rounded up to the block size; a record that does not fit before
+ * the end of the area starts again at its beginning. Records carry the
+ * superblock epoch, which is bumped on a clean close so that nothing
+ * older is ever replayed, and their header checksum is seeded with a
+ * random salt kept in the superblock so that guest data cannot pass for
+ * a record.
+ *
+ * The superblock also holds the tail. Reclaimed space is only reused
+ * once the tail written there has moved past it, so recovery can walk
+ * the records from the tail by sequence number and stop at the first
+ * one missing.
+ *
+ * Appends, superblock updates and reads of the journal all go to the
+ * local I/O workers; only opening and closing it is synchronous.
+ */
+
+#define HYC_WB_BLOCK		4096
+#define HYC_WB_MAGIC		0x6879636a726e6c31ULL	/* "hycjrnl1" */
+#define HYC_WB_REC_MAGIC	0x6879637265633031ULL	/* "hycrec01" */
+#define HYC_WB_VERSION		2
+#define HYC_WB_DEF_SIZE_MB	256
+#define HYC_WB_MAX_FLUSH	16
+#define HYC_WB_RETRY_SECS	1
+#define HYC_WB_TRIM_MAX		(1ULL << 30)
+
+enum {
+	HYC_WB_REC_WRITE,
+	HYC_WB_REC_TRIM,
+};
+
+struct hyc_wb_super {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t crc;
+	uint64_t epoch;
+	uint64_t size;
+	uint64_t tail;		/* logical position of the oldest record */
+	uint64_t tail_seq;	/* and its sequence number */
+	uint32_t salt;
+	uint32_t reserved;
+	char     vmdkid[256];
+};
+
+struct hyc_wb_rec_hdr {
+	uint64_t magic;
+	uint64_t epoch;
+	uint64_t seq;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t type;
+	uint32_t data_crc;
+	uint32_t hdr_crc;
+};
+
+struct hyc_wb_ack;
+
+struct hyc_wb_rec {
+	struct list_head   list;
+	struct list_head   alist;	/* on appending until acknowledged */
+	uint64_t           seq;
+	uint64_t           lpos;	/* logical position of the header */
+	uint64_t           offset;
+	uint32_t           length;
+	uint32_t           type;
+	int                refs;	/* READs waiting to overlay it */
+	char              *blockp;	/* the record, while being appended */
+	struct hyc_wb_ack *ackp;
+	bool               failed;	/* its append, the record is dropped */
+	bool               flushing;
+	bool               flushed;
+};
+
+/* a WRITE or UNMAP waiting for its records to be acknowledged */
+struct hyc_wb_ack {
+	struct scsi_cmd   *cmdp;
+	int                pending;
+	int                result;
+};
+
+struct hyc_wb_sync {
+	struct list_head   list;
+	struct scsi_cmd   *cmdp;
+	uint64_t           seq;		/* records before it to acknowledge */
+};
+
+/* journaled data a READ is patched with */
+struct hyc_wb_part {
+	struct hyc_wb_rec *recp;
+	char              *bufp;	/* NULL for a TRIM */
+	uint32_t           skip;	/* to the data in bufp */
+	uint64_t           start;
+	uint32_t           length;
+};
+
+struct hyc_wb_overlay {
+	struct list_head    list;
+	struct scsi_cmd    *cmdp;
+	char               *bufp;
+	uint64_t            offset;
+	uint32_t            length;
+	bool                covered;	/* nothing to read from stord */
+	int                 pending;	/* journal reads and the stord READ */
+	int                 result;
+	int                 nr_parts;
+	struct hyc_wb_part  parts[0];
+};
+
+static void hyc_wb_kick(struct bs_hyc_info *infop);
+static void hyc_wb_admit(struct bs_hyc_info *infop);
+static void hyc_wb_reclaim(struct bs_hyc_info *infop);
+static void hyc_ra_invalidate(struct bs_hyc_info *infop, uint64_t offset,
+		uint64_t length);
+static void hyc_unmap_invalidate(struct bs_hyc_info *infop, char *bufp,
+		size_t length);
+static void hyc_cmd_done(struct bs_hyc_info *infop, struct scsi_cmd *cmdp,
+		int result);
+
+static inline uint64_t hyc_wb_rec_size(uint32_t type, uint32_t length)
+{
+	if (type == HYC_WB_REC_TRIM)
+		return HYC_WB_BLOCK;
+	return HYC_WB_BLOCK + roundup(length, HYC_WB_BLOCK);
+}
+
+static inline off_t hyc_wb_phys(struct bs_hyc_wb *wb, uint64_t lpos)
+{
+	return HYC_WB_BLOCK + lpos % wb->size;
+}
+
+static inline uint64_t hyc_wb_tail(struct bs_hyc_wb *wb)
+{
+	if (list_empty(&wb->recs))
+		return wb->head;
+	return list_first_entry(&wb->recs, struct hyc_wb_rec, list)->lpos;
+}
+
+static inline uint64_t hyc_wb_tail_seq(struct bs_hyc_wb *wb)
+{
+	if (list_empty(&wb->recs))
+		return wb->seq;
+	return list_first_entry(&wb->recs, struct hyc_wb_rec, list)->seq;
+}
+
+/* journal space a record of @need bytes takes at the head, wrap included */
+static uint64_t hyc_wb_need(struct bs_hyc_wb *wb, uint64_t need)
+{
+	uint64_t phys = wb->head % wb->size;
+
+	if (phys + need > wb->size)
+		need += wb->size - phys;
+	return need;
+}
+
+static uint32_t hyc_wb_salt(void)
+{
+	uint32_t salt;
+	int      fd;
+
+	fd = open("/dev/urandom", O_RDONLY);
+	if (fd < 0 || read(fd, &salt, sizeof(salt)) != sizeof(salt))
+		salt = time(NULL) ^ getpid();
+	if (fd >= 0)
+		close(fd);
+	return salt;
+}
+
+static struct hyc_wb_super *hyc_wb_super_fill(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_wb    *wb = &infop->wb;
+	struct hyc_wb_super *sbp;
+
+	if (posix_memalign((void **) &sbp, HYC_WB_BLOCK, HYC_WB_BLOCK))
+		return NULL;
+	memset(sbp, 0, HYC_WB_BLOCK);
+	sbp->magic = HYC_WB_MAGIC;
+	sbp->version = HYC_WB_VERSION;
+	sbp->epoch = wb->epoch;
+	sbp->size = wb->size;
+	sbp->tail = hyc_wb_tail(wb);
+	sbp->tail_seq = hyc_wb_tail_seq(wb);
+	sbp->salt = wb->salt;
+	snprintf(sbp->vmdkid, sizeof(sbp->vmdkid), "%s", infop->vmdkid);
+	sbp->crc = crc32c(~0, sbp, sizeof(*sbp));
+	return sbp;
+}
+
+/* on open and close, when nothing else is in flight */
+static int hyc_wb_super_write(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_wb    *wb = &infop->wb;
+	struct hyc_wb_super *sbp;
+	int                  err;
+
+	sbp = hyc_wb_super_fill(infop);
+	if (!sbp)
+		return -ENOMEM;
+	err = hyc_rc_pio(wb->fd, (char *) sbp, HYC_WB_BLOCK, 0, true);
+	if (!err) {
+		wb->sb_tail = sbp->tail;
+		wb->sb_tail_seq = sbp->tail_seq;
+	}
+	free(sbp);
+	return err;
+}
+
+/*
+ * Acknowledge commands in journal order. Recovery stops at the first
+ * record missing, so a record is only durable once every one before it
+ * is too. Past a failed append that only holds again when the tail in
+ * the superblock has moved beyond it.
+ */
+static void hyc_wb_ack_put(struct hyc_wb_ack *ackp, int result)
+{
+	if (result)
+		ackp->result = result;
+	if (--ackp->pending)
+		return;
+	if (!ackp->result)
+		target_cmd_io_done(ackp->cmdp, SAM_STAT_GOOD);
+	else {
+		sense_data_build(ackp->cmdp, MEDIUM_ERROR, 0);
+		target_cmd_io_done(ackp->cmdp, SAM_STAT_CHECK_CONDITION);
+	}
+	free(ackp);
+}
+
+static void hyc_wb_ack(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_wb   *wb = &infop->wb;
+	struct hyc_wb_rec  *recp;
+	struct hyc_wb_sync *syncp;
+	uint64_t            seq;
+
+	while (!list_empty(&wb->appending)) {
+		recp = list_first_entry(&wb->appending, struct hyc_wb_rec,
+			alist);
+		if (recp->blockp || (wb->gap && !recp->failed))
+			break;
+		list_del_init(&recp->alist);
+		if (recp->failed) {
+			wb->gap = true;
+			wb->gap_seq = recp->seq;
+		}
+		hyc_wb_ack_put(recp->ackp, recp->failed ? -EIO : 0);
+		recp->ackp = NULL;
+	}
+
+	seq = list_empty(&wb->appending) ? wb->seq :
+		list_first_entry(&wb->appending, struct hyc_wb_rec,
+			alist)->seq;
+	while (!list_empty(&wb->syncs)) {
+		syncp = list_first_entry(&wb->syncs, struct hyc_wb_sync, list);
+		if (syncp->seq > seq)
+			break;
+		list_del(&syncp->list);
+		target_cmd_io_done(syncp->cmdp, SAM_STAT_GOOD);
+		free(syncp);
+	}
+}
+
+static void hyc_wb_super_done(struct hyc_io *iop)
+{
+	struct bs_hyc_info  *infop = iop->infop;
+	struct bs_hyc_wb    *wb = &infop->wb;
+	struct hyc_wb_super *sbp = (struct hyc_wb_super *) iop->bufp;
+
+	wb->sb_writing = false;
+	if (iop->result) {
+		eprintf("journal superblock write failed on %s, %s\n",
+			wb->path, strerror(-iop->result));
+		free(sbp);
+		/* the command waiting for it fails, the next one tries again */
+		if (!list_empty(&wb->waitq))
+			wb->sb_err = iop->result;
+		hyc_wb_admit(infop);
+		return;
+	}
+
+	wb->sb_tail = sbp->tail;
+	wb->sb_tail_seq = sbp->tail_seq;
+	free(sbp);
+	if (wb->gap && wb->sb_tail_seq > wb->gap_seq) {
+		wb->gap = false;
+		hyc_wb_ack(infop);
+	}
+	hyc_wb_reclaim(infop);
+}
+
+static int hyc_wb_super_issue(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_wb    *wb = &infop->wb;
+	struct hyc_wb_super *sbp;
+
+	if (wb->sb_writing)
+		return 0;
+	sbp = hyc_wb_super_fill(infop);
+	if (!sbp)
+		return -ENOMEM;
+	if (hyc_io_issue(infop, wb->fd, (char *) sbp, HYC_WB_BLOCK, 0,
+			HYC_IO_WRITE, hyc_wb_super_done, NULL)) {
+		free(sbp);
+		return -ENOMEM;
+	}
+	wb->sb_writing = true;
+	return 0;
+}
+
+/* 1 if @need bytes fit at the head, 0 if not yet, or a negative errno */
+static int hyc_wb_has_room(struct bs_hyc_info *infop, uint64_t need)
+{
+	struct bs_hyc_wb *wb = &infop->wb;
+	int               err;
+
+	if (wb->head - wb->sb_tail + need <= wb->size)
+		return 1;
+	if (wb->head - hyc_wb_tail(wb) + need > wb->size)
+		return 0;
+
+	/* reclaimed, but recovery still starts there */
+	if (wb->sb_err) {
+		err = wb->sb_err;
+		wb->sb_err = 0;
+		return err;
+	}
+	return hyc_wb_super_issue(infop);
+}
+
+static void hyc_wb_append_done(struct hyc_io *iop)
+{
+	struct bs_hyc_info *infop = iop->infop;
+	struct bs_hyc_wb   *wb = &infop->wb;
+	struct hyc_wb_rec  *recp = iop->privatep;
+
+	free(recp->blockp);
+	recp->blockp = NULL;
+	if (iop->result) {
+		if (!wb->append_errors++)
+			eprintf("journal write failed on %s, %s\n", wb->path,
+				strerror(-iop->result));
+		/* the command fails, nothing is left to flush */
+		recp->failed = true;
+		recp->flushed = true;
+		wb->nr_dirty--;
+		if (recp->type == HYC_WB_REC_WRITE)
+			wb->dirty_bytes -= recp->length;
+		if (infop->rcache.enabled)
+			hyc_rc_invalidate(&infop->rcache, recp->offset,
+				recp->length);
+	}
+	hyc_wb_ack(infop);
+	hyc_wb_reclaim(infop);
+	hyc_wb_kick(infop);
+}
+
+static struct hyc_wb_rec *hyc_wb_append(struct bs_hyc_info *infop,
+		uint32_t type, char *bufp, uint64_t offset, uint32_t length,
+		struct hyc_wb_ack *ackp)
+{
+	struct bs_hyc_wb      *wb = &infop->wb;
+	struct hyc_wb_rec_hdr *hdrp;
+	struct hyc_wb_rec     *recp;
+	uint64_t               size = hyc_wb_rec_size(type, length);
+	uint64_t               phys = wb->head % wb->size;
+	uint64_t               lpos = wb->head;
+	char                  *blockp;
+
+	recp = malloc(sizeof(*recp));
+	if (!recp)
+		return NULL;
+	if (posix_memalign((void **) &blockp, HYC_WB_BLOCK, size)) {
+		free(recp);
+		return NULL;
+	}
+
+	memset(blockp, 0, HYC_WB_BLOCK);
+	hdrp = (struct hyc_wb_rec_hdr *) blockp;
+	hdrp->magic = HYC_WB_REC_MAGIC;
+	hdrp->epoch = wb->epoch;
+	hdrp->seq = wb->seq;
+	hdrp->offset = offset;
+	hdrp->length = length;
+	hdrp->type = type;
+	if (type == HYC_WB_REC_WRITE) {
+		memcpy(blockp + HYC_WB_BLOCK, bufp, length);
+		memset(blockp + HYC_WB_BLOCK + length, 0,
+			size - HYC_WB_BLOCK - length);
+		hdrp->data_crc = crc32c(~0, bufp, length);
+	}
+	hdrp->hdr_crc = crc32c(wb->salt, hdrp, sizeof(*hdrp));
+
+	if (phys + size > wb->size)
+		lpos += wb->size - phys;
+
+	/* the journal is opened O_DSYNC, the record is durable once done */
+	if (hyc_io_issue(infop, wb->fd, blockp, size, hyc_wb_phys(wb, lpos),
+			HYC_IO_WRITE, hyc_wb_append_done, recp)) {
+		free(blockp);
+		free(recp);
+		return NULL;
+	}
+
+	recp->seq = wb->seq++;
+	recp->lpos = lpos;
+	recp->offset = offset;
+	recp->length = length;
+	recp->type = type;
+	recp->refs = 0;
+	recp->blockp = blockp;
+	recp->ackp = ackp;
+	recp->failed = false;
+	recp->flushing = false;
+	recp->flushed = false;
+	list_add_tail(&recp->list, &wb->recs);
+	list_add_tail(&recp->alist, &wb->appending);
+	ackp->pending++;
+	wb->head = lpos + size;
+
+	wb->nr_dirty++;
+	wb->appended++;
+	if (type == HYC_WB_REC_WRITE) {
+		wb->dirty_bytes += length;
+		wb->appended_bytes += length;
+	}
+	return recp;
+}
+
+static uint64_t hyc_wb_cmd_need(struct bs_hyc_info *infop,
+		struct scsi_cmd *cmdp)
+{
+	char     *bufp = scsi_cmd_buffer(cmdp);
+	uint32_t  length = scsi_cmd_length(cmdp);
+	uint64_t  need = 0;
+
+	if (scsi_cmd_operation(cmdp) == WRITE)
+		return hyc_wb_need(&infop->wb,
+			hyc_wb_rec_size(HYC_WB_REC_WRITE, length));
+
+	/* UNMAP parameter list: 8 byte header, 16 byte block descriptors */
+	for (bufp += 8, length -= 8; length >= 16; bufp += 16, length -= 16) {
+		uint64_t bytes = (uint64_t) get_unaligned_be32(bufp + 8) <<
+			infop->lup->blk_shift;
+
+		need += DIV_ROUND_UP(bytes, HYC_WB_TRIM_MAX) * HYC_WB_BLOCK;
+	}
+	return need;
+}
+
+/*
+ * Append the records of a WRITE or UNMAP, space has been checked. The
+ * command completes once they are acknowledged, unless this fails
+ * before any of them was issued.
+ */
+static int hyc_wb_journal_cmd(struct bs_hyc_info *infop,
+		struct scsi_cmd *cmdp)
+{
+	struct scsi_lu    *lup = infop->lup;
+	struct hyc_wb_ack *ackp;
+	char              *bufp = scsi_cmd_buffer(cmdp);
+	uint32_t           length = scsi_cmd_length(cmdp);
+	uint64_t           offset = scsi_cmd_offset(cmdp);
+	int                err = 0;
+
+	ackp = malloc(sizeof(*ackp));
+	if (!ackp)
+		return -ENOMEM;
+	ackp->cmdp = cmdp;
+	ackp->pending = 1;	/* until every record is issued */
+	ackp->result = 0;
+
+	if (scsi_cmd_operation(cmdp) == WRITE) {
+		if (!hyc_wb_append(infop, HYC_WB_REC_WRITE, bufp, offset,
+				length, ackp))
+			err = -EIO;
+		else if (infop->rcache.enabled)
+			hyc_rc_populate(&infop->rcache, bufp, offset, length);
+		goto out;
+	}
+
+	/* UNMAP parameter list: 8 byte header, 16 byte block descriptors */
+	for (bufp += 8, length -= 8; length >= 16; bufp += 16, length -= 16) {
+		uint64_t start = get_unaligned_be64(bufp) << lup->blk_shift;
+		uint64_t bytes = (uint64_t) get_unaligned_be32(bufp + 8) <<
+			lup->blk_shift;
+
+		while (bytes) {
+			uint32_t chunk = min_t(uint64_t, bytes, HYC_WB_TRIM_MAX);
+
+			if (!hyc_wb_append(infop, HYC_WB_REC_TRIM, NULL, start,
+					chunk, ackp)) {
+				err = -EIO;
+				goto out;
+			}
+			start += chunk;
+			bytes -= chunk;
+		}
+	}
+out:
+	if (ackp->pending == 1) {
+		free(ackp);
+		return err;
+	}
+	set_cmd_async(cmdp);
+	hyc_wb_ack_put(ackp, err);
+	hyc_wb_kick(infop);
+	return 0;
+}
+
+/*
+ * WRITE and UNMAP in write-back mode. Once the journal is full, commands
+ * wait on waitq, in arrival order, until flushed records are reclaimed.
+ */
+static int hyc_wb_submit(struct bs_hyc_info *infop, struct scsi_cmd *cmdp)
+{
+	struct bs_hyc_wb *wb = &infop->wb;
+	uint64_t          need = hyc_wb_cmd_need(infop, cmdp);
+	int               room = 0;
+
+	if (need > wb->size) {
+		eprintf("%u bytes do not fit in journal %s\n",
+			scsi_cmd_length(cmdp), wb->path);
+		return -EINVAL;
+	}
+	/* an UNMAP without blocks */
+	if (!need)
+		return SAM_STAT_GOOD;
+
+	if (list_empty(&wb->waitq)) {
+		room = hyc_wb_has_room(infop, need);
+		if (room < 0)
+			return -EIO;
+	}
+	if (!room) {
+		wb->throttled++;
+		set_cmd_async(cmdp);
+		list_add_tail(&cmdp->bs_list, &wb->waitq);
+		return 0;
+	}
+
+	return hyc_wb_journal_cmd(infop, cmdp) ? -EIO : 0;
+}
+
+static void hyc_wb_admit(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_wb *wb = &infop->wb;
+	struct scsi_cmd  *cmdp;
+	int               room;
+
+	while (!list_empty(&wb->waitq)) {
+		cmdp = list_first_entry(&wb->waitq, struct scsi_cmd, bs_list);
+		room = hyc_wb_has_room(infop, hyc_wb_cmd_need(infop, cmdp));
+		if (!room)
+			break;
+		list_del(&cmdp->bs_list);
+		if (room < 0) {
+			sense_data_build(cmdp, MEDIUM_ERROR, 0);
+			target_cmd_io_done(cmdp, SAM_STAT_CHECK_CONDITION);
+			continue;
+		}
+		/*
+		 * READs and readahead issued while the command waited went to
+		 * stord and fetched the data from before it
+		 */
+		if (scsi_cmd_operation(cmdp) == WRITE) {
+			if (infop->rcache.enabled)
+				hyc_rc_invalidate(&infop->rcache,
+					scsi_cmd_offset(cmdp),
+					scsi_cmd_length(cmdp));
+			if (infop->ra.max)
+				hyc_ra_invalidate(infop, scsi_cmd_offset(cmdp),
+					scsi_cmd_length(cmdp));
+		} else
+			hyc_unmap_invalidate(infop, scsi_cmd_buffer(cmdp) + 8,
+				scsi_cmd_length(cmdp) - 8);
+		if (hyc_wb_journal_cmd(infop, cmdp)) {
+			sense_data_build(cmdp, MEDIUM_ERROR, 0);
+			target_cmd_io_done(cmdp, SAM_STAT_CHECK_CONDITION);
+		}
+	}
+}
+
+/* free flushed records from the tail, nothing newer may go first */
+static void hyc_wb_reclaim(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_wb  *wb = &infop->wb;
+	struct hyc_wb_rec *recp, *nextp;
+
+	list_for_each_entry_safe(recp, nextp, &wb->recs, list) {
+		if (!recp->flushed || recp->refs || !list_empty(&recp->alist))
+			break;
+		list_del(&recp->list);
+		free(recp);
+	}
+	/* recovery must not stop at a failed append any more */
+	if (wb->gap && hyc_wb_tail_seq(wb) > wb->gap_seq)
+		hyc_wb_super_issue(infop);
+	hyc_wb_admit(infop);
+}
+
+static void hyc_wb_retry(void *datap)
+{
+	struct bs_hyc_info *infop = datap;
+
+	infop->wb.retry_pending = false;
+	hyc_wb_kick(infop);
+}
+
+static void hyc_wb_flush_done(struct hyc_req *reqp, int result)
+{
+	struct bs_hyc_info *infop = reqp->infop;
+	struct bs_hyc_wb   *wb = &infop->wb;
+	struct hyc_wb_rec  *recp = reqp->privatep;
+
+	free(reqp->bufp);
+	hyc_req_put(reqp);
+	wb->nr_flushing--;
+	recp->flushing = false;
+
+	if (result) {
+		if (!wb->flush_errors++)
+			eprintf("flush failed for vmid:%s, vmdkid:%s, offset:%"
+				PRIu64 ", length:%u\n", infop->vmid,
+				infop->vmdkid, recp->offset, recp->length);
+		if (!wb->retry_pending) {
+			wb->retry_pending = true;
+			wb->retry_work.func = hyc_wb_retry;
+			wb->retry_work.data = infop;
+			add_work(&wb->retry_work, HYC_WB_RETRY_SECS);
+		}
+		return;
+	}
+
+	recp->flushed = true;
+	wb->flushed++;
+	wb->nr_dirty--;
+	if (recp->type == HYC_WB_REC_WRITE)
+		wb->dirty_bytes -= recp->length;
+	hyc_wb_reclaim(infop);
+	hyc_wb_kick(infop);
+}
+
+static bool hyc_wb_overlaps_flushing(struct bs_hyc_info *infop,
+		struct hyc_wb_rec *recp)
+{
+	int i;
+
+	for (i = 0; i < HYC_NR_REQS; i++) {
+		struct hyc_req *reqp = &infop->reqs[i];
+
+		if (reqp->done != hyc_wb_flush_done || !reqp->privatep)
+			continue;
+		if (reqp->offset < recp->offset + recp->length &&
+				recp->offset < reqp->offset + reqp->length)
+			return true;
+	}
+	return false;
+}
+
+static void hyc_wb_flush_send(struct bs_hyc_info *infop, struct hyc_req *reqp)
+{
+	struct hyc_wb_rec *recp = reqp->privatep;
+	RequestID          reqid;
+	bool               trim = recp->type == HYC_WB_REC_TRIM;
+
+	if (!trim && hyc_zero_detect(infop) &&
+			is_zero_buf(reqp->bufp, recp->length)) {
+		/* the rest of the descriptor is zero already */
+		put_unaligned_be64(recp->offset >> infop->lup->blk_shift,
+			reqp->bufp);
+		put_unaligned_be32(recp->length >> infop->lup->blk_shift,
+			reqp->bufp + 8);
+		infop->zero.journal++;
+		infop->zero.elided_bytes += recp->length;
+		trim = true;
+	}
+	if (trim)
+		reqid = HycScheduleTruncate(infop->vmdk_handle, reqp,
+			reqp->bufp, 16);
+	else
+		reqid = HycScheduleWrite(infop->vmdk_handle, reqp, reqp->bufp,
+			recp->length, recp->offset);
+	if (reqid == kInvalidRequestID)
+		hyc_wb_flush_done(reqp, -EIO);
+}
+
+/* the data of a WRITE record was read back from the journal */
+static void hyc_wb_flush_read_done(struct hyc_io *iop)
+{
+	struct hyc_req *reqp = iop->privatep;
+
+	if (iop->result) {
+		hyc_wb_flush_done(reqp, iop->result);
+		return;
+	}
+	hyc_wb_flush_send(reqp->infop, reqp);
+}
+
+/*
+ * Issue unflushed records in journal order. A record overlapping one
+ * still in flight stops the scan so that stord sees overlapping data in
+ * the order it was written.
+ */
+static void hyc_wb_kick(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_wb  *wb = &infop->wb;
+	struct hyc_wb_rec *recp;
+	struct hyc_req    *reqp;
+
+	if (wb->retry_pending || infop->vmdk_handle == kInvalidVmdkHandle)
+		return;
+
+	list_for_each_entry(recp, &wb->recs, list) {
+		if (recp->flushed || recp->flushing)
+			continue;
+		/* not in the journal yet */
+		if (recp->blockp)
+			break;
+		if (wb->nr_flushing >= HYC_WB_MAX_FLUSH)
+			break;
+		if (hyc_wb_overlaps_flushing(infop, recp))
+			break;
+		reqp = hyc_req_get(infop);
+		if (!reqp)
+			break;
+
+		reqp->done = hyc_wb_flush_done;
+		reqp->privatep = recp;
+		reqp->offset = recp->offset;
+		reqp->length = recp->length;
+		if (recp->type == HYC_WB_REC_TRIM) {
+			reqp->bufp = calloc(1, 16);
+			if (reqp->bufp) {
+				put_unaligned_be64(recp->offset >>
+					infop->lup->blk_shift, reqp->bufp);
+				put_unaligned_be32(recp->length >>
+					infop->lup->blk_shift, reqp->bufp + 8);
+			}
+		} else if (posix_memalign((void **) &reqp->bufp, HYC_WB_BLOCK,
+				roundup(recp->length, HYC_WB_BLOCK)))
+			reqp->bufp = NULL;
+		if (!reqp->bufp) {
+			hyc_req_put(reqp);
+			break;
+		}
+		recp->flushing = true;
+		wb->nr_flushing++;
+
+		if (recp->type == HYC_WB_REC_TRIM)
+			hyc_wb_flush_send(infop, reqp);
+		else if (hyc_io_issue(infop, wb->fd, reqp->bufp,
+				roundup(recp->length, HYC_WB_BLOCK),
+				hyc_wb_phys(wb, recp->lpos) + HYC_WB_BLOCK,
+				HYC_IO_READ, hyc_wb_flush_read_done, reqp)) {
+			recp->flushing = false;
+			wb->nr_flushing--;
+			free(reqp->bufp);
+			hyc_req_put(reqp);
+			break;
+		}
+		if (wb->retry_pending)
+			break;
+	}
+}
+
+struct hyc_wb_extent {
+	uint64_t start;
+	uint64_t end;
+};
+
+static int hyc_wb_extent_cmp(const void *ap, const void *bp)
+{
+	const struct hyc_wb_extent *a = ap, *b = bp;
+
+	return a->start < b->start ? -1 : a->start > b->start;
+}
+
+static bool hyc_wb_covered(struct hyc_wb_overlay *ovp)
+{
+	struct hyc_wb_extent *extp;
+	uint64_t              covered = ovp->offset;
+	int                   i;
+
+	extp = malloc(sizeof(*extp) * ovp->nr_parts);
+	if (!extp)
+		return false;
+	for (i = 0; i < ovp->nr_parts; i++) {
+		extp[i].start = ovp->parts[i].start;
+		extp[i].end = ovp->parts[i].start + ovp->parts[i].length;
+	}
+	qsort(extp, ovp->nr_parts, sizeof(*extp), hyc_wb_extent_cmp);
+	for (i = 0; i < ovp->nr_parts && extp[i].start <= covered; i++)
+		covered = max(covered, extp[i].end);
+	free(extp);
+	return covered >= ovp->offset + ovp->length;
+}
+
+/* copy the journaled data over the READ buffer, oldest record first */
+static void hyc_wb_overlay_apply(struct hyc_wb_overlay *ovp)
+{
+	int i;
+
+	for (i = 0; i < ovp->nr_parts; i++) {
+		struct hyc_wb_part *partp = &ovp->parts[i];
+		char               *dstp = ovp->bufp +
+			(partp->start - ovp->offset);
+
+		if (partp->bufp)
+			memcpy(dstp, partp->bufp + partp->skip, partp->length);
+		else
+			memset(dstp, 0, partp->length);
+	}
+}
+
+static void hyc_wb_overlay_free(struct bs_hyc_info *infop,
+		struct hyc_wb_overlay *ovp)
+{
+	int i;
+
+	for (i = 0; i < ovp->nr_parts; i++) {
+		ovp->parts[i].recp->refs--;
+		free(ovp->parts[i].bufp);
+	}
+	free(ovp);
+	hyc_wb_reclaim(infop);
+}
+
+/* the journal reads of a READ are done, and its stord READ if any */
+static int hyc_wb_overlay_end(struct bs_hyc_info *infop,
+		struct hyc_wb_overlay *ovp)
+{
+	struct bs_hyc_wb *wb = &infop->wb;
+	int               err = ovp->result;
+
+	list_del(&ovp->list);
+	if (!err) {
+		hyc_wb_overlay_apply(ovp);
+		if (ovp->covered) {
+			wb->read_hits++;
+			if (infop->rcache.enabled)
+				hyc_rc_populate(&infop->rcache, ovp->bufp,
+					ovp->offset, ovp->length);
+		}
+	}
+	hyc_wb_overlay_free(infop, ovp);
+	return err;
+}
+
+static void hyc_wb_overlay_put(struct bs_hyc_info *infop,
+		struct hyc_wb_overlay *ovp)
+{
+	struct scsi_cmd *cmdp = ovp->cmdp;
+
+	if (--ovp->pending)
+		return;
+	hyc_cmd_done(infop, cmdp, hyc_wb_overlay_end(infop, ovp));
+}
+
+static void hyc_wb_part_done(struct hyc_io *iop)
+{
+	struct hyc_wb_overlay *ovp = iop->privatep;
+
+	if (iop->result)
+		ovp->result = iop->result;
+	hyc_wb_overlay_put(iop->infop, ovp);
+}
+
+/* read the data of @partp back, or copy it while the append is going on */
+static int hyc_wb_part_load(struct bs_hyc_info *infop,
+		struct hyc_wb_overlay *ovp, struct hyc_wb_part *partp)
+{
+	struct bs_hyc_wb  *wb = &infop->wb;
+	struct hyc_wb_rec *recp = partp->recp;
+	uint64_t           skip = partp->start - recp->offset;
+	uint64_t           start = skip & ~((uint64_t) HYC_WB_BLOCK - 1);
+	uint64_t           end = roundup(skip + partp->length, HYC_WB_BLOCK);
+
+	if (recp->type == HYC_WB_REC_TRIM)
+		return 0;
+
+	if (recp->blockp) {
+		partp->bufp = malloc(partp->length);
+		if (!partp->bufp)
+			return -ENOMEM;
+		memcpy(partp->bufp, recp->blockp + HYC_WB_BLOCK + skip,
+			partp->length);
+		return 0;
+	}
+
+	if (posix_memalign((void **) &partp->bufp, HYC_WB_BLOCK, end - start)) {
+		partp->bufp = NULL;
+		return -ENOMEM;
+	}
+	partp->skip = skip - start;
+	if (hyc_io_issue(infop, wb->fd, partp->bufp, end - start,
+			hyc_wb_phys(wb, recp->lpos) + HYC_WB_BLOCK + start,
+			HYC_IO_READ, hyc_wb_part_done, ovp))
+		return -ENOMEM;
+	ovp->pending++;
+	return 0;
+}
+
+static bool hyc_wb_cmd_overlaps(struct bs_hyc_info *infop,
+		struct scsi_cmd *cmdp, uint64_t offset, uint64_t length)
+{
+	char     *bufp = scsi_cmd_buffer(cmdp);
+	uint32_t  len = scsi_cmd_length(cmdp);
+	uint64_t  start, bytes;
+
+	if (scsi_cmd_operation(cmdp) == WRITE) {
+		start = scsi_cmd_offset(cmdp);
+		return start < offset + length && offset < start + len;
+	}
+
+	/* UNMAP parameter list: 8 byte header, 16 byte block descriptors */
+	for (bufp += 8, len -= 8; len >= 16; bufp += 16, len -= 16) {
+		start = get_unaligned_be64(bufp) << infop->lup->blk_shift;
+		bytes = (uint64_t) get_unaligned_be32(bufp + 8) <<
+			infop->lup->blk_shift;
+		if (start < offset + length && offset < start + bytes)
+			return true;
+	}
+	return false;
+}
+
+/* journaled records and commands still waiting to be journaled */
+static bool hyc_wb_overlaps(struct bs_hyc_info *infop, uint64_t offset,
+		uint64_t length)
+{
+	struct bs_hyc_wb  *wb = &infop->wb;
+	struct hyc_wb_rec *recp;
+	struct scsi_cmd   *cmdp;
+
+	list_for_each_entry(recp, &wb->recs, list) {
+		if (recp->offset < offset + length &&
+				offset < recp->offset + recp->length)
+			return true;
+	}
+	list_for_each_entry(cmdp, &wb->waitq, bs_list) {
+		if (hyc_wb_cmd_overlaps(infop, cmdp, offset, length))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * READ in write-back mode: returns 1 when the journal holds all of the
+ * data, which may still be read back before the READ completes, 2 when
+ * stord must be read too and the journaled parts patched in once both
+ * are done, 0 when the journal holds nothing for the range and a
+ * negative errno on failure.
+ */
+static int hyc_wb_read(struct bs_hyc_info *infop, struct scsi_cmd *cmdp,
+		char *bufp, uint64_t offset, uint32_t length)
+{
+	struct bs_hyc_wb      *wb = &infop->wb;
+	struct hyc_wb_overlay *ovp;
+	struct hyc_wb_part    *partp;
+	struct hyc_wb_rec     *recp;
+	int                    nr = 0, i, err;
+
+	list_for_each_entry(recp, &wb->recs, list) {
+		if (!recp->failed && recp->offset < offset + length &&
+				offset < recp->offset + recp->length)
+			nr++;
+	}
+	if (!nr)
+		return 0;
+
+	ovp = calloc(1, sizeof(*ovp) + nr * sizeof(ovp->parts[0]));
+	if (!ovp)
+		return -ENOMEM;
+	ovp->cmdp = cmdp;
+	ovp->bufp = bufp;
+	ovp->offset = offset;
+	ovp->length = length;
+	list_for_each_entry(recp, &wb->recs, list) {
+		if (recp->failed || recp->offset >= offset + length ||
+				offset >= recp->offset + recp->length)
+			continue;
+		partp = &ovp->parts[ovp->nr_parts++];
+		partp->recp = recp;
+		partp->start = max(offset, recp->offset);
+		partp->length = min(offset + length,
+			recp->offset + recp->length) - partp->start;
+		recp->refs++;
+	}
+	ovp->covered = hyc_wb_covered(ovp);
+	list_add_tail(&ovp->list, &wb->overlays);
+
+	for (i = 0; i < ovp->nr_parts && !ovp->result; i++)
+		ovp->result = hyc_wb_part_load(infop, ovp, &ovp->parts[i]);
+
+	if (!ovp->covered) {
+		/* and the stord READ */
+		ovp->pending++;
+		wb->read_overlays++;
+		return 2;
+	}
+	if (ovp->pending) {
+		set_cmd_async(cmdp);
+		return 1;
+	}
+
+	/* nothing had to be read back */
+	err = hyc_wb_overlay_end(infop, ovp);
+	return err ? err : 1;
+}
+
+/*
+ * A READ that went to stord is done. True if it is patched from the
+ * journal, which hands it back to the target, now or once the journal
+ * reads are done too.
+ */
+static bool hyc_wb_read_done(struct bs_hyc_info *infop, struct scsi_cmd *cmdp,
+		int result)
+{
+	struct bs_hyc_wb      *wb = &infop->wb;
+	struct hyc_wb_overlay *ovp;
+
+	if (!wb->enabled || list_empty(&wb->overlays))
+		return false;
+
+	list_for_each_entry(ovp, &wb->overlays, list) {
+		if (ovp->cmdp != cmdp)
+			continue;
+		if (result)
+			ovp->result = result;
+		hyc_wb_overlay_put(infop, ovp);
+		return true;
+	}
+	return false;
+}
+
+/* an aborted READ, with no journal reads in flight */
+static void hyc_wb_read_abort(struct bs_hyc_info *infop,
+		struct scsi_cmd *cmdp)
+{
+	struct bs_hyc_wb      *wb = &infop->wb;
+	struct hyc_wb_overlay *ovp;
+
+	if (!wb->enabled)
+		return;
+
+	list_for_each_entry(ovp, &wb->overlays, list) {
+		if (ovp->cmdp != cmdp)
+			continue;
+		list_del(&ovp->list);
+		hyc_wb_overlay_free(infop, ovp);
+		return;
+	}
+}
+
+/* SYNCHRONIZE CACHE waits for the records still being acknowledged */
+static int hyc_wb_sync(struct bs_hyc_info *infop, struct scsi_cmd *cmdp)
+{
+	struct bs_hyc_wb   *wb = &infop->wb;
+	struct hyc_wb_sync *syncp;
+
+	if (list_empty(&wb->appending))
+		return SAM_STAT_GOOD;
+
+	syncp = malloc(sizeof(*syncp));
+	if (!syncp)
+		return -ENOMEM;
+	syncp->cmdp = cmdp;
+	syncp->seq = wb->seq;
+	set_cmd_async(cmdp);
+	list_add_tail(&syncp->list, &wb->syncs);
+	return 0;
+}
+
+/*
+ * Abort the commands waiting for journal space, for an earlier record
+ * or, for a sync, for the records before it. Nothing may be in flight
+ * to the journal.
+ */
+static void hyc_wb_abort(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_wb   *wb = &infop->wb;
+	struct hyc_wb_rec  *recp, *nextp;
+	struct hyc_wb_sync *syncp, *snextp;
+	struct hyc_wb_ack  *ackp;
+	struct scsi_cmd    *cmdp;
+
+	if (!wb->enabled)
+		return;
+
+	while (!list_empty(&wb->waitq)) {
+		cmdp = list_first_entry(&wb->waitq, struct scsi_cmd, bs_list);
+		list_del(&cmdp->bs_list);
+		target_cmd_io_done(cmdp, TASK_ABORTED);
+	}
+	list_for_each_entry_safe(recp, nextp, &wb->appending, alist) {
+		list_del_init(&recp->alist);
+		ackp = recp->ackp;
+		recp->ackp = NULL;
+		if (!--ackp->pending) {
+			target_cmd_io_done(ackp->cmdp, TASK_ABORTED);
+			free(ackp);
+		}
+	}
+	list_for_each_entry_safe(syncp, snextp, &wb->syncs, list) {
+		list_del(&syncp->list);
+		target_cmd_io_done(syncp->cmdp, TASK_ABORTED);
+		free(syncp);
+	}
+}
+
+/*
+ * 1 if the record due next, by sequence number, starts at @lpos and is
+ * intact, 0 if not, or a negative errno
+ */
+static int hyc_wb_rec_load(struct bs_hyc_wb *wb, uint64_t lpos,
+		char *blockp, struct hyc_wb_rec_hdr *hdrp)
+{
+	struct hyc_wb_rec_hdr hdr;
+	uint64_t              size;
+	char                 *datap;
+	int                   err;
+
+	err = hyc_rc_pio(wb->fd, blockp, HYC_WB_BLOCK, hyc_wb_phys(wb, lpos),
+		false);
+	if (err)
+		return err;
+
+	hdr = *(struct hyc_wb_rec_hdr *) blockp;
+	hdr.hdr_crc = 0;
+	*hdrp = *(struct hyc_wb_rec_hdr *) blockp;
+	if (hdrp->magic != HYC_WB_REC_MAGIC || hdrp->epoch != wb->epoch ||
+			hdrp->seq != wb->seq ||
+			crc32c(wb->salt, &hdr, sizeof(hdr)) != hdrp->hdr_crc)
+		return 0;
+	size = hyc_wb_rec_size(hdrp->type, hdrp->length);
+	if (lpos % wb->size + size > wb->size)
+		return 0;
+	if (hdrp->type != HYC_WB_REC_WRITE)
+		return 1;
+
+	/* a torn record ends the journal */
+	if (posix_memalign((void **) &datap, HYC_WB_BLOCK, size - HYC_WB_BLOCK))
+		return -ENOMEM;
+	err = hyc_rc_pio(wb->fd, datap, size - HYC_WB_BLOCK,
+		hyc_wb_phys(wb, lpos) + HYC_WB_BLOCK, false);
+	if (!err)
+		err = crc32c(~0, datap, hdrp->length) == hdrp->data_crc;
+	free(datap);
+	return err;
+}
+
+/*
+ * Walk the records from the tail in the superblock up to the first one
+ * missing or torn: that is the part of the journal that may not have
+ * reached stord. It becomes dirty again and is flushed as if just
+ * written.
+ */
+static int hyc_wb_recover(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_wb      *wb = &infop->wb;
+	struct hyc_wb_rec_hdr  hdr;
+	struct hyc_wb_rec     *recp;
+	uint64_t               pos = wb->head, wrap, size;
+	char                  *blockp;
+	int                    found, err = 0;
+
+	if (posix_memalign((void **) &blockp, HYC_WB_BLOCK, HYC_WB_BLOCK))
+		return -ENOMEM;
+
+	while (pos - wb->sb_tail < wb->size) {
+		found = hyc_wb_rec_load(wb, pos, blockp, &hdr);
+		if (!found && pos % wb->size) {
+			/* one that did not fit went to the start of the area */
+			wrap = pos + wb->size - pos % wb->size;
+			found = hyc_wb_rec_load(wb, wrap, blockp, &hdr);
+			if (found > 0 && pos % wb->size +
+					hyc_wb_rec_size(hdr.type, hdr.length) <=
+					wb->size)
+				found = 0;
+			if (found > 0)
+				pos = wrap;
+		}
+		if (found < 0) {
+			err = found;
+			goto out;
+		}
+		size = hyc_wb_rec_size(hdr.type, hdr.length);
+		if (!found || pos + size - wb->sb_tail > wb->size)
+			break;
+
+		recp = calloc(1, sizeof(*recp));
+		if (!recp) {
+			err = -ENOMEM;
+			goto out;
+		}
+		INIT_LIST_HEAD(&recp->alist);
+		recp->seq = wb->seq++;
+		recp->lpos = pos;
+		recp->offset = hdr.offset;
+		recp->length = hdr.length;
+		recp->type = hdr.type;
+		list_add_tail(&recp->list, &wb->recs);
+		wb->nr_dirty++;
+		if (recp->type == HYC_WB_REC_WRITE)
+			wb->dirty_bytes += recp->length;
+		wb->recovered++;
+		pos += size;
+	}
+	wb->head = pos;
+	if (wb->recovered)
+		eprintf("replaying %" PRIu64 " journal records for vmdkid:%s\n",
+			wb->recovered, infop->vmdkid);
+out:
+	free(blockp);
+	return err;
+}
+
+static int hyc_wb_open(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_wb    *wb = &infop->wb;
+	struct hyc_wb_super *sbp = NULL;
+	struct hyc_wb_super  sb;
+	int                  err;
+
+	wb->fd = open(wb->path, O_RDWR | O_CREAT | O_LARGEFILE | O_DIRECT |
+		O_DSYNC, S_IRUSR | S_IWUSR);
+	if (wb->fd < 0) {
+		eprintf("Failed to open journal %s, %m\n", wb->path);
+		return -errno;
+	}
+
+	if (posix_memalign((void **) &sbp, HYC_WB_BLOCK, HYC_WB_BLOCK)) {
+		err = -ENOMEM;
+		goto error;
+	}
+	memset(sbp, 0, HYC_WB_BLOCK);
+	err = hyc_rc_pio(wb->fd, (char *) sbp, HYC_WB_BLOCK, 0, false);
+	if (err && err != -EIO)
+		goto error;
+
+	sb = *sbp;
+	sb.crc = 0;
+	if (!err && sbp->magic == HYC_WB_MAGIC &&
+			crc32c(~0, &sb, sizeof(sb)) == sbp->crc) {
+		if (strncmp(sbp->vmdkid, infop->vmdkid, sizeof(sbp->vmdkid))) {
+			eprintf("journal %s belongs to vmdkid:%.*s\n", wb->path,
+				(int) sizeof(sbp->vmdkid), sbp->vmdkid);
+			err = -EINVAL;
+			goto error;
+		}
+		if (sbp->version != HYC_WB_VERSION) {
+			eprintf("journal %s has version %u, expected %u\n",
+				wb->path, sbp->version, HYC_WB_VERSION);
+			err = -EINVAL;
+			goto error;
+		}
+		wb->epoch = sbp->epoch;
+		wb->size = sbp->size;
+		wb->salt = sbp->salt;
+		wb->head = wb->sb_tail = sbp->tail;
+		wb->seq = wb->sb_tail_seq = sbp->tail_seq;
+		err = hyc_wb_recover(infop);
+		if (err)
+			goto error;
+	} else {
+		/* new journal */
+		wb->size = (wb->size_mb ? : HYC_WB_DEF_SIZE_MB) << 20;
+		wb->epoch = 1;
+		wb->salt = hyc_wb_salt();
+		wb->head = wb->sb_tail = 0;
+		wb->seq = 0;
+		if (ftruncate(wb->fd, HYC_WB_BLOCK + wb->size)) {
+			err = -errno;
+			goto error;
+		}
+		err = hyc_wb_super_write(infop);
+		if (err)
+			goto error;
+	}
+	free(sbp);
+	return 0;
+error:
+	eprintf("journal %s unusable, %s\n", wb->path, strerror(-err));
+	free(sbp);
+	close(wb->fd);
+	wb->fd = -1;
+	return err;
+}
+
+static void hyc_wb_close(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_wb      *wb = &infop->wb;
+	struct hyc_wb_rec     *recp, *nextp;
+	struct hyc_wb_overlay *ovp, *ovnextp;
+	bool                   clean = true;
+	int                    i;
+
+	if (!wb->enabled || wb->fd < 0)
+		return;
+
+	if (wb->retry_pending) {
+		del_work(&wb->retry_work);
+		wb->retry_pending = false;
+	}
+	for (i = 0; i < HYC_NR_REQS; i++) {
+		struct hyc_req *reqp = &infop->reqs[i];
+
+		if (reqp->done == hyc_wb_flush_done && reqp->privatep) {
+			free(reqp->bufp);
+			hyc_req_put(reqp);
+		}
+	}
+	hyc_wb_abort(infop);
+	list_for_each_entry_safe(ovp, ovnextp, &wb->overlays, list) {
+		list_del(&ovp->list);
+		for (i = 0; i < ovp->nr_parts; i++)
+			free(ovp->parts[i].bufp);
+		free(ovp);
+	}
+	list_for_each_entry_safe(recp, nextp, &wb->recs, list) {
+		if (!recp->flushed)
+			clean = false;
+		list_del(&recp->list);
+		free(recp->blockp);
+		free(recp);
+	}
+
+	/* everything reached stord, retire the journal contents */
+	if (clean) {
+		wb->epoch++;
+		wb->salt = hyc_wb_salt();
+		hyc_wb_super_write(infop);
+	}
+	close(wb->fd);
+	wb->fd = -1;
+	wb->nr_flushing = 0;
+	wb->nr_dirty = 0;
+	wb->dirty_bytes = 0;
+	wb->sb_writing = false;
+	wb->sb_err = 0;
+	wb->gap = false;
+}
+
+/*
+ * Readahead
+ */
+
+#define HYC_RA_MIN_WINDOW	(128 << 10)
+#define HYC_RA_TRIGGER		2
+
+struct hyc_ra_buf {
+	struct list_head      list;
+	struct hyc_ra_stream *stream;
+	uint64_t              offset;
+	uint32_t              length;
+	uint32_t              used;
+	char                 *bufp;
+	bool                  ready;
+	bool                  stale;
+	struct list_head      waiters;
+};
+
+static inline bool hyc_ra_contains(struct hyc_ra_buf *rabp, uint64_t offset,
+		uint32_t length)
+{
+	return offset >= rabp->offset &&
+		offset + length <= rabp->offset + rabp->length;
+}
+
+static void hyc_ra_buf_free(struct bs_hyc_ra *ra, struct hyc_ra_buf *rabp)
+{
+	if (rabp->used < rabp->length)
+		ra->waste_bytes += rabp->length - rabp->used;
+	list_del(&rabp->list);
+	ra->nr_bufs--;
+	free(rabp->bufp);
+	free(rabp);
+}
+
+/* in-flight buffers are only marked, their request still owns them */
+static void hyc_ra_buf_drop(struct bs_hyc_ra *ra, struct hyc_ra_buf *rabp)
+{
+	rabp->stale = true;
+	rabp->stream = NULL;
+	if (rabp->ready)
+		hyc_ra_buf_free(ra, rabp);
+}
+
+static void hyc_ra_invalidate(struct bs_hyc_info *infop, uint64_t offset,
+		uint64_t length)
+{
+	struct bs_hyc_ra  *ra = &infop->ra;
+	struct hyc_ra_buf *rabp, *nextp;
+
+	list_for_each_entry_safe(rabp, nextp, &ra->bufs, list) {
+		if (rabp->offset < offset + length &&
+				offset < rabp->offset + rabp->length)
+			hyc_ra_buf_drop(ra, rabp);
+	}
+}
+
+/* random access: forget the stream and everything read ahead for it */
+static void hyc_ra_teardown(struct bs_hyc_ra *ra, struct hyc_ra_stream *sp)
+{
+	struct hyc_ra_buf *rabp, *nextp;
+
+	if (sp->window)
+		ra->teardowns++;
+	list_for_each_entry_safe(rabp, nextp, &ra->bufs, list) {
+		if (rabp->stream == sp)
+			hyc_ra_buf_drop(ra, rabp);
+	}
+	memset(sp, 0, sizeof(*sp));
+}
+
+static struct hyc_ra_stream *hyc_ra_stream_find(struct bs_hyc_ra *ra,
+		uint64_t offset)
+{
+	struct hyc_ra_stream *sp, *lru = NULL, *lru_seq = NULL;
+	int i;
+
+	for (i = 0; i < HYC_RA_STREAMS; i++) {
+		sp = &ra->streams[i];
+		if (sp->seq_count && sp->next == offset)
+			return sp;
+		/* one-off random reads go before established streams */
+		if (sp->seq_count < HYC_RA_TRIGGER) {
+			if (!lru || sp->last_use < lru->last_use)
+				lru = sp;
+		} else if (!lru_seq || sp->last_use < lru_seq->last_use)
+			lru_seq = sp;
+	}
+	if (!lru)
+		lru = lru_seq;
+	hyc_ra_teardown(ra, lru);
+	return lru;
+}
+
+static void hyc_ra_done(struct hyc_req *reqp, int result)
+{
+	struct bs_hyc_info *infop = reqp->infop;
+	struct bs_hyc_ra   *ra = &infop->ra;
+	struct hyc_ra_buf  *rabp = reqp->privatep;
+	struct scsi_cmd    *cmdp, *nextp;
+	RequestID           reqid;
+
+	hyc_req_put(reqp);
+	rabp->ready = true;
+
+	/*
+	 * Waiters queued before any overlapping WRITE arrived, so the data
+	 * is good for them even if the buffer went stale since.
+	 */
+	list_for_each_entry_safe(cmdp, nextp, &rabp->waiters, bs_list) {
+		uint64_t offset = scsi_cmd_offset(cmdp);
+		uint32_t length = scsi_cmd_length(cmdp);
+
+		list_del(&cmdp->bs_list);
+		if (!result) {
+			memcpy(scsi_cmd_buffer(cmdp),
+				rabp->bufp + (offset - rabp->offset), length);
+			rabp->used += length;
+			ra->hits++;
+			ra->hit_bytes += length;
+			target_cmd_io_done(cmdp, SAM_STAT_GOOD);
+			continue;
+		}
+		reqid = HycScheduleRead(infop->vmdk_handle, cmdp,
+			scsi_cmd_buffer(cmdp), length, offset);
+		if (reqid == kInvalidRequestID) {
+			sense_data_build(cmdp, MEDIUM_ERROR, 0);
+			target_cmd_io_done(cmdp, SAM_STAT_CHECK_CONDITION);
+		}
+	}
+
+	if (result || rabp->stale)
+		hyc_ra_buf_free(ra, rabp);
+}
+
+/* keep one window of data in flight or ready ahead of the reader */
+static void hyc_ra_issue(struct bs_hyc_info *infop, struct hyc_ra_stream *sp)
+{
+	struct bs_hyc_ra  *ra = &infop->ra;
+	struct hyc_ra_buf *rabp, *nextp;
+	struct hyc_req    *reqp;
+	uint64_t           start = max(sp->ra_end, sp->next);
+	uint64_t           size = infop->lup->size;
+	uint32_t           length;
+
+	if (start >= sp->next + sp->window || start >= size)
+		return;
+	length = min_t(uint64_t, sp->window, size - start);
+
+	/* reuse the slot of a buffer its stream has already passed */
+	if (ra->nr_bufs >= HYC_RA_NR_BUFS) {
+		list_for_each_entry_safe(rabp, nextp, &ra->bufs, list) {
+			if (rabp->ready && (!rabp->stream ||
+					rabp->offset + rabp->length <=
+					rabp->stream->next)) {
+				hyc_ra_buf_free(ra, rabp);
+				break;
+			}
+		}
+		if (ra->nr_bufs >= HYC_RA_NR_BUFS)
+			return;
+	}
+
+	rabp = calloc(1, sizeof(*rabp));
+	if (!rabp)
+		return;
+	if (posix_memalign((void **) &rabp->bufp, pagesize, length)) {
+		free(rabp);
+		return;
+	}
+	reqp = hyc_req_get(infop);
+	if (!reqp) {
+		free(rabp->bufp);
+		free(rabp);
+		return;
+	}
+	rabp->stream = sp;
+	rabp->offset = start;
+	rabp->length = length;
+	INIT_LIST_HEAD(&rabp->waiters);
+	/* stord does not have journaled or parked data yet */
+	if (infop->wb.enabled && hyc_wb_overlaps(infop, start, length))
+		rabp->stale = true;
+
+	reqp->done = hyc_ra_done;
+	reqp->privatep = rabp;
+	reqp->offset = start;
+	reqp->length = length;
+	if (HycScheduleRead(infop->vmdk_handle, reqp, rabp->bufp, length,
+			start) == kInvalidRequestID) {
+		hyc_req_put(reqp);
+		free(rabp->bufp);
+		free(rabp);
+		return;
+	}
+	list_add_tail(&rabp->list, &ra->bufs);
+	ra->nr_bufs++;
+	ra->issued++;
+	ra->issued_bytes += length;
+	sp->ra_end = start + length;
+}
+
+/*
+ * READ with readahead enabled: returns 1 when the command was served
+ * from, or queued behind, a readahead buffer, 0 when stord must be read.
+ */
+static int hyc_ra_read(struct bs_hyc_info *infop, struct scsi_cmd *cmdp,
+		char *bufp, uint64_t offset, uint32_t length)
+{
+	struct bs_hyc_ra     *ra = &infop->ra;
+	struct hyc_ra_stream *sp;
+	struct hyc_ra_buf    *rabp, *nextp;
+	int                   served = 0;
+
+	sp = hyc_ra_stream_find(ra, offset);
+	sp->seq_count++;
+	sp->next = offset + length;
+	sp->last_use = ++ra->clock;
+
+	list_for_each_entry_safe(rabp, nextp, &ra->bufs, list) {
+		if (rabp->stale || !hyc_ra_contains(rabp, offset, length))
+			continue;
+		if (!rabp->ready) {
+			ra->waits++;
+			set_cmd_async(cmdp);
+			list_add_tail(&cmdp->bs_list, &rabp->waiters);
+		} else {
+			memcpy(bufp, rabp->bufp + (offset - rabp->offset),
+				length);
+			rabp->used += length;
+			ra->hits++;
+			ra->hit_bytes += length;
+			if (offset + length >= rabp->offset + rabp->length)
+				hyc_ra_buf_free(ra, rabp);
+		}
+		served = 1;
+		/* the reader keeps up, look further ahead */
+		if (sp->window && sp->window < ra->max)
+			sp->window = min(sp->window * 2, ra->max);
+		break;
+	}
+
+	if (sp->seq_count >= HYC_RA_TRIGGER && length <= ra->max) {
+		if (!sp->window)
+			sp->window = max_t(uint32_t, HYC_RA_MIN_WINDOW, length);
+		sp->window = min(sp->window, ra->max);
+		hyc_ra_issue(infop, sp);
+	}
+	return served;
+}
+
+static void hyc_ra_close(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_ra  *ra = &infop->ra;
+	struct hyc_ra_buf *rabp, *nextp;
+	int                i;
+
+	if (!ra->max)
+		return;
+
+	for (i = 0; i < HYC_NR_REQS; i++) {
+		struct hyc_req *reqp = &infop->reqs[i];
+
+		if (reqp->done == hyc_ra_done && reqp->privatep)
+			hyc_req_put(reqp);
+	}
+	list_for_each_entry_safe(rabp, nextp, &ra->bufs, list) {
+		struct scsi_cmd *cmdp, *cnextp;
+
+		list_for_each_entry_safe(cmdp, cnextp, &rabp->waiters, bs_list) {
+			list_del(&cmdp->bs_list);
+			target_cmd_io_done(cmdp, TASK_ABORTED);
+		}
+		hyc_ra_buf_free(ra, rabp);
+	}
+	memset(ra->streams, 0, sizeof(ra->streams));
+}
+
+/*
+ * Allocation map
+ *
+ * One bit per granule, set while the granule may hold data on stord.
+ * READs that only touch clear granules are zero filled here; mixed ones
+ * only fetch the set extents. stord can't be asked what it allocated,
+ * so a map that wasn't saved cleanly starts out all set, and a READ
+ * that comes back zero clears the granules it covered as long as no
+ * WRITE was in flight. The saved map is marked dirty while the LUN is
+ * open, so a crash throws it away.
+ *
+ * With debug logging on, nothing is zero filled: READs go to stord and
+ * what they return is checked against the map instead.
+ */
+
+#define HYC_AM_MIN_SHIFT	16
+#define HYC_AM_MAGIC		0x687963616d617031ULL	/* "hycamap1" */
+#define HYC_AM_VERSION		1
+#define HYC_AM_HDR_SIZE		4096
+#define HYC_AM_MAX_READS	64
+#define HYC_AM_MAX_EXTENTS	4
+
+struct hyc_am_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t clean;
+	uint64_t size;
+	uint32_t shift;
+	uint32_t pad;
+};
+
+struct hyc_am_read {
+	struct list_head list;
+	struct scsi_cmd *cmdp;
+	uint64_t         offset;
+	uint32_t         length;
+	bool             stale;		/* a WRITE overlapped it */
+};
+
+/* a command served by several internal requests */
+struct hyc_zero_split {
+	struct scsi_cmd *cmdp;			/* NULL once aborted */
+	int              pending;
+	int              result;
+};
+
+struct hyc_zero_run {
+	uint32_t start;
+	uint32_t end;
+};
+
+static void hyc_zero_done(struct hyc_req *reqp, int result);
+
+/* every granule the range touches may hold data now */
+static void hyc_am_set(struct bs_hyc_amap *am, uint64_t offset,
+		uint64_t length)
+{
+	struct hyc_am_read *rp;
+	uint64_t            i, last;
+
+	if (!am->mapped || !length)
+		return;
+	list_for_each_entry(rp, &am->reads, list) {
+		if (rp->offset < offset + length &&
+				offset < rp->offset + rp->length)
+			rp->stale = true;
+	}
+	last = min((offset + length - 1) >> am->shift, am->nr_granules - 1);
+	for (i = offset >> am->shift; i <= last; i++) {
+		if (!test_bit(i, am->mapped)) {
+			set_bit(i, am->mapped);
+			am->nr_mapped++;
+		}
+	}
+}
+
+/* granules the range covers in full read back zero now */
+static void hyc_am_clear(struct bs_hyc_amap *am, uint64_t offset,
+		uint64_t length)
+{
+	uint64_t i = DIV_ROUND_UP(offset, 1ULL << am->shift);
+	uint64_t end = (offset + length) >> am->shift;
+
+	if (!am->mapped)
+		return;
+	if (offset + length >= am->size)
+		end = am->nr_granules;
+	for (; i < end; i++) {
+		if (test_bit(i, am->mapped)) {
+			clear_bit(i, am->mapped);
+			am->nr_mapped--;
+		}
+	}
+}
+
+static void hyc_am_write(struct bs_hyc_info *infop, uint64_t offset,
+		uint32_t length)
+{
+	struct bs_hyc_amap *am = &infop->amap;
+
+	if (!am->mapped)
+		return;
+	hyc_am_set(am, offset, length);
+	/* journaled WRITEs are tracked by the journal itself */
+	if (!infop->wb.enabled)
+		am->nr_writes++;
+}
+
+/* a failed UNMAP leaves its blocks in an unknown state */
+static void hyc_am_unmap_failed(struct bs_hyc_info *infop,
+		struct scsi_cmd *cmdp)
+{
+	char     *bufp = scsi_cmd_buffer(cmdp);
+	uint32_t  length = scsi_cmd_length(cmdp);
+	unsigned int shift = infop->lup->blk_shift;
+
+	if (!infop->amap.mapped || !bufp || length < 8)
+		return;
+	for (bufp += 8, length -= 8; length >= 16; bufp += 16, length -= 16)
+		hyc_am_set(&infop->amap, get_unaligned_be64(bufp) << shift,
+			(uint64_t) get_unaligned_be32(bufp + 8) << shift);
+}
+
+/*
+ * Zero fills a READ of clear granules, or splits a mixed one. Returns
+ * -1 if the READ has to go to stord as it is.
+ */
+static int hyc_am_read(struct bs_hyc_info *infop, struct scsi_cmd *cmdp,
+		char *bufp, uint64_t offset, uint32_t length)
+{
+	struct bs_hyc_amap    *am = &infop->amap;
+	struct hyc_zero_run    runs[HYC_AM_MAX_EXTENTS];
+	struct hyc_req        *reqs[HYC_AM_MAX_EXTENTS];
+	struct hyc_zero_split *zsp;
+	uint64_t               g, last;
+	uint32_t               start, end, pos;
+	int                    nr_runs = 0, i;
+
+	if (!am->mapped || is_debug)
+		return -1;
+
+	/* extents of set granules, relative to the buffer */
+	last = min((offset + length - 1) >> am->shift, am->nr_granules - 1);
+	for (g = offset >> am->shift; g <= last; g++) {
+		if (!test_bit(g, am->mapped))
+			continue;
+		start = g << am->shift > offset ? (g << am->shift) - offset : 0;
+		end = min_t(uint64_t, (g + 1) << am->shift, offset + length) -
+			offset;
+		if (nr_runs && runs[nr_runs - 1].end == start) {
+			runs[nr_runs - 1].end = end;
+			continue;
+		}
+		if (nr_runs == HYC_AM_MAX_EXTENTS)
+			return -1;
+		runs[nr_runs].start = start;
+		runs[nr_runs++].end = end;
+	}
+	if (nr_runs == 1 && runs[0].start == 0 && runs[0].end == length)
+		return -1;
+
+	if (!nr_runs) {
+		memset(bufp, 0, length);
+		am->zero_reads++;
+		am->zero_bytes += length;
+		return SAM_STAT_GOOD;
+	}
+
+	zsp = malloc(sizeof(*zsp));
+	for (i = 0; zsp && i < nr_runs; i++) {
+		reqs[i] = hyc_req_get(infop);
+		if (!reqs[i])
+			break;
+	}
+	if (!zsp || i < nr_runs) {
+		while (i--)
+			hyc_req_put(reqs[i]);
+		free(zsp);
+		return -1;
+	}
+
+	for (i = 0, pos = 0; i < nr_runs; pos = runs[i++].end) {
+		memset(bufp + pos, 0, runs[i].start - pos);
+		am->zero_bytes += runs[i].start - pos;
+	}
+	memset(bufp + pos, 0, length - pos);
+	am->zero_bytes += length - pos;
+	am->split_reads++;
+
+	zsp->cmdp = cmdp;
+	zsp->pending = nr_runs;
+	zsp->result = 0;
+	set_cmd_async(cmdp);
+	for (i = 0; i < nr_runs; i++) {
+		struct hyc_req *reqp = reqs[i];
+
+		reqp->done = hyc_zero_done;
+		reqp->privatep = zsp;
+		reqp->offset = offset + runs[i].start;
+		reqp->length = runs[i].end - runs[i].start;
+	}
+	for (i = 0; i < nr_runs; i++) {
+		struct hyc_req *reqp = reqs[i];
+
+		if (HycScheduleRead(infop->vmdk_handle, reqp,
+				bufp + runs[i].start, reqp->length,
+				reqp->offset) == kInvalidRequestID) {
+			eprintf("read submission failed, size: %u offset: %"
+				PRIu64 "\n", reqp->length, reqp->offset);
+			hyc_zero_done(reqp, -EIO);
+		}
+	}
+	return 0;
+}
+
+/* the READ goes to stord, see what it brings back */
+static void hyc_am_track(struct bs_hyc_info *infop, struct scsi_cmd *cmdp,
+		uint64_t offset, uint32_t length)
+{
+	struct bs_hyc_amap *am = &infop->amap;
+	struct hyc_am_read *rp;
+
+	if (!am->mapped || am->nr_writes || am->nr_reads >= HYC_AM_MAX_READS ||
+			(infop->wb.enabled && !list_empty(&infop->wb.recs)))
+		return;
+	rp = malloc(sizeof(*rp));
+	if (!rp)
+		return;
+	rp->cmdp = cmdp;
+	rp->offset = offset;
+	rp->length = length;
+	rp->stale = false;
+	list_add_tail(&rp->list, &am->reads);
+	am->nr_reads++;
+}
+
+static void hyc_am_learn(struct bs_hyc_info *infop, struct hyc_am_read *rp,
+		const char *bufp)
+{
+	struct bs_hyc_amap *am = &infop->amap;
+	uint64_t            g, last, gstart, gend;
+	bool                zero;
+
+	last = min((rp->offset + rp->length - 1) >> am->shift,
+		am->nr_granules - 1);
+	for (g = rp->offset >> am->shift; g <= last; g++) {
+		gstart = max(g << am->shift, rp->offset);
+		gend = min_t(uint64_t, (g + 1) << am->shift,
+			rp->offset + rp->length);
+		zero = is_zero_buf(bufp + (gstart - rp->offset), gend - gstart);
+		if (!zero && !test_bit(g, am->mapped)) {
+			am->mismatches++;
+			eprintf("%s: data in unmapped granule %" PRIu64 "\n",
+				infop->vmdkid, g);
+			set_bit(g, am->mapped);
+			am->nr_mapped++;
+		} else if (zero && test_bit(g, am->mapped) &&
+				(gend - gstart == 1ULL << am->shift ||
+				 gend == am->size)) {
+			clear_bit(g, am->mapped);
+			am->nr_mapped--;
+			am->learned++;
+		}
+	}
+}
+
+/* called for every READ and WRITE before it is handed back */
+static void hyc_am_io_done(struct bs_hyc_info *infop, struct scsi_cmd *cmdp,
+		bool good)
+{
+	struct bs_hyc_amap *am = &infop->amap;
+	struct hyc_am_read *rp;
+
+	if (!am->mapped)
+		return;
+	if (scsi_cmd_operation(cmdp) == WRITE) {
+		if (!infop->wb.enabled && am->nr_writes)
+			am->nr_writes--;
+		return;
+	}
+	list_for_each_entry(rp, &am->reads, list) {
+		if (rp->cmdp != cmdp)
+			continue;
+		if (good && !rp->stale)
+			hyc_am_learn(infop, rp, scsi_cmd_buffer(cmdp));
+		list_del(&rp->list);
+		am->nr_reads--;
+		free(rp);
+		return;
+	}
+}
+
+static int hyc_am_open(struct bs_hyc_info *infop, const char *pathp,
+		uint64_t size)
+{
+	struct bs_hyc_amap *am = &infop->amap;
+	struct hyc_am_hdr   hdr;
+	size_t              map_len;
+	bool                loaded = false;
+	uint64_t            i;
+
+	am->size = size;
+	am->shift = max_t(unsigned int, HYC_AM_MIN_SHIFT,
+		infop->lup->blk_shift);
+	while ((size >> am->shift) > INT_MAX)
+		am->shift++;
+	am->nr_granules = DIV_ROUND_UP(size, 1ULL << am->shift);
+	if (!am->nr_granules)
+		return 0;
+	map_len = BITS_TO_LONGS(am->nr_granules) * sizeof(unsigned long);
+	am->mapped = calloc(1, map_len);
+	if (!am->mapped || asprintf(&am->path, "%s.amap", pathp) < 0) {
+		free(am->mapped);
+		am->mapped = NULL;
+		am->path = NULL;
+		return -ENOMEM;
+	}
+
+	am->fd = open(am->path, O_RDWR | O_CREAT, 0600);
+	if (am->fd < 0)
+		eprintf("can't open allocation map %s, %m\n", am->path);
+	else if (pread(am->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+			hdr.magic == HYC_AM_MAGIC &&
+			hdr.version == HYC_AM_VERSION && hdr.clean &&
+			hdr.size == size && hdr.shift == am->shift &&
+			pread(am->fd, am->mapped, map_len, HYC_AM_HDR_SIZE) ==
+			map_len)
+		loaded = true;
+
+	if (loaded) {
+		for (i = 0; i < map_len / sizeof(unsigned long); i++)
+			am->nr_mapped += __builtin_popcountl(am->mapped[i]);
+	} else {
+		for (i = 0; i < am->nr_granules; i++)
+			set_bit(i, am->mapped);
+		am->nr_mapped = am->nr_granules;
+	}
+	eprintf("%s: allocation map %s, %" PRIu64 "/%" PRIu64 " mapped\n",
+		infop->vmdkid, loaded ? "loaded" : "reset", am->nr_mapped,
+		am->nr_granules);
+
+	/* only a clean close makes the saved map good again */
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = HYC_AM_MAGIC;
+	hdr.version = HYC_AM_VERSION;
+	hdr.size = size;
+	hdr.shift = am->shift;
+	if (am->fd >= 0 && (pwrite(am->fd, &hdr, sizeof(hdr), 0) !=
+			sizeof(hdr) || fdatasync(am->fd))) {
+		eprintf("can't update allocation map %s, %m\n", am->path);
+		close(am->fd);
+		am->fd = -1;
+	}
+	return 0;
+}
+
+static void hyc_am_close(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_amap *am = &infop->amap;
+	struct hyc_am_read *rp, *nextp;
+	struct hyc_am_hdr   hdr;
+	size_t              map_len;
+
+	if (!am->mapped)
+		return;
+
+	list_for_each_entry_safe(rp, nextp, &am->reads, list) {
+		list_del(&rp->list);
+		free(rp);
+	}
+	am->nr_reads = am->nr_writes = 0;
+
+	map_len = BITS_TO_LONGS(am->nr_granules) * sizeof(unsigned long);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = HYC_AM_MAGIC;
+	hdr.version = HYC_AM_VERSION;
+	hdr.clean = 1;
+	hdr.size = am->size;
+	hdr.shift = am->shift;
+	if (am->fd >= 0 && (pwrite(am->fd, am->mapped, map_len,
+			HYC_AM_HDR_SIZE) != map_len || fdatasync(am->fd) ||
+			pwrite(am->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+			fdatasync(am->fd)))
+		eprintf("can't save allocation map %s, %m\n", am->path);
+	if (am->fd >= 0)
+		close(am->fd);
+	am->fd = -1;
+	free(am->mapped);
+	am->mapped = NULL;
+	free(am->path);
+	am->path = NULL;
+	am->nr_mapped = 0;
+}
+
+/*
+ * Write coalescing
+ *
+ * WRITEs are held in an open run for the rest of the current event loop
+ * pass. A WRITE that touches the run's extent joins it; anything else
+ * closes it. A closed run of more than one command is copied into one
+ * buffer in arrival order, so later data wins where commands overlap,
+ * and sent to stord as a single request.
+ */
+
+static inline bool scsi_cmd_fua(struct scsi_cmd *cmdp)
+{
+	return cmdp->scb[0] != WRITE_6 && (cmdp->scb[1] & 0x8);
+}
+
+static void hyc_co_write(struct bs_hyc_info *infop, struct scsi_cmd *cmdp)
+{
+	uint64_t offset = scsi_cmd_offset(cmdp);
+	uint32_t length = scsi_cmd_length(cmdp);
+
+	if (HycScheduleWrite(infop->vmdk_handle, cmdp, scsi_cmd_buffer(cmdp),
+			length, offset) != kInvalidRequestID)
+		return;
+	eprintf("write submission failed, size: %u offset: %" PRIu64 "\n",
+		length, offset);
+	hyc_rc_fill_done(&infop->rcache, cmdp, false);
+	hyc_am_io_done(infop, cmdp, false);
+	target_cmd_io_done(cmdp, SAM_STAT_CHECK_CONDITION);
+}
+
+static void hyc_co_done(struct hyc_req *reqp, int result)
+{
+	struct bs_hyc_info *infop = reqp->infop;
+	struct scsi_cmd    *cmdp, *nextp;
+
+	list_for_each_entry_safe(cmdp, nextp, &reqp->cmds, bs_list) {
+		list_del(&cmdp->bs_list);
+		hyc_rc_fill_done(&infop->rcache, cmdp, !result);
+		hyc_am_io_done(infop, cmdp, !result);
+		if (!result) {
+			target_cmd_io_done(cmdp, SAM_STAT_GOOD);
+			continue;
+		}
+		sense_data_build(cmdp, MEDIUM_ERROR, 0);
+		target_cmd_io_done(cmdp, SAM_STAT_CHECK_CONDITION);
+	}
+	free(reqp->bufp);
+	hyc_req_put(reqp);
+}
+
+static void hyc_co_flush(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_coalesce *co = &infop->co;
+	struct scsi_cmd        *cmdp, *nextp;
+	struct hyc_req         *reqp = NULL;
+	uint32_t                length = co->end - co->start;
+	char                   *bufp;
+
+	if (!co->nr_cmds)
+		return;
+	tgt_remove_sched_event(&co->sched);
+
+	if (co->nr_cmds > 1) {
+		reqp = hyc_req_get(infop);
+		if (reqp && posix_memalign((void **) &bufp, pagesize, length)) {
+			hyc_req_put(reqp);
+			reqp = NULL;
+		}
+	}
+	if (!reqp) {
+		/* a lone command, or nothing to merge into: send as is */
+		list_for_each_entry_safe(cmdp, nextp, &co->cmds, bs_list) {
+			list_del(&cmdp->bs_list);
+			co->requests++;
+			hyc_co_write(infop, cmdp);
+		}
+		co->nr_cmds = 0;
+		return;
+	}
+
+	list_for_each_entry(cmdp, &co->cmds, bs_list)
+		memcpy(bufp + (scsi_cmd_offset(cmdp) - co->start),
+			scsi_cmd_buffer(cmdp), scsi_cmd_length(cmdp));
+	list_splice_init(&co->cmds, &reqp->cmds);
+	reqp->done = hyc_co_done;
+	reqp->privatep = co;
+	reqp->bufp = bufp;
+	reqp->offset = co->start;
+	reqp->length = length;
+	co->requests++;
+	co->merged += co->nr_cmds;
+	co->merged_bytes += length;
+	co->nr_cmds = 0;
+
+	if (HycScheduleWrite(infop->vmdk_handle, reqp, bufp, length,
+			reqp->offset) == kInvalidRequestID) {
+		eprintf("merged write submission failed, size: %u offset: %"
+			PRIu64 "\n", length, reqp->offset);
+		hyc_co_done(reqp, -EIO);
+	}
+}
+
+static void hyc_co_sched(struct event_data *tev)
+{
+	hyc_co_flush(tev->data);
+}
+
+static void hyc_co_queue(struct bs_hyc_info *infop, struct scsi_cmd *cmdp,
+		uint64_t offset, uint32_t length)
+{
+	struct bs_hyc_coalesce *co = &infop->co;
+	uint64_t end = offset + length;
+
+	if (co->nr_cmds && (offset > co->end || end < co->start ||
+			max(co->end, end) - min(co->start, offset) > co->max))
+		hyc_co_flush(infop);
+
+	if (!co->nr_cmds) {
+		co->start = offset;
+		co->end = end;
+	} else {
+		co->start = min(co->start, offset);
+		co->end = max(co->end, end);
 	}
-	return 0;
+	list_add_tail(&cmdp->bs_list, &co->cmds);
+	co->nr_cmds++;
+	co->writes++;
+	tgt_add_sched_event(&co->sched);
 }
 
-static uint32_t scsi_cmd_length(struct scsi_cmd *cmdp)
+/*
+ * Zero detection
+ *
+ * A WRITE of nothing but zeroes is sent to stord as a truncate of its
+ * range. A large WRITE is scanned block by block instead, and its long
+ * zero runs go out as one truncate next to a WRITE for each data extent
+ * in between; the command completes when all of them have.
+ */
+
+#define HYC_ZERO_SPLIT_MIN	(64 << 10)	/* smallest WRITE to split */
+#define HYC_ZERO_RUN_MIN	(32 << 10)	/* shortest zero run cut out */
+#define HYC_ZERO_MAX_RUNS	4
+
+static void hyc_zero_done(struct hyc_req *reqp, int result)
 {
-	switch (scsi_cmd_operation(cmdp)) {
-	case READ:
-		return scsi_get_in_length(cmdp);
-	case WRITE_SAME_OP:
-	case WRITE:
-		return scsi_get_out_transfer_len(cmdp);
-	case TRUNCATE:
-		return scsi_get_out_length(cmdp);
-	case SYNCHRONIZE_CACHE_OP:
-		return scsi_rw_count(cmdp->scb);
-	case ABORT_TASK_OP:
-	case ABORT_TASK_SET_OP:
-	default:
-		break;
+	struct bs_hyc_info    *infop = reqp->infop;
+	struct hyc_zero_split *zsp = reqp->privatep;
+	struct scsi_cmd       *cmdp = zsp->cmdp;
+
+	/* only the truncate carries a buffer of its own */
+	if (result && reqp->bufp)
+		hyc_am_set(&infop->amap, reqp->offset, reqp->length);
+	free(reqp->bufp);
+	hyc_req_put(reqp);
+	if (result && !zsp->result)
+		zsp->result = result;
+	if (--zsp->pending)
+		return;
+	if (cmdp)
+		hyc_am_io_done(infop, cmdp, false);
+	if (cmdp && !zsp->result) {
+		target_cmd_io_done(cmdp, SAM_STAT_GOOD);
+	} else if (cmdp) {
+		sense_data_build(cmdp, MEDIUM_ERROR, 0);
+		target_cmd_io_done(cmdp, SAM_STAT_CHECK_CONDITION);
 	}
-	return 0;
+	free(zsp);
 }
 
-static char *scsi_cmd_buffer(struct scsi_cmd *cmdp)
+static int hyc_zero_runs(struct bs_hyc_info *infop, const char *bufp,
+		uint32_t length, struct hyc_zero_run *runs)
 {
-	switch (scsi_cmd_operation(cmdp)) {
-	default:
-		return NULL;
-	case READ:
-		return scsi_get_in_buffer(cmdp);
-	case WRITE:
-	case WRITE_SAME_OP:
-	case TRUNCATE:
-		return scsi_get_out_buffer(cmdp);
+	uint32_t bs = 1U << infop->lup->blk_shift;
+	uint32_t off, start = 0;
+	bool     in_run = false;
+	int      nr = 0;
+
+	for (off = 0; off < length && nr < HYC_ZERO_MAX_RUNS; off += bs) {
+		if (is_zero_buf(bufp + off, bs)) {
+			if (!in_run)
+				start = off;
+			in_run = true;
+			continue;
+		}
+		if (in_run && off - start >= HYC_ZERO_RUN_MIN) {
+			runs[nr].start = start;
+			runs[nr++].end = off;
+		}
+		in_run = false;
+	}
+	if (in_run && off - start >= HYC_ZERO_RUN_MIN) {
+		runs[nr].start = start;
+		runs[nr++].end = off;
+	}
+	return nr;
+}
+
+/* returns false if the WRITE has to go out as it is */
+static bool hyc_zero_write(struct bs_hyc_info *infop, struct scsi_cmd *cmdp,
+		char *bufp, uint64_t offset, uint32_t length)
+{
+	struct bs_hyc_zero    *zd = &infop->zero;
+	struct hyc_zero_run    runs[HYC_ZERO_MAX_RUNS];
+	struct hyc_req        *reqs[HYC_ZERO_MAX_RUNS + 2];
+	struct hyc_zero_split *zsp;
+	unsigned int           shift = infop->lup->blk_shift;
+	uint32_t               pos, elided = 0;
+	char                  *descp;
+	int                    nr_runs, nr_reqs, i;
+
+	if (is_zero_buf(bufp, length)) {
+		runs[0].start = 0;
+		runs[0].end = length;
+		nr_runs = 1;
+	} else if (length < HYC_ZERO_SPLIT_MIN) {
+		return false;
+	} else {
+		nr_runs = hyc_zero_runs(infop, bufp, length, runs);
+		if (!nr_runs)
+			return false;
+	}
+
+	/* one truncate for the runs, one WRITE per extent between them */
+	nr_reqs = 1;
+	for (i = 0, pos = 0; i < nr_runs; pos = runs[i++].end) {
+		nr_reqs += runs[i].start > pos;
+		elided += runs[i].end - runs[i].start;
+	}
+	nr_reqs += length > pos;
+
+	zsp = malloc(sizeof(*zsp));
+	descp = calloc(nr_runs, 16);
+	for (i = 0; zsp && descp && i < nr_reqs; i++) {
+		reqs[i] = hyc_req_get(infop);
+		if (!reqs[i])
+			break;
+	}
+	if (!zsp || !descp || i < nr_reqs) {
+		while (i--)
+			hyc_req_put(reqs[i]);
+		free(zsp);
+		free(descp);
+		return false;
+	}
+
+	for (i = 0; i < nr_runs; i++) {
+		put_unaligned_be64((offset + runs[i].start) >> shift,
+			descp + i * 16);
+		put_unaligned_be32((runs[i].end - runs[i].start) >> shift,
+			descp + i * 16 + 8);
+	}
+	zsp->cmdp = cmdp;
+	zsp->pending = nr_reqs;
+	zsp->result = 0;
+	for (i = 0; i < nr_reqs; i++) {
+		reqs[i]->done = hyc_zero_done;
+		reqs[i]->privatep = zsp;
+	}
+	for (i = 0; i < nr_runs; i++)
+		hyc_am_clear(&infop->amap, offset + runs[i].start,
+			runs[i].end - runs[i].start);
+	if (nr_reqs == 1)
+		zd->writes++;
+	else
+		zd->splits++;
+	zd->elided_bytes += elided;
+
+	/* held WRITEs go out first */
+	hyc_co_flush(infop);
+	set_cmd_async(cmdp);
+
+	reqs[0]->bufp = descp;
+	reqs[0]->offset = offset;
+	reqs[0]->length = length;
+	if (HycScheduleTruncate(infop->vmdk_handle, reqs[0], descp,
+			nr_runs * 16) == kInvalidRequestID) {
+		eprintf("zero truncate submission failed, size: %u offset: %"
+			PRIu64 "\n", length, offset);
+		hyc_zero_done(reqs[0], -EIO);
+	}
+	for (i = 0, pos = 0, nr_reqs = 1; i <= nr_runs; i++) {
+		struct hyc_req *reqp;
+		uint32_t        end = i < nr_runs ? runs[i].start : length;
+
+		if (end > pos) {
+			reqp = reqs[nr_reqs++];
+			reqp->offset = offset + pos;
+			reqp->length = end - pos;
+			if (HycScheduleWrite(infop->vmdk_handle, reqp,
+					bufp + pos, reqp->length,
+					reqp->offset) == kInvalidRequestID) {
+				eprintf("write submission failed, size: %u"
+					" offset: %" PRIu64 "\n", reqp->length,
+					reqp->offset);
+				hyc_zero_done(reqp, -EIO);
+			}
+		}
+		if (i < nr_runs)
+			pos = runs[i].end;
+	}
+	return true;
+}
+
+static void hyc_zero_close(struct bs_hyc_info *infop)
+{
+	int i;
+
+	for (i = 0; i < HYC_NR_REQS; i++) {
+		struct hyc_req        *reqp = &infop->reqs[i];
+		struct hyc_zero_split *zsp = reqp->privatep;
+
+		if (reqp->done != hyc_zero_done || !zsp)
+			continue;
+		if (zsp->cmdp) {
+			hyc_am_io_done(infop, zsp->cmdp, false);
+			target_cmd_io_done(zsp->cmdp, TASK_ABORTED);
+		}
+		zsp->cmdp = NULL;
+		free(reqp->bufp);
+		hyc_req_put(reqp);
+		if (!--zsp->pending)
+			free(zsp);
+	}
+}
+
+static inline bool hyc_co_overlaps(struct bs_hyc_coalesce *co,
+		uint64_t offset, uint64_t length)
+{
+	return co->nr_cmds && offset < co->end && co->start < offset + length;
+}
+
+static void hyc_cmds_abort(struct bs_hyc_info *infop, struct list_head *cmds)
+{
+	struct scsi_cmd *cmdp, *nextp;
+
+	list_for_each_entry_safe(cmdp, nextp, cmds, bs_list) {
+		list_del(&cmdp->bs_list);
+		hyc_rc_fill_done(&infop->rcache, cmdp, false);
+		hyc_am_io_done(infop, cmdp, false);
+		target_cmd_io_done(cmdp, TASK_ABORTED);
+	}
+}
+
+static void hyc_co_close(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_coalesce *co = &infop->co;
+	int                     i;
+
+	if (!co->max)
+		return;
+
+	tgt_remove_sched_event(&co->sched);
+	hyc_cmds_abort(infop, &co->cmds);
+	co->nr_cmds = 0;
+	for (i = 0; i < HYC_NR_REQS; i++) {
+		struct hyc_req *reqp = &infop->reqs[i];
+
+		if (reqp->done != hyc_co_done || !reqp->privatep)
+			continue;
+		hyc_cmds_abort(infop, &reqp->cmds);
+		free(reqp->bufp);
+		hyc_req_put(reqp);
+	}
+}
+
+/*
+ * SYNCHRONIZE CACHE group commit
+ *
+ * Only one flush is sent to stord at a time. Commands arriving while it
+ * is in flight queue up and share the next one, which covers the union
+ * of their ranges.
+ */
+
+static void hyc_flush_issue(struct bs_hyc_info *infop);
+
+static void hyc_flush_done(struct hyc_req *reqp, int result)
+{
+	struct bs_hyc_info  *infop = reqp->infop;
+	struct scsi_cmd     *cmdp, *nextp;
+
+	infop->flush.inflight = NULL;
+	list_for_each_entry_safe(cmdp, nextp, &reqp->cmds, bs_list) {
+		list_del(&cmdp->bs_list);
+		if (!result) {
+			target_cmd_io_done(cmdp, SAM_STAT_GOOD);
+			continue;
+		}
+		sense_data_build(cmdp, MEDIUM_ERROR, 0);
+		target_cmd_io_done(cmdp, SAM_STAT_CHECK_CONDITION);
+	}
+	hyc_req_put(reqp);
+	hyc_flush_issue(infop);
+}
+
+static void hyc_flush_issue(struct bs_hyc_info *infop)
+{
+	struct bs_hyc_flush *fl = &infop->flush;
+	struct scsi_cmd     *cmdp, *nextp;
+	struct hyc_req      *reqp;
+
+	if (fl->inflight || list_empty(&fl->pending))
+		return;
+
+	reqp = hyc_req_get(infop);
+	if (!reqp) {
+		/* pool exhausted: flush them one by one as before */
+		list_for_each_entry_safe(cmdp, nextp, &fl->pending, bs_list) {
+			list_del(&cmdp->bs_list);
+			fl->syncs++;
+			if (HycScheduleSyncCache(infop->vmdk_handle, cmdp,
+					fl->start, fl->end - fl->start) ==
+					kInvalidRequestID) {
+				sense_data_build(cmdp, MEDIUM_ERROR, 0);
+				target_cmd_io_done(cmdp,
+					SAM_STAT_CHECK_CONDITION);
+			}
+		}
+		return;
+	}
+
+	list_splice_init(&fl->pending, &reqp->cmds);
+	reqp->done = hyc_flush_done;
+	reqp->privatep = fl;
+	fl->inflight = reqp;
+	fl->syncs++;
+	if (HycScheduleSyncCache(infop->vmdk_handle, reqp, fl->start,
+			fl->end - fl->start) == kInvalidRequestID) {
+		eprintf("flush submission failed for %s\n", infop->vmdkid);
+		hyc_flush_done(reqp, -EIO);
+	}
+}
+
+/* offset and length in bytes, length never 0 */
+static void hyc_flush_queue(struct bs_hyc_info *infop, struct scsi_cmd *cmdp,
+		uint64_t offset, uint64_t length)
+{
+	struct bs_hyc_flush *fl = &infop->flush;
+
+	if (list_empty(&fl->pending)) {
+		fl->start = offset;
+		fl->end = offset + length;
+	} else {
+		fl->start = min(fl->start, offset);
+		fl->end = max(fl->end, offset + length);
+	}
+	list_add_tail(&cmdp->bs_list, &fl->pending);
+	fl->requests++;
+	hyc_flush_issue(infop);
+}
+
+static void hyc_flush_close(struct bs_hyc_info *infop)
+{
+	int i;
+
+	hyc_cmds_abort(infop, &infop->flush.pending);
+	for (i = 0; i < HYC_NR_REQS; i++) {
+		struct hyc_req *reqp = &infop->reqs[i];
+
+		if (reqp->done != hyc_flush_done || !reqp->privatep)
+			continue;
+		hyc_cmds_abort(infop, &reqp->cmds);
+		hyc_req_put(reqp);
+	}
+	infop->flush.inflight = NULL;
+}
+
+/*
+ * Fail the commands of a merged WRITE, shared flush or zero split being
+ * aborted. Unless stord still owns the request, it is never completed,
+ * so it is freed here too.
+ */
+static void hyc_req_abort(struct bs_hyc_info *infop, struct hyc_req *reqp,
+		bool dropped)
+{
+	struct hyc_zero_split *zsp = reqp->privatep;
+
+	if (reqp->done == hyc_zero_done) {
+		if (zsp->cmdp) {
+			hyc_am_io_done(infop, zsp->cmdp, false);
+			target_cmd_io_done(zsp->cmdp, TASK_ABORTED);
+		}
+		zsp->cmdp = NULL;
+	} else
+		hyc_cmds_abort(infop, &reqp->cmds);
+	if (!dropped)
+		return;
+
+	if (reqp->done == hyc_zero_done && !--zsp->pending)
+		free(zsp);
+	if (reqp->done == hyc_flush_done)
+		infop->flush.inflight = NULL;
+	free(reqp->bufp);
+	hyc_req_put(reqp);
+}
+
+/* waiting for journal space, journal I/O or earlier records */
+static bool hyc_wb_held(struct bs_hyc_info *infop, struct scsi_cmd *cmdp)
+{
+	struct bs_hyc_wb      *wb = &infop->wb;
+	struct hyc_wb_rec     *recp;
+	struct hyc_wb_sync    *syncp;
+	struct hyc_wb_overlay *ovp;
+	struct scsi_cmd       *p;
+
+	list_for_each_entry(p, &wb->waitq, bs_list) {
+		if (p == cmdp)
+			return true;
+	}
+	list_for_each_entry(recp, &wb->appending, alist) {
+		if (recp->ackp->cmdp == cmdp)
+			return true;
+	}
+	list_for_each_entry(syncp, &wb->syncs, list) {
+		if (syncp->cmdp == cmdp)
+			return true;
+	}
+	/* a READ the journal covers never went to stord */
+	list_for_each_entry(ovp, &wb->overlays, list) {
+		if (ovp->cmdp == cmdp && ovp->covered)
+			return true;
+	}
+	return false;
+}
+
+/* is the command held here rather than known to stord? */
+static bool hyc_cmd_held(struct bs_hyc_info *infop, struct scsi_cmd *cmdp)
+{
+	struct hyc_rc_io *rciop;
+	struct scsi_cmd  *p;
+	int               i;
+
+	list_for_each_entry(p, &infop->co.cmds, bs_list) {
+		if (p == cmdp)
+			return true;
+	}
+	list_for_each_entry(p, &infop->flush.pending, bs_list) {
+		if (p == cmdp)
+			return true;
 	}
+	if (infop->wb.enabled && hyc_wb_held(infop, cmdp))
+		return true;
+	/* read cache hits */
+	list_for_each_entry(rciop, &infop->rcache.ios, list) {
+		if (rciop->cmdp == cmdp)
+			return true;
+	}
+	/* merged WRITEs, shared flushes and split zero WRITEs */
+	for (i = 0; i < HYC_NR_REQS; i++) {
+		struct hyc_req *reqp = &infop->reqs[i];
+
+		if (!reqp->privatep)
+			continue;
+		if (reqp->done == hyc_zero_done &&
+				((struct hyc_zero_split *) reqp->privatep)->cmdp ==
+				cmdp)
+			return true;
+		list_for_each_entry(p, &reqp->cmds, bs_list) {
+			if (p == cmdp)
+				return true;
+		}
+	}
+	return false;
+}
+
+/* UNMAP parameter list: 8 byte header, 16 byte block descriptors */
+static void hyc_unmap_invalidate(struct bs_hyc_info *infop, char *bufp,
+		size_t length)
+{
+	struct scsi_lu *lup = infop->lup;
+
+	while (length >= 16) {
+		uint64_t lba = get_unaligned_be64(bufp);
+		uint32_t nr_blocks = get_unaligned_be32(bufp + 8);
+		uint64_t offset = lba << lup->blk_shift;
+		uint64_t bytes = (uint64_t) nr_blocks << lup->blk_shift;
+
+		if (infop->rcache.enabled)
+			hyc_rc_invalidate(&infop->rcache, offset, bytes);
+		if (infop->ra.max)
+			hyc_ra_invalidate(infop, offset, bytes);
+		hyc_am_clear(&infop->amap, offset, bytes);
+		bufp += 16;
+		length -= 16;
+	}
+}
+
+static void bs_hyc_show(struct scsi_lu *lup, struct concat_buf *b)
+{
+	struct bs_hyc_rcache *rc = &BS_HYC_I(lup)->rcache;
+	struct bs_hyc_wb     *wb = &BS_HYC_I(lup)->wb;
+	struct bs_hyc_ra     *ra = &BS_HYC_I(lup)->ra;
+	struct bs_hyc_coalesce *co = &BS_HYC_I(lup)->co;
+	uint64_t lookups = rc->hits + rc->misses;
+	uint64_t ratio = co->requests ? co->writes * 100 / co->requests : 0;
+	struct bs_hyc_flush *fl = &BS_HYC_I(lup)->flush;
+	struct bs_hyc_zero *zd = &BS_HYC_I(lup)->zero;
+	struct bs_hyc_amap *am = &BS_HYC_I(lup)->amap;
+
+	concat_printf(b, _TAB3 "Flushes: %" PRIu64 ", syncs: %" PRIu64 "\n",
+		fl->requests, fl->syncs);
+
+	if (!am->mapped)
+		concat_printf(b, _TAB3 "Allocation map: No\n");
+	else
+		concat_printf(b,
+			_TAB3 "Allocation map: Yes, granule: %u KB\n"
+			_TAB3 "Allocation map granules: %" PRIu64 "/%" PRIu64
+				" mapped, learned: %" PRIu64 ", mismatches: %"
+				PRIu64 "\n"
+			_TAB3 "Allocation map reads: %" PRIu64 " zero, %"
+				PRIu64 " split (%" PRIu64 " bytes zero filled)\n",
+			(1U << am->shift) >> 10, am->nr_mapped,
+			am->nr_granules, am->learned, am->mismatches,
+			am->zero_reads, am->split_reads, am->zero_bytes);
+
+	if (!zd->enabled)
+		concat_printf(b, _TAB3 "Zero detection: No\n");
+	else
+		concat_printf(b,
+			_TAB3 "Zero detection: Yes%s\n"
+			_TAB3 "Zero writes: %" PRIu64 ", split: %" PRIu64
+				", journal: %" PRIu64 "\n"
+			_TAB3 "Zero bytes elided: %" PRIu64 "\n",
+			lup->attrs.thinprovisioning ? "" :
+				", inactive (not thin provisioned)",
+			zd->writes, zd->splits, zd->journal,
+			zd->elided_bytes);
+
+	if (!co->max)
+		concat_printf(b, _TAB3 "Write coalescing: No\n");
+	else
+		concat_printf(b,
+			_TAB3 "Write coalescing: Yes, max size: %u KB\n"
+			_TAB3 "Write coalescing writes: %" PRIu64
+				", requests: %" PRIu64 ", merge ratio: %" PRIu64
+				".%02" PRIu64 "\n"
+			_TAB3 "Write coalescing merged: %" PRIu64 " (%" PRIu64
+				" bytes)\n",
+			co->max >> 10, co->writes, co->requests,
+			ratio / 100, ratio % 100, co->merged,
+			co->merged_bytes);
+
+	if (!ra->max)
+		concat_printf(b, _TAB3 "Readahead: No\n");
+	else
+		concat_printf(b,
+			_TAB3 "Readahead: Yes, max window: %u KB\n"
+			_TAB3 "Readahead issued: %" PRIu64 " (%" PRIu64
+				" bytes), buffers: %d\n"
+			_TAB3 "Readahead hits: %" PRIu64 " (%" PRIu64
+				" bytes), waits: %" PRIu64 ", waste: %" PRIu64
+				" bytes, teardowns: %" PRIu64 "\n",
+			ra->max >> 10, ra->issued, ra->issued_bytes,
+			ra->nr_bufs, ra->hits, ra->hit_bytes, ra->waits,
+			ra->waste_bytes, ra->teardowns);
+
+	if (!wb->enabled)
+		concat_printf(b, _TAB3 "Write-back: No\n");
+	else
+		concat_printf(b,
+			_TAB3 "Write-back: Yes, journal: %s, size: %" PRIu64
+				"MB\n"
+			_TAB3 "Write-back dirty: %" PRIu64 " records, %" PRIu64
+				" bytes, journal used: %" PRIu64 " bytes\n"
+			_TAB3 "Write-back appended: %" PRIu64 " (%" PRIu64
+				" bytes), append errors: %" PRIu64 ", flushed: %"
+				PRIu64 ", flush errors: %" PRIu64 "\n"
+			_TAB3 "Write-back throttled: %" PRIu64
+				", read hits: %" PRIu64 ", read overlays: %"
+				PRIu64 ", recovered: %" PRIu64 "\n",
+			wb->path, wb->size >> 20,
+			wb->nr_dirty, wb->dirty_bytes,
+			wb->fd >= 0 ? wb->head - hyc_wb_tail(wb) : 0,
+			wb->appended, wb->appended_bytes, wb->append_errors,
+			wb->flushed,
+			wb->flush_errors, wb->throttled, wb->read_hits,
+			wb->read_overlays, wb->recovered);
+
+	if (!rc->enabled) {
+		concat_printf(b, _TAB3 "Read cache: No\n");
+		return;
+	}
+	concat_printf(b,
+		_TAB3 "Read cache: Yes, %s, block size: %u\n"
+		_TAB3 "Read cache blocks: %" PRIu64 "/%" PRIu64 "\n"
+		_TAB3 "Read cache hits: %" PRIu64 ", misses: %" PRIu64
+			", hit ratio: %" PRIu64 "%%\n"
+		_TAB3 "Read cache filled: %" PRIu64 ", evicted: %" PRIu64
+			", invalidated: %" PRIu64 ", errors: %" PRIu64 "\n",
+		rc->dev_path ? : "sparse file", 1U << rc->shift,
+		rc->nr_present, rc->capacity,
+		rc->hits, rc->misses,
+		lookups ? rc->hits * 100 / lookups : 0,
+		rc->filled, rc->evicted, rc->invalidated, rc->errors);
 }
 
 static int bs_hyc_unmap(struct bs_hyc_info* infop, struct scsi_lu* lup,
@@ -142,6 +3627,10 @@ static int bs_hyc_unmap(struct bs_hyc_info* infop, struct scsi_lu* lup,
 
 	length -= 8;
 	bufp += 8;
+	hyc_unmap_invalidate(infop, bufp, length);
+	if (infop->wb.enabled)
+		return hyc_wb_submit(infop, cmdp);
+	hyc_co_flush(infop);
 	set_cmd_async(cmdp);
 	return HycScheduleTruncate(infop->vmdk_handle, cmdp, bufp, length);
 }
@@ -178,9 +3667,16 @@ static int bs_hyc_sync(struct bs_hyc_info* infop, struct scsi_lu* lup,
 		goto sense;
 	}
 
+	/* WRITEs are durable in the journal once acknowledged */
+	if (infop->wb.enabled)
+		return hyc_wb_sync(infop, cmdp);
+
+	/* held WRITEs go out first */
+	hyc_co_flush(infop);
 	set_cmd_async(cmdp);
-	return HycScheduleSyncCache(infop->vmdk_handle, cmdp, lba << blk_shift,
-		num_blks << blk_shift);
+	hyc_flush_queue(infop, cmdp, lba << blk_shift,
+		(uint64_t) num_blks << blk_shift);
+	return 0;
 
 sense:
 	result = SAM_STAT_CHECK_CONDITION;
@@ -203,6 +3699,11 @@ static int bs_hyc_cmd_abort(struct scsi_cmd* cmdp)
 	if (infop->vmdk_handle == kInvalidVmdkHandle) {
 		return -EINVAL;
 	}
+	/* merged, split and shared requests are unknown to stord */
+	if (hyc_cmd_held(infop, cmdp)) {
+		hyc_co_flush(infop);
+		return -EBUSY;
+	}
 	RequestID reqid = HycScheduleAbort(infop->vmdk_handle, cmdp);
 	return reqid == kInvalidRequestID ? -EINVAL : 0;
 }
@@ -217,6 +3718,7 @@ static int bs_hyc_cmd_submit(struct scsi_cmd *cmdp)
 	char               *bufp = NULL;
 	RequestID           reqid = kInvalidRequestID;
 	int                 rc = 0;
+	bool                journaled = false;
 
 	lup = cmdp->dev;
 	infop = BS_HYC_I(lup);
@@ -239,8 +3741,9 @@ static int bs_hyc_cmd_submit(struct scsi_cmd *cmdp)
 
 	if (op != ABORT_TASK_OP && op != ABORT_TASK_SET_OP) {
 
-		offset = scsi_cmd_offset(cmdp);
-		length = scsi_cmd_length(cmdp);
+		/* op is known here, don't decode the CDB again */
+		offset = __scsi_cmd_offset(cmdp, op);
+		length = __scsi_cmd_length(cmdp, op);
 
 		/*
 		* Simply returing from top for zero size IOs, we may need to handle
@@ -259,8 +3762,74 @@ static int bs_hyc_cmd_submit(struct scsi_cmd *cmdp)
 			}
 		}
 
-		bufp = scsi_cmd_buffer(cmdp);
+		bufp = __scsi_cmd_buffer(cmdp, op);
+
+		if (op == READ && hyc_co_overlaps(&infop->co, offset, length))
+			hyc_co_flush(infop);
+
+		if (infop->rcache.enabled) {
+			struct bs_hyc_rcache *rc = &infop->rcache;
+
+			if (op == READ && hyc_rc_lookup(rc, offset, length) &&
+					!hyc_rc_hit(rc, cmdp, bufp, offset, length))
+				return 0;
+			if (op == READ)
+				rc->misses++;
+			else
+				hyc_rc_invalidate(rc, offset, length);
+		}
+
+		if (op == WRITE && infop->ra.max)
+			hyc_ra_invalidate(infop, offset, length);
+
+		if (op == WRITE)
+			hyc_am_write(infop, offset, length);
+
+		if (infop->wb.enabled) {
+			if (op == WRITE)
+				return hyc_wb_submit(infop, cmdp);
+			rc = hyc_wb_read(infop, cmdp, bufp, offset, length);
+			if (rc < 0)
+				return rc;
+			if (rc == 1)
+				return SAM_STAT_GOOD;
+			journaled = rc == 2;
+			rc = 0;
+		}
+
+		if (op == READ && !journaled) {
+			rc = hyc_am_read(infop, cmdp, bufp, offset, length);
+			if (rc >= 0)
+				return rc;
+			rc = 0;
+		}
+
+		if (op == READ && infop->ra.max && !journaled &&
+				hyc_ra_read(infop, cmdp, bufp, offset, length))
+			return SAM_STAT_GOOD;
+
+		if (op == READ && !journaled)
+			hyc_am_track(infop, cmdp, offset, length);
+
+		if (op == WRITE && hyc_zero_detect(infop) &&
+				hyc_zero_write(infop, cmdp, bufp, offset, length))
+			return 0;
+
+		if (infop->rcache.enabled)
+			hyc_rc_fill_start(&infop->rcache, cmdp, offset, length);
+
 		set_cmd_async(cmdp);
+
+		if (op == WRITE && infop->co.max) {
+			if (!scsi_cmd_fua(cmdp) && length < infop->co.max) {
+				hyc_co_queue(infop, cmdp, offset, length);
+				return 0;
+			}
+			/* FUA and large WRITEs keep their place behind the run */
+			hyc_co_flush(infop);
+			infop->co.writes++;
+			infop->co.requests++;
+		}
 	}
 
 	switch (op) {
@@ -292,6 +3861,10 @@ static int bs_hyc_cmd_submit(struct scsi_cmd *cmdp)
 		 */
 
 		//clear_cmd_async(cmdp);
+		if (op == READ && hyc_wb_read_done(infop, cmdp, -EIO))
+			return -EINVAL;
+		hyc_rc_fill_done(&infop->rcache, cmdp, false);
+		hyc_am_io_done(infop, cmdp, false);
 		target_cmd_io_done(cmdp, SAM_STAT_CHECK_CONDITION);
 		return -EINVAL;
 	}
@@ -308,6 +3881,30 @@ static int bs_hyc_stop(struct scsi_lu* lup)
 	int i;
 	tgtadm_err res;
 
+	/* let journal and cache I/O finish, none of it reached stord */
+	hyc_io_drain(infop);
+	hyc_wb_abort(infop);
+	if (infop->ra.max) {
+		struct hyc_ra_buf *rabp;
+
+		list_for_each_entry(rabp, &infop->ra.bufs, list) {
+			while (!list_empty(&rabp->waiters)) {
+				struct scsi_cmd *cmdp = list_first_entry(
+					&rabp->waiters, struct scsi_cmd,
+					bs_list);
+
+				list_del(&cmdp->bs_list);
+				target_cmd_io_done(cmdp, TASK_ABORTED);
+			}
+		}
+	}
+	if (infop->co.max) {
+		hyc_cmds_abort(infop, &infop->co.cmds);
+		infop->co.nr_cmds = 0;
+		tgt_remove_sched_event(&infop->co.sched);
+	}
+	hyc_cmds_abort(infop, &infop->flush.pending);
+
 	requests = NULL;
 	rc = HycGetAllScheduledRequests(infop->vmdk_handle, &requests, &nrequests);
 	if (hyc_unlikely(rc < 0 || requests == NULL)) {
@@ -321,17 +3918,50 @@ static int bs_hyc_stop(struct scsi_lu* lup)
 		if (hyc_unlikely(cmdp == NULL)) {
 			continue;
 		}
+		if (hyc_req_internal(infop, cmdp)) {
+			struct hyc_req *reqp = (struct hyc_req *) cmdp;
+
+			/* journal flushes stay, they are replayed anyway */
+			if (reqp->done != hyc_co_done &&
+					reqp->done != hyc_flush_done &&
+					reqp->done != hyc_zero_done)
+				continue;
+			rc = HycScheduleAbort(infop->vmdk_handle, reqp);
+			if (hyc_unlikely(rc == kInvalidRequestID))
+				res = TGTADM_TARGET_ACTIVE;
+			hyc_req_abort(infop, reqp, rc != kInvalidRequestID);
+			continue;
+		}
 		rc = HycScheduleAbort(infop->vmdk_handle, cmdp);
 		if (hyc_unlikely(rc == kInvalidRequestID)) {
 			res = TGTADM_TARGET_ACTIVE;
 			eprintf(" Abort failed %" PRIx64 " %lx\n", cmdp->tag, cmdp->state);
 		}
+		hyc_rc_fill_done(&infop->rcache, cmdp, false);
+		hyc_wb_read_abort(infop, cmdp);
+		hyc_am_io_done(infop, cmdp, false);
 		target_cmd_io_done(cmdp, TASK_ABORTED);
 	}
 	free(requests);
 	return res;
 }
 
+/* hand a command back to the target once stord is done with it */
+static void hyc_cmd_done(struct bs_hyc_info *infop, struct scsi_cmd *cmdp,
+		int result)
+{
+	hyc_rc_fill_done(&infop->rcache, cmdp, result == 0);
+	hyc_am_io_done(infop, cmdp, result == 0);
+	if (result && scsi_cmd_operation(cmdp) == TRUNCATE)
+		hyc_am_unmap_failed(infop, cmdp);
+	if (result == 0) {
+		target_cmd_io_done(cmdp, SAM_STAT_GOOD);
+		return;
+	}
+	sense_data_build(cmdp, MEDIUM_ERROR, 0);
+	target_cmd_io_done(cmdp, SAM_STAT_CHECK_CONDITION);
+}
+
 static void bs_hyc_handle_completion(int fd, int events, void *datap)
 {
 	struct bs_hyc_info *infop;
@@ -354,16 +3984,24 @@ static void bs_hyc_handle_completion(int fd, int events, void *datap)
 				continue;
 			}
 
-			if (resultsp[i].result ==0) {
-				target_cmd_io_done(cmdp, SAM_STAT_GOOD);
-			} else {
+			if (hyc_req_internal(infop, cmdp)) {
+				struct hyc_req *reqp = (struct hyc_req *) cmdp;
+
+				reqp->done(reqp, resultsp[i].result);
+				continue;
+			}
+
+			if (resultsp[i].result) {
 				eprintf("retry for vmid:%s, vmdkid:%s, path:%s, op_type:%d, offset:%lu, length:%u\n",
 					infop->vmid, infop->vmdkid, infop->lup->path,
 					scsi_cmd_operation(cmdp), scsi_cmd_offset(cmdp),
 					scsi_cmd_length(cmdp));
-				sense_data_build(cmdp, MEDIUM_ERROR, 0);
-				target_cmd_io_done(cmdp, SAM_STAT_CHECK_CONDITION);
 			}
+			if (scsi_cmd_operation(cmdp) == READ &&
+					hyc_wb_read_done(infop, cmdp,
+						resultsp[i].result))
+				continue;
+			hyc_cmd_done(infop, cmdp, resultsp[i].result);
 		}
 		memset(resultsp, 0, sizeof(*resultsp) * nr_results);
 
@@ -414,12 +4052,60 @@ static int bs_hyc_open(struct scsi_lu *lup, char *pathp,
 
 	infop->done_eventfd = efd;
 
+	if (infop->rcache.enabled || infop->wb.enabled) {
+		rc = hyc_io_start(infop);
+		if (rc < 0) {
+			hyc_io_stop(infop);
+			tgt_event_del(efd);
+			goto error;
+		}
+	}
+
+	if (infop->rcache.enabled) {
+		rc = hyc_rc_open(infop, ffd, *sizep);
+		if (rc < 0) {
+			hyc_io_stop(infop);
+			tgt_event_del(efd);
+			goto error;
+		}
+	}
+
+	if (infop->wb.enabled) {
+		rc = hyc_wb_open(infop);
+		if (rc < 0) {
+			hyc_rc_close(infop);
+			hyc_io_stop(infop);
+			tgt_event_del(efd);
+			goto error;
+		}
+	}
+
+	if (infop->amap.enabled) {
+		rc = hyc_am_open(infop, pathp, *sizep);
+		if (rc < 0) {
+			hyc_wb_close(infop);
+			hyc_rc_close(infop);
+			hyc_io_stop(infop);
+			tgt_event_del(efd);
+			goto error;
+		}
+	}
+
 	rc = HycOpenVmdk(infop->vmid, infop->vmdkid, *sizep, lup->blk_shift,
 		infop->done_eventfd, &infop->vmdk_handle);
 	if (rc < 0) {
+		hyc_am_close(infop);
+		hyc_wb_close(infop);
+		hyc_rc_close(infop);
+		hyc_io_stop(infop);
+		tgt_event_del(efd);
 		goto error;
 	}
 
+	/* drain whatever the journal recovered */
+	if (infop->wb.enabled)
+		hyc_wb_kick(infop);
+
 	*fdp = ffd;
 	return 0;
 error:
@@ -441,21 +4127,43 @@ static void bs_hyc_close(struct scsi_lu *lup)
 	assert(infop);
 	assert(infop->done_eventfd >= 0);
 
+	/* journal and cache I/O may still hand work to stord */
+	hyc_io_drain(infop);
 	tgt_event_del(infop->done_eventfd);
 	HycCloseVmdk(infop->vmdk_handle);
 	close(infop->done_eventfd);
 	infop->done_eventfd = -1;
 
+	hyc_flush_close(infop);
+	hyc_co_close(infop);
+	hyc_zero_close(infop);
+	hyc_am_close(infop);
+	hyc_ra_close(infop);
+	hyc_wb_close(infop);
+	hyc_rc_close(infop);
+	hyc_io_stop(infop);
+
 	close(lup->fd);
 }
 
 enum {
-	Opt_vmid, Opt_vmdkid, Opt_err,
+	Opt_vmid, Opt_vmdkid, Opt_rcache, Opt_rcache_size, Opt_rcache_dev,
+	Opt_wb_journal, Opt_wb_size, Opt_readahead, Opt_coalesce,
+	Opt_zero_detect, Opt_alloc_map, Opt_err,
 };
 
 static match_table_t bs_hyc_opts = {
 	{Opt_vmid, "vmid=%s"},
 	{Opt_vmdkid, "vmdkid=%s"},
+	{Opt_rcache, "rcache=%s"},
+	{Opt_rcache_size, "rcache_size=%s"},
+	{Opt_rcache_dev, "rcache_dev=%s"},
+	{Opt_wb_journal, "wb_journal=%s"},
+	{Opt_wb_size, "wb_size=%s"},
+	{Opt_readahead, "readahead=%s"},
+	{Opt_coalesce, "coalesce=%s"},
+	{Opt_zero_detect, "zero_detect=%s"},
+	{Opt_alloc_map, "alloc_map=%s"},
 	{Opt_err, NULL},
 };
 
@@ -466,6 +4174,16 @@ static tgtadm_err bs_hyc_init(struct scsi_lu *lup, char *bsoptsp)
 	char               *p;
 	char               *vmdkid = NULL;
 	char               *vmid = NULL;
+	char               *rcache_dev = NULL;
+	bool                rcache = false;
+	uint64_t            rcache_size = 0;
+	char               *wb_journal = NULL;
+	uint64_t            wb_size = 0;
+	uint32_t            readahead = 0;
+	uint32_t            coalesce = 0;
+	bool                zero_detect = false;
+	bool                alloc_map = false;
+	int                 i;
 
 	assert(lup->tgt);
 
@@ -483,13 +4201,64 @@ static tgtadm_err bs_hyc_init(struct scsi_lu *lup, char *bsoptsp)
 		case Opt_vmdkid:
 			vmdkid = match_strdup(&args[0]);
 			break;
+		case Opt_rcache:
+			rcache = !!atoi(args[0].from);
+			break;
+		case Opt_rcache_size:
+			if (str_to_int(args[0].from, rcache_size)) {
+				eprintf("invalid rcache_size %s\n", args[0].from);
+				e = TGTADM_INVALID_REQUEST;
+			}
+			rcache = true;
+			break;
+		case Opt_rcache_dev:
+			free(rcache_dev);
+			rcache_dev = match_strdup(&args[0]);
+			rcache = true;
+			break;
+		case Opt_wb_journal:
+			free(wb_journal);
+			wb_journal = match_strdup(&args[0]);
+			break;
+		case Opt_wb_size:
+			if (str_to_int(args[0].from, wb_size)) {
+				eprintf("invalid wb_size %s\n", args[0].from);
+				e = TGTADM_INVALID_REQUEST;
+			}
+			break;
+		case Opt_readahead:
+			/* max window in KiB */
+			if (str_to_int_range(args[0].from, readahead, 0,
+					64 << 10)) {
+				eprintf("invalid readahead %s\n", args[0].from);
+				e = TGTADM_INVALID_REQUEST;
+			}
+			break;
+		case Opt_coalesce:
+			/* max merged WRITE size in KiB */
+			if (str_to_int_range(args[0].from, coalesce, 0,
+					4 << 10)) {
+				eprintf("invalid coalesce %s\n", args[0].from);
+				e = TGTADM_INVALID_REQUEST;
+			}
+			break;
+		case Opt_zero_detect:
+			zero_detect = !!atoi(args[0].from);
+			break;
+		case Opt_alloc_map:
+			alloc_map = !!atoi(args[0].from);
+			break;
 		default:
 			break;
 		}
 	}
-	if (!vmid || !vmdkid) {
+	if (!vmid || !vmdkid || e != TGTADM_SUCCESS) {
 		eprintf("hyc bst needs both vmid: %s & vmdkid: %s as bsopts\n",
 			vmid, vmdkid);
+		free(vmid);
+		free(vmdkid);
+		free(rcache_dev);
+		free(wb_journal);
 		return TGTADM_INVALID_REQUEST;
 	}
 
@@ -498,14 +4267,53 @@ static tgtadm_err bs_hyc_init(struct scsi_lu *lup, char *bsoptsp)
 	infop->lup = lup;
 	infop->vmid = vmid;
 	infop->vmdkid = vmdkid;
+	infop->rcache.enabled = rcache;
+	infop->rcache.dev_path = rcache_dev;
+	infop->rcache.size_mb = rcache_size;
+	infop->rcache.fd = -1;
+	INIT_LIST_HEAD(&infop->rcache.fills);
+	INIT_LIST_HEAD(&infop->rcache.ios);
+	infop->wb.enabled = wb_journal != NULL;
+	infop->wb.path = wb_journal;
+	infop->wb.size_mb = wb_size;
+	infop->wb.fd = -1;
+	INIT_LIST_HEAD(&infop->wb.recs);
+	INIT_LIST_HEAD(&infop->wb.appending);
+	INIT_LIST_HEAD(&infop->wb.syncs);
+	INIT_LIST_HEAD(&infop->wb.overlays);
+	INIT_LIST_HEAD(&infop->wb.waitq);
+	infop->ra.max = readahead << 10;
+	INIT_LIST_HEAD(&infop->ra.bufs);
+	/* the journal already absorbs small writes */
+	infop->co.max = wb_journal ? 0 : coalesce << 10;
+	INIT_LIST_HEAD(&infop->co.cmds);
+	INIT_LIST_HEAD(&infop->flush.pending);
+	infop->zero.enabled = zero_detect;
+	infop->amap.enabled = alloc_map;
+	infop->amap.fd = -1;
+	INIT_LIST_HEAD(&infop->amap.reads);
+	infop->iopool.efd = -1;
+	tgt_init_sched_event(&infop->co.sched, hyc_co_sched, infop);
+	INIT_LIST_HEAD(&infop->free_reqs);
 	infop->nr_results = 32;
 	infop->request_resultsp = calloc(infop->nr_results,
 		sizeof(*infop->request_resultsp));
-	if (!infop->request_resultsp) {
+	infop->reqs = calloc(HYC_NR_REQS, sizeof(*infop->reqs));
+	if (!infop->request_resultsp || !infop->reqs) {
 		eprintf("hyc bs init failed\n");
 		e = TGTADM_NOMEM;
+		free(infop->request_resultsp);
+		free(infop->reqs);
 		free(vmid);
 		free(vmdkid);
+		free(rcache_dev);
+		free(wb_journal);
+		return e;
+	}
+	for (i = 0; i < HYC_NR_REQS; i++) {
+		infop->reqs[i].infop = infop;
+		INIT_LIST_HEAD(&infop->reqs[i].cmds);
+		list_add_tail(&infop->reqs[i].list, &infop->free_reqs);
 	}
 	return e;
 }
@@ -517,8 +4325,11 @@ static void bs_hyc_exit(struct scsi_lu *lup)
 	assert(infop);
 
 	free(infop->request_resultsp);
+	free(infop->reqs);
 	free(infop->vmid);
 	free(infop->vmdkid);
+	free(infop->rcache.dev_path);
+	free(infop->wb.path);
 }
 
 static struct backingstore_template hyc_bst = {
@@ -531,6 +4342,7 @@ static struct backingstore_template hyc_bst = {
 	.bs_cmd_submit = bs_hyc_cmd_submit,
 	.bs_cmd_abort = bs_hyc_cmd_abort,
 	.bs_stop = bs_hyc_stop,
+	.bs_show = bs_hyc_show,
 };
 
 __attribute__((constructor)) static void bs_hyc_constructor(void)
@@ -1,8 +1,12 @@
 #ifndef __BS_HYC_H__
 #define __BS_HYC_H__
 
+#include <pthread.h>
+
 #include "TgtTypes.h"
 #include "dll.h"
+#include "list.h"
+#include "work.h"
 
 typedef enum {
 	READ,
@@ -16,6 +20,227 @@ typedef enum {
 	UNKNOWN,
 } io_type_t;
 
+/**
+ * Optional local read cache. Blocks read from or written to stord are
+ * kept in the LUN's sparse file under /var/hyc (or a dedicated cache
+ * device) at their own offset, so only a presence bitmap is needed.
+ * Eviction is CLOCK over a second, referenced, bitmap.
+ */
+struct bs_hyc_rcache {
+	bool                   enabled;
+	int                    fd;
+	char                  *dev_path;	/* NULL: use the sparse file */
+	unsigned int           shift;		/* cache block size */
+	uint64_t               size_mb;		/* 0: whole LUN */
+	uint64_t               nr_blocks;
+	uint64_t               capacity;	/* max present blocks */
+	uint64_t               nr_present;
+	uint64_t               nr_filling;	/* being written, not present */
+	uint64_t               hand;
+	unsigned long         *present;
+	unsigned long         *referenced;
+	/* reads and writes in flight whose data may populate the cache */
+	struct list_head       fills;
+	/* cache reads, writes and hole punches in flight */
+	struct list_head       ios;
+
+	uint64_t               hits;
+	uint64_t               misses;
+	uint64_t               hit_bytes;
+	uint64_t               filled;
+	uint64_t               evicted;
+	uint64_t               invalidated;
+	uint64_t               errors;
+};
+
+/**
+ * Optional write-back journal. WRITE and UNMAP are appended to a local
+ * journal file and acknowledged once durable there, in journal order; a
+ * flusher drains records to stord in journal order. Unflushed records
+ * are replayed from the journal when the LUN is opened again.
+ */
+struct bs_hyc_wb {
+	bool                   enabled;
+	int                    fd;
+	char                  *path;
+	uint64_t               size_mb;
+	uint64_t               size;		/* journal data area */
+	uint64_t               epoch;
+	uint64_t               seq;
+	uint64_t               head;		/* logical journal position */
+	uint64_t               sb_tail;	/* tail in the superblock */
+	uint64_t               sb_tail_seq;
+	bool                   sb_writing;
+	int                    sb_err;		/* of the last superblock write */
+	uint32_t               salt;		/* seeds record header crcs */
+	struct list_head       recs;		/* unreclaimed, in seq order */
+	struct list_head       appending;	/* not acknowledged yet */
+	struct list_head       syncs;		/* SYNCHRONIZE CACHE waiting */
+	struct list_head       overlays;	/* READs to patch from it */
+	struct list_head       waitq;		/* commands waiting for space */
+	bool                   gap;		/* acks wait for sb_tail_seq ... */
+	uint64_t               gap_seq;	/* ... to pass this failed append */
+	int                    nr_flushing;
+	bool                   retry_pending;
+	struct tgt_work        retry_work;
+
+	uint64_t               nr_dirty;
+	uint64_t               dirty_bytes;
+	uint64_t               appended;
+	uint64_t               appended_bytes;
+	uint64_t               append_errors;
+	uint64_t               flushed;
+	uint64_t               flush_errors;
+	uint64_t               throttled;
+	uint64_t               read_hits;
+	uint64_t               read_overlays;
+	uint64_t               recovered;
+};
+
+/**
+ * Optional readahead. Sequential READ streams are detected by LBA
+ * continuity; for each, larger reads are issued ahead of the reader
+ * into a bounded set of buffers, which later READs are served from.
+ */
+#define HYC_RA_STREAMS		8
+#define HYC_RA_NR_BUFS		16
+
+struct hyc_ra_stream {
+	uint64_t               next;		/* expected next offset */
+	uint64_t               ra_end;		/* end of data read ahead */
+	uint32_t               window;
+	uint32_t               seq_count;
+	uint64_t               last_use;
+};
+
+struct bs_hyc_ra {
+	uint32_t               max;		/* max window, 0: disabled */
+	uint64_t               clock;
+	struct hyc_ra_stream   streams[HYC_RA_STREAMS];
+	struct list_head       bufs;
+	int                    nr_bufs;
+
+	uint64_t               issued;
+	uint64_t               issued_bytes;
+	uint64_t               hits;
+	uint64_t               hit_bytes;
+	uint64_t               waits;
+	uint64_t               waste_bytes;
+	uint64_t               teardowns;
+};
+
+/**
+ * Optional write coalescing. Contiguous or overlapping WRITEs arriving
+ * back to back within one event loop pass are gathered into a single
+ * stord request, which completes all of them.
+ */
+struct bs_hyc_coalesce {
+	uint32_t               max;		/* max merged size, 0: disabled */
+	struct list_head       cmds;		/* open run, in arrival order */
+	int                    nr_cmds;
+	uint64_t               start;
+	uint64_t               end;
+	struct event_data      sched;
+
+	uint64_t               writes;
+	uint64_t               requests;
+	uint64_t               merged;		/* commands sent merged */
+	uint64_t               merged_bytes;
+};
+
+/**
+ * SYNCHRONIZE CACHE group commit: one flush in flight to stord, the
+ * commands arriving meanwhile share the next one.
+ */
+struct bs_hyc_flush {
+	struct hyc_req        *inflight;
+	struct list_head       pending;
+	uint64_t               start;		/* union of pending ranges */
+	uint64_t               end;
+
+	uint64_t               requests;
+	uint64_t               syncs;
+};
+
+/**
+ * Allocation map, one bit per granule that may hold data on stord.
+ * READs of clear granules are zero filled locally. Saved next to the
+ * LUN file on a clean close.
+ */
+struct bs_hyc_amap {
+	bool                   enabled;
+	int                    fd;
+	char                  *path;
+	unsigned int           shift;		/* granule size */
+	uint64_t               size;
+	uint64_t               nr_granules;
+	uint64_t               nr_mapped;
+	unsigned long         *mapped;
+	/* READs that may find granules zero, WRITEs that may spoil that */
+	struct list_head       reads;
+	int                    nr_reads;
+	int                    nr_writes;
+
+	uint64_t               zero_reads;	/* completed locally */
+	uint64_t               split_reads;
+	uint64_t               zero_bytes;
+	uint64_t               learned;		/* granules a READ found zero */
+	uint64_t               mismatches;
+};
+
+/**
+ * Zero detection. A thin provisioned LUN reports LBPRZ, so WRITEs of
+ * zeroes needn't carry them to stord: whole zero WRITEs and journal
+ * records go as a truncate, large WRITEs have their zero runs cut out.
+ */
+struct bs_hyc_zero {
+	bool                   enabled;
+
+	uint64_t               writes;		/* sent as a truncate only */
+	uint64_t               splits;		/* sent as data and truncate */
+	uint64_t               journal;		/* journal records truncated */
+	uint64_t               elided_bytes;
+};
+
+/**
+ * Worker threads doing the journal and read cache file I/O, so that
+ * none of it blocks the event loop. Finished jobs come back through an
+ * eventfd and complete on the loop.
+ */
+#define HYC_IO_THREADS	4
+
+struct bs_hyc_iopool {
+	int                    nr_threads;
+	pthread_t              threads[HYC_IO_THREADS];
+	pthread_mutex_t        lock;
+	pthread_cond_t         cond;
+	struct list_head       pending;
+	struct list_head       done;
+	bool                   stop;
+	int                    efd;
+	int                    nr_inflight;	/* submitted, not completed */
+};
+
+/**
+ * Requests issued by the backing store itself rather than for a SCSI
+ * command. They come from a per LUN pool so that completions can tell
+ * them apart from scsi_cmd pointers by address.
+ */
+#define HYC_NR_REQS	32
+
+struct bs_hyc_info;
+
+struct hyc_req {
+	struct list_head       list;
+	struct bs_hyc_info    *infop;
+	void                 (*done)(struct hyc_req *reqp, int result);
+	void                  *privatep;
+	char                  *bufp;
+	uint64_t               offset;
+	uint32_t               length;
+	struct list_head       cmds;		/* coalesced WRITEs */
+};
+
 /** This structure is per LUN/VMDK */
 struct bs_hyc_info {
 	struct scsi_lu        *lup;
@@ -25,6 +250,16 @@ struct bs_hyc_info {
 	int                    done_eventfd;
 	struct RequestResult  *request_resultsp;
 	uint32_t               nr_results;
+	struct bs_hyc_rcache   rcache;
+	struct bs_hyc_wb       wb;
+	struct bs_hyc_ra       ra;
+	struct bs_hyc_coalesce co;
+	struct bs_hyc_flush    flush;
+	struct bs_hyc_zero     zero;
+	struct bs_hyc_amap     amap;
+	struct bs_hyc_iopool   iopool;
+	struct hyc_req        *reqs;
+	struct list_head       free_reqs;
 };
 
 #endif
@@ -96,12 +96,18 @@ static void set_medium_error(int *result, uint8_t *key, uint16_t *asc)
 	*asc = ASC_READ_ERROR;
 }
 
+static int bs_rbd_flush(void *arg)
+{
+	return rbd_flush(*(rbd_image_t *)arg);
+}
+
 static void bs_sync_sync_range(struct scsi_cmd *cmd, uint32_t length,
 			       int *result, uint8_t *key, uint16_t *asc)
 {
 	int ret;
 
-	ret = rbd_flush(RBDP(cmd->dev)->rbd_image);
+	ret = bs_thread_sync(BS_THREAD_I(cmd->dev), bs_rbd_flush,
+			     &RBDP(cmd->dev)->rbd_image);
 	if (ret)
 		set_medium_error(result, key, asc);
 }
@@ -682,6 +688,7 @@ static struct backingstore_template rbd_bst = {
 	.bs_init		= bs_rbd_init,
 	.bs_exit		= bs_rbd_exit,
 	.bs_cmd_submit		= bs_thread_cmd_submit,
+	.bs_show		= bs_thread_show,
 	.bs_oflags_supported    = O_SYNC | O_DIRECT,
 };
 
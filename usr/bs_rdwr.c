@@ -48,12 +48,19 @@ static void set_medium_error(int *result, uint8_t *key, uint16_t *asc)
 	*asc = ASC_READ_ERROR;
 }
 
+static int bs_rdwr_fdatasync(void *arg)
+{
+	return fdatasync(*(int *)arg) ? -errno : 0;
+}
+
+/* concurrent flushes of the LU are merged, see bs_thread_sync() */
 static void bs_sync_sync_range(struct scsi_cmd *cmd, uint32_t length,
 			       int *result, uint8_t *key, uint16_t *asc)
 {
 	int ret;
 
-	ret = fdatasync(cmd->dev->fd);
+	ret = bs_thread_sync(BS_THREAD_I(cmd->dev), bs_rdwr_fdatasync,
+			     &cmd->dev->fd);
 	if (ret)
 		set_medium_error(result, key, asc);
 }
@@ -418,6 +425,7 @@ static struct backingstore_template rdwr_bst = {
 	.bs_init		= bs_rdwr_init,
 	.bs_exit		= bs_rdwr_exit,
 	.bs_cmd_submit		= bs_thread_cmd_submit,
+	.bs_show		= bs_thread_show,
 	.bs_oflags_supported    = O_SYNC | O_DIRECT,
 };
 
@@ -429,6 +437,7 @@ static struct backingstore_template mmc_bst = {
 	.bs_init		= bs_rdwr_init,
 	.bs_exit		= bs_rdwr_exit,
 	.bs_cmd_submit		= bs_thread_cmd_submit,
+	.bs_show		= bs_thread_show,
 	.bs_oflags_supported    = O_SYNC | O_DIRECT,
 };
 
@@ -440,6 +449,7 @@ static struct backingstore_template smc_bst = {
 	.bs_init		= bs_rdwr_init,
 	.bs_exit		= bs_rdwr_exit,
 	.bs_cmd_submit		= bs_thread_cmd_submit,
+	.bs_show		= bs_thread_show,
 	.bs_oflags_supported    = O_SYNC | O_DIRECT,
 };
 
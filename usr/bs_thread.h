@@ -1,4 +1,19 @@
 typedef void (request_func_t) (struct scsi_cmd *);
+typedef int (sync_func_t) (void *);
+
+/*
+ * Group commit: a flush that arrives while another is running waits
+ * for it, then all flushes queued meanwhile share a single one.
+ */
+struct bs_sync_group {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* protected by lock */
+	int running;
+	struct list_head waiters;
+	uint64_t requests;
+	uint64_t syncs;
+};
 
 struct bs_thread_info {
 	pthread_t *worker_thread;
@@ -12,6 +27,8 @@ struct bs_thread_info {
 	struct list_head pending_list;
 
 	request_func_t *request_fn;
+
+	struct bs_sync_group sync_group;
 };
 
 static inline struct bs_thread_info *BS_THREAD_I(struct scsi_lu *lu)
@@ -23,4 +40,7 @@ extern tgtadm_err bs_thread_open(struct bs_thread_info *info, request_func_t *rf
 				 int nr_threads);
 extern void bs_thread_close(struct bs_thread_info *info);
 extern int bs_thread_cmd_submit(struct scsi_cmd *cmd);
+extern int bs_thread_sync(struct bs_thread_info *info, sync_func_t *fn,
+			  void *arg);
+extern void bs_thread_show(struct scsi_lu *lu, struct concat_buf *b);
 extern int nr_iothreads;
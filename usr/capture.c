@@ -0,0 +1,377 @@
+/*
+ * LU workload capture
+ *
+ * When a LU has a capture file (the capture=<path> LU parameter),
+ * every data, sync and discard command is appended to it on
+ * completion as a struct capture_rec: submission time, opcode, range,
+ * flags and service latency, no data. tgtreplay plays such a file
+ * back against a backing file to compare backends offline.
+ *
+ * Records are gathered in buffers on the event loop; full buffers are
+ * written, and the file synced on stop, by a writer thread per capture
+ * so the traced commands don't wait for the capture file. If the writer
+ * falls CAPTURE_BUFS buffers behind, records are dropped and counted.
+ */
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+#include "scsi.h"
+#include "be_byteshift.h"
+#include "capture.h"
+
+#define CAPTURE_BUF_RECS	8192	/* 256KB per buffer */
+#define CAPTURE_BUFS		8
+#define CAPTURE_UNMAP_DESCS	16
+
+struct capture_buf {
+	struct list_head list;
+	unsigned int nr;
+	struct capture_rec recs[CAPTURE_BUF_RECS];
+};
+
+struct lu_capture {
+	int fd;
+	char *path;
+	uint64_t start;		/* CLOCK_MONOTONIC usecs */
+	uint64_t records;
+	uint64_t dropped;	/* no buffer free */
+	struct capture_buf *cur;
+	unsigned int nr_bufs;
+
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct list_head full;
+	struct list_head free;
+	int stop;
+};
+
+static uint64_t capture_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void capture_write(struct lu_capture *cap, struct capture_buf *buf)
+{
+	size_t len = buf->nr * sizeof(struct capture_rec);
+	char *p = (char *)buf->recs;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(cap->fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			eprintf("capture %s: %m, %zu records lost\n",
+				cap->path, len / sizeof(struct capture_rec));
+			break;
+		}
+		p += ret;
+		len -= ret;
+	}
+	buf->nr = 0;
+}
+
+static void capture_free(struct lu_capture *cap)
+{
+	struct capture_buf *buf, *next;
+
+	list_for_each_entry_safe(buf, next, &cap->free, list)
+		free(buf);
+	pthread_cond_destroy(&cap->cond);
+	pthread_mutex_destroy(&cap->lock);
+	free(cap->path);
+	free(cap);
+}
+
+/* owns cap once it is stopped */
+static void *capture_writer(void *arg)
+{
+	struct lu_capture *cap = arg;
+	struct capture_buf *buf;
+
+	pthread_mutex_lock(&cap->lock);
+	for (;;) {
+		while (list_empty(&cap->full) && !cap->stop)
+			pthread_cond_wait(&cap->cond, &cap->lock);
+		if (list_empty(&cap->full))
+			break;
+
+		buf = list_first_entry(&cap->full, struct capture_buf, list);
+		list_del(&buf->list);
+		pthread_mutex_unlock(&cap->lock);
+
+		capture_write(cap, buf);
+
+		pthread_mutex_lock(&cap->lock);
+		list_add(&buf->list, &cap->free);
+	}
+	pthread_mutex_unlock(&cap->lock);
+
+	fsync(cap->fd);
+	close(cap->fd);
+	eprintf("capture %s: %" PRIu64 " records, %" PRIu64 " dropped\n",
+		cap->path, cap->records, cap->dropped);
+	capture_free(cap);
+	return NULL;
+}
+
+static void capture_queue(struct lu_capture *cap)
+{
+	pthread_mutex_lock(&cap->lock);
+	list_add_tail(&cap->cur->list, &cap->full);
+	pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+	cap->cur = NULL;
+}
+
+static struct capture_buf *capture_buf_get(struct lu_capture *cap)
+{
+	struct capture_buf *buf = NULL;
+
+	pthread_mutex_lock(&cap->lock);
+	if (!list_empty(&cap->free)) {
+		buf = list_first_entry(&cap->free, struct capture_buf, list);
+		list_del(&buf->list);
+	}
+	pthread_mutex_unlock(&cap->lock);
+
+	if (!buf && cap->nr_bufs < CAPTURE_BUFS) {
+		buf = malloc(sizeof(*buf));
+		if (buf) {
+			buf->nr = 0;
+			cap->nr_bufs++;
+		}
+	}
+	return buf;
+}
+
+void lu_capture_stop(struct scsi_lu *lu)
+{
+	struct lu_capture *cap = lu->capture;
+
+	if (!cap)
+		return;
+	lu->capture = NULL;
+
+	/* the writer drains what is left, syncs and frees cap */
+	pthread_mutex_lock(&cap->lock);
+	if (cap->cur) {
+		if (cap->cur->nr)
+			list_add_tail(&cap->cur->list, &cap->full);
+		else
+			list_add(&cap->cur->list, &cap->free);
+		cap->cur = NULL;
+	}
+	cap->stop = 1;
+	pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+	pthread_detach(cap->writer);
+}
+
+/* path "off" or "" stops the current capture */
+tgtadm_err lu_capture_start(struct scsi_lu *lu, char *path)
+{
+	struct lu_capture *cap;
+	struct capture_hdr hdr;
+
+	lu_capture_stop(lu);
+	if (!*path || !strcmp(path, "off"))
+		return TGTADM_SUCCESS;
+
+	cap = zalloc(sizeof(*cap));
+	if (!cap)
+		return TGTADM_NOMEM;
+	INIT_LIST_HEAD(&cap->full);
+	INIT_LIST_HEAD(&cap->free);
+	pthread_mutex_init(&cap->lock, NULL);
+	pthread_cond_init(&cap->cond, NULL);
+
+	/*
+	 * A stopped writer may still be draining into the old file, so
+	 * a restart on the same path gets a new one rather than sharing it.
+	 */
+	unlink(path);
+	cap->path = strdup(path);
+	cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (!cap->path || cap->fd < 0) {
+		eprintf("capture %s: %m\n", path);
+		goto fail;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(CAPTURE_VERSION);
+	hdr.rec_size = htole32(sizeof(struct capture_rec));
+	hdr.lu_size = htole64(lu->size);
+	hdr.start = htole64(time(NULL));
+	hdr.blk_shift = htole32(lu->blk_shift);
+	if (write(cap->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		eprintf("capture %s: %m\n", path);
+		goto fail;
+	}
+
+	if (pthread_create(&cap->writer, NULL, capture_writer, cap)) {
+		eprintf("capture %s: can't start the writer\n", path);
+		goto fail;
+	}
+
+	cap->start = capture_now();
+	lu->capture = cap;
+	return TGTADM_SUCCESS;
+fail:
+	if (cap->fd >= 0)
+		close(cap->fd);
+	capture_free(cap);
+	return TGTADM_INVALID_REQUEST;
+}
+
+void lu_capture_submit(struct scsi_cmd *cmd)
+{
+	if (cmd->dev->lun == cmd->dev_id)
+		cmd->capture_stamp = capture_now();
+}
+
+static struct capture_rec *capture_rec_get(struct lu_capture *cap)
+{
+	if (cap->cur && cap->cur->nr == CAPTURE_BUF_RECS)
+		capture_queue(cap);
+	if (!cap->cur)
+		cap->cur = capture_buf_get(cap);
+	if (!cap->cur) {
+		cap->dropped++;
+		return NULL;
+	}
+	cap->records++;
+	return &cap->cur->recs[cap->cur->nr++];
+}
+
+static void capture_rec_fill(struct capture_rec *rec, struct scsi_cmd *cmd,
+			     uint64_t stamp, uint32_t latency, uint64_t offset,
+			     uint64_t length, uint8_t flags, int result)
+{
+	rec->stamp = htole64(stamp);
+	rec->offset = htole64(offset);
+	rec->length = htole64(length);
+	rec->latency = htole32(latency);
+	rec->opcode = cmd->scb[0];
+	rec->flags = flags;
+	rec->status = result;
+	rec->reserved = 0;
+}
+
+/* one record per block descriptor, the parameter list is still around */
+static void capture_unmap(struct lu_capture *cap, struct scsi_cmd *cmd,
+			  uint64_t stamp, uint32_t latency, int result)
+{
+	struct scsi_lu *lu = cmd->dev;
+	uint8_t *p = scsi_get_out_buffer(cmd);
+	uint32_t len = scsi_get_out_length(cmd);
+	struct capture_rec *rec;
+	uint32_t i;
+
+	for (i = 0; i < CAPTURE_UNMAP_DESCS && 8 + (i + 1) * 16 <= len; i++) {
+		uint8_t *d = p + 8 + i * 16;
+
+		rec = capture_rec_get(cap);
+		if (!rec)
+			return;
+		capture_rec_fill(rec, cmd, stamp, latency,
+				 __get_unaligned_be64(d) << lu->blk_shift,
+				 (uint64_t)__get_unaligned_be32(d + 8) <<
+				 lu->blk_shift,
+				 CAPTURE_WRITE | CAPTURE_DISCARD, result);
+	}
+}
+
+void lu_capture_done(struct scsi_cmd *cmd, int result)
+{
+	struct scsi_lu *lu = cmd->dev;
+	struct lu_capture *cap = lu->capture;
+	struct capture_rec *rec;
+	uint64_t now, stamp, offset, length;
+	uint32_t latency;
+	uint8_t flags = 0;
+
+	if (!cmd->capture_stamp || cmd->capture_stamp < cap->start)
+		return;
+
+	switch (cmd->scb[0]) {
+	case READ_10:
+	case READ_12:
+	case READ_16:
+		if (cmd->scb[1] & 0x08)
+			flags |= CAPTURE_FUA;
+		/* fall through */
+	case READ_6:
+		break;
+	case WRITE_10:
+	case WRITE_12:
+	case WRITE_16:
+	case WRITE_VERIFY:
+	case WRITE_VERIFY_12:
+	case WRITE_VERIFY_16:
+		if (cmd->scb[1] & 0x08)
+			flags |= CAPTURE_FUA;
+		/* fall through */
+	case WRITE_6:
+		flags |= CAPTURE_WRITE;
+		break;
+	case WRITE_SAME:
+	case WRITE_SAME_16:
+		flags |= CAPTURE_WRITE;
+		if (cmd->scb[1] & 0x08)
+			flags |= CAPTURE_DISCARD;
+		break;
+	case SYNCHRONIZE_CACHE:
+	case SYNCHRONIZE_CACHE_16:
+		flags |= CAPTURE_SYNC;
+		break;
+	case UNMAP:
+		break;
+	default:
+		return;
+	}
+
+	now = capture_now();
+	stamp = cmd->capture_stamp - cap->start;
+	latency = min_t(uint64_t, now - cmd->capture_stamp, UINT32_MAX);
+
+	if (cmd->scb[0] == UNMAP) {
+		capture_unmap(cap, cmd, stamp, latency, result);
+		return;
+	}
+
+	offset = scsi_rw_offset(cmd->scb) << lu->blk_shift;
+	length = (uint64_t)scsi_rw_count(cmd->scb) << lu->blk_shift;
+
+	rec = capture_rec_get(cap);
+	if (rec)
+		capture_rec_fill(rec, cmd, stamp, latency, offset, length,
+				 flags, result);
+}
+
+void lu_capture_show(struct scsi_lu *lu, struct concat_buf *b)
+{
+	struct lu_capture *cap = lu->capture;
+
+	if (!cap)
+		return;
+
+	concat_printf(b, _TAB3 "Capture: %s, %" PRIu64 " records, %" PRIu64
+		      " dropped\n", cap->path, cap->records, cap->dropped);
+}
@@ -0,0 +1,41 @@
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include <stdint.h>
+
+/*
+ * On-disk format of a LU workload capture, written by tgtd (capture.c)
+ * and read by tgtreplay. A header is followed by fixed size records in
+ * completion order, little endian, without any data.
+ */
+
+#define CAPTURE_MAGIC		"tgtcap01"
+#define CAPTURE_VERSION		2
+
+struct capture_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t rec_size;	/* sizeof(struct capture_rec) */
+	uint64_t lu_size;	/* bytes */
+	uint64_t start;		/* seconds since the epoch */
+	uint32_t blk_shift;
+	uint32_t reserved[9];
+};
+
+#define CAPTURE_FUA		(1U << 0)	/* FUA bit set in the CDB */
+#define CAPTURE_WRITE		(1U << 1)	/* moves data to the LU */
+#define CAPTURE_SYNC		(1U << 2)	/* SYNCHRONIZE CACHE */
+#define CAPTURE_DISCARD		(1U << 3)	/* UNMAP or WRITE SAME with unmap */
+
+struct capture_rec {
+	uint64_t stamp;		/* usecs from the start to submission */
+	uint64_t offset;	/* bytes */
+	uint64_t length;	/* bytes, an UNMAP range can pass 4GB */
+	uint32_t latency;	/* usecs from submission to completion */
+	uint8_t opcode;
+	uint8_t flags;		/* CAPTURE_* */
+	uint8_t status;		/* SAM status */
+	uint8_t reserved;
+};
+
+#endif
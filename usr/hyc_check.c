@@ -0,0 +1,995 @@
+/*
+ * Checks of bs_hyc against hyc_sim, run by make test with HYC_SIM=1
+ *
+ * hyc LUs are created through the SCSI core of tgtd behind a fake LLD,
+ * like tgtreplay does, and driven with READ, WRITE and UNMAP commands
+ * whose data is checked against a shadow copy of every LU. hyc_sim
+ * keeps the vmdk data in files, so a LU can be closed and opened again
+ * with its contents intact. Commands can be queued together and waited
+ * for later, so that they race in bs_hyc the way they would under
+ * iscsi.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+#include "driver.h"
+#include "scsi.h"
+#include "target.h"
+#include "log.h"
+#include "bs_hyc.h"
+#include "tgtd_stub.h"
+
+#define CHECK_TID	1
+#define CHECK_TARGET	"iqn.2007-03.org.tgt:hyc-check"
+#define CHECK_LU_SIZE	(16ULL << 20)
+#define CHECK_GRANULE	(64 << 10)	/* of the allocation map */
+
+struct check_cmd {
+	struct scsi_cmd scmd;
+	uint8_t cdb[16];
+	uint8_t unmap[24];	/* UNMAP header and one block descriptor */
+	int done;
+	int result;
+};
+
+struct check_lu {
+	int lun;
+	char *bsopts;
+	struct scsi_lu *lu;
+	char *shadow;		/* what the LU must read back */
+};
+
+struct check {
+	const char *name;
+	int (*run)(void);
+};
+
+static char program_name[] = "hyc_check";
+static char dir[] = "/var/tmp/hyc_check.XXXXXX";
+static uint64_t tag;
+
+static int check_cmd_end_notify(uint64_t nid, int result,
+				struct scsi_cmd *scmd)
+{
+	struct check_cmd *cc = container_of(scmd, struct check_cmd, scmd);
+
+	cc->done = 1;
+	cc->result = result;
+	return 0;
+}
+
+static int check_mgmt_end_notify(struct mgmt_req *mreq)
+{
+	return 0;
+}
+
+static struct tgt_driver check_drv = {
+	.name			= "check",
+	.cmd_end_notify		= check_cmd_end_notify,
+	.mgmt_end_notify	= check_mgmt_end_notify,
+	.default_bst		= "hyc",
+};
+
+__attribute__((constructor)) static void check_driver_constructor(void)
+{
+	register_driver(&check_drv);
+}
+
+static inline struct bs_hyc_info *check_hyc(struct check_lu *cl)
+{
+	return (struct bs_hyc_info *) ((char *) cl->lu + sizeof(*cl->lu));
+}
+
+/*
+ * Every 8 byte word holds its offset and the seed of the WRITE, so
+ * misplaced or stale data shows, and none of it is zero.
+ */
+static void pattern_fill(char *buf, uint64_t offset, uint32_t length,
+			 uint8_t seed)
+{
+	uint64_t word;
+	uint32_t i;
+
+	for (i = 0; i < length; i += sizeof(word)) {
+		word = ((offset + i) << 8) | seed;
+		memcpy(buf + i, &word, sizeof(word));
+	}
+}
+
+static void check_cmd_init(struct check_cmd *cc, struct check_lu *cl)
+{
+	memset(cc, 0, sizeof(*cc));
+	cc->scmd.scb = cc->cdb;
+	cc->scmd.scb_len = sizeof(cc->cdb);
+	cc->scmd.cmd_itn_id = 1;
+	cc->scmd.tag = tag++;
+	cc->scmd.attribute = MSG_SIMPLE_TAG;
+	cc->scmd.lun[1] = cl->lun;
+	scsi_set_data_dir(&cc->scmd, DATA_NONE);
+}
+
+static int check_cmd_queue(struct check_cmd *cc)
+{
+	int ret;
+
+	ret = target_cmd_queue(CHECK_TID, &cc->scmd);
+	if (ret) {
+		eprintf("failed to queue command 0x%02x, %d\n", cc->cdb[0],
+			ret);
+		cc->done = 1;
+		cc->result = SAM_STAT_CHECK_CONDITION;
+	}
+	return ret;
+}
+
+/* the command goes back to the SCSI layer from the main loop, like iscsi */
+static int check_wait(struct check_cmd *cc)
+{
+	while (!cc->done)
+		tgtd_stub_poll(-1);
+	target_cmd_done(&cc->scmd);
+	return cc->result;
+}
+
+static void check_rw_queue(struct check_cmd *cc, struct check_lu *cl,
+			   uint8_t opcode, uint8_t flags, char *buf,
+			   uint64_t offset, uint32_t length)
+{
+	check_cmd_init(cc, cl);
+	cc->cdb[0] = opcode;
+	cc->cdb[1] = flags;
+	put_unaligned_be64(offset >> 9, cc->cdb + 2);
+	put_unaligned_be32(length >> 9, cc->cdb + 10);
+	if (opcode == WRITE_16) {
+		scsi_set_data_dir(&cc->scmd, DATA_WRITE);
+		scsi_set_out_buffer(&cc->scmd, buf);
+		scsi_set_out_length(&cc->scmd, length);
+	} else {
+		scsi_set_data_dir(&cc->scmd, DATA_READ);
+		scsi_set_in_buffer(&cc->scmd, buf);
+		scsi_set_in_length(&cc->scmd, length);
+	}
+	check_cmd_queue(cc);
+}
+
+/* the shadow is updated when the WRITE succeeds */
+static int check_write_buf(struct check_lu *cl, char *buf, uint64_t offset,
+			   uint32_t length)
+{
+	struct check_cmd cc;
+	int ret;
+
+	check_rw_queue(&cc, cl, WRITE_16, 0, buf, offset, length);
+	ret = check_wait(&cc);
+	if (ret == SAM_STAT_GOOD)
+		memcpy(cl->shadow + offset, buf, length);
+	else
+		fprintf(stderr, "WRITE %" PRIu64 "+%u failed, 0x%x\n",
+			offset, length, ret);
+	return ret;
+}
+
+/* a WRITE of seed's pattern */
+static int check_write(struct check_lu *cl, uint64_t offset, uint32_t length,
+		       uint8_t seed)
+{
+	char *buf;
+	int ret;
+
+	buf = malloc(length);
+	if (!buf)
+		return -ENOMEM;
+	pattern_fill(buf, offset, length, seed);
+	ret = check_write_buf(cl, buf, offset, length);
+	free(buf);
+	return ret;
+}
+
+/* a WRITE queued now and waited for with the others by check_writes_wait() */
+struct check_write {
+	struct check_cmd cc;
+	uint64_t offset;
+	uint32_t length;
+	char *buf;
+};
+
+static void check_write_queue(struct check_write *w, struct check_lu *cl,
+			      uint64_t offset, uint32_t length, uint8_t seed,
+			      uint8_t flags)
+{
+	w->offset = offset;
+	w->length = length;
+	w->buf = malloc(length);
+	if (!w->buf) {
+		w->cc.done = 1;
+		w->cc.result = SAM_STAT_CHECK_CONDITION;
+		return;
+	}
+	pattern_fill(w->buf, offset, length, seed);
+	check_rw_queue(&w->cc, cl, WRITE_16, flags, w->buf, offset, length);
+}
+
+/* the shadow takes the WRITEs in the order they were queued */
+static int check_writes_wait(struct check_lu *cl, struct check_write *w,
+			     int nr)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < nr; i++) {
+		if (!w[i].buf || check_wait(&w[i].cc) != SAM_STAT_GOOD) {
+			fprintf(stderr, "WRITE %" PRIu64 "+%u failed\n",
+				w[i].offset, w[i].length);
+			ret = -EIO;
+			continue;
+		}
+		memcpy(cl->shadow + w[i].offset, w[i].buf, w[i].length);
+	}
+	for (i = 0; i < nr; i++)
+		free(w[i].buf);
+	return ret;
+}
+
+static int check_unmap(struct check_lu *cl, uint64_t offset, uint64_t length)
+{
+	struct check_cmd cc;
+	int ret;
+
+	check_cmd_init(&cc, cl);
+	cc.cdb[0] = UNMAP;
+	put_unaligned_be16(sizeof(cc.unmap), cc.cdb + 7);
+	put_unaligned_be16(sizeof(cc.unmap) - 2, cc.unmap);
+	put_unaligned_be16(16, cc.unmap + 2);
+	put_unaligned_be64(offset >> 9, cc.unmap + 8);
+	put_unaligned_be32(length >> 9, cc.unmap + 16);
+	scsi_set_data_dir(&cc.scmd, DATA_WRITE);
+	scsi_set_out_buffer(&cc.scmd, cc.unmap);
+	scsi_set_out_length(&cc.scmd, sizeof(cc.unmap));
+	check_cmd_queue(&cc);
+	ret = check_wait(&cc);
+	if (ret == SAM_STAT_GOOD)
+		memset(cl->shadow + offset, 0, length);
+	else
+		fprintf(stderr, "UNMAP %" PRIu64 "+%" PRIu64 " failed, 0x%x\n",
+			offset, length, ret);
+	return ret;
+}
+
+static int check_data(struct check_lu *cl, const char *buf, uint64_t offset,
+		      uint32_t length)
+{
+	uint32_t i;
+
+	if (!memcmp(buf, cl->shadow + offset, length))
+		return 0;
+	for (i = 0; buf[i] == cl->shadow[offset + i]; i++)
+		;
+	fprintf(stderr, "READ %" PRIu64 "+%u differs at %" PRIu64 "\n",
+		offset, length, offset + i);
+	return -EIO;
+}
+
+/* a READ that must find what the shadow holds */
+static int check_read(struct check_lu *cl, uint64_t offset, uint32_t length)
+{
+	struct check_cmd cc;
+	char *buf;
+	int ret;
+
+	buf = malloc(length);
+	if (!buf)
+		return -ENOMEM;
+	memset(buf, 0xee, length);
+	check_rw_queue(&cc, cl, READ_16, 0, buf, offset, length);
+	ret = check_wait(&cc);
+	if (ret != SAM_STAT_GOOD)
+		fprintf(stderr, "READ %" PRIu64 "+%u failed, 0x%x\n", offset,
+			length, ret);
+	else
+		ret = check_data(cl, buf, offset, length);
+	free(buf);
+	return ret;
+}
+
+/* the nexus gets unit attentions for a new LU, TUR until they are gone */
+static int check_clear_ua(struct check_lu *cl)
+{
+	struct check_cmd cc;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		check_cmd_init(&cc, cl);
+		cc.cdb[0] = TEST_UNIT_READY;
+		check_cmd_queue(&cc);
+		if (check_wait(&cc) == SAM_STAT_GOOD)
+			return 0;
+	}
+	return -EIO;
+}
+
+static int check_lu_open(struct check_lu *cl)
+{
+	char tp[] = "thin_provisioning=1";
+	struct target *target;
+	char *params;
+	int ret;
+
+	ret = asprintf(&params, "bstype=hyc,path=%s/lu%d,bsopts=vmid=1:"
+		       "vmdkid=check%d:%s", dir, cl->lun, cl->lun, cl->bsopts);
+	if (ret < 0)
+		return -ENOMEM;
+	ret = tgt_device_create(CHECK_TID, TYPE_DISK, cl->lun, params, 1);
+	free(params);
+	if (ret) {
+		fprintf(stderr, "can't create LU %d, %d\n", cl->lun, ret);
+		return -EINVAL;
+	}
+	/* UNMAP and zero detection need it */
+	if (tgt_device_update(CHECK_TID, cl->lun, tp)) {
+		fprintf(stderr, "can't thin provision LU %d\n", cl->lun);
+		return -EINVAL;
+	}
+
+	target = it_nexus_lookup(CHECK_TID, 1)->nexus_target;
+	list_for_each_entry(cl->lu, &target->device_list, device_siblings)
+		if (cl->lu->lun == cl->lun)
+			break;
+	return check_clear_ua(cl);
+}
+
+static void check_lu_close(struct check_lu *cl)
+{
+	tgt_device_destroy(CHECK_TID, cl->lun, 1);
+	cl->lu = NULL;
+}
+
+/* a new LU, its backing file and its vmdk start out empty */
+static int check_lu_create(struct check_lu *cl, int lun, char *bsopts)
+{
+	char path[PATH_MAX];
+	int fd, ret;
+
+	memset(cl, 0, sizeof(*cl));
+	cl->lun = lun;
+	cl->bsopts = bsopts;
+	cl->shadow = calloc(1, CHECK_LU_SIZE);
+	if (!cl->shadow)
+		return -ENOMEM;
+
+	snprintf(path, sizeof(path), "%s/lu%d", dir, lun);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return -errno;
+	ret = ftruncate(fd, CHECK_LU_SIZE);
+	close(fd);
+	if (ret)
+		return -errno;
+	return check_lu_open(cl);
+}
+
+static void check_lu_free(struct check_lu *cl)
+{
+	if (cl->lu)
+		check_lu_close(cl);
+	free(cl->shadow);
+}
+
+#define CHECK(cond)							\
+do {									\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s\n", __func__, __LINE__,	\
+			#cond);						\
+		failed++;						\
+	}								\
+} while (0)
+
+/*
+ * Allocation map
+ */
+
+static inline int am_granule_mapped(struct check_lu *cl, uint64_t g)
+{
+	return test_bit(g, check_hyc(cl)->amap.mapped);
+}
+
+/* written granules stay mapped across a clean close, the rest read zero */
+static int check_amap_reopen(void)
+{
+	struct check_lu cl;
+	struct bs_hyc_amap *am;
+	uint64_t zero_reads, split_reads;
+	int failed = 0;
+
+	if (check_lu_create(&cl, 1, "alloc_map=1"))
+		return 1;
+
+	/* a new map has nothing to go by, every granule may hold data */
+	CHECK(check_hyc(&cl)->amap.nr_mapped == CHECK_LU_SIZE / CHECK_GRANULE);
+	CHECK(!check_unmap(&cl, 0, CHECK_LU_SIZE));
+	CHECK(check_hyc(&cl)->amap.nr_mapped == 0);
+
+	CHECK(!check_write(&cl, 3 * CHECK_GRANULE, CHECK_GRANULE, 1));
+	CHECK(!check_write(&cl, 10 * CHECK_GRANULE + 4096, 8192, 2));
+	CHECK(check_hyc(&cl)->amap.nr_mapped == 2);
+	CHECK(!check_read(&cl, 3 * CHECK_GRANULE, CHECK_GRANULE));
+
+	check_lu_close(&cl);
+	if (check_lu_open(&cl))
+		return failed + 1;
+	am = &check_hyc(&cl)->amap;
+
+	CHECK(am->nr_mapped == 2);
+	CHECK(am_granule_mapped(&cl, 3) && am_granule_mapped(&cl, 10));
+	CHECK(!check_read(&cl, 3 * CHECK_GRANULE, CHECK_GRANULE));
+	CHECK(!check_read(&cl, 10 * CHECK_GRANULE, CHECK_GRANULE));
+
+	/* never written: zero filled without going to stord */
+	zero_reads = am->zero_reads;
+	CHECK(!check_read(&cl, 7 * CHECK_GRANULE, CHECK_GRANULE));
+	CHECK(am->zero_reads == zero_reads + 1);
+
+	/* around a written granule: only that one is read from stord */
+	split_reads = am->split_reads;
+	CHECK(!check_read(&cl, 2 * CHECK_GRANULE, 3 * CHECK_GRANULE));
+	CHECK(am->split_reads == split_reads + 1);
+
+	check_lu_free(&cl);
+	return failed;
+}
+
+/* UNMAP clears the granules it covers in full, partial ones stay mapped */
+static int check_amap_unmap_read(void)
+{
+	struct check_lu cl;
+	struct bs_hyc_amap *am;
+	uint64_t zero_reads;
+	int failed = 0;
+
+	if (check_lu_create(&cl, 2, "alloc_map=1"))
+		return 1;
+	am = &check_hyc(&cl)->amap;
+
+	CHECK(!check_write(&cl, 3 * CHECK_GRANULE, 4 * CHECK_GRANULE, 3));
+	CHECK(!check_unmap(&cl, 3 * CHECK_GRANULE + CHECK_GRANULE / 2,
+			   2 * CHECK_GRANULE));
+	CHECK(!am_granule_mapped(&cl, 4));
+	CHECK(am_granule_mapped(&cl, 3) && am_granule_mapped(&cl, 5));
+
+	CHECK(!check_read(&cl, 3 * CHECK_GRANULE, 4 * CHECK_GRANULE));
+	zero_reads = am->zero_reads;
+	CHECK(!check_read(&cl, 4 * CHECK_GRANULE, CHECK_GRANULE));
+	CHECK(am->zero_reads == zero_reads + 1);
+	CHECK(!check_read(&cl, 3 * CHECK_GRANULE, CHECK_GRANULE));
+	CHECK(!check_read(&cl, 5 * CHECK_GRANULE, CHECK_GRANULE));
+
+	/* written again after the UNMAP */
+	CHECK(!check_write(&cl, 4 * CHECK_GRANULE + 512, 512, 4));
+	CHECK(am_granule_mapped(&cl, 4));
+	CHECK(!check_read(&cl, 4 * CHECK_GRANULE, 2 * CHECK_GRANULE));
+
+	check_lu_free(&cl);
+	return failed;
+}
+
+/*
+ * Queues a READ and a WRITE of the same granule in one loop pass, in
+ * the given order, and checks that the READ found either all old or
+ * all new data.
+ */
+static int check_race(struct check_lu *cl, uint64_t offset, uint8_t seed,
+		      int read_first)
+{
+	struct check_cmd rd, wr;
+	char *rbuf, *wbuf, *old;
+	int ret = -ENOMEM;
+
+	rbuf = malloc(CHECK_GRANULE);
+	wbuf = malloc(CHECK_GRANULE);
+	old = malloc(CHECK_GRANULE);
+	if (!rbuf || !wbuf || !old)
+		goto out;
+	memcpy(old, cl->shadow + offset, CHECK_GRANULE);
+	pattern_fill(wbuf, offset, CHECK_GRANULE, seed);
+
+	if (read_first)
+		check_rw_queue(&rd, cl, READ_16, 0, rbuf, offset, CHECK_GRANULE);
+	check_rw_queue(&wr, cl, WRITE_16, 0, wbuf, offset, CHECK_GRANULE);
+	if (!read_first)
+		check_rw_queue(&rd, cl, READ_16, 0, rbuf, offset, CHECK_GRANULE);
+	ret = check_wait(&rd);
+	ret |= check_wait(&wr);
+	if (ret) {
+		fprintf(stderr, "racing READ and WRITE failed\n");
+		goto out;
+	}
+	memcpy(cl->shadow + offset, wbuf, CHECK_GRANULE);
+	if (memcmp(rbuf, old, CHECK_GRANULE) &&
+	    memcmp(rbuf, wbuf, CHECK_GRANULE)) {
+		fprintf(stderr, "READ racing a WRITE at %" PRIu64
+			" found mixed data\n", offset);
+		ret = -EIO;
+	}
+out:
+	free(rbuf);
+	free(wbuf);
+	free(old);
+	return ret;
+}
+
+/*
+ * A READ that finds a granule zero only clears it when no WRITE to it
+ * came along meanwhile, and a READ after a WRITE never zero fills what
+ * the WRITE set.
+ */
+static int check_amap_race(void)
+{
+	struct check_lu cl;
+	struct bs_hyc_amap *am;
+	uint64_t learned;
+	int failed = 0;
+
+	if (check_lu_create(&cl, 3, "alloc_map=1"))
+		return 1;
+	am = &check_hyc(&cl)->amap;
+
+	/* nothing in the way: a READ of zeroes clears the granule */
+	CHECK(!check_read(&cl, CHECK_GRANULE, CHECK_GRANULE));
+	CHECK(am->learned == 1 && !am_granule_mapped(&cl, 1));
+
+	/* the READ is tracked, the WRITE spoils what it brings back */
+	learned = am->learned;
+	CHECK(!check_race(&cl, 2 * CHECK_GRANULE, 5, 1));
+	CHECK(am->learned == learned);
+	CHECK(am_granule_mapped(&cl, 2));
+	CHECK(!check_read(&cl, 2 * CHECK_GRANULE, CHECK_GRANULE));
+
+	/* the WRITE maps the granule before the READ looks at it */
+	CHECK(!check_race(&cl, CHECK_GRANULE, 6, 0));
+	CHECK(am_granule_mapped(&cl, 1));
+	CHECK(!check_read(&cl, CHECK_GRANULE, CHECK_GRANULE));
+
+	CHECK(am->mismatches == 0);
+	check_lu_free(&cl);
+	return failed;
+}
+
+/*
+ * Write coalescing
+ */
+
+/* where queued WRITEs overlap, the one queued last wins */
+static int check_co_last_writer(void)
+{
+	struct check_write w[3];
+	struct check_lu cl;
+	struct bs_hyc_coalesce *co;
+	uint64_t requests, merged;
+	int failed = 0;
+
+	if (check_lu_create(&cl, 4, "coalesce=256"))
+		return 1;
+	co = &check_hyc(&cl)->co;
+
+	requests = co->requests;
+	merged = co->merged;
+	check_write_queue(&w[0], &cl, 0, 16384, 1, 0);
+	check_write_queue(&w[1], &cl, 8192, 16384, 2, 0);
+	check_write_queue(&w[2], &cl, 4096, 8192, 3, 0);
+	CHECK(co->nr_cmds == 3);
+	CHECK(!check_writes_wait(&cl, w, 3));
+	CHECK(co->requests == requests + 1 && co->merged == merged + 3);
+	CHECK(!check_read(&cl, 0, 32768));
+
+	/* the same blocks twice */
+	check_write_queue(&w[0], &cl, 65536, 4096, 4, 0);
+	check_write_queue(&w[1], &cl, 65536, 4096, 5, 0);
+	CHECK(!check_writes_wait(&cl, w, 2));
+	CHECK(!check_read(&cl, 65536, 4096));
+
+	/* a FUA WRITE goes out on its own, after the run it overlaps */
+	requests = co->requests;
+	check_write_queue(&w[0], &cl, 131072, 4096, 6, 0);
+	check_write_queue(&w[1], &cl, 131072, 4096, 7, 0x08);
+	CHECK(co->nr_cmds == 0);
+	CHECK(!check_writes_wait(&cl, w, 2));
+	CHECK(co->requests == requests + 2);
+	CHECK(!check_read(&cl, 131072, 4096));
+
+	check_lu_free(&cl);
+	return failed;
+}
+
+/*
+ * A READ overlapping the open run sends it first and finds the merged
+ * data, one elsewhere leaves the run open.
+ */
+static int check_co_read_overlap(void)
+{
+	struct check_write w[2];
+	struct check_cmd rd;
+	struct check_lu cl;
+	struct bs_hyc_coalesce *co;
+	uint64_t merged;
+	char *buf;
+	int failed = 0;
+
+	if (check_lu_create(&cl, 5, "coalesce=256"))
+		return 1;
+	co = &check_hyc(&cl)->co;
+	buf = malloc(32768);
+	if (!buf) {
+		check_lu_free(&cl);
+		return 1;
+	}
+
+	merged = co->merged;
+	check_write_queue(&w[0], &cl, 0, 8192, 1, 0);
+	check_write_queue(&w[1], &cl, 4096, 12288, 2, 0);
+	check_rw_queue(&rd, &cl, READ_16, 0, buf, 0, 32768);
+	CHECK(co->nr_cmds == 0 && co->merged == merged + 2);
+	CHECK(!check_writes_wait(&cl, w, 2));
+	CHECK(check_wait(&rd) == SAM_STAT_GOOD);
+	CHECK(!check_data(&cl, buf, 0, 32768));
+
+	merged = co->merged;
+	check_write_queue(&w[0], &cl, 65536, 8192, 3, 0);
+	check_rw_queue(&rd, &cl, READ_16, 0, buf, 262144, 4096);
+	CHECK(co->nr_cmds == 1);
+	check_write_queue(&w[1], &cl, 73728, 8192, 4, 0);
+	CHECK(co->nr_cmds == 2);
+	CHECK(check_wait(&rd) == SAM_STAT_GOOD);
+	CHECK(!check_data(&cl, buf, 262144, 4096));
+	CHECK(!check_writes_wait(&cl, w, 2));
+	CHECK(co->merged == merged + 2);
+	CHECK(!check_read(&cl, 65536, 16384));
+
+	free(buf);
+	check_lu_free(&cl);
+	return failed;
+}
+
+/*
+ * Zero detection
+ */
+
+/*
+ * Zero runs cut out of a WRITE must read back zero over older data, and
+ * the data extents around them must land where they belong.
+ */
+static int check_zero_split(void)
+{
+	struct check_lu cl;
+	struct bs_hyc_zero *zd;
+	uint64_t splits, writes, elided;
+	char *buf;
+	int i, failed = 0;
+
+	if (check_lu_create(&cl, 6, "zero_detect=1"))
+		return 1;
+	zd = &check_hyc(&cl)->zero;
+	buf = malloc(262144);
+	if (!buf) {
+		check_lu_free(&cl);
+		return 1;
+	}
+	CHECK(!check_write(&cl, 0, 524288, 1));
+
+	/* zero head, middle and tail */
+	splits = zd->splits;
+	elided = zd->elided_bytes;
+	pattern_fill(buf, 0, 262144, 2);
+	memset(buf, 0, 32768);
+	memset(buf + 98304, 0, 65536);
+	memset(buf + 229376, 0, 32768);
+	CHECK(!check_write_buf(&cl, buf, 0, 262144));
+	CHECK(zd->splits == splits + 1);
+	CHECK(zd->elided_bytes == elided + 131072);
+	CHECK(!check_read(&cl, 0, 524288));
+
+	/* a run too short to cut out goes with the data */
+	splits = zd->splits;
+	pattern_fill(buf, 262144, 65536, 3);
+	memset(buf + 16384, 0, 16384);
+	CHECK(!check_write_buf(&cl, buf, 262144, 65536));
+	CHECK(zd->splits == splits);
+	CHECK(!check_read(&cl, 262144, 65536));
+
+	/* more runs than are cut out, the last one is written */
+	pattern_fill(buf, 0, 184320, 4);
+	for (i = 0; i < 5; i++)
+		memset(buf + i * 36864, 0, 32768);
+	CHECK(!check_write_buf(&cl, buf, 0, 184320));
+	CHECK(zd->splits == splits + 1);
+	CHECK(!check_read(&cl, 0, 262144));
+
+	/* nothing but zeroes */
+	writes = zd->writes;
+	memset(buf, 0, 8192);
+	CHECK(!check_write_buf(&cl, buf, 270336, 8192));
+	CHECK(zd->writes == writes + 1);
+	CHECK(!check_read(&cl, 262144, 65536));
+
+	free(buf);
+	check_lu_free(&cl);
+	return failed;
+}
+
+/*
+ * Write-back journal
+ */
+
+static void check_sync_queue(struct check_cmd *cc, struct check_lu *cl)
+{
+	check_cmd_init(cc, cl);
+	cc->cdb[0] = SYNCHRONIZE_CACHE;
+	check_cmd_queue(cc);
+}
+
+/* wait for the flusher to drain the journal to stord */
+static int wb_wait_clean(struct check_lu *cl)
+{
+	int i;
+
+	for (i = 0; i < 1000 && check_hyc(cl)->wb.nr_dirty; i++)
+		tgtd_stub_poll(10);
+	return check_hyc(cl)->wb.nr_dirty ? -ETIMEDOUT : 0;
+}
+
+/*
+ * With the flusher held off, as if a flush had failed, READs must find
+ * journaled data: read back from the journal, or from memory while the
+ * append is still going on, and patched over what stord returns. A
+ * SYNCHRONIZE CACHE completes only after the WRITEs queued before it.
+ * Whatever did not reach stord is replayed when the LU is opened again.
+ */
+static int check_wb_journal(void)
+{
+	static char opts[PATH_MAX];
+	struct check_write w[2];
+	struct check_cmd rd, sync;
+	struct check_lu cl;
+	struct bs_hyc_wb *wb;
+	uint64_t hits, overlays;
+	char *buf;
+	int failed = 0;
+
+	snprintf(opts, sizeof(opts), "wb_journal=%s/journal7:wb_size=4", dir);
+	if (check_lu_create(&cl, 7, opts))
+		return 1;
+	wb = &check_hyc(&cl)->wb;
+	buf = malloc(131072);
+	if (!buf) {
+		check_lu_free(&cl);
+		return 1;
+	}
+	wb->retry_pending = true;
+
+	CHECK(!check_write(&cl, 0, 65536, 1));
+	hits = wb->read_hits;
+	CHECK(!check_read(&cl, 4096, 8192));
+	CHECK(wb->read_hits == hits + 1);
+
+	/* a READ and a sync right behind WRITEs still being appended */
+	check_write_queue(&w[0], &cl, 32768, 16384, 2, 0);
+	check_write_queue(&w[1], &cl, 40960, 4096, 3, 0);
+	memset(buf, 0xee, 16384);
+	check_rw_queue(&rd, &cl, READ_16, 0, buf, 36864, 16384);
+	check_sync_queue(&sync, &cl);
+	CHECK(!sync.done);
+	CHECK(check_wait(&sync) == SAM_STAT_GOOD);
+	CHECK(w[0].cc.done && w[1].cc.done);
+	CHECK(!check_writes_wait(&cl, w, 2));
+	CHECK(check_wait(&rd) == SAM_STAT_GOOD);
+	CHECK(!check_data(&cl, buf, 36864, 16384));
+
+	/* partly journaled, the rest comes from stord */
+	overlays = wb->read_overlays;
+	CHECK(!check_read(&cl, 0, 131072));
+	CHECK(wb->read_overlays == overlays + 1);
+
+	CHECK(!check_unmap(&cl, 16384, 8192));
+	CHECK(!check_read(&cl, 0, 65536));
+	CHECK(wb->nr_dirty == 4);
+
+	/* closed dirty, the records are replayed */
+	wb->retry_pending = false;
+	check_lu_close(&cl);
+	if (check_lu_open(&cl)) {
+		free(buf);
+		return failed + 1;
+	}
+	wb = &check_hyc(&cl)->wb;
+	CHECK(wb->recovered == 4);
+	CHECK(!check_read(&cl, 0, 131072));
+
+	/* flushed as they are appended, only stord has them after a close */
+	check_write_queue(&w[0], &cl, 65536, 32768, 4, 0);
+	check_write_queue(&w[1], &cl, 8192, 4096, 5, 0);
+	CHECK(!check_writes_wait(&cl, w, 2));
+	CHECK(!wb_wait_clean(&cl));
+	CHECK(!check_read(&cl, 0, 131072));
+
+	/* closed clean, nothing to replay, stord has it all */
+	check_lu_close(&cl);
+	if (check_lu_open(&cl)) {
+		free(buf);
+		return failed + 1;
+	}
+	wb = &check_hyc(&cl)->wb;
+	CHECK(wb->recovered == 0);
+	CHECK(!check_read(&cl, 0, 131072));
+
+	free(buf);
+	check_lu_free(&cl);
+	return failed;
+}
+
+/*
+ * Read cache
+ */
+
+/* wait for cache writes and hole punches to land */
+static int rc_wait_idle(struct check_lu *cl)
+{
+	struct bs_hyc_rcache *rc = &check_hyc(cl)->rcache;
+	int i;
+
+	for (i = 0; i < 1000 && !list_empty(&rc->ios); i++)
+		tgtd_stub_poll(10);
+	return list_empty(&rc->ios) ? 0 : -ETIMEDOUT;
+}
+
+/*
+ * Hits are read by the worker threads and complete from the main loop.
+ * A WRITE racing a hit must not leave older data cached, and blocks
+ * evicted to make room read back from stord.
+ */
+static int check_rc_hits(void)
+{
+	struct check_write w;
+	struct check_cmd rd;
+	struct check_lu cl;
+	struct bs_hyc_rcache *rc;
+	uint64_t hits, offset;
+	char *buf;
+	int failed = 0;
+
+	if (check_lu_create(&cl, 8, "rcache_size=1"))
+		return 1;
+	rc = &check_hyc(&cl)->rcache;
+	buf = malloc(65536 + 512);
+	if (!buf) {
+		check_lu_free(&cl);
+		return 1;
+	}
+
+	/* the WRITE fills the cache */
+	CHECK(!check_write(&cl, 0, 65536, 1));
+	CHECK(!rc_wait_idle(&cl));
+	CHECK(rc->nr_present == 16);
+
+	hits = rc->hits;
+	memset(buf, 0xee, 65536);
+	check_rw_queue(&rd, &cl, READ_16, 0, buf, 0, 65536);
+	CHECK(!rd.done);
+	CHECK(check_wait(&rd) == SAM_STAT_GOOD);
+	CHECK(rc->hits == hits + 1);
+	CHECK(!check_data(&cl, buf, 0, 65536));
+
+	/* not cache block aligned, read through a bounce buffer */
+	memset(buf, 0xee, 8192 + 512);
+	check_rw_queue(&rd, &cl, READ_16, 0, buf + 512, 512, 8192);
+	CHECK(check_wait(&rd) == SAM_STAT_GOOD);
+	CHECK(rc->hits == hits + 2);
+	CHECK(!check_data(&cl, buf + 512, 512, 8192));
+
+	check_rw_queue(&rd, &cl, READ_16, 0, buf, 0, 65536);
+	check_write_queue(&w, &cl, 0, 8192, 2, 0);
+	CHECK(check_wait(&rd) == SAM_STAT_GOOD);
+	CHECK(!check_writes_wait(&cl, &w, 1));
+	CHECK(!rc_wait_idle(&cl));
+	CHECK(!check_read(&cl, 0, 65536));
+
+	/* twice what the cache holds */
+	for (offset = 65536; offset < (2 << 20); offset += 262144)
+		CHECK(!check_write(&cl, offset, 262144, 3));
+	CHECK(!rc_wait_idle(&cl));
+	CHECK(rc->evicted && rc->nr_present <= rc->capacity);
+	CHECK(!check_read(&cl, 0, 65536));
+	CHECK(!rc_wait_idle(&cl));
+	CHECK(!check_read(&cl, 0, 65536));
+	CHECK(!check_read(&cl, 1 << 20, 65536));
+
+	free(buf);
+	check_lu_free(&cl);
+	return failed;
+}
+
+static struct check checks[] = {
+	{"amap_reopen", check_amap_reopen},
+	{"amap_unmap_read", check_amap_unmap_read},
+	{"amap_race", check_amap_race},
+	{"co_last_writer", check_co_last_writer},
+	{"co_read_overlap", check_co_read_overlap},
+	{"zero_split", check_zero_split},
+	{"wb_journal", check_wb_journal},
+	{"rc_hits", check_rc_hits},
+};
+
+static int rm_entry(const char *path, const struct stat *st, int flag,
+		    struct FTW *ftw)
+{
+	return remove(path);
+}
+
+static int check_setup(void)
+{
+	char args[] = "targetname=" CHECK_TARGET;
+	char *opts;
+	int ret;
+
+	/* data in files, so that it outlives a close */
+	if (asprintf(&opts, "data=file:dir=%s:dist=fixed:read_lat=50:"
+		     "write_lat=100", dir) < 0)
+		return -ENOMEM;
+	setenv("HYC_SIM_OPTS", opts, 1);
+	free(opts);
+
+	check_drv.drv_state = DRIVER_INIT;
+	INIT_LIST_HEAD(&check_drv.target_list);
+	ret = tgt_target_create(get_driver_index("check"), CHECK_TID, args);
+	if (ret) {
+		fprintf(stderr, "can't create the target, %d\n", ret);
+		return -EINVAL;
+	}
+	ret = it_nexus_create(CHECK_TID, 1, 0, NULL);
+	if (ret) {
+		fprintf(stderr, "can't create the nexus, %d\n", ret);
+		return ret;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int i, ret, failed = 0;
+
+	/* O_DIRECT, which bs_hyc opens with, fails on tmpfs */
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "can't create %s, %m\n", dir);
+		return 1;
+	}
+	if (tgtd_stub_init(program_name) || check_setup()) {
+		nftw(dir, rm_entry, 8, FTW_DEPTH | FTW_PHYS);
+		return 1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(checks); i++) {
+		ret = checks[i].run();
+		printf("%-20s %s\n", checks[i].name, ret ? "FAILED" : "ok");
+		failed += ret;
+	}
+
+	it_nexus_destroy(CHECK_TID, 1);
+	tgt_target_destroy(get_driver_index("check"), CHECK_TID, 1);
+	nftw(dir, rm_entry, 8, FTW_DEPTH | FTW_PHYS);
+	return failed ? 1 : 0;
+}
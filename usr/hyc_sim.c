@@ -0,0 +1,930 @@
+/*
+ * hyc client simulator
+ *
+ * Implements the TgtInterface.h API of the stord client library in
+ * process, so that bs_hyc and everything around it can be exercised
+ * and benchmarked without a stord. Built into tgtd instead of the
+ * client libraries with "make HYC_SIM=1".
+ *
+ * Every request completes through the eventfd given to HycOpenVmdk
+ * after a latency drawn from a configurable distribution. Completions
+ * keep the submission order unless reordering is enabled, a share of
+ * them can fail or take a tail latency, and all of them can be held
+ * periodically to mimic a stord that stalls. The data lives in memory,
+ * in a file per vmdk or nowhere.
+ *
+ * The simulator is configured by the HYC_SIM_OPTS environment variable
+ * of tgtd, ':' separated like the hyc bsopts:
+ *
+ *   data=mem|file|none   where the data is kept, mem (default) is a
+ *                        sparse anonymous mapping of the vmdk size
+ *   dir=<path>           directory of the data=file files, /var/tmp
+ *   read_lat=<us>        mean READ latency, 100
+ *   write_lat=<us>       mean WRITE, TRUNCATE and SYNC latency, 200
+ *   dist=fixed|uniform|exp
+ *                        latency distribution around the mean, exp
+ *   tail_ppm=<n>         requests per million taking tail_lat instead
+ *   tail_lat=<us>        tail latency, 20000
+ *   error_ppm=<n>        requests per million completing with -EIO
+ *   reorder=0|1          complete in latency order rather than in
+ *                        submission order
+ *   stall_every=<ms>     hold all completions every so often ...
+ *   stall_ms=<ms>        ... for this long
+ *   seed=<n>             random seed, so that runs can be repeated
+ *
+ * e.g. HYC_SIM_OPTS="read_lat=300:write_lat=800:tail_ppm=100:reorder=1"
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "list.h"
+#include "util.h"
+#include "log.h"
+#include "parser.h"
+
+#include "TgtTypes.h"
+#include "TgtInterface.h"
+
+enum {
+	SIM_READ,
+	SIM_WRITE,
+	SIM_TRUNCATE,
+	SIM_SYNC,
+};
+
+enum {
+	SIM_DATA_MEM,
+	SIM_DATA_FILE,
+	SIM_DATA_NONE,
+};
+
+enum {
+	SIM_DIST_FIXED,
+	SIM_DIST_UNIFORM,
+	SIM_DIST_EXP,
+};
+
+struct hyc_sim_conf {
+	int data;
+	char *dir;
+	uint64_t read_lat;
+	uint64_t write_lat;
+	int dist;
+	uint32_t tail_ppm;
+	uint64_t tail_lat;
+	uint32_t error_ppm;
+	int reorder;
+	uint64_t stall_every;
+	uint64_t stall_len;
+	long seed;
+};
+
+static struct hyc_sim_conf conf = {
+	.data		= SIM_DATA_MEM,
+	.read_lat	= 100,
+	.write_lat	= 200,
+	.dist		= SIM_DIST_EXP,
+	.tail_lat	= 20000,
+	.seed		= 1,
+};
+
+struct hyc_sim_req {
+	struct list_head list;
+	RequestID id;
+	const void *privatep;
+	int op;
+	char *bufp;
+	size_t length;
+	int64_t offset;
+	uint64_t submit;
+	uint64_t due;
+	int32_t result;
+};
+
+struct hyc_sim_vmdk {
+	struct list_head list;
+	char *vmdkid;
+	uint64_t size;
+	uint32_t blk_shift;
+	int efd;
+
+	char *mem;
+	int fd;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int stop;
+
+	/* pending requests, a min heap on (due, id) */
+	struct hyc_sim_req **heap;
+	uint32_t nr_heap;
+	uint32_t heap_size;
+	/* picked by the completion thread, data being copied */
+	struct list_head inflight;
+	/* waiting for HycGetCompleteRequests */
+	struct list_head done;
+
+	RequestID next_id;
+	uint64_t last_due;
+	uint64_t next_stall;
+	struct drand48_data rand;
+
+	vmdk_stats_t stats;
+	/* completed requests and their summed latency, per type */
+	uint64_t read_done;
+	uint64_t write_done;
+	uint64_t truncate_done;
+	uint64_t read_lat_sum;
+	uint64_t write_lat_sum;
+	uint64_t truncate_lat_sum;
+};
+
+static pthread_once_t conf_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t vmdks_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(vmdks);
+
+enum {
+	Opt_data, Opt_dir, Opt_read_lat, Opt_write_lat, Opt_dist,
+	Opt_tail_ppm, Opt_tail_lat, Opt_error_ppm, Opt_reorder,
+	Opt_stall_every, Opt_stall_ms, Opt_seed, Opt_err,
+};
+
+static match_table_t hyc_sim_opts = {
+	{Opt_data, "data=%s"},
+	{Opt_dir, "dir=%s"},
+	{Opt_read_lat, "read_lat=%s"},
+	{Opt_write_lat, "write_lat=%s"},
+	{Opt_dist, "dist=%s"},
+	{Opt_tail_ppm, "tail_ppm=%s"},
+	{Opt_tail_lat, "tail_lat=%s"},
+	{Opt_error_ppm, "error_ppm=%s"},
+	{Opt_reorder, "reorder=%s"},
+	{Opt_stall_every, "stall_every=%s"},
+	{Opt_stall_ms, "stall_ms=%s"},
+	{Opt_seed, "seed=%s"},
+	{Opt_err, NULL},
+};
+
+static void hyc_sim_conf_init(void)
+{
+	char *opts, *p, *str;
+	int err = 0;
+
+	str = getenv("HYC_SIM_OPTS");
+	opts = str ? strdup(str) : NULL;
+	str = opts;
+
+	while (str && (p = strsep(&str, ":")) != NULL) {
+		substring_t args[MAX_OPT_ARGS];
+		char *arg;
+
+		if (!*p)
+			continue;
+		switch (match_token(p, hyc_sim_opts, args)) {
+		case Opt_data:
+			arg = args[0].from;
+			if (!strcmp(arg, "mem"))
+				conf.data = SIM_DATA_MEM;
+			else if (!strcmp(arg, "file"))
+				conf.data = SIM_DATA_FILE;
+			else if (!strcmp(arg, "none"))
+				conf.data = SIM_DATA_NONE;
+			else
+				err = EINVAL;
+			break;
+		case Opt_dir:
+			conf.dir = match_strdup(&args[0]);
+			break;
+		case Opt_read_lat:
+			err = str_to_int(args[0].from, conf.read_lat);
+			break;
+		case Opt_write_lat:
+			err = str_to_int(args[0].from, conf.write_lat);
+			break;
+		case Opt_dist:
+			arg = args[0].from;
+			if (!strcmp(arg, "fixed"))
+				conf.dist = SIM_DIST_FIXED;
+			else if (!strcmp(arg, "uniform"))
+				conf.dist = SIM_DIST_UNIFORM;
+			else if (!strcmp(arg, "exp"))
+				conf.dist = SIM_DIST_EXP;
+			else
+				err = EINVAL;
+			break;
+		case Opt_tail_ppm:
+			err = str_to_int_range(args[0].from, conf.tail_ppm, 0,
+				1000000);
+			break;
+		case Opt_tail_lat:
+			err = str_to_int(args[0].from, conf.tail_lat);
+			break;
+		case Opt_error_ppm:
+			err = str_to_int_range(args[0].from, conf.error_ppm, 0,
+				1000000);
+			break;
+		case Opt_reorder:
+			conf.reorder = !!atoi(args[0].from);
+			break;
+		case Opt_stall_every:
+			err = str_to_int(args[0].from, conf.stall_every);
+			conf.stall_every *= 1000;
+			break;
+		case Opt_stall_ms:
+			err = str_to_int(args[0].from, conf.stall_len);
+			conf.stall_len *= 1000;
+			break;
+		case Opt_seed:
+			err = str_to_int(args[0].from, conf.seed);
+			break;
+		default:
+			err = EINVAL;
+			break;
+		}
+		if (err) {
+			eprintf("invalid HYC_SIM_OPTS %s\n", p);
+			err = 0;
+		}
+	}
+	free(opts);
+	if (!conf.dir)
+		conf.dir = strdup("/var/tmp");
+
+	eprintf("hyc simulator, data:%s read_lat:%" PRIu64 "us write_lat:%"
+		PRIu64 "us dist:%s tail:%u ppm of %" PRIu64 "us errors:%u ppm"
+		" reorder:%d stall:%" PRIu64 "ms every %" PRIu64 "ms\n",
+		conf.data == SIM_DATA_MEM ? "mem" :
+		conf.data == SIM_DATA_FILE ? conf.dir : "none",
+		conf.read_lat, conf.write_lat,
+		conf.dist == SIM_DIST_FIXED ? "fixed" :
+		conf.dist == SIM_DIST_UNIFORM ? "uniform" : "exp",
+		conf.tail_ppm, conf.tail_lat, conf.error_ppm, conf.reorder,
+		conf.stall_len / 1000, conf.stall_every / 1000);
+}
+
+static uint64_t sim_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static double sim_rand(struct hyc_sim_vmdk *vmdk)
+{
+	double r;
+
+	drand48_r(&vmdk->rand, &r);
+	return r;
+}
+
+static uint64_t sim_latency(struct hyc_sim_vmdk *vmdk, uint64_t mean)
+{
+	if (conf.tail_ppm && sim_rand(vmdk) * 1000000 < conf.tail_ppm)
+		return conf.tail_lat;
+
+	switch (conf.dist) {
+	case SIM_DIST_UNIFORM:
+		return 2 * mean * sim_rand(vmdk);
+	case SIM_DIST_EXP:
+		/* 1 - r is never 0 */
+		return -log(1 - sim_rand(vmdk)) * mean;
+	default:
+		return mean;
+	}
+}
+
+static int req_before(struct hyc_sim_req *a, struct hyc_sim_req *b)
+{
+	return a->due < b->due || (a->due == b->due && a->id < b->id);
+}
+
+static void heap_swap(struct hyc_sim_vmdk *vmdk, uint32_t i, uint32_t j)
+{
+	struct hyc_sim_req *t = vmdk->heap[i];
+
+	vmdk->heap[i] = vmdk->heap[j];
+	vmdk->heap[j] = t;
+}
+
+static void heap_up(struct hyc_sim_vmdk *vmdk, uint32_t i)
+{
+	while (i && req_before(vmdk->heap[i], vmdk->heap[(i - 1) / 2])) {
+		heap_swap(vmdk, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_down(struct hyc_sim_vmdk *vmdk, uint32_t i)
+{
+	for (;;) {
+		uint32_t m = i, l = 2 * i + 1, r = 2 * i + 2;
+
+		if (l < vmdk->nr_heap && req_before(vmdk->heap[l], vmdk->heap[m]))
+			m = l;
+		if (r < vmdk->nr_heap && req_before(vmdk->heap[r], vmdk->heap[m]))
+			m = r;
+		if (m == i)
+			break;
+		heap_swap(vmdk, i, m);
+		i = m;
+	}
+}
+
+static int heap_push(struct hyc_sim_vmdk *vmdk, struct hyc_sim_req *req)
+{
+	if (vmdk->nr_heap == vmdk->heap_size) {
+		uint32_t size = vmdk->heap_size ? vmdk->heap_size * 2 : 256;
+		struct hyc_sim_req **heap;
+
+		heap = realloc(vmdk->heap, size * sizeof(*heap));
+		if (!heap)
+			return -ENOMEM;
+		vmdk->heap = heap;
+		vmdk->heap_size = size;
+	}
+	vmdk->heap[vmdk->nr_heap] = req;
+	heap_up(vmdk, vmdk->nr_heap++);
+	return 0;
+}
+
+static void heap_remove(struct hyc_sim_vmdk *vmdk, uint32_t i)
+{
+	vmdk->heap[i] = vmdk->heap[--vmdk->nr_heap];
+	if (i < vmdk->nr_heap) {
+		heap_up(vmdk, i);
+		heap_down(vmdk, i);
+	}
+}
+
+static void sim_zero(struct hyc_sim_vmdk *vmdk, uint64_t offset,
+		uint64_t length)
+{
+	if (offset >= vmdk->size)
+		return;
+	if (length > vmdk->size - offset)
+		length = vmdk->size - offset;
+
+	switch (conf.data) {
+	case SIM_DATA_MEM:
+		memset(vmdk->mem + offset, 0, length);
+		break;
+	case SIM_DATA_FILE:
+		if (fallocate(vmdk->fd, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, offset, length) < 0)
+			eprintf("%s: punch hole failed, %m\n", vmdk->vmdkid);
+		break;
+	}
+}
+
+/* runs in the completion thread, without the lock */
+static int32_t sim_do_io(struct hyc_sim_vmdk *vmdk, struct hyc_sim_req *req)
+{
+	ssize_t ret = 0;
+	size_t i;
+
+	switch (req->op) {
+	case SIM_READ:
+		if (conf.data == SIM_DATA_MEM)
+			memcpy(req->bufp, vmdk->mem + req->offset, req->length);
+		else if (conf.data == SIM_DATA_FILE)
+			ret = pread(vmdk->fd, req->bufp, req->length,
+				req->offset);
+		break;
+	case SIM_WRITE:
+		if (conf.data == SIM_DATA_MEM)
+			memcpy(vmdk->mem + req->offset, req->bufp, req->length);
+		else if (conf.data == SIM_DATA_FILE)
+			ret = pwrite(vmdk->fd, req->bufp, req->length,
+				req->offset);
+		break;
+	case SIM_TRUNCATE:
+		/* UNMAP block descriptors, as bs_hyc passes them on */
+		for (i = 0; i + 16 <= req->length; i += 16) {
+			uint8_t *desc = (uint8_t *) req->bufp + i;
+
+			sim_zero(vmdk,
+				get_unaligned_be64(desc) << vmdk->blk_shift,
+				(uint64_t) get_unaligned_be32(desc + 8) <<
+				vmdk->blk_shift);
+		}
+		break;
+	case SIM_SYNC:
+		if (conf.data == SIM_DATA_FILE)
+			ret = fdatasync(vmdk->fd);
+		break;
+	}
+
+	if (ret < 0 || (conf.data == SIM_DATA_FILE &&
+			(req->op == SIM_READ || req->op == SIM_WRITE) &&
+			ret != req->length))
+		return -EIO;
+	return 0;
+}
+
+static void sim_account(struct hyc_sim_vmdk *vmdk, struct hyc_sim_req *req,
+		uint64_t now)
+{
+	vmdk_stats_t *st = &vmdk->stats;
+	uint64_t lat = now - req->submit;
+
+	st->pending--;
+	switch (req->op) {
+	case SIM_READ:
+		vmdk->read_lat_sum += lat;
+		if (req->result)
+			st->read_failed++;
+		else
+			st->read_bytes += req->length;
+		st->read_latency = vmdk->read_lat_sum / ++vmdk->read_done;
+		break;
+	case SIM_WRITE:
+		vmdk->write_lat_sum += lat;
+		if (req->result)
+			st->write_failed++;
+		else
+			st->write_bytes += req->length;
+		st->write_latency = vmdk->write_lat_sum / ++vmdk->write_done;
+		break;
+	case SIM_TRUNCATE:
+		vmdk->truncate_lat_sum += lat;
+		if (req->result)
+			st->truncate_failed++;
+		st->truncate_latency = vmdk->truncate_lat_sum /
+			++vmdk->truncate_done;
+		break;
+	}
+}
+
+static void sim_wait_until(struct hyc_sim_vmdk *vmdk, uint64_t usec)
+{
+	struct timespec ts = {
+		.tv_sec = usec / 1000000,
+		.tv_nsec = (usec % 1000000) * 1000,
+	};
+
+	pthread_cond_timedwait(&vmdk->cond, &vmdk->lock, &ts);
+}
+
+static void *sim_thread_fn(void *arg)
+{
+	struct hyc_sim_vmdk *vmdk = arg;
+	struct hyc_sim_req *req, *tmp;
+	uint64_t now;
+
+	pthread_mutex_lock(&vmdk->lock);
+	while (!vmdk->stop) {
+		now = sim_now();
+
+		if (conf.stall_every && now >= vmdk->next_stall) {
+			uint64_t end = vmdk->next_stall + conf.stall_len;
+
+			vmdk->next_stall += conf.stall_every;
+			while (!vmdk->stop && sim_now() < end)
+				sim_wait_until(vmdk, end);
+			continue;
+		}
+
+		if (!vmdk->nr_heap) {
+			pthread_cond_wait(&vmdk->cond, &vmdk->lock);
+			continue;
+		}
+		if (vmdk->heap[0]->due > now) {
+			uint64_t wake = vmdk->heap[0]->due;
+
+			if (conf.stall_every && vmdk->next_stall < wake)
+				wake = vmdk->next_stall;
+			sim_wait_until(vmdk, wake);
+			continue;
+		}
+
+		while (vmdk->nr_heap && vmdk->heap[0]->due <= now) {
+			list_add_tail(&vmdk->heap[0]->list, &vmdk->inflight);
+			heap_remove(vmdk, 0);
+		}
+		pthread_mutex_unlock(&vmdk->lock);
+
+		list_for_each_entry(req, &vmdk->inflight, list) {
+			int32_t result = sim_do_io(vmdk, req);
+
+			if (!req->result)
+				req->result = result;
+		}
+
+		pthread_mutex_lock(&vmdk->lock);
+		now = sim_now();
+		list_for_each_entry_safe(req, tmp, &vmdk->inflight, list) {
+			sim_account(vmdk, req, now);
+			list_del(&req->list);
+			list_add_tail(&req->list, &vmdk->done);
+		}
+		eventfd_write(vmdk->efd, 1);
+	}
+	pthread_mutex_unlock(&vmdk->lock);
+
+	return NULL;
+}
+
+static RequestID sim_schedule(VmdkHandle handle, const void *privatep,
+		int op, char *bufp, size_t length, int64_t offset)
+{
+	struct hyc_sim_vmdk *vmdk = handle;
+	struct hyc_sim_req *req;
+	vmdk_stats_t *st;
+	uint64_t mean;
+	RequestID id;
+
+	if (vmdk == kInvalidVmdkHandle)
+		return kInvalidRequestID;
+	if ((op == SIM_READ || op == SIM_WRITE) && (offset < 0 ||
+			offset > vmdk->size || length > vmdk->size - offset)) {
+		eprintf("%s: request past the end, offset:%" PRId64
+			" length:%zu\n", vmdk->vmdkid, offset, length);
+		return kInvalidRequestID;
+	}
+
+	req = zalloc(sizeof(*req));
+	if (!req)
+		return kInvalidRequestID;
+	req->privatep = privatep;
+	req->op = op;
+	req->bufp = bufp;
+	req->length = length;
+	req->offset = offset;
+
+	pthread_mutex_lock(&vmdk->lock);
+	req->id = id = ++vmdk->next_id;
+	req->submit = sim_now();
+
+	mean = op == SIM_READ ? conf.read_lat : conf.write_lat;
+	req->due = req->submit + sim_latency(vmdk, mean);
+	if (!conf.reorder) {
+		if (req->due < vmdk->last_due)
+			req->due = vmdk->last_due;
+		vmdk->last_due = req->due;
+	}
+	if (conf.error_ppm && sim_rand(vmdk) * 1000000 < conf.error_ppm)
+		req->result = -EIO;
+
+	if (heap_push(vmdk, req)) {
+		pthread_mutex_unlock(&vmdk->lock);
+		free(req);
+		return kInvalidRequestID;
+	}
+
+	st = &vmdk->stats;
+	st->pending++;
+	st->rpc_requests_scheduled++;
+	switch (op) {
+	case SIM_READ:
+		st->read_requests++;
+		break;
+	case SIM_WRITE:
+		st->write_requests++;
+		break;
+	case SIM_TRUNCATE:
+		st->truncate_requests++;
+		break;
+	}
+
+	if (vmdk->heap[0] == req)
+		pthread_cond_signal(&vmdk->cond);
+	pthread_mutex_unlock(&vmdk->lock);
+
+	return id;
+}
+
+static int sim_data_open(struct hyc_sim_vmdk *vmdk)
+{
+	char path[PATH_MAX];
+
+	switch (conf.data) {
+	case SIM_DATA_MEM:
+		/* untouched pages read as zero and cost nothing */
+		vmdk->mem = mmap(NULL, vmdk->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (vmdk->mem == MAP_FAILED) {
+			vmdk->mem = NULL;
+			return -errno;
+		}
+		break;
+	case SIM_DATA_FILE:
+		snprintf(path, sizeof(path), "%s/hyc-sim-%s", conf.dir,
+			vmdk->vmdkid);
+		vmdk->fd = open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+		if (vmdk->fd < 0)
+			return -errno;
+		if (ftruncate(vmdk->fd, vmdk->size) < 0)
+			return -errno;
+		break;
+	}
+	return 0;
+}
+
+static void sim_vmdk_free(struct hyc_sim_vmdk *vmdk)
+{
+	struct hyc_sim_req *req, *tmp;
+
+	while (vmdk->nr_heap)
+		free(vmdk->heap[--vmdk->nr_heap]);
+	list_for_each_entry_safe(req, tmp, &vmdk->done, list)
+		free(req);
+	free(vmdk->heap);
+	if (vmdk->mem)
+		munmap(vmdk->mem, vmdk->size);
+	if (vmdk->fd >= 0)
+		close(vmdk->fd);
+	pthread_cond_destroy(&vmdk->cond);
+	pthread_mutex_destroy(&vmdk->lock);
+	free(vmdk->vmdkid);
+	free(vmdk);
+}
+
+int HycStorInitialize(int argc, char **argv, char *stord_ip,
+		uint16_t stord_port)
+{
+	pthread_once(&conf_once, hyc_sim_conf_init);
+	return 0;
+}
+
+int HycStorRpcServerConnect(void)
+{
+	return 0;
+}
+
+void HycSetBatchingAttributes(int adaptive_batch, int wan_latency,
+		int batch_incr_val, int batch_decr_pct, int system_load_factor,
+		int max_batch_size)
+{
+}
+
+void HycSetDeploymentTarget(enum HycDeploymentTarget target)
+{
+}
+
+int HycOpenVmdk(const char *vmid, const char *vmdkid, uint64_t lun_size,
+		uint32_t lun_blk_shift, int eventfd, VmdkHandle *handlep)
+{
+	struct hyc_sim_vmdk *vmdk;
+	pthread_condattr_t attr;
+	int ret;
+
+	pthread_once(&conf_once, hyc_sim_conf_init);
+
+	vmdk = zalloc(sizeof(*vmdk));
+	if (!vmdk)
+		return -ENOMEM;
+	vmdk->vmdkid = strdup(vmdkid);
+	vmdk->size = lun_size;
+	vmdk->blk_shift = lun_blk_shift ? : 9;
+	vmdk->efd = eventfd;
+	vmdk->fd = -1;
+	INIT_LIST_HEAD(&vmdk->inflight);
+	INIT_LIST_HEAD(&vmdk->done);
+	srand48_r(conf.seed, &vmdk->rand);
+	vmdk->next_stall = sim_now() + conf.stall_every;
+
+	pthread_mutex_init(&vmdk->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&vmdk->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	ret = vmdk->vmdkid ? sim_data_open(vmdk) : -ENOMEM;
+	if (ret) {
+		eprintf("%s: failed to set up the data, %d\n", vmdkid, ret);
+		sim_vmdk_free(vmdk);
+		return ret;
+	}
+
+	ret = pthread_create(&vmdk->thread, NULL, sim_thread_fn, vmdk);
+	if (ret) {
+		sim_vmdk_free(vmdk);
+		return -ret;
+	}
+
+	pthread_mutex_lock(&vmdks_lock);
+	list_add_tail(&vmdk->list, &vmdks);
+	pthread_mutex_unlock(&vmdks_lock);
+
+	eprintf("%s/%s opened, %" PRIu64 " bytes\n", vmid, vmdkid, lun_size);
+	*handlep = vmdk;
+	return 0;
+}
+
+void HycCloseVmdk(VmdkHandle handle)
+{
+	struct hyc_sim_vmdk *vmdk = handle;
+
+	if (vmdk == kInvalidVmdkHandle)
+		return;
+
+	pthread_mutex_lock(&vmdks_lock);
+	list_del(&vmdk->list);
+	pthread_mutex_unlock(&vmdks_lock);
+
+	pthread_mutex_lock(&vmdk->lock);
+	vmdk->stop = 1;
+	pthread_cond_signal(&vmdk->cond);
+	pthread_mutex_unlock(&vmdk->lock);
+	pthread_join(vmdk->thread, NULL);
+
+	sim_vmdk_free(vmdk);
+}
+
+RequestID HycScheduleRead(VmdkHandle handle, const void *privatep,
+		char *bufp, size_t length, int64_t offset)
+{
+	return sim_schedule(handle, privatep, SIM_READ, bufp, length, offset);
+}
+
+RequestID HycScheduleWrite(VmdkHandle handle, const void *privatep,
+		char *bufp, size_t length, int64_t offset)
+{
+	return sim_schedule(handle, privatep, SIM_WRITE, bufp, length, offset);
+}
+
+RequestID HycScheduleTruncate(VmdkHandle handle, const void *privatep,
+		char *bufp, size_t length)
+{
+	return sim_schedule(handle, privatep, SIM_TRUNCATE, bufp, length, 0);
+}
+
+RequestID HycScheduleSyncCache(VmdkHandle handle, const void *privatep,
+		uint64_t offset, uint64_t length)
+{
+	return sim_schedule(handle, privatep, SIM_SYNC, NULL, length, offset);
+}
+
+/*
+ * A request that hasn't completed yet is dropped and never reported,
+ * the caller completes the command itself. Completed ones can't be
+ * aborted any more.
+ */
+RequestID HycScheduleAbort(VmdkHandle handle, const void *privatep)
+{
+	struct hyc_sim_vmdk *vmdk = handle;
+	RequestID id = kInvalidRequestID;
+	uint32_t i;
+
+	if (vmdk == kInvalidVmdkHandle)
+		return kInvalidRequestID;
+
+	pthread_mutex_lock(&vmdk->lock);
+	for (i = 0; i < vmdk->nr_heap; i++) {
+		struct hyc_sim_req *req = vmdk->heap[i];
+
+		if (req->privatep != privatep)
+			continue;
+		id = req->id;
+		heap_remove(vmdk, i);
+		vmdk->stats.pending--;
+		free(req);
+		break;
+	}
+	pthread_mutex_unlock(&vmdk->lock);
+
+	return id;
+}
+
+uint32_t HycGetCompleteRequests(VmdkHandle handle,
+		struct RequestResult *resultsp, uint32_t nr_results,
+		bool *has_morep)
+{
+	struct hyc_sim_vmdk *vmdk = handle;
+	struct hyc_sim_req *req, *tmp;
+	uint32_t nr = 0;
+
+	pthread_mutex_lock(&vmdk->lock);
+	list_for_each_entry_safe(req, tmp, &vmdk->done, list) {
+		if (nr == nr_results)
+			break;
+		resultsp[nr].privatep = req->privatep;
+		resultsp[nr].request_id = req->id;
+		resultsp[nr].result = req->result;
+		nr++;
+		list_del(&req->list);
+		free(req);
+	}
+	*has_morep = !list_empty(&vmdk->done);
+	pthread_mutex_unlock(&vmdk->lock);
+
+	return nr;
+}
+
+int HycGetAllScheduledRequests(VmdkHandle handle,
+		struct ScheduledRequest **requestsp, uint32_t *nr_requestsp)
+{
+	struct hyc_sim_vmdk *vmdk = handle;
+	struct ScheduledRequest *requests;
+	struct hyc_sim_req *req;
+	uint32_t i, nr = 0;
+
+	pthread_mutex_lock(&vmdk->lock);
+	list_for_each_entry(req, &vmdk->inflight, list)
+		nr++;
+	list_for_each_entry(req, &vmdk->done, list)
+		nr++;
+	nr += vmdk->nr_heap;
+
+	/* never NULL, bs_hyc takes that for a failure */
+	requests = calloc(nr ? : 1, sizeof(*requests));
+	if (!requests) {
+		pthread_mutex_unlock(&vmdk->lock);
+		return -ENOMEM;
+	}
+
+	nr = 0;
+	for (i = 0; i < vmdk->nr_heap; i++) {
+		requests[nr].privatep = vmdk->heap[i]->privatep;
+		requests[nr++].request_id = vmdk->heap[i]->id;
+	}
+	list_for_each_entry(req, &vmdk->inflight, list) {
+		requests[nr].privatep = req->privatep;
+		requests[nr++].request_id = req->id;
+	}
+	list_for_each_entry(req, &vmdk->done, list) {
+		requests[nr].privatep = req->privatep;
+		requests[nr++].request_id = req->id;
+	}
+	pthread_mutex_unlock(&vmdk->lock);
+
+	*requestsp = requests;
+	*nr_requestsp = nr;
+	return 0;
+}
+
+int HycGetVmdkStats(const char *vmdkid, vmdk_stats_t *stats)
+{
+	struct hyc_sim_vmdk *vmdk;
+	int ret = -ENOENT;
+
+	pthread_mutex_lock(&vmdks_lock);
+	list_for_each_entry(vmdk, &vmdks, list) {
+		if (strcmp(vmdk->vmdkid, vmdkid))
+			continue;
+		pthread_mutex_lock(&vmdk->lock);
+		*stats = vmdk->stats;
+		pthread_mutex_unlock(&vmdk->lock);
+		ret = 0;
+		break;
+	}
+	pthread_mutex_unlock(&vmdks_lock);
+
+	return ret;
+}
+
+int HycGetComponentStats(component_stats_t *stats)
+{
+	vmdk_stats_t *sum = &stats->vmdk_stats;
+	struct hyc_sim_vmdk *vmdk;
+	uint64_t rd_lat = 0, wr_lat = 0, tr_lat = 0;
+	uint64_t rd_done = 0, wr_done = 0, tr_done = 0;
+
+	pthread_mutex_lock(&vmdks_lock);
+	list_for_each_entry(vmdk, &vmdks, list) {
+		vmdk_stats_t *st = &vmdk->stats;
+
+		pthread_mutex_lock(&vmdk->lock);
+		sum->read_requests += st->read_requests;
+		sum->read_failed += st->read_failed;
+		sum->read_bytes += st->read_bytes;
+		sum->write_requests += st->write_requests;
+		sum->write_failed += st->write_failed;
+		sum->write_bytes += st->write_bytes;
+		sum->truncate_requests += st->truncate_requests;
+		sum->truncate_failed += st->truncate_failed;
+		sum->pending += st->pending;
+		sum->rpc_requests_scheduled += st->rpc_requests_scheduled;
+		rd_lat += vmdk->read_lat_sum;
+		wr_lat += vmdk->write_lat_sum;
+		tr_lat += vmdk->truncate_lat_sum;
+		rd_done += vmdk->read_done;
+		wr_done += vmdk->write_done;
+		tr_done += vmdk->truncate_done;
+		pthread_mutex_unlock(&vmdk->lock);
+	}
+	pthread_mutex_unlock(&vmdks_lock);
+
+	/* average latencies in us, like the per vmdk ones */
+	if (rd_done)
+		sum->read_latency = rd_lat / rd_done;
+	if (wr_done)
+		sum->write_latency = wr_lat / wr_done;
+	if (tr_done)
+		sum->truncate_latency = tr_lat / tr_done;
+	return 0;
+}
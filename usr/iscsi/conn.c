@@ -28,6 +28,7 @@
 #include "iscsid.h"
 #include "tgtd.h"
 #include "util.h"
+#include "work.h"
 #include "tgtadm_error.h"
 
 void conn_add_to_session(struct iscsi_connection *conn, struct iscsi_session *session)
@@ -64,6 +65,8 @@ int conn_init(struct iscsi_connection *conn)
 	INIT_LIST_HEAD(&conn->clist);
 	INIT_LIST_HEAD(&conn->tx_clist);
 	INIT_LIST_HEAD(&conn->task_list);
+	INIT_LIST_HEAD(&conn->retained_list);
+	INIT_LIST_HEAD(&conn->retain_work.entry);
 
 	return 0;
 }
@@ -85,9 +88,57 @@ void conn_exit(struct iscsi_connection *conn)
 		session_put(session);
 }
 
+/* commands are left in place if the connection retains its tasks */
+static void conn_free_pending(struct iscsi_connection *conn, int keep_cmds)
+{
+	struct iscsi_session *session = conn->session;
+	struct iscsi_task *task;
+	int i;
+
+	for (i = 0; session->nr_pending_cmds && i < ISCSI_CMDSN_WINDOW; i++) {
+		task = session->pending_cmd_ring[i];
+		if (!task || task->conn != conn)
+			continue;
+		if (keep_cmds && task_opcode(task) == ISCSI_OP_SCSI_CMD)
+			continue;
+		eprintf("Forcing release of pending task %p %" PRIx64 "\n",
+			task, task->tag);
+		session->pending_cmd_ring[i] = NULL;
+		session->nr_pending_cmds--;
+		iscsi_free_task(task);
+	}
+}
+
+/*
+ * DefaultTime2Retain is up and nobody reassigned what was left of the
+ * connection. Commands still in SCSI are freed as they complete.
+ */
+static void conn_retain_expire(void *data)
+{
+	struct iscsi_connection *conn = data;
+	struct iscsi_task *task, *tmp;
+
+	conn->retain_expired = 1;
+
+	conn_free_pending(conn, 0);
+
+	list_for_each_entry_safe(task, tmp, &conn->task_list, c_siblings) {
+		if (task_in_scsi(task))
+			continue;
+		list_del_init(&task->c_list);
+		if (task_done(task))
+			iscsi_free_cmd_task(task);
+		else
+			iscsi_free_task(task);
+	}
+
+	conn_put(conn);
+}
+
 void conn_close(struct iscsi_connection *conn)
 {
 	struct iscsi_task *task, *tmp;
+	int retain, orphans = 0;
 	int ret;
 
 	if (conn->closed) {
@@ -112,17 +163,12 @@ void conn_close(struct iscsi_connection *conn)
 
 	/*
 	 * We just closed the ep so we are not going to send/recv anything.
-	 * Just free these up since they are not going to complete.
+	 * Just free these up since they are not going to complete, unless
+	 * ErrorRecoveryLevel 2 lets another connection take over the
+	 * SCSI commands.
 	 */
-	list_for_each_entry_safe(task, tmp, &conn->session->pending_cmd_list,
-				 c_list) {
-		if (task->conn != conn)
-			continue;
-		eprintf("Forcing release of pending task %p %" PRIx64 "\n",
-			task, task->tag);
-		list_del(&task->c_list);
-		iscsi_free_task(task);
-	}
+	retain = conn_retains_tasks(conn);
+	conn_free_pending(conn, retain);
 
 	if (conn->tx_task) {
 		dprintf("Add current tx task to the tx list for removal "
@@ -137,6 +183,18 @@ void conn_close(struct iscsi_connection *conn)
 
 		op = task->req.opcode & ISCSI_OPCODE_MASK;
 
+		if (task_reject(task)) {
+			iscsi_free_task(task);
+			continue;
+		}
+
+		if (retain && op == ISCSI_OP_SCSI_CMD) {
+			/* picked up by TASK REASSIGN or conn_retain_expire */
+			list_del_init(&task->c_list);
+			clear_task_r2t_queued(task);
+			continue;
+		}
+
 		eprintf("Forcing release of tx task %p %" PRIx64 " %x\n",
 			task, task->tag, op);
 		switch (op) {
@@ -179,7 +237,9 @@ void conn_close(struct iscsi_connection *conn)
 		}
 	}
 
-	if (conn->rx_task) {
+	/* a write waiting for the rest of its data is kept when retaining */
+	if (conn->rx_task && (!retain ||
+	    (conn->req.bhs.opcode & ISCSI_OPCODE_MASK) != ISCSI_OP_SCSI_DATA_OUT)) {
 		eprintf("Forcing release of rx task %p %" PRIx64 "\n",
 			conn->rx_task, conn->rx_task->tag);
 		iscsi_free_task(conn->rx_task);
@@ -195,12 +255,45 @@ void conn_close(struct iscsi_connection *conn)
 		
 		if (task_in_scsi(task))
 			continue;
+		if (retain && task_opcode(task) == ISCSI_OP_SCSI_CMD) {
+			orphans++;
+			continue;
+		}
 		iscsi_free_task(task);
 	}
+
+	if (retain) {
+		/* released in conn_retain_expire */
+		conn_get(conn);
+		conn->retain_work.func = conn_retain_expire;
+		conn->retain_work.data = conn;
+		add_work(&conn->retain_work,
+			 conn->session_param[ISCSI_PARAM_DEFAULTTIME2RETAIN].val);
+		dprintf("retaining %d tasks of %p for %d seconds\n", orphans,
+			conn,
+			conn->session_param[ISCSI_PARAM_DEFAULTTIME2RETAIN].val);
+	}
 done:
 	conn_put(conn);
 }
 
+/*
+ * Close a connection for good, e.g. on session reinstatement: its
+ * commands are not kept for TASK REASSIGN, and any a dropped
+ * connection still holds are let go now.
+ */
+void conn_drop(struct iscsi_connection *conn)
+{
+	if (!conn->closed) {
+		conn->retain_expired = 1;
+		conn_close(conn);
+	} else if (!list_empty(&conn->retain_work.entry)) {
+		del_work(&conn->retain_work);
+		conn_retain_expire(conn);
+	} else
+		conn->retain_expired = 1;
+}
+
 void conn_put(struct iscsi_connection *conn)
 {
 	conn->refcount--;
@@ -219,14 +312,29 @@ struct iscsi_connection *conn_find(struct iscsi_session *session, uint32_t cid)
 {
 	struct iscsi_connection *conn;
 
+	/* a closed connection may linger while its tasks are retained */
 	list_for_each_entry(conn, &session->conn_list, clist) {
-		if (conn->cid == cid)
+		if (conn->cid == cid && !conn->closed)
 			return conn;
 	}
 
 	return NULL;
 }
 
+/* connections of the session that are not on their way out */
+int session_conn_count(struct iscsi_session *session)
+{
+	struct iscsi_connection *conn;
+	int count = 0;
+
+	list_for_each_entry(conn, &session->conn_list, clist) {
+		if (!conn->closed && conn->state != STATE_CLOSE)
+			count++;
+	}
+
+	return count;
+}
+
 int conn_take_fd(struct iscsi_connection *conn)
 {
 	dprintf("%u %u %u %" PRIx64 "\n", conn->cid, conn->stat_sn,
@@ -308,4 +416,6 @@ void iscsi_update_conn_stats_tx(struct iscsi_connection *conn, int size, int opc
 		conn->stats.datain_pdus++;
 	else if (opcode == ISCSI_OP_SCSI_CMD_RSP)
 		conn->stats.scsirsp_pdus++;
+	else if (opcode == ISCSI_OP_R2T)
+		conn->stats.r2t_pdus++;
 }
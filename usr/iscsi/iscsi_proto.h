@@ -535,17 +535,25 @@ struct iscsi_logout_rsp {
 struct iscsi_snack {
 	uint8_t opcode;
 	uint8_t flags;
-	uint8_t rsvd2[14];
+	uint8_t rsvd2[2];
+	uint8_t hlength;
+	uint8_t dlength[3];
+	uint8_t lun[8];
 	uint32_t itt;
+	uint32_t ttt;	/* or SNACK Tag */
+	uint32_t rsvd3;
+	uint32_t exp_statsn;
+	uint8_t rsvd4[8];
 	uint32_t begrun;
 	uint32_t runlength;
-	uint32_t exp_statsn;
-	uint32_t rsvd3;
-	uint32_t exp_datasn;
-	uint8_t rsvd6[8];
 };
 
 /* SNACK PDU flags */
+#define ISCSI_FLAG_SNACK_TYPE_DATA	0
+#define ISCSI_FLAG_SNACK_TYPE_R2T	0
+#define ISCSI_FLAG_SNACK_TYPE_STATUS	1
+#define ISCSI_FLAG_SNACK_TYPE_DATA_ACK	2
+#define ISCSI_FLAG_SNACK_TYPE_RDATA	3
 #define ISCSI_FLAG_SNACK_TYPE_MASK	0x0F	/* 4 bits */
 
 /* Reject Message Header */
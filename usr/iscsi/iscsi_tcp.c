@@ -39,6 +39,7 @@
 #include "work.h"
 
 static void iscsi_tcp_event_handler(int fd, int events, void *data);
+static void iscsi_tcp_sched_handler(struct event_data *tev);
 static void iscsi_tcp_release(struct iscsi_connection *conn);
 static struct iscsi_task *iscsi_tcp_alloc_task(struct iscsi_connection *conn,
 						size_t ext_len);
@@ -52,6 +53,14 @@ static struct iscsi_transport iscsi_tcp;
 #define USE_NET_IN_STREAM 1
 #define USE_NET_OUT_STREAM 1
 
+/*
+ * What one connection may move in each direction per wakeup. The rest
+ * is picked up from a sched event after every other ready fd has had
+ * its turn, so a streaming neighbour can't starve small I/O.
+ */
+#define ISCSI_TCP_PDU_BUDGET	32
+#define ISCSI_TCP_BYTE_BUDGET	(1U << 20)
+
 static inline struct iscsi_tcp_connection *TCP_CONN(struct iscsi_connection *conn)
 {
 	return container_of(conn, struct iscsi_tcp_connection, iscsi_conn);
@@ -86,7 +95,8 @@ static void iscsi_tcp_nop_work_handler(void *data)
 	struct iscsi_tcp_connection *tcp_conn;
 
 	list_for_each_entry(tcp_conn, &iscsi_tcp_conn_list, tcp_conn_siblings) {
-		if (tcp_conn->nop_interval == 0)
+		/* a closed connection may linger while its tasks are retained */
+		if (tcp_conn->nop_interval == 0 || tcp_conn->iscsi_conn.closed)
 			continue;
 
 		tcp_conn->nop_tick--;
@@ -276,7 +286,10 @@ static void accept_connection(int afd, int events, void *data)
 
 	conn_read_pdu(conn);
 	set_non_blocking(fd);
+	tgt_init_sched_event(&tcp_conn->sched_ev, iscsi_tcp_sched_handler,
+			     conn);
 
+	tcp_conn->ep_events = EPOLLIN;
 	ret = tgt_event_add(fd, EPOLLIN, iscsi_tcp_event_handler, conn);
 	if (ret) {
 		conn_exit(conn);
@@ -292,16 +305,88 @@ out:
 	return;
 }
 
+static void iscsi_tcp_set_events(struct iscsi_connection *conn, int events)
+{
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+	int ret;
+
+	if (tcp_conn->ep_events == events)
+		return;
+
+	ret = tgt_event_modify(tcp_conn->fd, events);
+	if (ret)
+		eprintf("tgt_event_modify failed\n");
+	tcp_conn->ep_events = events;
+	conn->tx_event_mods++;
+}
+
+/*
+ * Completions and NOP-Ins ask for EPOLLOUT once per queued response.
+ * In full feature phase that is turned into a flush from the sched
+ * event, which runs once the current epoll batch has been handled, so
+ * a burst of completions costs one send pass and no epoll_ctl.
+ */
+static void iscsi_event_modify(struct iscsi_connection *conn, int events)
+{
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+
+	if (conn->state == STATE_SCSI && events & EPOLLOUT &&
+	    !(events & EPOLLERR)) {
+		/* already armed, or a flush is already on its way */
+		if (!((tcp_conn->ep_events | tcp_conn->sched_events) &
+		      EPOLLOUT)) {
+			conn->tx_kicks++;
+			tcp_conn->sched_events |= EPOLLOUT;
+			tgt_add_sched_event(&tcp_conn->sched_ev);
+		}
+		return;
+	}
+
+	iscsi_tcp_set_events(conn, events);
+}
+
+static void iscsi_tcp_sched_handler(struct event_data *tev)
+{
+	struct iscsi_connection *conn = tev->data;
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+	int events = tcp_conn->sched_events;
+
+	tcp_conn->sched_events = 0;
+	iscsi_tcp_event_handler(tcp_conn->fd, events, conn);
+}
+
 static void iscsi_tcp_event_handler(int fd, int events, void *data)
 {
 	struct iscsi_connection *conn = (struct iscsi_connection *) data;
+	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
+	uint64_t start;
+	int pdus;
+
+	if (conn->login_parked) {
+		/* only hangups are watched while login waits on a redirect */
+		conn->state = STATE_CLOSE;
+		conn_close(conn);
+		return;
+	}
 
 	if (events & EPOLLIN) {
 #ifndef USE_NET_IN_STREAM
 		iscsi_rx_handler(conn);
 #else
+		start = conn->stats.rxdata_octets;
+		pdus = 0;
 		do {
+			/* a pass handles at most one PDU */
 			iscsi_rx_handler(conn);
+			if (conn->state == STATE_CLOSE || conn->login_parked)
+				break;
+			if (++pdus >= ISCSI_TCP_PDU_BUDGET ||
+			    conn->stats.rxdata_octets - start >=
+			    ISCSI_TCP_BYTE_BUDGET) {
+				if (net_is_has_data(conn->in_stream))
+					tcp_conn->sched_events |= EPOLLIN;
+				break;
+			}
 		} while (net_is_has_data(conn->in_stream));
 #endif
 	}
@@ -315,8 +400,17 @@ static void iscsi_tcp_event_handler(int fd, int events, void *data)
 		iscsi_tx_handler(conn);
 #else
 		int rc = 0;
+
+		start = conn->stats.txdata_octets;
+		pdus = 1;
 		iscsi_tx_handler(conn);
 		while (rc == 0 && conn->state == STATE_SCSI) {
+			if (pdus++ >= ISCSI_TCP_PDU_BUDGET ||
+			    conn->stats.txdata_octets - start >=
+			    ISCSI_TCP_BYTE_BUDGET) {
+				tcp_conn->sched_events |= EPOLLOUT;
+				break;
+			}
 			rc = iscsi_tx_handler(conn);
 		}
 #endif
@@ -330,14 +424,20 @@ static void iscsi_tcp_event_handler(int fd, int events, void *data)
 #ifdef USE_NET_OUT_STREAM
 		if (conn->state == STATE_SCSI) {
 			int events = EPOLLIN;
-			if (conn->tx_size ||
-					!list_empty(&conn->tx_clist) ||
-					net_os_has_data(conn->out_stream)) {
+
+			/*
+			 * Only wait for the socket when it pushed back; queued
+			 * responses are sent from the sched event.
+			 */
+			if (net_os_has_data(conn->out_stream))
 				events |= EPOLLOUT;
-			}
-			conn->tp->ep_event_modify(conn, events);
+			else if (conn->tx_size || !list_empty(&conn->tx_clist))
+				tcp_conn->sched_events |= EPOLLOUT;
+			iscsi_tcp_set_events(conn, events);
 		}
 #endif
+		if (tcp_conn->sched_events)
+			tgt_add_sched_event(&tcp_conn->sched_ev);
 	}
 }
 
@@ -580,6 +680,8 @@ static size_t iscsi_tcp_close(struct iscsi_connection *conn)
 	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
 
 	tgt_event_del(tcp_conn->fd);
+	tgt_remove_sched_event(&tcp_conn->sched_ev);
+	tcp_conn->sched_events = 0;
 	conn->state = STATE_CLOSE;
 	tcp_conn->nop_interval = 0;
 	return 0;
@@ -591,6 +693,7 @@ static void iscsi_tcp_release(struct iscsi_connection *conn)
 
 	conn_exit(conn);
 	close(tcp_conn->fd);
+	tgt_remove_sched_event(&tcp_conn->sched_ev);
 	list_del(&tcp_conn->tcp_conn_siblings);
 	free(tcp_conn);
 }
@@ -622,16 +725,6 @@ static int iscsi_tcp_show(struct iscsi_connection *conn, char *buf, int rest)
 	return total > 0 ? total : 0;
 }
 
-static void iscsi_event_modify(struct iscsi_connection *conn, int events)
-{
-	struct iscsi_tcp_connection *tcp_conn = TCP_CONN(conn);
-	int ret;
-
-	ret = tgt_event_modify(tcp_conn->fd, events);
-	if (ret)
-		eprintf("tgt_event_modify failed\n");
-}
-
 static struct iscsi_task *iscsi_tcp_alloc_task(struct iscsi_connection *conn,
 					size_t ext_len)
 {
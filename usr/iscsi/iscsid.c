@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/epoll.h>
 
@@ -76,6 +77,11 @@ enum {
 	IOSTATE_TX_END,
 };
 
+/* see struct iscsi_task, the hot part of scmd ends at itn_lu_info */
+BUILD_BUG_ON_COLD(struct iscsi_task, r2t_count, 1);
+BUILD_BUG_ON_COLD(struct iscsi_task, stamp, 2);
+BUILD_BUG_ON_COLD(struct iscsi_task, scmd.itn_lu_info, 4);
+
 void conn_read_pdu(struct iscsi_connection *conn)
 {
 	conn->rx_iostate = IOSTATE_RX_BHS;
@@ -256,37 +262,56 @@ static void login_security_done(struct iscsi_connection *conn)
 	struct iscsi_login *req = (struct iscsi_login *)&conn->req.bhs;
 	struct iscsi_login_rsp *rsp = (struct iscsi_login_rsp *) &conn->rsp.bhs;
 	struct iscsi_session *session;
+	struct iscsi_connection *ent;
 
 	if (!conn->tid)
 		return;
 
 	session = session_find_name(conn->tid, conn->initiator, req->isid);
 	if (session) {
+		/* closing its last connection must not free the session */
+		session_get(session);
+
 		if (!req->tsih) {
-			struct iscsi_connection *ent, *next;
+			struct iscsi_connection *next;
 
 			/* do session reinstatement */
-			session_get(session);
 			list_for_each_entry_safe(ent, next, &session->conn_list,
 						 clist) {
-				conn_close(ent);
+				conn_drop(ent);
 			}
-			session_put(session);
-
-			session = NULL;
 		} else if (req->tsih != session->tsih) {
 			/* fail the login */
 			rsp->status_class = ISCSI_STATUS_CLS_INITIATOR_ERR;
 			rsp->status_detail = ISCSI_LOGIN_STATUS_TGT_NOT_FOUND;
 			conn->state = STATE_EXIT;
-			return;
-		} else if (conn_find(session, conn->cid)) {
-			/* do connection reinstatement */
-		}
+		} else if (session_conn_count(session) >=
+			   session->session_param[ISCSI_PARAM_MAXCONNECTIONS].val &&
+			   !conn_find(session, conn->cid)) {
+			rsp->status_class = ISCSI_STATUS_CLS_INITIATOR_ERR;
+			rsp->status_detail = ISCSI_LOGIN_STATUS_CONN_ADD_FAILED;
+			conn->state = STATE_EXIT;
+		} else {
+			/*
+			 * Connection reinstatement. At ErrorRecoveryLevel 2
+			 * the old connection's commands are kept for TASK
+			 * REASSIGN on this one, otherwise it goes for good.
+			 */
+			ent = conn_find(session, conn->cid);
+			if (ent && iscsi_conn_erl(ent) < 2)
+				conn_drop(ent);
+			else if (ent)
+				conn_close(ent);
 
-		/* add a new connection to the session */
-		if (session)
+			/* add a new connection to the session */
 			conn_add_to_session(conn, session);
+
+			/* CmdSN is session wide, StatSN stays per connection */
+			conn->exp_cmd_sn = session->exp_cmd_sn;
+			conn->max_cmd_sn = iscsi_session_max_cmd_sn(session);
+		}
+
+		session_put(session);
 	} else {
 		if (req->tsih) {
 			/* fail the login */
@@ -510,7 +535,20 @@ static void login_start(struct iscsi_connection *conn)
 		conn->tid = target->tid;
 
 		redir = target_redirected(target, conn, buf, &reason);
-		if (redir < 0) {
+		if (redir == -EINPROGRESS) {
+			/*
+			 * Parked until the redirect callback answers, then
+			 * this request is redone by iscsi_login_resume().
+			 * Only hangups are of interest meanwhile.
+			 */
+			free(conn->initiator);
+			conn->initiator = NULL;
+			free(conn->initiator_alias);
+			conn->initiator_alias = NULL;
+			conn->state = STATE_FREE;
+			conn->tp->ep_event_modify(conn, EPOLLRDHUP);
+			return;
+		} else if (redir < 0) {
 			rsp->status_class = ISCSI_STATUS_CLS_TARGET_ERR;
 			rsp->status_detail = ISCSI_LOGIN_STATUS_TARGET_ERROR;
 			conn->state = STATE_EXIT;
@@ -701,6 +739,8 @@ static void cmnd_exec_login(struct iscsi_connection *conn)
 		case STATE_FREE:
 			conn->state = STATE_SECURITY;
 			login_start(conn);
+			if (conn->login_parked)
+				return;
 			if (rsp->status_class)
 				return;
 			/* fall through */
@@ -739,8 +779,14 @@ static void cmnd_exec_login(struct iscsi_connection *conn)
 			conn->state = STATE_LOGIN;
 
 			login_start(conn);
+			if (conn->login_parked)
+				return;
 			if (account_available(conn->tid, AUTH_DIR_INCOMING))
 				goto auth_err;
+			if (rsp->status_class)
+				return;
+			/* no security stage, join an existing session now */
+			login_security_done(conn);
 			if (rsp->status_class)
 				return;
 			text_scan_login(conn);
@@ -996,6 +1042,19 @@ static int cmnd_execute(struct iscsi_connection *conn)
 	return res;
 }
 
+/* the redirect decision is in, redo the login request that was parked */
+void iscsi_login_resume(struct iscsi_connection *conn)
+{
+	conn->login_parked = 0;
+	if (!conn->closed && conn->state != STATE_CLOSE) {
+		conn_write_pdu(conn);
+		conn->tp->ep_event_modify(conn, EPOLLOUT);
+		if (cmnd_execute(conn))
+			conn->state = STATE_CLOSE;
+	}
+	conn_put(conn);
+}
+
 static void cmnd_finish(struct iscsi_connection *conn)
 {
 	switch (conn->state) {
@@ -1078,6 +1137,16 @@ struct iscsi_sense_data {
 	uint8_t  data[0];
 } __packed;
 
+/* a status sent again for a SNACK goes out under its original StatSN */
+static uint32_t iscsi_task_stat_sn(struct iscsi_task *task)
+{
+	if (!task_stat_sn(task)) {
+		task->stat_sn = task->conn->stat_sn++;
+		set_task_stat_sn(task);
+	}
+	return task->stat_sn;
+}
+
 static int iscsi_cmd_rsp_build(struct iscsi_task *task)
 {
 	struct iscsi_connection *conn = task->conn;
@@ -1091,10 +1160,9 @@ static int iscsi_cmd_rsp_build(struct iscsi_task *task)
 	rsp->flags = ISCSI_FLAG_CMD_FINAL;
 	rsp->response = ISCSI_STATUS_CMD_COMPLETED;
 	rsp->cmd_status = scsi_get_result(&task->scmd);
-	rsp->statsn = cpu_to_be32(conn->stat_sn++);
+	rsp->statsn = cpu_to_be32(iscsi_task_stat_sn(task));
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-				     conn->session->max_queue_cmd);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_session_max_cmd_sn(conn->session));
 
 	iscsi_rsp_set_residual(rsp, &task->scmd);
 
@@ -1130,9 +1198,12 @@ static int iscsi_data_rsp_build(struct iscsi_task *task)
 
 	datalen = scsi_get_in_transfer_len(&task->scmd) - task->offset;
 
-	maxdatalen = conn->tp->rdma ?
-		conn->session_param[ISCSI_PARAM_MAX_BURST].val :
-		conn->session_param[ISCSI_PARAM_MAX_XMIT_DLENGTH].val;
+	/* DataSN N starts at N * datain_len, which a Data SNACK relies on */
+	if (!task->datain_len)
+		task->datain_len = conn->tp->rdma ?
+			conn->session_param[ISCSI_PARAM_MAX_BURST].val :
+			conn->session_param[ISCSI_PARAM_MAX_XMIT_DLENGTH].val;
+	maxdatalen = task->datain_len;
 
 	dprintf("%d %d %d %" PRIu32 "%x\n", datalen,
 		scsi_get_in_transfer_len(&task->scmd), task->offset, maxdatalen,
@@ -1147,15 +1218,14 @@ static int iscsi_data_rsp_build(struct iscsi_task *task)
 		    !conn->tp->rdma) {
 			rsp->flags |= ISCSI_FLAG_DATA_STATUS;
 			rsp->cmd_status = result;
-			rsp->statsn = cpu_to_be32(conn->stat_sn++);
+			rsp->statsn = cpu_to_be32(iscsi_task_stat_sn(task));
 			iscsi_set_data_rsp_residual(rsp, &task->scmd);
 		}
 	} else
 		datalen = maxdatalen;
 
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-				     conn->session->max_queue_cmd);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_session_max_cmd_sn(conn->session));
 
 	conn->rsp.datasize = datalen;
 	hton24(rsp->dlength, datalen);
@@ -1167,11 +1237,108 @@ static int iscsi_data_rsp_build(struct iscsi_task *task)
 	return 0;
 }
 
+static uint32_t r2t_ttt;
+
+static struct iscsi_r2t *iscsi_r2t_lookup(struct iscsi_task *task,
+					  uint32_t ttt)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(task->r2t); i++)
+		if (task->r2t[i].length && task->r2t[i].ttt == ttt)
+			return &task->r2t[i];
+	return NULL;
+}
+
+static struct iscsi_r2t *iscsi_r2t_resend(struct iscsi_task *task)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(task->r2t); i++)
+		if (task->r2t[i].length && task->r2t[i].resend)
+			return &task->r2t[i];
+	return NULL;
+}
+
+static struct iscsi_r2t *iscsi_r2t_free_slot(struct iscsi_task *task)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(task->r2t); i++)
+		if (!task->r2t[i].length)
+			return &task->r2t[i];
+	return NULL;
+}
+
+static int iscsi_r2t_needed(struct iscsi_task *task)
+{
+	struct iscsi_cmd *req = (struct iscsi_cmd *) &task->req;
+	struct param *p = task->conn->session_param;
+	int max_r2t;
+
+	max_r2t = min_t(int, p[ISCSI_PARAM_MAX_R2T].val,
+			ISCSI_MAX_R2T_PER_TASK);
+
+	if (task->r2t_offset < ntohl(req->data_length) &&
+	    task->r2t_outstanding < max_r2t)
+		return 1;
+
+	/* R2Ts to send again don't count against MaxOutstandingR2T */
+	return iscsi_r2t_resend(task) != NULL;
+}
+
+/* queue the task for another R2T unless it already is or can't have one */
+static void iscsi_r2t_queue(struct iscsi_task *task)
+{
+	if (task_r2t_queued(task) || !iscsi_r2t_needed(task))
+		return;
+
+	set_task_r2t_queued(task);
+	list_add_tail(&task->c_list, &task->conn->tx_clist);
+}
+
 static int iscsi_r2t_build(struct iscsi_task *task)
 {
 	struct iscsi_connection *conn = task->conn;
 	struct iscsi_r2t_rsp *rsp = (struct iscsi_r2t_rsp *) &conn->rsp.bhs;
-	uint32_t length;
+	struct iscsi_cmd *req = (struct iscsi_cmd *) &task->req;
+	struct iscsi_r2t *r2t;
+
+	clear_task_r2t_queued(task);
+
+	r2t = iscsi_r2t_resend(task);
+	if (r2t) {
+		if (r2t->resend == ISCSI_R2T_RESEND_NEW) {
+			if (++r2t_ttt == ISCSI_RESERVED_TAG)
+				r2t_ttt = 0;
+			r2t->ttt = cpu_to_be32(r2t_ttt);
+			r2t->r2tsn = task->exp_r2tsn++;
+		}
+		r2t->resend = 0;
+		r2t->received = 0;
+		goto build;
+	}
+
+	r2t = iscsi_r2t_free_slot(task);
+	if (!r2t) {
+		eprintf("no free r2t slot %" PRIx64 "\n", task->tag);
+		return -EINVAL;
+	}
+
+	if (++r2t_ttt == ISCSI_RESERVED_TAG)
+		r2t_ttt = 0;
+
+	r2t->ttt = cpu_to_be32(r2t_ttt);
+	r2t->r2tsn = task->exp_r2tsn++;
+	r2t->offset = task->r2t_offset;
+	r2t->length = min_t(uint32_t,
+			    ntohl(req->data_length) - task->r2t_offset,
+			    conn->session_param[ISCSI_PARAM_MAX_BURST].val);
+	r2t->received = 0;
+
+	task->r2t_offset += r2t->length;
+	task->r2t_outstanding++;
+build:
 
 	memset(rsp, 0, sizeof(*rsp));
 
@@ -1180,21 +1347,114 @@ static int iscsi_r2t_build(struct iscsi_task *task)
 	memcpy(rsp->lun, task->req.lun, sizeof(rsp->lun));
 
 	rsp->itt = task->req.itt;
-	rsp->r2tsn = cpu_to_be32(task->exp_r2tsn++);
-	rsp->data_offset = cpu_to_be32(task->offset);
+	rsp->r2tsn = cpu_to_be32(r2t->r2tsn);
+	rsp->data_offset = cpu_to_be32(r2t->offset);
 	/* return next statsn for this conn w/o advancing it */
 	rsp->statsn = cpu_to_be32(conn->stat_sn);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-				     conn->session->max_queue_cmd);
-	rsp->ttt = (unsigned long) task;
-	length = min_t(uint32_t, task->r2t_count,
-		       conn->session_param[ISCSI_PARAM_MAX_BURST].val);
-	rsp->data_length = cpu_to_be32(length);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_session_max_cmd_sn(conn->session));
+	rsp->ttt = r2t->ttt;
+	rsp->data_length = cpu_to_be32(r2t->length);
 
 	return 0;
 }
 
+/*
+ * Adaptive CmdSN window. Every period, about one window's worth of
+ * completions, the average latency is compared to a slowly aging
+ * baseline: if it has grown well past it, or too much command data is
+ * buffered, the window shrinks by a quarter, otherwise it grows by one
+ * if the initiator actually used most of it. MaxCmdSN never moves
+ * backwards, so a smaller window takes effect as ExpCmdSN advances.
+ */
+
+static uint64_t iscsi_inflight_bytes;
+
+static uint64_t iscsi_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static inline uint32_t iscsi_window_floor(struct iscsi_session *session)
+{
+	return min_t(uint32_t, ISCSI_WINDOW_MIN, session->max_queue_cmd);
+}
+
+void iscsi_window_init(struct iscsi_session *session)
+{
+	struct iscsi_window *w = &session->window;
+
+	memset(w, 0, sizeof(*w));
+	w->cur = session->max_queue_cmd;
+	w->max_cmd_sn = session->exp_cmd_sn + w->cur;
+}
+
+uint32_t iscsi_session_max_cmd_sn(struct iscsi_session *session)
+{
+	struct iscsi_window *w = &session->window;
+	uint32_t sn = session->exp_cmd_sn + w->cur;
+
+	if (after(sn, w->max_cmd_sn))
+		w->max_cmd_sn = sn;
+	return w->max_cmd_sn;
+}
+
+static void iscsi_window_start(struct iscsi_task *task)
+{
+	struct iscsi_window *w = &task->conn->session->window;
+
+	task->stamp = iscsi_now();
+	/* the out length shrinks when sbc_rw trims the transfer */
+	task->charged = (uint64_t) scsi_get_in_length(&task->scmd) +
+		scsi_get_out_length(&task->scmd);
+	iscsi_inflight_bytes += task->charged;
+	if (++w->inflight > w->inflight_peak)
+		w->inflight_peak = w->inflight;
+}
+
+static void iscsi_window_done(struct iscsi_task *task, int failed)
+{
+	struct iscsi_session *session = task->conn->session;
+	struct iscsi_window *w = &session->window;
+	uint64_t lat;
+
+	if (!task->stamp)
+		return;
+	lat = iscsi_now() - task->stamp;
+	task->stamp = 0;
+	iscsi_inflight_bytes -= task->charged;
+	w->inflight--;
+	if (failed)
+		return;
+
+	w->lat_sum += lat;
+	if (++w->nr_done < w->cur)
+		return;
+
+	w->lat_avg = w->lat_sum / w->nr_done;
+	if (!w->lat_base || w->lat_avg < w->lat_base)
+		w->lat_base = w->lat_avg;
+	else
+		w->lat_base += (w->lat_avg - w->lat_base) >> 6;
+
+	if (w->lat_avg > 2 * w->lat_base + ISCSI_WINDOW_LAT_SLACK ||
+	    iscsi_inflight_bytes > ISCSI_WINDOW_MEM_HIGH) {
+		w->cur = max(w->cur - w->cur / 4, iscsi_window_floor(session));
+		w->decreases++;
+	} else if (w->cur < session->max_queue_cmd &&
+		   w->inflight_peak >= w->cur - w->cur / 4) {
+		w->cur++;
+		w->increases++;
+	}
+
+	w->nr_done = 0;
+	w->lat_sum = 0;
+	w->inflight_peak = w->inflight;
+}
+
 static struct iscsi_task *iscsi_alloc_task(struct iscsi_connection *conn,
 					   int ext_len, int data_len)
 {
@@ -1233,6 +1493,9 @@ void iscsi_free_task(struct iscsi_task *task)
 	if (task_opcode(task) == ISCSI_OP_SCSI_CMD)
 		list_del(&task->c_hlist);
 
+	if (task_retained(task))
+		list_del(&task->r_list);
+
 	conn->tp->free_data_buf(conn, scsi_get_in_buffer(&task->scmd));
 	conn->tp->free_data_buf(conn, scsi_get_out_buffer(&task->scmd));
 
@@ -1255,22 +1518,77 @@ static inline struct iscsi_task *ITASK(struct scsi_cmd *scmd)
 
 void iscsi_free_cmd_task(struct iscsi_task *task)
 {
-	target_cmd_done(&task->scmd);
+	if (!task_released(task))
+		target_cmd_done(&task->scmd);
 
 	iscsi_free_task(task);
 }
 
+/*
+ * The status went out. Below ErrorRecoveryLevel 1 that is the end of
+ * the task; otherwise it is kept until ExpStatSN says the initiator
+ * has it, in case a SNACK asks for it again.
+ */
+static void iscsi_scsi_cmd_finish(struct iscsi_task *task)
+{
+	struct iscsi_connection *conn = task->conn;
+
+	if (iscsi_conn_erl(conn) < 1) {
+		iscsi_free_cmd_task(task);
+		return;
+	}
+
+	if (!task_released(task)) {
+		target_cmd_done(&task->scmd);
+		set_task_released(task);
+	}
+
+	if (!task_retained(task)) {
+		list_add_tail(&task->r_list, &conn->retained_list);
+		set_task_retained(task);
+	}
+}
+
+/* a task queued for another go at its data or status */
+static inline int iscsi_task_busy(struct iscsi_task *task)
+{
+	return !list_empty(&task->c_list) || task->conn->tx_task == task;
+}
+
+static void iscsi_retained_release(struct iscsi_connection *conn,
+				   uint32_t exp_stat_sn)
+{
+	struct iscsi_task *task, *tmp;
+
+	list_for_each_entry_safe(task, tmp, &conn->retained_list, r_list) {
+		if (!before(task->stat_sn, exp_stat_sn))
+			break;
+		if (!iscsi_task_busy(task))
+			iscsi_free_task(task);
+	}
+}
+
 static int iscsi_scsi_cmd_done(uint64_t nid, int result, struct scsi_cmd *scmd)
 {
 	struct iscsi_task *task = ITASK(scmd);
+	struct iscsi_connection *conn = task->conn;
+
+	iscsi_window_done(task, result != SAM_STAT_GOOD);
+
+	clear_task_in_scsi(task);
+	set_task_done(task);
 
 	/*
-	 * Since the connection is closed we just free the task.
-	 * We could delay the closing of the conn in some cases and send
-	 * the response with a little extra code or we can check if this
-	 * task got reassinged to another connection.
+	 * Since the connection is closed we just free the task, unless
+	 * it waits for a TASK REASSIGN on another connection.
 	 */
-	if (task->conn->state == STATE_CLOSE) {
+	if (conn->state == STATE_CLOSE) {
+		if (conn_retains_tasks(conn)) {
+			/* conn_close() hasn't run yet if it isn't closed */
+			if (!conn->closed)
+				list_add_tail(&task->c_list, &conn->tx_clist);
+			return 0;
+		}
 		iscsi_free_cmd_task(task);
 		return 0;
 	}
@@ -1385,10 +1703,13 @@ static int iscsi_target_cmd_queue(struct iscsi_task *task)
 	scmd->attribute = cmd_attr(task);
 	scmd->tag = req->itt;
 	set_task_in_scsi(task);
+	iscsi_window_start(task);
 
 	err = target_cmd_queue(conn->session->target->tid, scmd);
-	if (err)
+	if (err) {
 		clear_task_in_scsi(task);
+		iscsi_window_done(task, 1);
+	}
 
 	return err;
 }
@@ -1400,15 +1721,17 @@ int iscsi_scsi_cmd_execute(struct iscsi_task *task)
 	int ret = 0;
 
 	if ((req->flags & ISCSI_FLAG_CMD_WRITE) && task->r2t_count) {
-		if (!task->unsol_count)
-			list_add_tail(&task->c_list, &task->conn->tx_clist);
+		/* a retained task's R2Ts are sent once it is reassigned */
+		if (!task->unsol_count && !conn->closed)
+			iscsi_r2t_queue(task);
 		goto no_queuing;
 	}
 
 	task->offset = 0;  /* for use as transmit pointer for data-ins */
 	ret = iscsi_target_cmd_queue(task);
 no_queuing:
-	conn->tp->ep_event_modify(conn, EPOLLIN | EPOLLOUT);
+	if (!conn->closed)
+		conn->tp->ep_event_modify(conn, EPOLLIN | EPOLLOUT);
 	return ret;
 }
 
@@ -1446,6 +1769,87 @@ static int iscsi_tm_done(struct mgmt_req *mreq)
 	return 0;
 }
 
+/*
+ * ErrorRecoveryLevel 2: a command of a dropped connection moves over
+ * to this one. One still in SCSI just completes here, a finished one
+ * sends its data from ExpDataSN and its status again, and a write
+ * still short of data asks for all of it again.
+ */
+static int iscsi_task_reassign(struct iscsi_task *tm)
+{
+	struct iscsi_connection *conn = tm->conn, *old;
+	struct iscsi_tm *req = (struct iscsi_tm *) &tm->req;
+	struct iscsi_cmd *cmd;
+	struct iscsi_task *task;
+	uint32_t len;
+
+	if (iscsi_conn_erl(conn) < 2)
+		return ISCSI_TMF_RSP_NO_FAILOVER;
+
+	list_for_each_entry(task, iscsi_cmd_hash_head(conn->session, req->rtt),
+			    c_hlist) {
+		if (task->tag == req->rtt && task->conn->closed)
+			goto found;
+	}
+
+	list_for_each_entry(task, iscsi_cmd_hash_head(conn->session, req->rtt),
+			    c_hlist) {
+		if (task->tag == req->rtt)
+			return ISCSI_TMF_RSP_TASK_ALLEGIANT;
+	}
+	return ISCSI_TMF_RSP_NO_TASK;
+found:
+	old = task->conn;
+	if (old->retain_expired)
+		return ISCSI_TMF_RSP_NO_TASK;
+
+	dprintf("%" PRIx64 " from cid %u to %u\n", task->tag, old->cid,
+		conn->cid);
+
+	list_del(&task->c_siblings);
+	list_add(&task->c_siblings, &conn->task_list);
+	list_del_init(&task->c_list);
+	clear_task_r2t_queued(task);
+	if (task_retained(task)) {
+		list_del(&task->r_list);
+		clear_task_retained(task);
+	}
+	/* the status gets a StatSN of the new connection */
+	clear_task_stat_sn(task);
+	task->tx_end = 0;
+
+	task->conn = conn;
+	conn_get(conn);
+	conn_put(old);
+
+	/* the TMF response goes out ahead of anything for the task */
+	list_add_tail(&tm->c_list, &conn->tx_clist);
+
+	if (task_done(task)) {
+		len = scsi_get_in_transfer_len(&task->scmd);
+		task->exp_r2tsn = be32_to_cpu(req->exp_datasn);
+		task->offset = task->exp_r2tsn * task->datain_len;
+		if (!task->datain_len || task->offset > len) {
+			task->exp_r2tsn = 0;
+			task->offset = 0;
+		}
+		list_add_tail(&task->c_list, &conn->tx_clist);
+	} else if (!task_in_scsi(task) && !task_pending(task) &&
+		   task->r2t_count) {
+		cmd = (struct iscsi_cmd *) &task->req;
+		task->offset = ntoh24(cmd->dlength);
+		task->r2t_count = ntohl(cmd->data_length) - task->offset;
+		task->r2t_offset = task->offset;
+		task->r2t_outstanding = 0;
+		task->unsol_count = 0;
+		memset(task->r2t, 0, sizeof(task->r2t));
+		iscsi_r2t_queue(task);
+	}
+
+	conn->tp->ep_event_modify(conn, EPOLLIN | EPOLLOUT);
+	return ISCSI_TMF_RSP_COMPLETE;
+}
+
 static int iscsi_tm_execute(struct iscsi_task *task)
 {
 	struct iscsi_connection *conn = task->conn;
@@ -1470,9 +1874,13 @@ static int iscsi_tm_execute(struct iscsi_task *task)
 		break;
 	case ISCSI_TM_FUNC_TARGET_WARM_RESET:
 	case ISCSI_TM_FUNC_TARGET_COLD_RESET:
-	case ISCSI_TM_FUNC_TASK_REASSIGN:
 		err = ISCSI_TMF_RSP_NOT_SUPPORTED;
 		break;
+	case ISCSI_TM_FUNC_TASK_REASSIGN:
+		task->result = iscsi_task_reassign(task);
+		if (task->result == ISCSI_TMF_RSP_COMPLETE)
+			return 0;	/* already queued */
+		return task->result;
 	default:
 		err = ISCSI_TMF_RSP_REJECTED;
 
@@ -1549,6 +1957,7 @@ static int iscsi_task_execute(struct iscsi_task *task)
 static int iscsi_data_out_rx_done(struct iscsi_task *task)
 {
 	struct iscsi_hdr *hdr = &task->conn->req.bhs;
+	struct iscsi_r2t *r2t;
 	int err = 0;
 
 	if (hdr->ttt == cpu_to_be32(ISCSI_RESERVED_TAG)) {
@@ -1561,33 +1970,129 @@ static int iscsi_data_out_rx_done(struct iscsi_task *task)
 		if (!(hdr->flags & ISCSI_FLAG_CMD_FINAL))
 			return err;
 
+		r2t = iscsi_r2t_lookup(task, hdr->ttt);
+		if (r2t && r2t->received < r2t->length) {
+			/* sequence ended short, the data is in order */
+			eprintf("r2t %x of %" PRIx64 " ended at %u of %u\n",
+				be32_to_cpu(r2t->ttt), task->tag,
+				r2t->received, r2t->length);
+			if (iscsi_conn_erl(task->conn) < 1)
+				return -EINVAL;
+			r2t->offset += r2t->received;
+			r2t->length -= r2t->received;
+			r2t->resend = ISCSI_R2T_RESEND_NEW;
+		} else if (r2t) {
+			/* this R2T's sequence is complete, free its slot */
+			r2t->length = 0;
+			task->r2t_outstanding--;
+		}
+
 		err = iscsi_scsi_cmd_execute(task);
 	}
 
 	return err;
 }
 
+static struct iscsi_task *iscsi_task_lookup(struct iscsi_session *session,
+					    uint32_t itt)
+{
+	struct iscsi_task *task;
+
+	list_for_each_entry(task, iscsi_cmd_hash_head(session, itt), c_hlist) {
+		if (task->tag == itt)
+			return task;
+	}
+	return NULL;
+}
+
+/*
+ * ErrorRecoveryLevel 1: a Data-Out that failed its data digest is
+ * dropped and its range asked for again with an R2T of its own.
+ */
+static int iscsi_data_out_recover(struct iscsi_task *task)
+{
+	struct iscsi_data *req = (struct iscsi_data *) &task->conn->req.bhs;
+	uint32_t length = ntoh24(req->dlength);
+	struct iscsi_r2t *r2t;
+
+	/*
+	 * Undo what iscsi_data_out_rx_start counted, but for the R2T the
+	 * PDU came under: the range is owed to the new R2T from now on.
+	 */
+	task->offset -= length;
+	task->r2t_count += length;
+
+	r2t = iscsi_r2t_free_slot(task);
+	if (!r2t) {
+		eprintf("no r2t slot to recover %" PRIx64 "\n", task->tag);
+		return -ENOSPC;
+	}
+
+	r2t->offset = be32_to_cpu(req->offset);
+	r2t->length = length;
+	r2t->received = 0;
+	r2t->resend = ISCSI_R2T_RESEND_NEW;
+	task->r2t_outstanding++;
+
+	/* the rest of the PDU, e.g. the F bit, still counts */
+	return iscsi_data_out_rx_done(task);
+}
+
 static int iscsi_data_out_rx_start(struct iscsi_connection *conn)
 {
 	struct iscsi_task *task;
 	struct iscsi_data *req = (struct iscsi_data *) &conn->req.bhs;
+	struct iscsi_r2t *r2t;
+	uint32_t offset, length;
 
-	list_for_each_entry(task, &conn->session->cmd_list, c_hlist) {
-		if (task->tag == req->itt)
-			goto found;
+	task = iscsi_task_lookup(conn->session, req->itt);
+	if (!task)
+		return -EINVAL;
+
+	/* connection allegiance: data must come on the command's connection */
+	if (task->conn != conn) {
+		eprintf("data out for %" PRIx64 " on cid %u, expected %u\n",
+			task->tag, conn->cid, task->conn->cid);
+		return -EINVAL;
 	}
-	return -EINVAL;
-found:
+
 	dprintf("found a task %" PRIx64 " %u %u %u %u %u\n", task->tag,
 		ntohl(((struct iscsi_cmd *) (&task->req))->data_length),
 		task->offset,
 		task->r2t_count,
 		ntoh24(req->dlength), be32_to_cpu(req->offset));
 
-	conn->req.data = task->data + be32_to_cpu(req->offset);
+	offset = be32_to_cpu(req->offset);
+	length = ntoh24(req->dlength);
 
-	task->offset += ntoh24(req->dlength);
-	task->r2t_count -= ntoh24(req->dlength);
+	if (offset + length >
+	    ntohl(((struct iscsi_cmd *) (&task->req))->data_length)) {
+		eprintf("data out beyond the buffer %" PRIx64 " %u %u\n",
+			task->tag, offset, length);
+		return -EINVAL;
+	}
+
+	if (req->ttt == cpu_to_be32(ISCSI_RESERVED_TAG)) {
+		/* unsolicited data is never asked for by an R2T */
+		if (offset + length > task->r2t_offset)
+			task->r2t_offset = offset + length;
+	} else {
+		/* R2T sequences may be interleaved, match on the TTT */
+		r2t = iscsi_r2t_lookup(task, req->ttt);
+		if (!r2t || offset < r2t->offset ||
+		    offset + length > r2t->offset + r2t->length) {
+			eprintf("data out outside of any r2t %" PRIx64
+				" %x %u %u\n", task->tag, req->ttt, offset,
+				length);
+			return -EINVAL;
+		}
+		r2t->received += length;
+	}
+
+	conn->req.data = task->data + offset;
+
+	task->offset += length;
+	task->r2t_count -= length;
 
 	conn->rx_task = task;
 
@@ -1598,8 +2103,7 @@ static int iscsi_task_queue(struct iscsi_task *task)
 {
 	struct iscsi_session *session = task->conn->session;
 	struct iscsi_hdr *req = (struct iscsi_hdr *) &task->req;
-	uint32_t cmd_sn;
-	struct iscsi_task *ent;
+	uint32_t cmd_sn, slot;
 
 	dprintf("%x %x %x\n", be32_to_cpu(req->statsn), session->exp_cmd_sn,
 		req->opcode);
@@ -1615,14 +2119,15 @@ static int iscsi_task_queue(struct iscsi_task *task)
 		/* Should we close the connection... */
 		iscsi_task_execute(task);
 
-		if (list_empty(&session->pending_cmd_list))
+		if (!session->nr_pending_cmds)
 			return 0;
-		task = list_first_entry(&session->pending_cmd_list,
-					struct iscsi_task, c_list);
-		if (be32_to_cpu(task->req.statsn) != cmd_sn)
+		slot = cmd_sn & (ISCSI_CMDSN_WINDOW - 1);
+		task = session->pending_cmd_ring[slot];
+		if (!task)
 			return 0;
 
-		list_del(&task->c_list);
+		session->pending_cmd_ring[slot] = NULL;
+		session->nr_pending_cmds--;
 		clear_task_pending(task);
 		goto retry;
 	} else {
@@ -1632,14 +2137,26 @@ static int iscsi_task_queue(struct iscsi_task *task)
 			return -EINVAL;
 		}
 
-		/* TODO: check max cmd_sn */
+		/*
+		 * exp_cmd_sn only moves forward and MaxCmdSN never moves
+		 * back, so anything the initiator was allowed to send is
+		 * at most the highest MaxCmdSN advertised.
+		 */
+		if (after(cmd_sn, iscsi_session_max_cmd_sn(session))) {
+			eprintf("cmd_sn beyond max_cmd_sn (%u,%u,%u)\n",
+				cmd_sn, session->exp_cmd_sn,
+				session->window.max_cmd_sn);
+			return -EINVAL;
+		}
 
-		list_for_each_entry(ent, &session->pending_cmd_list, c_list) {
-			if (before(cmd_sn, be32_to_cpu(ent->req.statsn)))
-				break;
+		slot = cmd_sn & (ISCSI_CMDSN_WINDOW - 1);
+		if (session->pending_cmd_ring[slot]) {
+			eprintf("duplicate cmd_sn %u\n", cmd_sn);
+			return -EINVAL;
 		}
 
-		list_add_tail(&task->c_list, &ent->c_list);
+		session->pending_cmd_ring[slot] = task;
+		session->nr_pending_cmds++;
 		set_task_pending(task);
 	}
 	return 0;
@@ -1679,13 +2196,14 @@ static int iscsi_scsi_cmd_rx_start(struct iscsi_connection *conn)
 	if (req->flags & ISCSI_FLAG_CMD_WRITE) {
 		task->offset = ntoh24(req->dlength);
 		task->r2t_count = ntohl(req->data_length) - task->offset;
+		task->r2t_offset = task->offset;
 		task->unsol_count = !(req->flags & ISCSI_FLAG_CMD_FINAL);
 
 		dprintf("%d %d %d %d\n", conn->rx_size, task->r2t_count,
 			task->unsol_count, task->offset);
 	}
 
-	list_add(&task->c_hlist, &conn->session->cmd_list);
+	list_add(&task->c_hlist, iscsi_cmd_hash_head(conn->session, task->tag));
 	return 0;
 }
 
@@ -1730,6 +2248,194 @@ out:
 	return err;
 }
 
+/* full feature phase Reject of the PDU being received */
+static int iscsi_reject_queue(struct iscsi_connection *conn, uint8_t reason)
+{
+	struct iscsi_task *task;
+
+	task = iscsi_alloc_task(conn, 0, 0);
+	if (!task)
+		return -ENOMEM;
+
+	task->result = reason;
+	set_task_reject(task);
+	list_add_tail(&task->c_list, &conn->tx_clist);
+	conn->tp->ep_event_modify(conn, EPOLLIN | EPOLLOUT);
+	return 0;
+}
+
+/*
+ * Returns zero if the PDU could be dropped and the connection carry
+ * on, which takes ErrorRecoveryLevel 1.
+ */
+static int iscsi_data_digest_error(struct iscsi_connection *conn)
+{
+	struct iscsi_task *task = conn->rx_task;
+	int err;
+
+	if (iscsi_conn_erl(conn) < 1 || !task)
+		return -EINVAL;
+
+	switch (conn->req.bhs.opcode & ISCSI_OPCODE_MASK) {
+	case ISCSI_OP_SCSI_DATA_OUT:
+		err = iscsi_data_out_recover(task);
+		if (err)
+			return err;
+		break;
+	case ISCSI_OP_SCSI_CMD:
+	case ISCSI_OP_NOOP_OUT:
+		/* the initiator sends it again with the same CmdSN */
+		iscsi_free_task(task);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	conn->rx_task = NULL;
+	return iscsi_reject_queue(conn, ISCSI_REASON_DATA_DIGEST_ERROR);
+}
+
+/* Data SNACK for a read: send the Data-In PDUs of the run again */
+static int iscsi_snack_data_in(struct iscsi_task *task, uint32_t begrun,
+			       uint32_t runlength)
+{
+	uint32_t len = scsi_get_in_transfer_len(&task->scmd);
+	uint64_t offset = (uint64_t) begrun * task->datain_len;
+
+	/* no datain_len yet means starting over from the first PDU */
+	if (!task_retained(task) || iscsi_task_busy(task) ||
+	    (begrun && !task->datain_len) || offset >= len)
+		return ISCSI_REASON_DATA_SNACK_REJECT;
+
+	task->offset = offset;
+	task->exp_r2tsn = begrun;
+	if (runlength)
+		task->tx_end = min_t(uint64_t, len,
+				     offset + (uint64_t) runlength *
+				     task->datain_len);
+	else
+		task->tx_end = 0;
+
+	list_add_tail(&task->c_list, &task->conn->tx_clist);
+	return 0;
+}
+
+/* R2T SNACK for a write: the R2Ts of the run go out again unchanged */
+static int iscsi_snack_r2t(struct iscsi_task *task, uint32_t begrun,
+			   uint32_t runlength)
+{
+	struct iscsi_r2t *r2t;
+	int i, found = 0;
+
+	for (i = 0; i < ARRAY_SIZE(task->r2t); i++) {
+		r2t = &task->r2t[i];
+		if (!r2t->length || before(r2t->r2tsn, begrun) ||
+		    (runlength && !before(r2t->r2tsn, begrun + runlength)))
+			continue;
+		if (!r2t->resend)
+			r2t->resend = ISCSI_R2T_RESEND_SAME;
+		found++;
+	}
+
+	if (!found)
+		return ISCSI_REASON_DATA_SNACK_REJECT;
+
+	iscsi_r2t_queue(task);
+	return 0;
+}
+
+/* Status SNACK: statuses still retained go out again */
+static int iscsi_snack_status(struct iscsi_connection *conn, uint32_t begrun,
+			      uint32_t runlength)
+{
+	struct iscsi_task *task;
+	uint32_t len, seg;
+	int found = 0;
+
+	list_for_each_entry(task, &conn->retained_list, r_list) {
+		if (before(task->stat_sn, begrun) ||
+		    (runlength && !before(task->stat_sn, begrun + runlength)))
+			continue;
+		if (iscsi_task_busy(task))
+			continue;
+
+		/* a good read carried its status in the last Data-In */
+		len = scsi_get_in_transfer_len(&task->scmd);
+		seg = task->datain_len;
+		if (scsi_get_data_dir(&task->scmd) == DATA_READ && len && seg &&
+		    scsi_get_result(&task->scmd) == SAM_STAT_GOOD &&
+		    !conn->tp->rdma) {
+			task->exp_r2tsn = (len - 1) / seg;
+			task->offset = task->exp_r2tsn * seg;
+		} else
+			task->offset = len;
+		task->tx_end = 0;
+
+		list_add_tail(&task->c_list, &conn->tx_clist);
+		found++;
+	}
+
+	return found ? 0 : ISCSI_REASON_PROTOCOL_ERROR;
+}
+
+static int iscsi_snack_rx_done(struct iscsi_task *snack)
+{
+	struct iscsi_connection *conn = snack->conn;
+	struct iscsi_snack *req = (struct iscsi_snack *) &snack->req;
+	uint32_t begrun = be32_to_cpu(req->begrun);
+	uint32_t runlength = be32_to_cpu(req->runlength);
+	struct iscsi_task *task;
+	int reason = 0;
+
+	if (iscsi_conn_erl(conn) < 1) {
+		reason = ISCSI_REASON_PROTOCOL_ERROR;
+		goto out;
+	}
+
+	switch (req->flags & ISCSI_FLAG_SNACK_TYPE_MASK) {
+	case ISCSI_FLAG_SNACK_TYPE_DATA:
+	case ISCSI_FLAG_SNACK_TYPE_RDATA:
+		task = iscsi_task_lookup(conn->session, req->itt);
+		if (!task || task->conn != conn) {
+			reason = ISCSI_REASON_INVALID_SNACK;
+			break;
+		}
+
+		/* R-Data asks for all of it, segmented for today's limits */
+		if ((req->flags & ISCSI_FLAG_SNACK_TYPE_MASK) ==
+		    ISCSI_FLAG_SNACK_TYPE_RDATA) {
+			if (task_retained(task) && !iscsi_task_busy(task))
+				task->datain_len = 0;
+			begrun = runlength = 0;
+		}
+
+		if (task_done(task))
+			reason = iscsi_snack_data_in(task, begrun, runlength);
+		else if (!task_in_scsi(task) && task->r2t_count)
+			reason = iscsi_snack_r2t(task, begrun, runlength);
+		else
+			reason = ISCSI_REASON_DATA_SNACK_REJECT;
+		break;
+	case ISCSI_FLAG_SNACK_TYPE_STATUS:
+		reason = iscsi_snack_status(conn, begrun, runlength);
+		break;
+	case ISCSI_FLAG_SNACK_TYPE_DATA_ACK:
+		/* we never ask for DataACKs, nothing is held for them */
+		break;
+	default:
+		reason = ISCSI_REASON_INVALID_SNACK;
+		break;
+	}
+out:
+	iscsi_free_task(snack);
+
+	if (reason)
+		return iscsi_reject_queue(conn, reason);
+
+	conn->tp->ep_event_modify(conn, EPOLLIN | EPOLLOUT);
+	return 0;
+}
+
 static int iscsi_task_rx_done(struct iscsi_connection *conn)
 {
 	struct iscsi_hdr *hdr = &conn->req.bhs;
@@ -1748,8 +2454,10 @@ static int iscsi_task_rx_done(struct iscsi_connection *conn)
 	case ISCSI_OP_SCSI_DATA_OUT:
 		err = iscsi_data_out_rx_done(task);
 		break;
-	case ISCSI_OP_TEXT:
 	case ISCSI_OP_SNACK:
+		err = iscsi_snack_rx_done(task);
+		break;
+	case ISCSI_OP_TEXT:
 	default:
 		eprintf("Cannot handle yet %x\n", op);
 		break;
@@ -1766,6 +2474,10 @@ static int iscsi_task_rx_start(struct iscsi_connection *conn)
 	uint8_t op;
 	int err = 0;
 
+	/* statuses the initiator now has need no keeping for a SNACK */
+	if (!list_empty(&conn->retained_list))
+		iscsi_retained_release(conn, be32_to_cpu(hdr->exp_statsn));
+
 	op = hdr->opcode & ISCSI_OPCODE_MASK;
 	switch (op) {
 	case ISCSI_OP_SCSI_CMD:
@@ -1783,6 +2495,7 @@ static int iscsi_task_rx_start(struct iscsi_connection *conn)
 		break;
 	case ISCSI_OP_SCSI_TMFUNC:
 	case ISCSI_OP_LOGOUT:
+	case ISCSI_OP_SNACK:
 		task = iscsi_alloc_task(conn, 0, 0);
 		if (task)
 			conn->rx_task = task;
@@ -1790,7 +2503,6 @@ static int iscsi_task_rx_start(struct iscsi_connection *conn)
 			err = -ENOMEM;
 		break;
 	case ISCSI_OP_TEXT:
-	case ISCSI_OP_SNACK:
 		eprintf("Cannot handle yet %x\n", op);
 		err = -EINVAL;
 		break;
@@ -1851,8 +2563,7 @@ static int iscsi_logout_tx_start(struct iscsi_task *task)
 	rsp->itt = task->req.itt;
 	rsp->statsn = cpu_to_be32(conn->stat_sn++);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-				     conn->session->max_queue_cmd);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_session_max_cmd_sn(conn->session));
 
 	return 0;
 }
@@ -1869,8 +2580,7 @@ static int iscsi_noop_in_tx_start(struct iscsi_task *task)
 	rsp->ttt = task->req.ttt;
 	rsp->statsn = cpu_to_be32(conn->stat_sn);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-				     conn->session->max_queue_cmd);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_session_max_cmd_sn(conn->session));
 
 	/* TODO: honor max_burst */
 	conn->rsp.datasize = task->len;
@@ -1902,8 +2612,8 @@ static int iscsi_noop_out_tx_start(struct iscsi_task *task, int *is_rsp)
 		rsp->ttt = cpu_to_be32(ISCSI_RESERVED_TAG);
 		rsp->statsn = cpu_to_be32(conn->stat_sn++);
 		rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-		rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-					     conn->session->max_queue_cmd);
+		rsp->max_cmdsn = cpu_to_be32(
+			iscsi_session_max_cmd_sn(conn->session));
 
 		/* TODO: honor max_burst */
 		conn->rsp.datasize = task->len;
@@ -1927,8 +2637,29 @@ static int iscsi_tm_tx_start(struct iscsi_task *task)
 
 	rsp->statsn = cpu_to_be32(conn->stat_sn++);
 	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
-	rsp->max_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn +
-				     conn->session->max_queue_cmd);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_session_max_cmd_sn(conn->session));
+
+	return 0;
+}
+
+static int iscsi_reject_tx_start(struct iscsi_task *task)
+{
+	struct iscsi_connection *conn = task->conn;
+	struct iscsi_reject *rsp = (struct iscsi_reject *) &conn->rsp.bhs;
+
+	memset(rsp, 0, sizeof(*rsp));
+	rsp->opcode = ISCSI_OP_REJECT;
+	rsp->flags = ISCSI_FLAG_CMD_FINAL;
+	rsp->reason = task->result;
+	rsp->ffffffff = cpu_to_be32(ISCSI_RESERVED_TAG);
+	rsp->statsn = cpu_to_be32(conn->stat_sn++);
+	rsp->exp_cmdsn = cpu_to_be32(conn->session->exp_cmd_sn);
+	rsp->max_cmdsn = cpu_to_be32(iscsi_session_max_cmd_sn(conn->session));
+
+	/* the data segment is the rejected header */
+	conn->rsp.datasize = BHS_SIZE;
+	hton24(rsp->dlength, BHS_SIZE);
+	conn->rsp.data = &task->req;
 
 	return 0;
 }
@@ -1940,8 +2671,15 @@ static int iscsi_scsi_cmd_tx_done(struct iscsi_connection *conn)
 
 	switch (hdr->opcode & ISCSI_OPCODE_MASK) {
 	case ISCSI_OP_R2T:
+		/* keep up to MaxOutstandingR2T in flight */
+		iscsi_r2t_queue(task);
 		break;
 	case ISCSI_OP_SCSI_DATA_IN:
+		if (task->tx_end && task->offset >= task->tx_end) {
+			/* the end of a run a Data SNACK asked for */
+			task->tx_end = 0;
+			break;
+		}
 		if (task->offset < scsi_get_in_transfer_len(&task->scmd) ||
 		    scsi_get_result(&task->scmd) != SAM_STAT_GOOD ||
 		    scsi_get_data_dir(&task->scmd) == DATA_BIDIRECTIONAL) {
@@ -1950,7 +2688,7 @@ static int iscsi_scsi_cmd_tx_done(struct iscsi_connection *conn)
 			return 0;
 		}
 	case ISCSI_OP_SCSI_CMD_RSP:
-		iscsi_free_cmd_task(task);
+		iscsi_scsi_cmd_finish(task);
 		break;
 	default:
 		eprintf("target bug %x\n", hdr->opcode & ISCSI_OPCODE_MASK);
@@ -1959,11 +2697,63 @@ static int iscsi_scsi_cmd_tx_done(struct iscsi_connection *conn)
 	return 0;
 }
 
+static void iscsi_logout_done(struct iscsi_task *task)
+{
+	struct iscsi_connection *conn = task->conn, *ent, *next;
+	struct iscsi_logout *req = (struct iscsi_logout *) &task->req;
+	uint16_t cid = be16_to_cpu(req->cid);
+	int reason = req->flags & ISCSI_FLAG_LOGOUT_REASON_MASK;
+
+	switch (reason) {
+	case ISCSI_LOGOUT_REASON_CLOSE_SESSION:
+		list_for_each_entry_safe(ent, next, &conn->session->conn_list,
+					 clist) {
+			/* the session's tasks end with it */
+			ent->retain_expired = 1;
+			if (ent == conn)
+				continue;
+			/* a dropped one only holds tasks for reassign */
+			if (ent->closed)
+				conn_drop(ent);
+			else
+				ent->tp->ep_force_close(ent);
+		}
+		break;
+	case ISCSI_LOGOUT_REASON_CLOSE_CONNECTION:
+	case ISCSI_LOGOUT_REASON_RECOVERY:
+		/* a connection may log out one of its siblings */
+		ent = conn;
+		if (cid != conn->cid) {
+			ent = conn_find(conn->session, cid);
+			if (!ent)
+				ent = conn;
+		}
+
+		/* only a logout for recovery keeps tasks to reassign */
+		if (reason != ISCSI_LOGOUT_REASON_RECOVERY)
+			ent->retain_expired = 1;
+
+		if (ent != conn) {
+			ent->tp->ep_force_close(ent);
+			return;
+		}
+		break;
+	}
+
+	conn->state = STATE_CLOSE;
+}
+
 static int iscsi_task_tx_done(struct iscsi_connection *conn)
 {
 	struct iscsi_task *task = conn->tx_task;
 	uint8_t op;
 
+	if (task_reject(task)) {
+		iscsi_free_task(task);
+		conn->tx_task = NULL;
+		return 0;
+	}
+
 	op = task->req.opcode & ISCSI_OPCODE_MASK;
 	switch (op) {
 	case ISCSI_OP_SCSI_CMD:
@@ -1988,10 +2778,10 @@ static int iscsi_task_tx_done(struct iscsi_connection *conn)
 	case ISCSI_OP_NOOP_OUT:
 	case ISCSI_OP_LOGOUT:
 	case ISCSI_OP_SCSI_TMFUNC:
-		iscsi_free_task(task);
-
 		if (op == ISCSI_OP_LOGOUT)
-			conn->state = STATE_CLOSE;
+			iscsi_logout_done(task);
+
+		iscsi_free_task(task);
 	}
 
 	conn->tx_task = NULL;
@@ -2014,7 +2804,12 @@ static int iscsi_task_tx_start(struct iscsi_connection *conn)
 		task->offset,
 		task->r2t_count);
 
-	list_del(&task->c_list);
+	list_del_init(&task->c_list);
+
+	if (task_reject(task)) {
+		err = iscsi_reject_tx_start(task);
+		goto out;
+	}
 
 	switch (task->req.opcode & ISCSI_OPCODE_MASK) {
 	case ISCSI_OP_SCSI_CMD:
@@ -2035,7 +2830,7 @@ static int iscsi_task_tx_start(struct iscsi_connection *conn)
 		err = iscsi_tm_tx_start(task);
 		break;
 	}
-
+out:
 	conn->tx_task = task;
 	return err;
 
@@ -2199,8 +2994,13 @@ again:
 		crc = ~crc;
 		conn->rx_iostate = IOSTATE_RX_END;
 		if (*((uint32_t *)conn->rx_digest) != crc) {
-			eprintf("rx hdr digest error 0x%x calc 0x%x\n",
+			eprintf("rx data digest error 0x%x calc 0x%x\n",
 				*((uint32_t *)conn->rx_digest), crc);
+			/* the header was good, so the next PDU can be found */
+			if (!iscsi_data_digest_error(conn)) {
+				conn_read_pdu(conn);
+				return;
+			}
 			conn->state = STATE_CLOSE;
 		}
 		break;
@@ -36,6 +36,7 @@
 
 #include "net_is.h"
 #include "net_os.h"
+#include "work.h"
 
 #define cpu_to_be16(x)	__cpu_to_be16(x)
 #define cpu_to_be32(x)	__cpu_to_be32(x)
@@ -48,6 +49,22 @@
 #define MAX_QUEUE_CMD_DEF	128
 #define MAX_QUEUE_CMD_MAX	512
 
+#define ISCSI_CMD_HASH_BITS	8
+#define ISCSI_CMD_HASH_SIZE	(1 << ISCSI_CMD_HASH_BITS)
+
+/*
+ * Bounds of the adaptive CmdSN window; the ceiling is the session's
+ * MaxQueueCmd. The window shrinks when completion latency grows past
+ * twice its baseline plus the slack, or when buffered command data
+ * across all sessions passes the high mark.
+ */
+#define ISCSI_WINDOW_MIN	8
+#define ISCSI_WINDOW_LAT_SLACK	500		/* usecs */
+#define ISCSI_WINDOW_MEM_HIGH	(256ULL << 20)
+
+/* must be a power of two larger than MAX_QUEUE_CMD_MAX */
+#define ISCSI_CMDSN_WINDOW	1024
+
 #define ISCSI_NAME_LEN 256
 
 #define DIGEST_ALL		(DIGEST_NONE | DIGEST_CRC32C)
@@ -74,6 +91,19 @@ struct iscsi_pdu {
 	unsigned int datasize;
 };
 
+struct iscsi_window {
+	uint32_t cur;		/* commands the initiator may have queued */
+	uint32_t max_cmd_sn;	/* highest MaxCmdSN advertised so far */
+	uint32_t inflight;
+	uint32_t inflight_peak;	/* during the current period */
+	uint32_t nr_done;	/* completions in the current period */
+	uint64_t lat_sum;	/* and their latency, usecs */
+	uint64_t lat_avg;	/* of the last period */
+	uint64_t lat_base;
+	uint64_t increases;
+	uint64_t decreases;
+};
+
 struct iscsi_session {
 	int refcount;
 
@@ -93,14 +123,22 @@ struct iscsi_session {
 	struct list_head conn_list;
 	int conn_cnt;
 
-	/* links all tasks (task->c_hlist) */
+	/* links all tasks (task->c_hlist), only used by iser */
 	struct list_head cmd_list;
 
-	/* links pending tasks (task->c_list) */
+	/* links pending tasks (task->c_list), only used by iser */
 	struct list_head pending_cmd_list;
 
+	/* SCSI command tasks hashed by ITT (task->c_hlist) */
+	struct list_head cmd_hash[ISCSI_CMD_HASH_SIZE];
+
+	/* out of order tasks waiting for their CmdSN, indexed by CmdSN */
+	struct iscsi_task *pending_cmd_ring[ISCSI_CMDSN_WINDOW];
+	int nr_pending_cmds;
+
 	uint32_t exp_cmd_sn;
 	uint32_t max_queue_cmd;
+	struct iscsi_window window;
 
 	struct param session_param[ISCSI_PARAM_MAX];
 
@@ -110,37 +148,73 @@ struct iscsi_session {
 	int rdma;
 };
 
-struct iscsi_task {
-	struct iscsi_hdr req;
-	struct iscsi_hdr rsp;
+/* upper bound on R2Ts kept outstanding for one task */
+#define ISCSI_MAX_R2T_PER_TASK	8
+
+struct iscsi_r2t {
+	uint32_t ttt;
+	uint32_t r2tsn;
+	uint32_t offset;
+	uint32_t length;	/* zero if the slot is free */
+	uint32_t received;
+	int resend;		/* ISCSI_R2T_RESEND_* or zero */
+};
+
+/* send the R2T again as it was (SNACK) or under a new TTT (digest error) */
+#define ISCSI_R2T_RESEND_SAME		1
+#define ISCSI_R2T_RESEND_NEW		2
 
+/*
+ * Fields every command touches come first, then the embedded
+ * scsi_cmd whose own hot part follows; R2T state and the response
+ * header copy are cold for reads and small writes. Checked in
+ * iscsid.c.
+ */
+struct iscsi_task {
 	uint64_t tag;
 	struct iscsi_connection *conn;
+	unsigned long flags;
+	void *data;
 
-	/* linked to session->cmd_list */
-	struct list_head c_hlist;
-
-	/* linked to conn->tx_clist or session->cmd_pending_list */
+	/* linked to conn->tx_clist */
 	struct list_head c_list;
 
-	/* linked to conn->tx_clist or conn->task_list */
-	struct list_head c_siblings;
-
-	unsigned long flags;
-
 	int result;
 	int len;
-
 	int offset;
-
 	int r2t_count;
+
+	struct iscsi_hdr req;
+
+	/* usecs when handed to SCSI and bytes charged, for the CmdSN window */
+	uint64_t stamp;
+	uint64_t charged;
+
+	struct scsi_cmd scmd;
+
+	/* linked to session->cmd_hash */
+	struct list_head c_hlist;
+
+	/* linked to conn->tx_clist or conn->task_list */
+	struct list_head c_siblings;
+
 	int unsol_count;
 	int exp_r2tsn;
 
-	void *ahs;
-	void *data;
+	/* next buffer offset to solicit with an R2T */
+	uint32_t r2t_offset;
+	int r2t_outstanding;
+	struct iscsi_r2t r2t[ISCSI_MAX_R2T_PER_TASK];
 
-	struct scsi_cmd scmd;
+	/* ErrorRecoveryLevel > 0: what a SNACK needs to send it all again */
+	uint32_t stat_sn;
+	uint32_t datain_len;
+	uint32_t tx_end;
+	/* linked to conn->retained_list until ExpStatSN passes stat_sn */
+	struct list_head r_list;
+
+	void *ahs;
+	struct iscsi_hdr rsp;
 
 	unsigned long extdata[0];
 };
@@ -215,6 +289,21 @@ struct iscsi_connection {
 	struct net_is* in_stream;
 	struct net_os* out_stream;
 	struct iscsi_stats stats;
+
+	/* login waiting on a redirect callback, see iscsi_login_resume() */
+	int login_parked;
+	struct list_head login_wait;
+
+	/* tx wakeups taken without epoll vs epoll_ctl(MOD) calls made */
+	uint64_t tx_kicks;
+	uint64_t tx_event_mods;
+
+	/* statuses sent but not yet acknowledged, in StatSN order */
+	struct list_head retained_list;
+
+	/* tasks left for TASK REASSIGN after the connection dropped */
+	struct tgt_work retain_work;
+	int retain_expired;
 };
 
 struct iscsi_tcp_connection {
@@ -227,6 +316,12 @@ struct iscsi_tcp_connection {
 	int nop_count;
 	long ttt;
 
+	/* work left over when the per-wakeup budget ran out */
+	struct event_data sched_ev;
+	int sched_events;
+	/* what the fd is registered for in epoll */
+	int ep_events;
+
 	struct iscsi_connection iscsi_conn;
 };
 
@@ -288,6 +383,9 @@ struct iscsi_target {
 		char	*callback;
 	} redirect_info;
 
+	/* redirect callback answers, see target_redirected() */
+	struct list_head redirect_cache;
+
 	struct list_head isns_list;
 
 	int rdma;
@@ -298,6 +396,12 @@ struct iscsi_target {
 enum task_flags {
 	TASK_pending,
 	TASK_in_scsi,
+	TASK_r2t_queued,
+	TASK_done,
+	TASK_released,
+	TASK_stat_sn,
+	TASK_retained,
+	TASK_reject,
 };
 
 struct iscsi_portal {
@@ -321,6 +425,49 @@ extern char *portal_arguments;
 #define clear_task_in_scsi(t)	((t)->flags &= ~(1 << TASK_in_scsi))
 #define task_in_scsi(t)		((t)->flags & (1 << TASK_in_scsi))
 
+#define set_task_r2t_queued(t)	((t)->flags |= (1 << TASK_r2t_queued))
+#define clear_task_r2t_queued(t) ((t)->flags &= ~(1 << TASK_r2t_queued))
+#define task_r2t_queued(t)	((t)->flags & (1 << TASK_r2t_queued))
+
+/* SCSI has completed the command */
+#define set_task_done(t)	((t)->flags |= (1 << TASK_done))
+#define task_done(t)		((t)->flags & (1 << TASK_done))
+
+/* target_cmd_done() has been called */
+#define set_task_released(t)	((t)->flags |= (1 << TASK_released))
+#define task_released(t)	((t)->flags & (1 << TASK_released))
+
+/* task->stat_sn holds the StatSN of its status */
+#define set_task_stat_sn(t)	((t)->flags |= (1 << TASK_stat_sn))
+#define clear_task_stat_sn(t)	((t)->flags &= ~(1 << TASK_stat_sn))
+#define task_stat_sn(t)		((t)->flags & (1 << TASK_stat_sn))
+
+#define set_task_retained(t)	((t)->flags |= (1 << TASK_retained))
+#define clear_task_retained(t)	((t)->flags &= ~(1 << TASK_retained))
+#define task_retained(t)	((t)->flags & (1 << TASK_retained))
+
+/* carries a Reject of the PDU in task->req, reason in task->result */
+#define set_task_reject(t)	((t)->flags |= (1 << TASK_reject))
+#define task_reject(t)		((t)->flags & (1 << TASK_reject))
+
+static inline int iscsi_conn_erl(struct iscsi_connection *conn)
+{
+	return conn->session_param[ISCSI_PARAM_ERL].val;
+}
+
+/* ErrorRecoveryLevel 2 keeps a dropped connection's commands around */
+static inline int conn_retains_tasks(struct iscsi_connection *conn)
+{
+	return iscsi_conn_erl(conn) >= 2 && !conn->retain_expired &&
+		conn->session_param[ISCSI_PARAM_DEFAULTTIME2RETAIN].val;
+}
+
+static inline struct list_head *
+iscsi_cmd_hash_head(struct iscsi_session *session, uint64_t itt)
+{
+	return &session->cmd_hash[hash_32(itt, ISCSI_CMD_HASH_BITS)];
+}
+
 extern int lld_index;
 extern struct list_head iscsi_targets_list;
 
@@ -331,10 +478,12 @@ extern int cmnd_exec_auth_chap(struct iscsi_connection *conn);
 extern int conn_init(struct iscsi_connection *conn);
 extern void conn_exit(struct iscsi_connection *conn);
 extern void conn_close(struct iscsi_connection *conn);
+extern void conn_drop(struct iscsi_connection *conn);
 extern void conn_put(struct iscsi_connection *conn);
 extern int conn_get(struct iscsi_connection *conn);
 extern struct iscsi_connection * conn_find(struct iscsi_session *session, uint32_t cid);
 extern int conn_take_fd(struct iscsi_connection *conn);
+extern int session_conn_count(struct iscsi_session *session);
 extern void conn_add_to_session(struct iscsi_connection *conn, struct iscsi_session *session);
 extern tgtadm_err conn_close_admin(uint32_t tid, uint64_t sid, uint32_t cid);
 extern tgtadm_err conn_close_all(uint32_t tid);
@@ -343,6 +492,7 @@ extern tgtadm_err conn_close_all(uint32_t tid);
 extern char *text_key_find(struct iscsi_connection *conn, char *searchKey);
 extern void text_key_add(struct iscsi_connection *conn, char *key, char *value);
 extern void conn_read_pdu(struct iscsi_connection *conn);
+extern void iscsi_login_resume(struct iscsi_connection *conn);
 extern int iscsi_tx_handler(struct iscsi_connection *conn);
 extern void iscsi_rx_handler(struct iscsi_connection *conn);
 extern int iscsi_scsi_cmd_execute(struct iscsi_task *task);
@@ -362,6 +512,8 @@ extern void iscsi_rsp_set_residual(struct iscsi_cmd_rsp *rsp, struct scsi_cmd *s
 /* iscsid.c iscsi_task */
 extern void iscsi_free_task(struct iscsi_task *task);
 extern void iscsi_free_cmd_task(struct iscsi_task *task);
+extern void iscsi_window_init(struct iscsi_session *session);
+extern uint32_t iscsi_session_max_cmd_sn(struct iscsi_session *session);
 
 /* session.c */
 extern struct iscsi_session *session_find_name(int tid, const char *iname, uint8_t *isid);
@@ -64,7 +64,7 @@ struct iscsi_session *session_lookup_by_tsih(uint16_t tsih)
 
 int session_create(struct iscsi_connection *conn)
 {
-	int err;
+	int i, err;
 	struct iscsi_session *session = NULL;
 	static uint16_t tsih, last_tsih = 0;
 	struct iscsi_target *target;
@@ -137,6 +137,8 @@ int session_create(struct iscsi_connection *conn)
 	INIT_LIST_HEAD(&session->conn_list);
 	INIT_LIST_HEAD(&session->cmd_list);
 	INIT_LIST_HEAD(&session->pending_cmd_list);
+	for (i = 0; i < ARRAY_SIZE(session->cmd_hash); i++)
+		INIT_LIST_HEAD(&session->cmd_hash[i]);
 
 	memcpy(session->isid, conn->isid, sizeof(session->isid));
 	session->tsih = last_tsih = tsih;
@@ -155,6 +157,7 @@ int session_create(struct iscsi_connection *conn)
 
 	session->max_queue_cmd =
 		session->session_param[ISCSI_PARAM_MAX_QUEUE_CMD].val;
+	iscsi_window_init(session);
 
 	return 0;
 }
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <sys/stat.h>
@@ -218,17 +219,12 @@ int iqn_acl(int tid, struct iscsi_connection *conn)
 		return -EPERM;
 }
 
-static int
-get_redirect_address(char *callback, char *buffer, int buflen,
-			char **address, char **ip_port, int *rsn)
+/* syntax is string_addr:string_port:string_reason */
+static int parse_redirect_address(char *buffer, char **address,
+				  char **ip_port, int *rsn)
 {
 	char *p, *addr, *port;
 
-	bzero(buffer, buflen);
-	if (call_program(callback, NULL, NULL, buffer, buflen, 0))
-		return -1;
-
-	/* syntax is string_addr:string_port:string_reason */
 	addr = p = buffer;
 	if (*p == '[') {
 		while (*p != ']' && *p != '\0')
@@ -263,6 +259,115 @@ get_redirect_address(char *callback, char *buffer, int buflen,
 	return 0;
 }
 
+static int
+get_redirect_address(char *callback, char *buffer, int buflen,
+			char **address, char **ip_port, int *rsn)
+{
+	bzero(buffer, buflen);
+	if (call_program(callback, NULL, NULL, buffer, buflen, 0))
+		return -1;
+
+	return parse_redirect_address(buffer, address, ip_port, rsn);
+}
+
+/*
+ * Answers of the redirect callback are kept per initiator address for
+ * a few seconds, so a login storm runs the callback once per initiator
+ * rather than once per connection, and logins that arrive while it is
+ * running wait on the same answer.
+ */
+#define REDIRECT_CACHE_TTL		5
+#define REDIRECT_CALLBACK_TIMEOUT	1
+
+struct redirect_decision {
+	struct list_head list;
+	/* NULL once dropped from the cache while still pending */
+	struct iscsi_target *target;
+	char dst[INET6_ADDRSTRLEN];
+	int pending;
+	int error;
+	char addr[NI_MAXHOST + 1];
+	char port[NI_MAXSERV + 1];
+	int rsn;
+	time_t expires;
+	/* connections parked in login until the answer is in */
+	struct list_head waiters;
+};
+
+static void redirect_decision_done(void *data, char *output)
+{
+	struct redirect_decision *d = data;
+	struct iscsi_connection *conn, *tmp;
+	char *addr, *port;
+
+	d->pending = 0;
+	d->expires = time(NULL) + REDIRECT_CACHE_TTL;
+	if (!output || parse_redirect_address(output, &addr, &port, &d->rsn))
+		d->error = 1;
+	else {
+		snprintf(d->addr, sizeof(d->addr), "%s", addr);
+		snprintf(d->port, sizeof(d->port), "%s", port);
+	}
+
+	list_for_each_entry_safe(conn, tmp, &d->waiters, login_wait) {
+		list_del(&conn->login_wait);
+		iscsi_login_resume(conn);
+	}
+
+	if (!d->target)
+		free(d);
+}
+
+static struct redirect_decision *
+redirect_decision_get(struct iscsi_target *target, char *dst, char *cmd)
+{
+	struct redirect_decision *d, *tmp;
+	time_t now = time(NULL);
+
+	list_for_each_entry_safe(d, tmp, &target->redirect_cache, list) {
+		if (!d->pending && d->expires <= now) {
+			list_del(&d->list);
+			free(d);
+			continue;
+		}
+		if (!strcmp(d->dst, dst))
+			return d;
+	}
+
+	d = zalloc(sizeof(*d));
+	if (!d)
+		return NULL;
+
+	d->target = target;
+	snprintf(d->dst, sizeof(d->dst), "%s", dst);
+	INIT_LIST_HEAD(&d->waiters);
+	list_add(&d->list, &target->redirect_cache);
+
+	d->pending = 1;
+	if (call_program_async(cmd, REDIRECT_CALLBACK_TIMEOUT,
+			       redirect_decision_done, d)) {
+		eprintf("failed to run redirect callback %s\n", cmd);
+		d->pending = 0;
+		d->error = 1;
+		d->expires = now + REDIRECT_CACHE_TTL;
+	}
+
+	return d;
+}
+
+static void redirect_cache_flush(struct iscsi_target *target)
+{
+	struct redirect_decision *d, *tmp;
+
+	list_for_each_entry_safe(d, tmp, &target->redirect_cache, list) {
+		list_del(&d->list);
+		if (d->pending)
+			d->target = NULL;
+		else
+			free(d);
+	}
+}
+
 int target_redirected(struct iscsi_target *target,
 	struct iscsi_connection *conn, char *buf, int *reason)
 {
@@ -289,10 +394,29 @@ int target_redirected(struct iscsi_target *target,
 		if (ret)
 			goto predefined;
 		sprintf(p, "%s", dst);
-		ret = get_redirect_address(in_buf, buffer,
+		if (conn->tp->rdma) {
+			ret = get_redirect_address(in_buf, buffer,
 					sizeof(buffer), &addr, &port, &rsn);
-		if (ret)
-			return -1;
+			if (ret)
+				return -1;
+		} else {
+			struct redirect_decision *d;
+
+			d = redirect_decision_get(target, dst, in_buf);
+			if (!d)
+				return -1;
+			if (d->pending) {
+				conn_get(conn);
+				conn->login_parked = 1;
+				list_add_tail(&conn->login_wait, &d->waiters);
+				return -EINPROGRESS;
+			}
+			if (d->error)
+				return -1;
+			addr = d->addr;
+			port = d->port;
+			rsn = d->rsn;
+		}
 	}
 
 predefined:
@@ -412,7 +536,7 @@ void iscsi_target_destroy(int tid, int force)
 	list_for_each_entry_safe(session, stmp, &target->sessions_list, slist) {
 		session_get(session);
 		list_for_each_entry_safe(conn, ctmp, &session->conn_list, clist) {
-			conn_close(conn);
+			conn_drop(conn);
 		}
 		session_put(session);
 	}
@@ -423,6 +547,7 @@ void iscsi_target_destroy(int tid, int force)
 	}
 
 	list_del(&target->tlist);
+	redirect_cache_flush(target);
 	if (target->redirect_info.callback)
 		free(target->redirect_info.callback);
 	free(target);
@@ -440,7 +565,7 @@ int iscsi_target_create(struct target *t)
 		[ISCSI_PARAM_HDRDGST_EN] = {0, DIGEST_NONE},
 		[ISCSI_PARAM_DATADGST_EN] = {0, DIGEST_NONE},
 		[ISCSI_PARAM_INITIAL_R2T_EN] = {0, 1},
-		[ISCSI_PARAM_MAX_R2T] = {0, 1},
+		[ISCSI_PARAM_MAX_R2T] = {0, 4},
 		[ISCSI_PARAM_IMM_DATA_EN] = {0, 1},
 		[ISCSI_PARAM_FIRST_BURST] = {0, 65536},
 		[ISCSI_PARAM_MAX_BURST] = {0, 262144},
@@ -453,7 +578,7 @@ int iscsi_target_create(struct target *t)
 		[ISCSI_PARAM_DEFAULTTIME2RETAIN] = {0, 20},
 		[ISCSI_PARAM_OFMARKINT] = {0, 2048},
 		[ISCSI_PARAM_IFMARKINT] = {0, 2048},
-		[ISCSI_PARAM_MAXCONNECTIONS] = {0, 1},
+		[ISCSI_PARAM_MAXCONNECTIONS] = {0, 8},
 		[ISCSI_PARAM_RDMA_EXTENSIONS] = {0, 1},
 		[ISCSI_PARAM_TARGET_RDSL] = {0, 262144},
 		[ISCSI_PARAM_INITIATOR_RDSL] = {0, 262144},
@@ -474,6 +599,7 @@ int iscsi_target_create(struct target *t)
 
 	INIT_LIST_HEAD(&target->tlist);
 	INIT_LIST_HEAD(&target->sessions_list);
+	INIT_LIST_HEAD(&target->redirect_cache);
 	INIT_LIST_HEAD(&target->isns_list);
 	target->tid = tid;
 	target->nop_interval = default_nop_interval;
@@ -547,6 +673,8 @@ tgtadm_err iscsi_target_update(int mode, int op, int tid, uint64_t sid, uint64_t
 			} else
 				break;
 		} else if (!strncmp(name, "RedirectCallback", 16)) {
+			redirect_cache_flush(target);
+			free(target->redirect_info.callback);
 			target->redirect_info.callback = strdup(str);
 			if (!target->redirect_info.callback) {
 				adm_err = TGTADM_NOMEM;
@@ -771,6 +899,20 @@ static void _stat_iscsi_conn(struct iscsi_connection *conn, struct concat_buf *b
 		      conn->stats.scsirsp_pdus);
 }
 
+static void _stat_iscsi_window(struct iscsi_session *session,
+			       struct concat_buf *b)
+{
+	struct iscsi_window *w = &session->window;
+
+	concat_printf(b, "\nsid cmdsn_window max_queue_cmd inflight"
+		      " latency_us base_latency_us increases decreases\n");
+	concat_printf(b, "%3d %12" PRIu32 " %13" PRIu32 " %8" PRIu32
+		      " %10" PRIu64 " %15" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n",
+		      (unsigned int)session->tsih, w->cur,
+		      session->max_queue_cmd, w->inflight, w->lat_avg,
+		      w->lat_base, w->increases, w->decreases);
+}
+
 static tgtadm_err _stat_iscsi_session(struct iscsi_session *session,
 				      uint64_t lun, int filter_lun,
 				      struct concat_buf *b)
@@ -806,6 +948,16 @@ static tgtadm_err _stat_iscsi_session(struct iscsi_session *session,
 		_stat_iscsi_conn(conn, b);
 	}
 
+	_stat_iscsi_window(session, b);
+
+	if (!list_empty(&session->conn_list))
+		concat_printf(b, "\nsid cid tx_kicks tx_event_mods\n");
+	list_for_each_entry(conn, &session->conn_list, clist)
+		concat_printf(b, "%3d %3d %8" PRIu64 " %13" PRIu64 "\n",
+			      (unsigned int)session->tsih,
+			      (unsigned int)conn->cid,
+			      conn->tx_kicks, conn->tx_event_mods);
+
 	return TGTADM_SUCCESS;
 }
 
@@ -178,6 +178,8 @@ static tgtadm_err target_mgmt(int lld_no, struct mgmt_task *mtask)
 
 		if (!strcmp(mtask->req_buf, "state")) {
 			adm_err = tgt_set_target_state(req->tid, p);
+		} else if (!strncmp(mtask->req_buf, "qos_", 4)) {
+			adm_err = tgt_set_target_qos(req->tid, mtask->req_buf, p);
 		} else if (tgt_drivers[lld_no]->update)
 			adm_err = tgt_drivers[lld_no]->update(req->mode, req->op, req->tid,
 							  req->sid, req->lun,
@@ -261,7 +263,11 @@ static tgtadm_err device_mgmt(int lld_no, struct mgmt_task *mtask)
 		break;
 	case OP_STATS:
 		concat_buf_init(&mtask->rsp_concat);
-		if (!req->sid)
+		if (!req->sid && !strncmp(params, "analytics=", 10))
+			adm_err = tgt_stat_analytics_by_id(req->tid, req->lun,
+							   params + 10,
+							   &mtask->rsp_concat);
+		else if (!req->sid)
 			adm_err = tgt_stat_device_by_id(req->tid, req->lun,
 							&mtask->rsp_concat);
 		else if (tgt_drivers[lld_no]->stat)
@@ -0,0 +1,532 @@
+/*
+ *	SCSI pipeline microbenchmark
+ *
+ * Drives CDBs built in memory through the real SCSI emulation of tgtd
+ * (target_cmd_queue, target_cmd_perform, the sbc/spc handlers and
+ * bs_cmd_submit) against null backed LUs, with a fake low level
+ * driver standing in for iscsi. There are no sockets and no event
+ * loop, so what is measured is the per command cost of the SCSI layer
+ * alone, reported in ns per command for every opcode.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+#include "driver.h"
+#include "scsi.h"
+#include "iscsi/iscsid.h"
+
+#define PIPE_TID	1
+#define PIPE_TARGET	"iqn.2007-03.org.tgt:pipe-bench"
+#define NSEC_PER_SEC	1000000000ULL
+#define PIPE_BUF_SIZE	(1 << 20)
+
+struct pipe_cmd {
+	struct scsi_cmd scmd;
+	uint8_t cdb[16];
+	int done;
+	int result;
+};
+
+struct pipe_op {
+	const char *name;
+	uint8_t opcode;
+	int dir;
+	int rw;
+	void (*build)(uint8_t *cdb, uint64_t lba, uint32_t blocks);
+	uint32_t (*length)(uint32_t blocks);
+	int skip;
+	uint64_t errors;
+	uint64_t nsecs;
+};
+
+static int nr_nexus = 4;
+static int nr_lu = 4;
+static int depth = 32;
+static uint32_t blocks = 8;
+static uint64_t count = 1000000;
+static int csv;
+
+static struct pipe_cmd *cmds;
+static void *data_buf;
+static int pipe_lld;
+
+static char program_name[] = "pipe_bench";
+
+static struct option const long_options[] = {
+	{"nexuses", required_argument, NULL, 'n'},
+	{"luns", required_argument, NULL, 'l'},
+	{"queue-depth", required_argument, NULL, 'q'},
+	{"blocks", required_argument, NULL, 'b'},
+	{"count", required_argument, NULL, 'c'},
+	{"opcodes", required_argument, NULL, 'o'},
+	{"csv", no_argument, NULL, 'x'},
+	{"debug", no_argument, NULL, 'd'},
+	{"help", no_argument, NULL, 'h'},
+	{NULL, 0, NULL, 0},
+};
+
+static void usage(int status)
+{
+	if (status) {
+		fprintf(stderr, "Try `%s --help' for more information.\n",
+			program_name);
+		exit(status);
+	}
+
+	printf("Usage: %s [OPTION]\n", program_name);
+	printf("\
+Times the SCSI layer of tgtd on null backed LUs, without a transport.\n\
+  -n, --nexuses=N         I_T nexuses to spread the commands over, 4\n\
+  -l, --luns=N            LUs to spread the commands over, 4\n\
+  -q, --queue-depth=N     commands completed but not yet released, 32\n\
+  -b, --blocks=N          blocks per READ/WRITE, 8\n\
+  -c, --count=N           commands per opcode, 1000000\n\
+  -o, --opcodes=LIST      comma separated opcodes to run, all by default\n\
+  -x, --csv               print opcode,ns per command,errors lines\n\
+  -d, --debug             print debugging messages of the SCSI layer\n\
+  -h, --help              display this help and exit\n");
+	exit(0);
+}
+
+static void build_none(uint8_t *cdb, uint64_t lba, uint32_t blocks)
+{
+}
+
+static void build_inquiry(uint8_t *cdb, uint64_t lba, uint32_t blocks)
+{
+	put_unaligned_be16(96, cdb + 3);
+}
+
+static void build_report_luns(uint8_t *cdb, uint64_t lba, uint32_t blocks)
+{
+	put_unaligned_be32(4096, cdb + 6);
+}
+
+static void build_mode_sense(uint8_t *cdb, uint64_t lba, uint32_t blocks)
+{
+	cdb[2] = 0x3f;
+	cdb[4] = 255;
+}
+
+static void build_read_capacity_16(uint8_t *cdb, uint64_t lba,
+				   uint32_t blocks)
+{
+	cdb[1] = SAI_READ_CAPACITY_16;
+	put_unaligned_be32(32, cdb + 10);
+}
+
+static void build_rw_10(uint8_t *cdb, uint64_t lba, uint32_t blocks)
+{
+	put_unaligned_be32(lba, cdb + 2);
+	put_unaligned_be16(blocks, cdb + 7);
+}
+
+static void build_rw_16(uint8_t *cdb, uint64_t lba, uint32_t blocks)
+{
+	put_unaligned_be64(lba, cdb + 2);
+	put_unaligned_be32(blocks, cdb + 10);
+}
+
+static uint32_t length_none(uint32_t blocks)
+{
+	return 0;
+}
+
+static uint32_t length_inquiry(uint32_t blocks)
+{
+	return 96;
+}
+
+static uint32_t length_report_luns(uint32_t blocks)
+{
+	return 4096;
+}
+
+static uint32_t length_mode_sense(uint32_t blocks)
+{
+	return 255;
+}
+
+static uint32_t length_read_capacity_16(uint32_t blocks)
+{
+	return 32;
+}
+
+static uint32_t length_rw(uint32_t blocks)
+{
+	return blocks << 9;
+}
+
+static struct pipe_op pipe_ops[] = {
+	{"TEST_UNIT_READY", TEST_UNIT_READY, DATA_NONE, 0,
+	 build_none, length_none},
+	{"INQUIRY", INQUIRY, DATA_READ, 0,
+	 build_inquiry, length_inquiry},
+	{"REPORT_LUNS", REPORT_LUNS, DATA_READ, 0,
+	 build_report_luns, length_report_luns},
+	{"MODE_SENSE", MODE_SENSE, DATA_READ, 0,
+	 build_mode_sense, length_mode_sense},
+	{"READ_CAPACITY_16", SERVICE_ACTION_IN, DATA_READ, 0,
+	 build_read_capacity_16, length_read_capacity_16},
+	{"READ_10", READ_10, DATA_READ, 1, build_rw_10, length_rw},
+	{"WRITE_10", WRITE_10, DATA_WRITE, 1, build_rw_10, length_rw},
+	{"READ_16", READ_16, DATA_READ, 1, build_rw_16, length_rw},
+	{"WRITE_16", WRITE_16, DATA_WRITE, 1, build_rw_16, length_rw},
+	{"SYNCHRONIZE_CACHE", SYNCHRONIZE_CACHE, DATA_NONE, 0,
+	 build_none, length_none},
+};
+
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Like iscsi, the command is handed back to the SCSI layer only after
+ * the response went out, here when its slot is reused. That keeps
+ * depth commands per run on the nexus hash lists and LU queues.
+ */
+static int pipe_cmd_end_notify(uint64_t nid, int result, struct scsi_cmd *scmd)
+{
+	struct pipe_cmd *pc = container_of(scmd, struct pipe_cmd, scmd);
+
+	pc->done = 1;
+	pc->result = result;
+	return 0;
+}
+
+static int pipe_mgmt_end_notify(struct mgmt_req *mreq)
+{
+	return 0;
+}
+
+static struct tgt_driver pipe_drv = {
+	.name			= "pipe",
+	.cmd_end_notify		= pipe_cmd_end_notify,
+	.mgmt_end_notify	= pipe_mgmt_end_notify,
+	.default_bst		= "null",
+};
+
+__attribute__((constructor)) static void pipe_driver_constructor(void)
+{
+	register_driver(&pipe_drv);
+}
+
+static int pipe_cmd_release(struct pipe_cmd *pc, struct pipe_op *op)
+{
+	if (!pc->scmd.c_target)
+		return 0;
+
+	if (!pc->done) {
+		/* a null backed command can't still be in the backend */
+		eprintf("%s %" PRIx64 " did not complete\n", op->name,
+			pc->scmd.tag);
+		return -EIO;
+	}
+
+	if (pc->result != SAM_STAT_GOOD)
+		op->errors++;
+	target_cmd_done(&pc->scmd);
+	pc->scmd.c_target = NULL;
+	return 0;
+}
+
+static int pipe_cmd_submit(struct pipe_cmd *pc, struct pipe_op *op,
+			   uint64_t tag, uint64_t lba)
+{
+	struct scsi_cmd *scmd = &pc->scmd;
+	uint32_t len = op->length(blocks);
+	int lun = 1 + (tag / nr_nexus) % nr_lu;
+	int ret;
+
+	memset(pc, 0, sizeof(*pc));
+	pc->cdb[0] = op->opcode;
+	op->build(pc->cdb, lba, blocks);
+
+	scmd->scb = pc->cdb;
+	scmd->scb_len = sizeof(pc->cdb);
+	scmd->cmd_itn_id = 1 + tag % nr_nexus;
+	scmd->tag = tag;
+	scmd->attribute = MSG_SIMPLE_TAG;
+	scmd->lun[1] = lun;
+
+	scsi_set_data_dir(scmd, op->dir);
+	if (op->dir == DATA_WRITE) {
+		scsi_set_out_buffer(scmd, data_buf);
+		scsi_set_out_length(scmd, len);
+	} else if (op->dir == DATA_READ) {
+		scsi_set_in_buffer(scmd, data_buf);
+		scsi_set_in_length(scmd, len);
+	}
+
+	ret = target_cmd_queue(PIPE_TID, scmd);
+	if (ret) {
+		eprintf("%s %" PRIx64 " failed to queue, %d\n", op->name,
+			tag, ret);
+		return ret;
+	}
+	return 0;
+}
+
+static int pipe_run(struct pipe_op *op, uint64_t nr)
+{
+	uint64_t i, lba = 0, nr_blocks = (1ULL << 40) >> 9;
+	int ret;
+
+	for (i = 0; i < nr; i++) {
+		struct pipe_cmd *pc = &cmds[i % depth];
+
+		ret = pipe_cmd_release(pc, op);
+		if (ret)
+			return ret;
+
+		ret = pipe_cmd_submit(pc, op, i, lba);
+		if (ret)
+			return ret;
+
+		if (op->rw) {
+			lba += blocks;
+			if (lba + blocks > nr_blocks)
+				lba = 0;
+		}
+	}
+
+	for (i = 0; i < depth; i++) {
+		ret = pipe_cmd_release(&cmds[i], op);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int pipe_op_bench(struct pipe_op *op)
+{
+	uint64_t start;
+	int ret;
+
+	/* warm up the caches and the allocator, not counted */
+	ret = pipe_run(op, count / 10 + depth);
+	if (ret)
+		return ret;
+	op->errors = 0;
+
+	start = now_nsec();
+	ret = pipe_run(op, count);
+	op->nsecs = now_nsec() - start;
+	return ret;
+}
+
+/* every nexus starts with a POWER ON unit attention on every LU */
+static int pipe_clear_ua(void)
+{
+	struct pipe_op *tur = &pipe_ops[0];
+	int i, ret;
+
+	for (i = 0; i < nr_nexus * nr_lu * 2; i++) {
+		ret = pipe_cmd_submit(&cmds[0], tur, i, 0);
+		if (!ret)
+			ret = pipe_cmd_release(&cmds[0], tur);
+		if (ret)
+			return ret;
+	}
+	tur->errors = 0;
+	return 0;
+}
+
+static int pipe_setup(void)
+{
+	char args[] = "targetname=" PIPE_TARGET;
+	char params[64];
+	int i, ret;
+
+	pipe_lld = get_driver_index("pipe");
+	if (pipe_lld < 0)
+		return -ENOENT;
+	pipe_drv.drv_state = DRIVER_INIT;
+	INIT_LIST_HEAD(&pipe_drv.target_list);
+
+	ret = tgt_target_create(pipe_lld, PIPE_TID, args);
+	if (ret) {
+		eprintf("failed to create the target, %d\n", ret);
+		return -EINVAL;
+	}
+
+	for (i = 1; i <= nr_lu; i++) {
+		snprintf(params, sizeof(params), "bstype=null,path=pipe%d", i);
+		ret = tgt_device_create(PIPE_TID, TYPE_DISK, i, params, 1);
+		if (ret) {
+			eprintf("failed to create LU %d, %d\n", i, ret);
+			return -EINVAL;
+		}
+	}
+
+	for (i = 1; i <= nr_nexus; i++) {
+		ret = it_nexus_create(PIPE_TID, i, 0, NULL);
+		if (ret) {
+			eprintf("failed to create nexus %d, %d\n", i, ret);
+			return ret;
+		}
+	}
+
+	return pipe_clear_ua();
+}
+
+static int pipe_select(char *list)
+{
+	char *name;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(pipe_ops); i++)
+		pipe_ops[i].skip = 1;
+
+	while ((name = strsep(&list, ","))) {
+		for (i = 0; i < ARRAY_SIZE(pipe_ops); i++)
+			if (!strcasecmp(name, pipe_ops[i].name))
+				break;
+		if (i == ARRAY_SIZE(pipe_ops)) {
+			fprintf(stderr, "unknown opcode %s\n", name);
+			return -EINVAL;
+		}
+		pipe_ops[i].skip = 0;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char *opcodes = NULL;
+	int ch, longindex, debug = 0, i, ret;
+
+	while ((ch = getopt_long(argc, argv, "n:l:q:b:c:o:xdh",
+				 long_options, &longindex)) >= 0) {
+		switch (ch) {
+		case 'n':
+			nr_nexus = atoi(optarg);
+			break;
+		case 'l':
+			nr_lu = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'b':
+			blocks = atoi(optarg);
+			break;
+		case 'c':
+			count = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			opcodes = optarg;
+			break;
+		case 'x':
+			csv = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+
+	if (nr_nexus < 1 || nr_lu < 1 || nr_lu > 255 || depth < 1 ||
+	    !blocks || blocks > 0xffff || length_rw(blocks) > PIPE_BUF_SIZE ||
+	    !count) {
+		fprintf(stderr, "invalid nexus, LU, depth, block or count\n");
+		usage(1);
+	}
+	if (opcodes && pipe_select(opcodes))
+		exit(1);
+
+	log_init(program_name, 0, 0, debug);
+
+	cmds = calloc(depth, sizeof(*cmds));
+	data_buf = calloc(1, PIPE_BUF_SIZE);
+	if (!cmds || !data_buf) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	if (pipe_setup()) {
+		fprintf(stderr, "failed to set up the target\n");
+		exit(1);
+	}
+
+	if (!csv)
+		printf("%d nexuses x %d LUs, %d commands outstanding, "
+		       "%" PRIu64 " commands per opcode, %u blocks per I/O\n\n"
+		       "%-20s %10s %10s %10s\n", nr_nexus, nr_lu, depth, count,
+		       blocks, "opcode", "ns/cmd", "Kcmd/s", "errors");
+
+	for (i = 0; i < ARRAY_SIZE(pipe_ops); i++) {
+		struct pipe_op *op = &pipe_ops[i];
+		double ns;
+
+		if (op->skip)
+			continue;
+
+		ret = pipe_op_bench(op);
+		if (ret) {
+			fprintf(stderr, "%s failed\n", op->name);
+			exit(1);
+		}
+
+		ns = (double)op->nsecs / count;
+		if (csv)
+			printf("%s,%.1f,%" PRIu64 "\n", op->name, ns,
+			       op->errors);
+		else
+			printf("%-20s %10.1f %10.0f %10" PRIu64 "\n", op->name,
+			       ns, 1000000.0 / ns, op->errors);
+	}
+
+	return 0;
+}
+
+/*
+ * What target.c and log.c reach into tgtd.c, mgmt.c and the iscsi
+ * driver for. None of it is on the command path.
+ */
+char mgmt_path[256];
+
+int tgt_event_add(int fd, int events, event_handler_t handler, void *data)
+{
+	return -EOPNOTSUPP;
+}
+
+void tgt_event_del(int fd)
+{
+}
+
+void iscsi_print_nop_settings(struct concat_buf *b, int tid)
+{
+}
+
+tgtadm_err conn_close_all(uint32_t tid)
+{
+	return TGTADM_SUCCESS;
+}
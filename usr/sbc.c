@@ -114,7 +114,12 @@ static int sbc_mode_page_update(struct scsi_cmd *cmd, uint8_t *data, int *change
 
 static int sbc_mode_select(int host_no, struct scsi_cmd *cmd)
 {
-	return spc_mode_select(host_no, cmd, sbc_mode_page_update);
+	int ret;
+
+	ret = spc_mode_select(host_no, cmd, sbc_mode_page_update);
+	/* SWP may have changed */
+	scsi_lu_fastpath_update(cmd->dev);
+	return ret;
 }
 
 static int sbc_mode_sense(int host_no, struct scsi_cmd *cmd)
@@ -412,6 +417,62 @@ sense:
 	return SAM_STAT_CHECK_CONDITION;
 }
 
+/*
+ * READ/WRITE 10/16 on an LU whose fastpath allows them. Nothing the
+ * generic checks or sbc_rw look at can fail there, so only the CDB is
+ * validated; anything out of the ordinary takes the sbc_rw path.
+ */
+static int sbc_fast_rw(int host_no, struct scsi_cmd *cmd)
+{
+	struct scsi_lu *lu = cmd->dev;
+	uint64_t lba;
+	uint32_t tl, len;
+
+	/* We only support protection information type 0 */
+	if (cmd->scb[1] & 0xe0)
+		return sbc_rw(host_no, cmd);
+
+	switch (cmd->scb[0]) {
+	case READ_10:
+		lba = get_unaligned_be32(&cmd->scb[2]);
+		tl = get_unaligned_be16(&cmd->scb[7]);
+		len = scsi_get_in_length(cmd);
+		break;
+	case READ_16:
+		lba = get_unaligned_be64(&cmd->scb[2]);
+		tl = get_unaligned_be32(&cmd->scb[10]);
+		len = scsi_get_in_length(cmd);
+		break;
+	case WRITE_10:
+		lba = get_unaligned_be32(&cmd->scb[2]);
+		tl = get_unaligned_be16(&cmd->scb[7]);
+		len = scsi_get_out_length(cmd);
+		break;
+	default:
+		lba = get_unaligned_be64(&cmd->scb[2]);
+		tl = get_unaligned_be32(&cmd->scb[10]);
+		len = scsi_get_out_length(cmd);
+		break;
+	}
+
+	/* zero length, out of range or residuals */
+	if (!tl || lba + tl < lba || lba + tl > lu->size >> lu->blk_shift ||
+	    (uint64_t) tl << lu->blk_shift != len)
+		return sbc_rw(host_no, cmd);
+
+	cmd->offset = lba << lu->blk_shift;
+	cmd->tl = len;
+
+	if (lu->bst->bs_cmd_submit(cmd)) {
+		cmd->offset = 0;
+		scsi_set_in_resid_by_actual(cmd, 0);
+		scsi_set_out_resid_by_actual(cmd, 0);
+		sense_data_build(cmd, HARDWARE_ERROR, ASC_INTERNAL_TGT_FAILURE);
+		return SAM_STAT_CHECK_CONDITION;
+	}
+	return SAM_STAT_GOOD;
+}
+
 static int sbc_reserve(int host_no, struct scsi_cmd *cmd)
 {
 	if (device_reserve(cmd))
@@ -791,6 +852,7 @@ static struct device_type_template sbc_template = {
 	.lu_online	= spc_lu_online,
 	.lu_offline	= spc_lu_offline,
 	.lu_exit	= spc_lu_exit,
+	.cmd_fastpath	= sbc_fast_rw,
 	.ops		= {
 		{spc_test_unit,},
 		{spc_illegal_op,},
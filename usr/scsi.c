@@ -46,6 +46,10 @@ static unsigned char scsi_command_size[8] = {6, 10, 10, 12, 16, 12, 10, 10};
 #define CDB_CONTROL(cmd) (((cmd)->scb[0] == 0x7f) ? (cmd)->scb[1] \
 			  : (cmd)->scb[CDB_SIZE((cmd))-1])
 
+/* see struct scsi_cmd */
+BUILD_BUG_ON_COLD(struct scsi_cmd, sense_len, 1);
+BUILD_BUG_ON_COLD(struct scsi_cmd, itn_lu_info, 2);
+
 int get_scsi_command_size(unsigned char op)
 {
 	return COMMAND_SIZE(op);
@@ -461,6 +465,57 @@ uint32_t scsi_rw_count(uint8_t *scb)
 	return cnt;
 }
 
+/*
+ * READ/WRITE 10/16 skip the per-command checks below when nothing on
+ * the LU can make them fail: no reservation, no PR holder, not offline
+ * or write protected, and the bs takes the opcodes. That is recomputed
+ * here whenever one of those changes; pending UAs are per I_T nexus and
+ * checked for each command instead.
+ */
+void scsi_lu_fastpath_update(struct scsi_lu *lu)
+{
+	unsigned int fastpath = 0;
+
+	if (!lu->dev_type_template.cmd_fastpath || !lu->bst ||
+	    lu->reserve_id || lu->pr_holder ||
+	    (lu->attrs.removable && !lu->attrs.online))
+		goto out;
+
+	if (is_bs_support_opcode(lu->bst, READ_10) &&
+	    is_bs_support_opcode(lu->bst, READ_16))
+		fastpath |= LU_FASTPATH_READ;
+
+	if (!lu->attrs.readonly && !lu->attrs.swp &&
+	    is_bs_support_opcode(lu->bst, WRITE_10) &&
+	    is_bs_support_opcode(lu->bst, WRITE_16))
+		fastpath |= LU_FASTPATH_WRITE;
+out:
+	lu->fastpath = fastpath;
+}
+
+static inline int scsi_cmd_fastpath(struct scsi_cmd *cmd)
+{
+	unsigned int need;
+
+	switch (cmd->scb[0]) {
+	case READ_10:
+	case READ_16:
+		need = LU_FASTPATH_READ;
+		break;
+	case WRITE_10:
+	case WRITE_16:
+		need = LU_FASTPATH_WRITE;
+		break;
+	default:
+		return 0;
+	}
+
+	return (cmd->dev->fastpath & need) &&
+		cmd->dev->lun == cmd->dev_id &&
+		!(CDB_CONTROL(cmd) & ((1U << 0) | (1U << 2))) &&
+		list_empty(&cmd->itn_lu_info->pending_ua_sense_list);
+}
+
 int scsi_cmd_perform(int host_no, struct scsi_cmd *cmd)
 {
 	int ret;
@@ -479,6 +534,14 @@ int scsi_cmd_perform(int host_no, struct scsi_cmd *cmd)
 		cmd->itn_lu_info->stat.bidir_subm_cmds++;
 	}
 
+	if (cmd->dev->analytics_on)
+		lu_analytics_record(cmd);
+	if (cmd->dev->capture)
+		lu_capture_submit(cmd);
+
+	if (scsi_cmd_fastpath(cmd))
+		return cmd->dev->dev_type_template.cmd_fastpath(host_no, cmd);
+
 	if (CDB_CONTROL(cmd) & ((1U << 0) | (1U << 2))) {
 		/*
 		 * We don't support a linked command. SAM-3 say that
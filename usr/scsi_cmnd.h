@@ -18,39 +18,45 @@ struct scsi_data_buffer {
 	int32_t resid;
 };
 
+/*
+ * Ordered by how often a command touches a field: the first cache
+ * line holds what every READ/WRITE reads or writes from submit to
+ * completion, the second the buffers and nexus pointers, then the
+ * queueing state. Sense data is only written on errors and goes last.
+ * Checked in scsi.c.
+ */
 struct scsi_cmd {
-	struct target *c_target;
-	/* linked it_nexus->cmd_hash_list */
-	struct list_head c_hlist;
-	struct list_head qlist;
-
-	uint64_t dev_id;
-
-	struct scsi_lu *dev;
 	unsigned long state;
-
+	struct scsi_lu *dev;
+	uint8_t *scb;
+	uint64_t offset;
+	uint64_t tag;
+	uint64_t dev_id;
+	uint32_t tl;
 	enum data_direction data_dir;
+	int result;
+	int sense_len;
+
 	struct scsi_data_buffer in_sdb;
 	struct scsi_data_buffer out_sdb;
+	struct target *c_target;
+	struct it_nexus_lu_info *itn_lu_info;
 
+	struct it_nexus *it_nexus;
 	uint64_t cmd_itn_id;
-	uint64_t offset;
-	uint32_t tl;
-	uint8_t *scb;
+	struct list_head qlist;
+	/* linked it_nexus->cmd_hash_list */
+	struct list_head c_hlist;
+	struct list_head bs_list;
+	int attribute;
+
 	int scb_len;
 	uint8_t lun[8];
-	int attribute;
-	uint64_t tag;
-	int result;
 	struct mgmt_req *mreq;
+	/* submission time when the LU is captured, see usr/capture.c */
+	uint64_t capture_stamp;
 
 	unsigned char sense_buffer[SCSI_SENSE_BUFFERSIZE];
-	int sense_len;
-
-	struct list_head bs_list;
-
-	struct it_nexus *it_nexus;
-	struct it_nexus_lu_info *itn_lu_info;
 };
 
 #define scsi_cmnd_accessor(field, type)						\
@@ -123,6 +129,7 @@ enum {
 	TGT_CMD_PROCESSED,
 	TGT_CMD_ASYNC,
 	TGT_CMD_NOT_LAST,
+	TGT_CMD_BYPASS,
 };
 
 #define CMD_FNS(bit, name)						\
@@ -143,3 +150,4 @@ CMD_FNS(QUEUED, queued)
 CMD_FNS(PROCESSED, processed)
 CMD_FNS(ASYNC, async)
 CMD_FNS(NOT_LAST, not_last)
+CMD_FNS(BYPASS, bypass)
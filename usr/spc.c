@@ -245,6 +245,56 @@ static void update_b0_opt_xfer_len(struct scsi_lu *lu, int opt_xfer_len)
 	put_unaligned_be32(opt_xfer_len, vpd_pg->data + 8);
 }
 
+/*
+ * Path checkers ask for the same few pages on every path every few
+ * seconds, so those are kept encoded per LU until its config changes
+ * (see lu_inquiry_cache_invalidate()).
+ */
+enum {
+	LU_INQ_STD,
+	LU_INQ_VPD_00,
+	LU_INQ_VPD_80,
+	LU_INQ_VPD_83,
+	LU_INQ_CACHED,
+};
+
+struct lu_inq_resp {
+	uint32_t len;		/* 0: not built yet */
+	uint8_t data[256];
+};
+
+static struct lu_inq_resp *spc_inquiry_cache(struct scsi_lu *lu, int evpd,
+					     int pcode)
+{
+	int slot;
+
+	if (!evpd)
+		slot = LU_INQ_STD;
+	else if (pcode == 0x00)
+		slot = LU_INQ_VPD_00;
+	else if (pcode == 0x80)
+		slot = LU_INQ_VPD_80;
+	else if (pcode == 0x83)
+		slot = LU_INQ_VPD_83;
+	else
+		return NULL;
+
+	if (!lu->inq_cache)
+		lu->inq_cache = zalloc(LU_INQ_CACHED * sizeof(*lu->inq_cache));
+	return lu->inq_cache ? &lu->inq_cache[slot] : NULL;
+}
+
+/*
+ * Called by everything that can change what INQUIRY returns: the LU
+ * parameters, MODE SELECT and PERSISTENT RESERVE OUT. The next INQUIRY
+ * rebuilds the pages.
+ */
+void lu_inquiry_cache_invalidate(struct scsi_lu *lu)
+{
+	free(lu->inq_cache);
+	lu->inq_cache = NULL;
+}
+
 int spc_inquiry(int host_no, struct scsi_cmd *cmd)
 {
 	int ret = SAM_STAT_CHECK_CONDITION;
@@ -258,6 +308,7 @@ int spc_inquiry(int host_no, struct scsi_cmd *cmd)
 	uint8_t devtype = 0;
 	struct lu_phy_attr *attrs;
 	struct vpd *vpd_pg;
+	struct lu_inq_resp *resp;
 	uint8_t buf[256];
 
 	if (!evpd && pcode)
@@ -267,6 +318,13 @@ int spc_inquiry(int host_no, struct scsi_cmd *cmd)
 	if (scsi_get_in_length(cmd) < alloc_len)
 		goto sense;
 
+	resp = spc_inquiry_cache(cmd->dev, evpd, pcode);
+	if (resp && resp->len) {
+		data = resp->data;
+		avail_len = resp->len;
+		goto copy;
+	}
+
 	memset(buf, 0, sizeof(buf));
 	data = buf;
 	avail_len = 0;
@@ -337,11 +395,15 @@ int spc_inquiry(int host_no, struct scsi_cmd *cmd)
 	if (ret != SAM_STAT_GOOD)
 		goto sense;
 
-	if (cmd->dev->lun != cmd->dev_id)
-		data[0] = TYPE_NO_LUN;
-
+	if (resp) {
+		memcpy(resp->data, buf, avail_len);
+		resp->len = avail_len;
+	}
+copy:
 	actual_len = spc_memcpy(scsi_get_in_buffer(cmd), &alloc_len,
 				data, avail_len);
+	if (cmd->dev->lun != cmd->dev_id && actual_len)
+		*(uint8_t *)scsi_get_in_buffer(cmd) = TYPE_NO_LUN;
 	scsi_set_in_resid_by_actual(cmd, actual_len);
 
 	return SAM_STAT_GOOD;
@@ -351,12 +413,40 @@ sense:
 	return SAM_STAT_CHECK_CONDITION;
 }
 
-int spc_report_luns(int host_no, struct scsi_cmd *cmd)
+/* the LUN list of a target, rebuilt after a LUN comes or goes */
+static int spc_report_luns_build(struct target *target)
 {
 	struct scsi_lu *lu;
-	struct list_head *dev_list = &cmd->c_target->device_list;
-	uint32_t alloc_len, avail_len, remain_len, actual_len;
-	uint64_t lun, *data, *plun;
+	uint32_t len = 8;
+	uint64_t lun;
+	uint8_t *data, *plun;
+
+	list_for_each_entry(lu, &target->device_list, device_siblings)
+		len += 8;
+
+	data = zalloc(len);
+	if (!data)
+		return -ENOMEM;
+
+	put_unaligned_be32(len - 8, data);
+	plun = data + 8;
+	list_for_each_entry(lu, &target->device_list, device_siblings) {
+		lun = lu->lun;
+		lun = ((lun > 0xff) ? (0x1 << 30) : 0) |
+		      ((0x3fff & lun) << 16);
+		put_unaligned_be64(lun << 32, plun);
+		plun += 8;
+	}
+
+	target->report_luns = data;
+	target->report_luns_len = len;
+	return 0;
+}
+
+int spc_report_luns(int host_no, struct scsi_cmd *cmd)
+{
+	struct target *target = cmd->c_target;
+	uint32_t alloc_len, actual_len;
 	unsigned char key = ILLEGAL_REQUEST;
 	uint16_t asc = ASC_INVALID_FIELD_IN_CDB;
 	uint8_t *scb = cmd->scb;
@@ -368,27 +458,14 @@ int spc_report_luns(int host_no, struct scsi_cmd *cmd)
 	if (scsi_get_in_length(cmd) < alloc_len)
 		goto sense;
 
-	data = scsi_get_in_buffer(cmd);
-	plun = data + 1;
-	remain_len = alloc_len - 8;
-	actual_len = 8;
-	avail_len = 0; /* accumulate LUN list length */
-
-	list_for_each_entry(lu, dev_list, device_siblings) {
-		if (remain_len) {
-			lun = lu->lun;
-			lun = ((lun > 0xff) ? (0x1 << 30) : 0) |
-			      ((0x3fff & lun) << 16);
-			lun = __cpu_to_be64(lun << 32);
-		}
-		actual_len += spc_memcpy((uint8_t *)plun, &remain_len,
-					 (uint8_t *)&lun, 8);
-		avail_len += 8;
-		plun++;
+	if (!target->report_luns && spc_report_luns_build(target)) {
+		key = HARDWARE_ERROR;
+		asc = ASC_INTERNAL_TGT_FAILURE;
+		goto sense;
 	}
 
-	*data = 0;
-	*((uint32_t *) data) = __cpu_to_be32(avail_len);
+	actual_len = spc_memcpy(scsi_get_in_buffer(cmd), &alloc_len,
+				target->report_luns, target->report_luns_len);
 	scsi_set_in_resid_by_actual(cmd, actual_len);
 
 	return SAM_STAT_GOOD;
@@ -482,6 +559,9 @@ int spc_mode_select(int host_no, struct scsi_cmd *cmd,
 	if (device_reserved(cmd))
 		return SAM_STAT_RESERVATION_CONFLICT;
 
+	/* pages may be updated even if a later one is rejected */
+	lu_inquiry_cache_invalidate(cmd->dev);
+
 	pf = scb[1] & 0x10;
 	sp = scb[1] & 0x01;
 
@@ -990,6 +1070,7 @@ int spc_service_action(int host_no, struct scsi_cmd *cmd)
 	uint8_t action;
 	unsigned char op = cmd->scb[0];
 	struct service_action *service_action, *actions;
+	int ret;
 
 	action = cmd->scb[1] & 0x1f;
 	actions = cmd->dev->dev_type_template.ops[op].service_actions;
@@ -1003,7 +1084,12 @@ int spc_service_action(int host_no, struct scsi_cmd *cmd)
 		return SAM_STAT_CHECK_CONDITION;
 	}
 
-	return service_action->cmd_perform(host_no, cmd);
+	ret = service_action->cmd_perform(host_no, cmd);
+	if (op == PERSISTENT_RESERVE_OUT) {
+		lu_inquiry_cache_invalidate(cmd->dev);
+		scsi_lu_fastpath_update(cmd->dev);
+	}
+	return ret;
 }
 
 static int is_pr_holder(struct scsi_lu *lu, struct registration *reg)
@@ -1907,6 +1993,7 @@ enum {
 	Opt_mode_page,
 	Opt_path, Opt_bsopts,
 	Opt_bsoflags, Opt_thinprovisioning,
+	Opt_qos, Opt_capture, Opt_analytics,
 	Opt_err,
 };
 
@@ -1929,12 +2016,17 @@ static match_table_t tokens = {
 	{Opt_bsopts, "bsopts=%s"},
 	{Opt_bsoflags, "bsoflags=%s"},
 	{Opt_thinprovisioning, "thin_provisioning=%s"},
+	{Opt_qos, "qos_%s"},
+	{Opt_capture, "capture=%s"},
+	{Opt_analytics, "analytics=%s"},
 	{Opt_err, NULL},
 };
 
 tgtadm_err spc_lu_online(struct scsi_lu *lu)
 {
 	lu->attrs.online = 1;
+	lu_inquiry_cache_invalidate(lu);
+	scsi_lu_fastpath_update(lu);
 	return TGTADM_SUCCESS;
 }
 
@@ -1944,6 +2036,8 @@ tgtadm_err spc_lu_offline(struct scsi_lu *lu)
 		return TGTADM_PREVENT_REMOVAL;
 
 	lu->attrs.online = 0;
+	lu_inquiry_cache_invalidate(lu);
+	scsi_lu_fastpath_update(lu);
 	return TGTADM_SUCCESS;
 }
 
@@ -2042,10 +2136,33 @@ tgtadm_err lu_config(struct scsi_lu *lu, char *params, match_fn_t *fn)
 			match_strncpy(buf, &args[0], sizeof(buf));
 			adm_err = tgt_device_path_update(lu->tgt, lu, buf);
 			break;
+		case Opt_qos: {
+			char *val;
+
+			match_strncpy(buf, &args[0], sizeof(buf));
+			val = strchr(buf, '=');
+			if (!val) {
+				adm_err = TGTADM_INVALID_REQUEST;
+				break;
+			}
+			*val++ = '\0';
+			adm_err = tgt_qos_update(&lu->qos, buf, val);
+			break;
+		}
+		case Opt_capture:
+			match_strncpy(buf, &args[0], sizeof(buf));
+			adm_err = lu_capture_start(lu, buf);
+			break;
+		case Opt_analytics:
+			match_strncpy(buf, &args[0], sizeof(buf));
+			adm_err = lu_analytics_enable(lu, buf);
+			break;
 		default:
 			adm_err = fn ? fn(lu, p) : TGTADM_INVALID_REQUEST;
 		}
 	}
+	lu_inquiry_cache_invalidate(lu);
+	scsi_lu_fastpath_update(lu);
 	return adm_err;
 }
 
@@ -6,6 +6,7 @@ extern struct service_action maint_in_service_actions[],
 
 extern int spc_service_action(int host_no, struct scsi_cmd *cmd);
 extern int spc_inquiry(int host_no, struct scsi_cmd *cmd);
+extern void lu_inquiry_cache_invalidate(struct scsi_lu *lu);
 extern int spc_report_luns(int host_no, struct scsi_cmd *cmd);
 extern int spc_start_stop(int host_no, struct scsi_cmd *cmd);
 extern int spc_test_unit(int host_no, struct scsi_cmd *cmd);
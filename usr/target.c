@@ -27,8 +27,10 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <ctype.h>
 
 #include "list.h"
@@ -289,6 +291,7 @@ int it_nexus_create(int tid, uint64_t itn_id, int host_no, char *info)
 	struct scsi_lu *lu;
 	struct it_nexus_lu_info *itn_lu;
 	struct timeval tv;
+	int i;
 
 	dprintf("%d %" PRIu64 " %d\n", tid, itn_id, host_no);
 	/* for reserve/release code */
@@ -334,7 +337,8 @@ int it_nexus_create(int tid, uint64_t itn_id, int host_no, char *info)
 			 &itn->itn_itl_info_list);
 	}
 
-	INIT_LIST_HEAD(&itn->cmd_list);
+	for (i = 0; i < ARRAY_SIZE(itn->cmd_hash); i++)
+		INIT_LIST_HEAD(&itn->cmd_hash[i]);
 
 	list_add_tail(&itn->nexus_siblings, &target->it_nexus_list);
 
@@ -356,7 +360,7 @@ int it_nexus_destroy(int tid, uint64_t itn_id)
 	if (!itn)
 		return -ENOENT;
 
-	if (!list_empty(&itn->cmd_list))
+	if (itn->nr_cmds)
 		return -EBUSY;
 
 	list_for_each_entry(lu, &itn->nexus_target->device_list,
@@ -381,23 +385,330 @@ static struct scsi_lu *device_lookup(struct target *target, uint64_t lun)
 	return NULL;
 }
 
+static inline struct list_head *cmd_hash_head(struct it_nexus *itn,
+					      uint64_t tag)
+{
+	return &itn->cmd_hash[hash_32(tag, IT_NEXUS_CMD_HASH_BITS)];
+}
+
 static void cmd_hlist_insert(struct it_nexus *itn, struct scsi_cmd *cmd)
 {
-	list_add(&cmd->c_hlist, &itn->cmd_list);
+	list_add(&cmd->c_hlist, cmd_hash_head(itn, cmd->tag));
+	itn->nr_cmds++;
 }
 
 static void cmd_hlist_remove(struct scsi_cmd *cmd)
 {
 	list_del(&cmd->c_hlist);
+	cmd->it_nexus->nr_cmds--;
 }
 
 static void tgt_cmd_queue_init(struct tgt_cmd_queue *q)
 {
 	q->active_cmd = 0;
+	q->bypass_cmd = 0;
 	q->state = 0;
 	INIT_LIST_HEAD(&q->queue);
 }
 
+/*
+ * QoS: token buckets for IOPS and bytes per second, per direction, on
+ * both the LU and its target. A command is admitted when every bucket
+ * it draws from holds its cost (or is full, for commands larger than
+ * the bucket); otherwise it is parked in the LU's queue, which stays
+ * throttled until the QoS timer or a completion lets it move again.
+ */
+
+#define USEC_PER_SEC	1000000ULL
+
+static LIST_HEAD(qos_throttled_list);
+static int qos_timer_fd = -1;
+static uint64_t qos_timer_expiry;
+
+static void post_cmd_done(struct tgt_cmd_queue *q);
+
+static uint64_t qos_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t qos_depth(struct tgt_qos_bucket *b)
+{
+	return b->burst ? : b->rate;
+}
+
+static void qos_refill(struct tgt_qos_bucket *b, uint64_t now)
+{
+	uint64_t depth = qos_depth(b);
+	uint64_t elapsed, add;
+
+	if (now <= b->stamp)
+		return;
+	elapsed = now - b->stamp;
+	add = elapsed / USEC_PER_SEC * b->rate +
+		elapsed % USEC_PER_SEC * b->rate / USEC_PER_SEC;
+	if (b->tokens + (int64_t) add >= (int64_t) depth) {
+		b->tokens = depth;
+		b->stamp = now;
+	} else if (add) {
+		b->tokens += add;
+		b->stamp += add * USEC_PER_SEC / b->rate;
+	}
+}
+
+/* usecs until the bucket can pay for cost, 0 if it can now */
+static uint64_t qos_bucket_wait(struct tgt_qos_bucket *b, uint64_t cost,
+				uint64_t now)
+{
+	int64_t need;
+
+	if (!b->rate || !cost)
+		return 0;
+	qos_refill(b, now);
+	need = min_t(uint64_t, cost, qos_depth(b));
+	if (b->tokens >= need)
+		return 0;
+	return (need - b->tokens) * USEC_PER_SEC / b->rate + 1;
+}
+
+static uint64_t qos_wait(struct tgt_qos *qos, int dir, uint64_t bytes,
+			 uint64_t now)
+{
+	if (!qos->enabled)
+		return 0;
+	return max(qos_bucket_wait(&qos->iops[dir], 1, now),
+		   qos_bucket_wait(&qos->bps[dir], bytes, now));
+}
+
+static void qos_charge(struct tgt_qos *qos, int dir, uint64_t bytes)
+{
+	if (!qos->enabled)
+		return;
+	if (qos->iops[dir].rate)
+		qos->iops[dir].tokens--;
+	if (qos->bps[dir].rate)
+		qos->bps[dir].tokens -= bytes;
+}
+
+static void qos_release(void)
+{
+	struct tgt_qos *qos, *next;
+
+	list_for_each_entry_safe(qos, next, &qos_throttled_list,
+				 throttled_siblings) {
+		struct scsi_lu *lu = container_of(qos, struct scsi_lu, qos);
+
+		post_cmd_done(&lu->cmd_queue);
+	}
+}
+
+static void qos_timer_handler(int fd, int events, void *data)
+{
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		eprintf("qos timer read failed, %m\n");
+	qos_timer_expiry = 0;
+	qos_release();
+}
+
+static void qos_timer_arm(uint64_t now, uint64_t wait)
+{
+	struct itimerspec its;
+	uint64_t expiry = now + wait;
+
+	if (qos_timer_fd < 0) {
+		qos_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+					      TFD_NONBLOCK | TFD_CLOEXEC);
+		if (qos_timer_fd < 0) {
+			eprintf("failed to create qos timer, %m\n");
+			return;
+		}
+		if (tgt_event_add(qos_timer_fd, EPOLLIN, qos_timer_handler,
+				  NULL)) {
+			close(qos_timer_fd);
+			qos_timer_fd = -1;
+			return;
+		}
+	}
+	if (qos_timer_expiry && qos_timer_expiry <= expiry)
+		return;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = expiry / USEC_PER_SEC;
+	its.it_value.tv_nsec = expiry % USEC_PER_SEC * 1000;
+	if (timerfd_settime(qos_timer_fd, TFD_TIMER_ABSTIME, &its, NULL))
+		eprintf("failed to arm qos timer, %m\n");
+	else
+		qos_timer_expiry = expiry;
+}
+
+/*
+ * Returns 1 and parks the queue if the command is over budget, 0 after
+ * charging its buckets otherwise.
+ */
+static int qos_throttle(struct tgt_cmd_queue *q, struct scsi_cmd *cmd)
+{
+	struct scsi_lu *lu = cmd->dev;
+	struct tgt_qos *tqos = &lu->tgt->qos;
+	uint64_t bytes, now, wait;
+	int dir;
+
+	if (!lu->qos.enabled && !tqos->enabled)
+		return 0;
+
+	switch (scsi_get_data_dir(cmd)) {
+	case DATA_READ:
+		dir = TGT_QOS_READ;
+		bytes = scsi_get_in_length(cmd);
+		break;
+	case DATA_WRITE:
+	case DATA_BIDIRECTIONAL:
+		dir = TGT_QOS_WRITE;
+		bytes = scsi_get_out_length(cmd);
+		break;
+	default:
+		return 0;
+	}
+
+	now = qos_now();
+	wait = max(qos_wait(&lu->qos, dir, bytes, now),
+		   qos_wait(tqos, dir, bytes, now));
+	if (!wait) {
+		qos_charge(&lu->qos, dir, bytes);
+		qos_charge(tqos, dir, bytes);
+		return 0;
+	}
+
+	set_queue_throttled(q);
+	if (!lu->qos.throttle_start) {
+		lu->qos.throttle_start = now;
+		list_add_tail(&lu->qos.throttled_siblings,
+			      &qos_throttled_list);
+	}
+	qos_timer_arm(now, wait);
+	return 1;
+}
+
+static void qos_unthrottled(struct scsi_lu *lu)
+{
+	struct tgt_qos *qos = &lu->qos;
+
+	if (!qos->throttle_start)
+		return;
+	qos->throttled_usecs += qos_now() - qos->throttle_start;
+	qos->throttle_start = 0;
+	list_del_init(&qos->throttled_siblings);
+}
+
+static void qos_count_throttled(struct scsi_cmd *cmd)
+{
+	switch (scsi_get_data_dir(cmd)) {
+	case DATA_READ:
+		cmd->dev->qos.throttled_cmds[TGT_QOS_READ]++;
+		break;
+	case DATA_WRITE:
+	case DATA_BIDIRECTIONAL:
+		cmd->dev->qos.throttled_cmds[TGT_QOS_WRITE]++;
+		break;
+	default:
+		break;
+	}
+}
+
+static void qos_init(struct tgt_qos *qos)
+{
+	memset(qos, 0, sizeof(*qos));
+	INIT_LIST_HEAD(&qos->throttled_siblings);
+}
+
+/*
+ * name is {read,write}_{iops,bps}[_burst], a value of 0 removes the
+ * limit or, for a burst, makes it one second worth of the rate.
+ */
+tgtadm_err tgt_qos_update(struct tgt_qos *qos, char *name, char *value)
+{
+	struct tgt_qos_bucket *b;
+	uint64_t val;
+	int dir, i;
+
+	if (!strncmp(name, "read_", 5)) {
+		dir = TGT_QOS_READ;
+		name += 5;
+	} else if (!strncmp(name, "write_", 6)) {
+		dir = TGT_QOS_WRITE;
+		name += 6;
+	} else
+		return TGTADM_INVALID_REQUEST;
+
+	if (!strncmp(name, "iops", 4)) {
+		b = &qos->iops[dir];
+		name += 4;
+	} else if (!strncmp(name, "bps", 3)) {
+		b = &qos->bps[dir];
+		name += 3;
+	} else
+		return TGTADM_INVALID_REQUEST;
+
+	if (str_to_int(value, val))
+		return TGTADM_INVALID_REQUEST;
+	if (!strcmp(name, "_burst"))
+		b->burst = val;
+	else if (!*name)
+		b->rate = val;
+	else
+		return TGTADM_INVALID_REQUEST;
+
+	/* start with a full bucket */
+	b->tokens = qos_depth(b);
+	b->stamp = qos_now();
+
+	qos->enabled = 0;
+	for (i = 0; i < TGT_QOS_DIRS; i++)
+		if (qos->iops[i].rate || qos->bps[i].rate)
+			qos->enabled = 1;
+
+	/* parked commands may be within the new limits */
+	qos_release();
+	return TGTADM_SUCCESS;
+}
+
+static void qos_show_limits(struct concat_buf *b, const char *indent,
+			    struct tgt_qos *qos)
+{
+	static const char *dir_names[TGT_QOS_DIRS] = { "read", "write" };
+	int i;
+
+	if (!qos->enabled) {
+		concat_printf(b, "%sQoS: No\n", indent);
+		return;
+	}
+	for (i = 0; i < TGT_QOS_DIRS; i++)
+		concat_printf(b, "%sQoS %s limits: IOPS: %" PRIu64
+			      " (burst %" PRIu64 "), bytes/s: %" PRIu64
+			      " (burst %" PRIu64 ")\n", indent, dir_names[i],
+			      qos->iops[i].rate, qos_depth(&qos->iops[i]),
+			      qos->bps[i].rate, qos_depth(&qos->bps[i]));
+}
+
+static void qos_show_lu(struct concat_buf *b, struct scsi_lu *lu)
+{
+	struct tgt_qos *qos = &lu->qos;
+	uint64_t usecs = qos->throttled_usecs;
+
+	if (qos->throttle_start)
+		usecs += qos_now() - qos->throttle_start;
+
+	qos_show_limits(b, _TAB3, qos);
+	concat_printf(b, _TAB3 "QoS throttled: read: %" PRIu64 ", write: %"
+		      PRIu64 " commands, %" PRIu64 " usecs\n",
+		      qos->throttled_cmds[TGT_QOS_READ],
+		      qos->throttled_cmds[TGT_QOS_WRITE], usecs);
+}
+
 tgtadm_err tgt_device_path_update(struct target *target, struct scsi_lu *lu,
 				  char *path)
 {
@@ -600,6 +911,7 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 	lu->bsoflags = lu_bsoflags;
 
 	tgt_cmd_queue_init(&lu->cmd_queue);
+	qos_init(&lu->qos);
 	INIT_LIST_HEAD(&lu->registration_list);
 	INIT_LIST_HEAD(&lu->lu_itl_info_list);
 	INIT_LIST_HEAD(&lu->mode_pages);
@@ -662,6 +974,8 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 			break;
 	}
 	list_add_tail(&lu->device_siblings, &pos->device_siblings);
+	free(target->report_luns);
+	target->report_luns = NULL;
 
 	list_for_each_entry(itn, &target->it_nexus_list, nexus_siblings) {
 		itn_lu = zalloc(sizeof(*itn_lu));
@@ -694,6 +1008,8 @@ tgtadm_err tgt_device_create(int tid, int dev_type, uint64_t lun, char *params,
 	if (backing && !path)
 		lu->dev_type_template.lu_offline(lu);
 
+	scsi_lu_fastpath_update(lu);
+
 	dprintf("Add a logical unit %" PRIu64 " to the target %d\n", lun, tid);
 out:
 	if (bstype)
@@ -757,7 +1073,8 @@ tgtadm_err tgt_device_destroy(int tid, uint64_t lun, int force)
 		return TGTADM_NO_LUN;
 	}
 
-	if (!list_empty(&lu->cmd_queue.queue) || lu->cmd_queue.active_cmd)
+	if (!list_empty(&lu->cmd_queue.queue) || lu->cmd_queue.active_cmd ||
+	    lu->cmd_queue.bypass_cmd)
 		return TGTADM_LUN_ACTIVE;
 
 	if (lu->dev_type_template.lu_exit)
@@ -786,12 +1103,17 @@ tgtadm_err tgt_device_destroy(int tid, uint64_t lun, int force)
 	}
 
 	list_del(&lu->device_siblings);
+	free(target->report_luns);
+	target->report_luns = NULL;
+	qos_unthrottled(lu);
 
 	list_for_each_entry_safe(reg, reg_next, &lu->registration_list,
 				 registration_siblings) {
 		free(reg);
 	}
 
+	lu_capture_stop(lu);
+	lu_inquiry_cache_invalidate(lu);
 	free(lu);
 
 	list_for_each_entry(itn, &target->it_nexus_list, nexus_siblings) {
@@ -915,6 +1237,7 @@ int device_reserve(struct scsi_cmd *cmd)
 	}
 
 	lu->reserve_id = cmd->cmd_itn_id;
+	scsi_lu_fastpath_update(lu);
 	return 0;
 }
 
@@ -931,6 +1254,7 @@ int device_release(int tid, uint64_t itn_id, uint64_t lun, int force)
 
 	if (force || lu->reserve_id == itn_id) {
 		lu->reserve_id = 0;
+		scsi_lu_fastpath_update(lu);
 		return 0;
 	}
 
@@ -1033,6 +1357,25 @@ tgtadm_err tgt_stat_device_by_id(int tid, uint64_t dev_id, struct concat_buf *b)
 	return adm_err;
 }
 
+tgtadm_err tgt_stat_analytics_by_id(int tid, uint64_t dev_id, char *value,
+				   struct concat_buf *b)
+{
+	struct target *target;
+	struct scsi_lu *lu;
+
+	target = target_lookup(tid);
+	if (!target)
+		return TGTADM_NO_TARGET;
+
+	lu = device_lookup(target, dev_id);
+	if (!lu) {
+		eprintf("device %" PRIu64 " not found\n", dev_id);
+		return TGTADM_NO_LUN;
+	}
+
+	return lu_analytics_show(lu, value, b);
+}
+
 tgtadm_err tgt_stat_target(struct target *target, struct concat_buf *b)
 {
 	struct scsi_lu *lu;
@@ -1084,11 +1427,12 @@ static int cmd_enabled(struct tgt_cmd_queue *q, struct scsi_cmd *cmd)
 
 	switch (cmd->attribute) {
 	case MSG_SIMPLE_TAG:
-		if (!queue_blocked(q))
+		if (!queue_blocked(q) && !queue_throttled(q))
 			enabled = 1;
 		break;
 	case MSG_ORDERED_TAG:
-		if (!queue_blocked(q) && !queue_active(q))
+		if (!queue_blocked(q) && !queue_throttled(q) &&
+		    !queue_active(q))
 			enabled = 1;
 		break;
 	case MSG_HEAD_TAG:
@@ -1097,7 +1441,8 @@ static int cmd_enabled(struct tgt_cmd_queue *q, struct scsi_cmd *cmd)
 	default:
 		eprintf("unknown command attribute %x\n", cmd->attribute);
 		cmd->attribute = MSG_ORDERED_TAG;
-		if (!queue_blocked(q) && !queue_active(q))
+		if (!queue_blocked(q) && !queue_throttled(q) &&
+		    !queue_active(q))
 			enabled = 1;
 	}
 
@@ -1172,6 +1517,27 @@ int target_cmd_queue(int tid, struct scsi_cmd *cmd)
 	return cmd->dev->cmd_perform(tid, cmd);
 }
 
+/*
+ * multipathd and ESXi poll every path with TUR, INQUIRY and REPORT
+ * LUNS. None of them touch the medium, so unless something ordered is
+ * pending they are answered right away, without counting as active
+ * on the LU queue or being throttled.
+ */
+static int cmd_bypass_queue(struct tgt_cmd_queue *q, struct scsi_cmd *cmd)
+{
+	switch (cmd->scb[0]) {
+	case TEST_UNIT_READY:
+	case INQUIRY:
+	case REPORT_LUNS:
+		break;
+	default:
+		return 0;
+	}
+
+	return cmd->attribute == MSG_SIMPLE_TAG && !queue_blocked(q) &&
+		list_empty(&q->queue);
+}
+
 /*
  * Used by all non bs_sg backstores for internal STGT port emulation
  */
@@ -1181,8 +1547,21 @@ int target_cmd_perform(int tid, struct scsi_cmd *cmd)
 	int result, enabled = 0;
 
 	cmd_hlist_insert(cmd->it_nexus, cmd);
+	cmd->capture_stamp = 0;
+
+	if (cmd_bypass_queue(q, cmd)) {
+		set_cmd_bypass(cmd);
+		q->bypass_cmd++;
+		result = scsi_cmd_perform(cmd->it_nexus->host_no, cmd);
+		set_cmd_processed(cmd);
+		if (!cmd_async(cmd))
+			target_cmd_io_done(cmd, result);
+		return 0;
+	}
 
 	enabled = cmd_enabled(q, cmd);
+	if (enabled && qos_throttle(q, cmd))
+		enabled = 0;
 	dprintf("%p %x %" PRIx64 " %d\n", cmd, cmd->scb[0], cmd->dev_id,
 		enabled);
 
@@ -1202,6 +1581,8 @@ int target_cmd_perform(int tid, struct scsi_cmd *cmd)
 			target_cmd_io_done(cmd, result);
 	} else {
 		set_cmd_queued(cmd);
+		if (queue_throttled(q))
+			qos_count_throttled(cmd);
 		dprintf("blocked %" PRIx64 " %x %" PRIu64 " %d\n",
 			cmd->tag, cmd->scb[0], cmd->dev->lun, q->active_cmd);
 
@@ -1219,6 +1600,7 @@ int target_cmd_perform_passthrough(int tid, struct scsi_cmd *cmd)
 	int result;
 
 	dprintf("%p %x %" PRIx64 " PT\n", cmd, cmd->scb[0], cmd->dev_id);
+	cmd->capture_stamp = 0;
 
 	result = cmd->dev->dev_type_template.cmd_passthrough(tid, cmd);
 
@@ -1255,6 +1637,8 @@ void target_cmd_io_done(struct scsi_cmd *cmd, int result)
 	}
 	if (result != SAM_STAT_GOOD)
 		stat->err_num++;
+	if (cmd->dev->capture)
+		lu_capture_done(cmd, result);
 
 	tgt_drivers[lid]->cmd_end_notify(cmd->cmd_itn_id, result, cmd);
 	return;
@@ -1265,8 +1649,13 @@ static void post_cmd_done(struct tgt_cmd_queue *q)
 	struct scsi_cmd *cmd, *tmp;
 	int enabled, result;
 
+	/* buckets are checked again below */
+	clear_queue_throttled(q);
+
 	list_for_each_entry_safe(cmd, tmp, &q->queue, qlist) {
 		enabled = cmd_enabled(q, cmd);
+		if (enabled && qos_throttle(q, cmd))
+			enabled = 0;
 		if (enabled) {
 			int tid = cmd->c_target->tid;
 			uint64_t itn_id = cmd->cmd_itn_id;
@@ -1287,6 +1676,9 @@ static void post_cmd_done(struct tgt_cmd_queue *q)
 		} else
 			break;
 	}
+
+	if (!queue_throttled(q))
+		qos_unthrottled(container_of(q, struct scsi_lu, cmd_queue));
 }
 
 /*
@@ -1304,6 +1696,13 @@ static void __cmd_done(struct target *target, struct scsi_cmd *cmd)
 		scsi_get_in_length(cmd));
 
 	q = &cmd->dev->cmd_queue;
+
+	/* never counted on the queue, see cmd_bypass_queue() */
+	if (cmd_bypass(cmd)) {
+		q->bypass_cmd--;
+		return;
+	}
+
 	q->active_cmd--;
 	switch (cmd->attribute) {
 	case MSG_ORDERED_TAG:
@@ -1370,26 +1769,49 @@ static int abort_cmd(struct target *target, struct mgmt_req *mreq,
 	return err;
 }
 
-static int abort_task_set(struct mgmt_req *mreq, struct target *target,
+static int abort_cmd_list(struct mgmt_req *mreq, struct target *target,
+			  struct it_nexus *itn, struct list_head *head,
 			  uint64_t itn_id, uint64_t tag, uint8_t *lun, int all)
 {
 	struct scsi_cmd *cmd, *tmp;
-	struct it_nexus *itn;
 	int err, count = 0;
 
+	list_for_each_entry_safe(cmd, tmp, head, c_hlist) {
+		if ((all && itn->itn_id == itn_id) ||
+		    (cmd->tag == tag && itn->itn_id == itn_id) ||
+		    (lun && !memcmp(cmd->lun, lun, sizeof(cmd->lun)))) {
+			err = abort_cmd(target, mreq, cmd);
+			if (err)
+				mreq->busy++;
+			count++;
+		}
+	}
+	return count;
+}
+
+static int abort_task_set(struct mgmt_req *mreq, struct target *target,
+			  uint64_t itn_id, uint64_t tag, uint8_t *lun, int all)
+{
+	struct it_nexus *itn;
+	int i, count = 0;
+
 	eprintf("\nfound %" PRIx64 " %d\n", tag, all);
 
 	list_for_each_entry(itn, &target->it_nexus_list, nexus_siblings) {
-		list_for_each_entry_safe(cmd, tmp, &itn->cmd_list, c_hlist) {
-			if ((all && itn->itn_id == itn_id) ||
-			    (cmd->tag == tag && itn->itn_id == itn_id) ||
-			    (lun && !memcmp(cmd->lun, lun, sizeof(cmd->lun)))) {
-				err = abort_cmd(target, mreq, cmd);
-				if (err)
-					mreq->busy++;
-				count++;
-			}
+		/* ABORT TASK only has to look at one bucket of one nexus */
+		if (!all && !lun) {
+			if (itn->itn_id != itn_id)
+				continue;
+			count += abort_cmd_list(mreq, target, itn,
+						cmd_hash_head(itn, tag),
+						itn_id, tag, lun, all);
+			continue;
 		}
+
+		for (i = 0; i < ARRAY_SIZE(itn->cmd_hash); i++)
+			count += abort_cmd_list(mreq, target, itn,
+						&itn->cmd_hash[i],
+						itn_id, tag, lun, all);
 	}
 	return count;
 }
@@ -2037,6 +2459,17 @@ static char *print_type(int type)
 	return name;
 }
 
+tgtadm_err tgt_set_target_qos(int tid, char *name, char *value)
+{
+	struct target *target;
+
+	target = target_lookup(tid);
+	if (!target)
+		return TGTADM_NO_TARGET;
+
+	return tgt_qos_update(&target->qos, name + strlen("qos_"), value);
+}
+
 tgtadm_err tgt_target_show_all(struct concat_buf *b)
 {
 	char strflags[128];
@@ -2058,6 +2491,7 @@ tgtadm_err tgt_target_show_all(struct concat_buf *b)
 
 		if (!strcmp(tgt_drivers[target->lid]->name, "iscsi"))
 			iscsi_print_nop_settings(b, target->tid);
+		qos_show_limits(b, _TAB2, &target->qos);
 
 		concat_printf(b, _TAB1 "I_T nexus information:\n");
 
@@ -2071,7 +2505,7 @@ tgtadm_err tgt_target_show_all(struct concat_buf *b)
 		}
 
 		concat_printf(b, _TAB1 "LUN information:\n");
-		list_for_each_entry(lu, &target->device_list, device_siblings)
+		list_for_each_entry(lu, &target->device_list, device_siblings) {
 			concat_printf(b,
 				_TAB2 "LUN: %" PRIu64 "\n"
 				_TAB3 "Type: %s\n"
@@ -2105,6 +2539,11 @@ tgtadm_err tgt_target_show_all(struct concat_buf *b)
 				lu->path ? : "None",
 					open_flags_to_str(strflags,
 							  lu->bsoflags));
+			qos_show_lu(b, lu);
+			lu_capture_show(lu, b);
+			if (lu->bst && lu->bst->bs_show)
+				lu->bst->bs_show(lu, b);
+		}
 
 		if (!strcmp(tgt_drivers[target->lid]->name, "iscsi") ||
 		    !strcmp(tgt_drivers[target->lid]->name, "iser")) {
@@ -2231,6 +2670,7 @@ tgtadm_err tgt_target_create(int lld, int tid, char *args)
 	INIT_LIST_HEAD(&target->acl_list);
 	INIT_LIST_HEAD(&target->iqn_acl_list);
 	INIT_LIST_HEAD(&target->it_nexus_list);
+	qos_init(&target->qos);
 
 	tgt_device_create(tid, TYPE_RAID, 0, NULL, 0);
 
@@ -2318,6 +2758,7 @@ tgtadm_err tgt_target_destroy(int lld_no, int tid, int force)
 	list_del(&target->lld_siblings);
 
 	free(target->account.in_aids);
+	free(target->report_luns);
 	free(target->name);
 	free(target);
 
@@ -31,6 +31,9 @@ struct target {
 	struct list_head target_siblings;
 
 	struct list_head device_list;
+	/* pre-encoded REPORT LUNS data, see spc_report_luns() */
+	uint8_t *report_luns;
+	uint32_t report_luns_len;
 
 	struct list_head it_nexus_list;
 
@@ -42,14 +45,21 @@ struct target {
 
 	struct tgt_account account;
 
+	struct tgt_qos qos;
+
 	struct list_head lld_siblings;
 };
 
+#define IT_NEXUS_CMD_HASH_BITS	6
+#define IT_NEXUS_CMD_HASH_SIZE	(1 << IT_NEXUS_CMD_HASH_BITS)
+
 struct it_nexus {
 	uint64_t itn_id;
 	long ctime;
 
-	struct list_head cmd_list;
+	/* outstanding commands hashed by tag (cmd->c_hlist) */
+	struct list_head cmd_hash[IT_NEXUS_CMD_HASH_SIZE];
+	int nr_cmds;
 
 	struct target *nexus_target;
 
@@ -68,6 +78,7 @@ struct it_nexus {
 enum {
 	TGT_QUEUE_BLOCKED,
 	TGT_QUEUE_DELETED,
+	TGT_QUEUE_THROTTLED,
 };
 
 #define QUEUE_FNS(bit, name)						\
@@ -91,5 +102,6 @@ static inline int queue_active(const struct tgt_cmd_queue *q)		\
 
 QUEUE_FNS(BLOCKED, blocked)
 QUEUE_FNS(DELETED, deleted)
+QUEUE_FNS(THROTTLED, throttled)
 
 #endif
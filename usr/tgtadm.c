@@ -172,6 +172,11 @@ static void usage(int status)
 		"--lld <driver> --mode logicalunit --op delete --tid <id> --lun <lun>\n"
 		"\tdelete the specific logical unit with <lun> that\n"
 		"\tthe target with <id> has.\n"
+		"--lld <driver> --mode logicalunit --op stat --tid <id> --lun <lun>\n"
+		"  [--name analytics --value text|json|reset]\n"
+		"\tshow the I/O statistics of the logical unit, or its\n"
+		"\tdecayed I/O profile: size and inter-arrival histograms,\n"
+		"\tsequential share and hot regions.\n"
 		"--lld <driver> --mode account --op new --user <name> --password <pass>\n"
 		"\tadd a new account with <name> and <pass>.\n"
 		"--lld <driver> --mode account --op delete --user <name>\n"
@@ -847,7 +852,6 @@ int main(int argc, char **argv)
 			}
 			break;
 		case OP_DELETE:
-		case OP_STATS:
 			rc = verify_mode_params(argc, argv, "LmotlC");
 			if (rc) {
 				eprintf("logicalunit mode: option '-%c' is not "
@@ -855,6 +859,24 @@ int main(int argc, char **argv)
 				exit(EINVAL);
 			}
 			break;
+		case OP_STATS:
+			rc = verify_mode_params(argc, argv, "LmotlnvC");
+			if (rc) {
+				eprintf("logicalunit mode: option '-%c' is not "
+					  "allowed/supported\n", rc);
+				exit(EINVAL);
+			}
+			if (name && strcmp(name, "analytics")) {
+				eprintf("logicalunit mode: unknown stat '%s'\n",
+					name);
+				exit(EINVAL);
+			}
+			if (name && !value) {
+				eprintf("stat operation requires 'value' with "
+					"'name'\n");
+				exit(EINVAL);
+			}
+			break;
 		case OP_UPDATE:
 			rc = verify_mode_params(argc, argv, "LmofytlPC");
 			if (rc) {
@@ -0,0 +1,2223 @@
+/*
+ *	iSCSI initiator load generator
+ *
+ * Logs a number of sessions into a target over TCP and keeps a fixed
+ * number of READ(16)/WRITE(16) commands in flight on each, with
+ * immediate, unsolicited and solicited data and optional CRC32C
+ * digests, then reports IOPS, bandwidth and latency percentiles. It
+ * talks to tgtd directly, so no kernel initiator is needed.
+ *
+ * With --erl-check it runs the error recovery checks instead, see
+ * erl_run().
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "util.h"
+#include "scsi.h"
+#include "crc32c.h"
+#include "iscsi/iscsi_proto.h"
+
+#define NSEC_PER_SEC		1000000000ULL
+#define BHS_LEN			((uint32_t)sizeof(struct iscsi_hdr))
+#define DIGEST_LEN		4
+#define MAX_RECV_DLENGTH	262144	/* ours, Data-In segments */
+#define MAX_BURST		16776192
+#define LOGIN_DLENGTH		8192
+#define LOGIN_ROUNDS		8
+#define STALL_SECS		30
+#define TX_IOV			64
+#define ERL_LEN			65536	/* --erl-check, per command */
+#define ERL_DLENGTH		8192	/* ours, 8 Data-In per READ */
+#define ERL_SEGS		(ERL_LEN / ERL_DLENGTH)
+#define ERL_TIMEOUT		5	/* secs for an answer */
+
+#define HIST_SUB_BITS		4	/* 16 buckets per power of two */
+#define HIST_BUCKETS		(64 << HIST_SUB_BITS)
+
+enum {
+	DIR_READ,
+	DIR_WRITE,
+	DIRS,
+};
+
+static const char *dir_name[DIRS] = {
+	"read", "write",
+};
+
+struct bench_hist {
+	uint64_t count;
+	uint64_t sum;		/* nsecs */
+	uint64_t max;
+	uint64_t bucket[HIST_BUCKETS];
+};
+
+struct bench_task {
+	int busy;
+	int sync;		/* setup command, not counted */
+	int write;
+	int status;
+	uint32_t length;
+	uint64_t issue;		/* nsecs */
+
+	/* synchronous setup commands */
+	uint8_t *buf;
+	uint32_t buf_len;
+};
+
+struct tx_pdu {
+	uint8_t hdr[BHS_LEN + DIGEST_LEN];
+	uint8_t trailer[PAD_WORD_LEN + DIGEST_LEN];
+	const void *data;
+	uint32_t hdr_len;
+	uint32_t data_len;
+	uint32_t trailer_len;
+};
+
+struct bench_thread;
+
+struct bench_session {
+	int fd;
+	int id;
+	struct bench_thread *th;
+	uint8_t isid[6];
+	uint16_t tsih;
+	int dead;
+	uint8_t *wbuf;		/* bench.wbuf but in some erl checks */
+
+	uint32_t cmdsn;
+	uint32_t max_cmdsn;
+	uint32_t exp_statsn;
+
+	/* negotiated */
+	int hdigest;
+	int ddigest;
+	uint32_t max_xmit;	/* the target's MaxRecvDataSegmentLength */
+	uint32_t first_burst;
+	uint32_t max_burst;
+	int initial_r2t;
+	int imm_data;
+	int erl;
+
+	struct bench_task *tasks;
+	uint32_t *free_tasks;
+	unsigned int nr_free;
+	unsigned int inflight;
+	uint64_t next_lba;	/* sequential pattern */
+	uint64_t last_done;
+
+	uint8_t *rx;
+	size_t rx_size;
+	size_t rx_pos;
+	size_t rx_len;
+
+	struct tx_pdu *tx;
+	unsigned int tx_size;	/* power of two */
+	unsigned int tx_head;
+	unsigned int tx_tail;
+	size_t tx_off;
+	int tx_wait;		/* EPOLLOUT armed */
+};
+
+struct bench_thread {
+	pthread_t thread;
+	int id;
+	int epfd;
+	struct bench_session **sessions;
+	int nr_sessions;
+	uint64_t rnd;
+	int failed;
+
+	struct bench_hist hist[DIRS];
+	uint64_t bytes[DIRS];
+	uint64_t errors;
+};
+
+struct bench {
+	char *host;
+	char *port;
+	char *target;
+	char *initiator;
+	uint64_t lun;
+	int sessions;
+	int threads;
+	unsigned int depth;
+	uint32_t block_size;
+	int read_pct;
+	int seq;
+	int hdigest;
+	int ddigest;
+	int runtime;		/* secs */
+	int ramp;
+	int csv;
+	int erl;		/* error recovery checks, no load */
+
+	uint8_t lun_id[8];
+	uint32_t lu_blk_size;
+	uint64_t lu_blocks;
+	uint8_t *wbuf;		/* write data, shared by everybody */
+
+	uint64_t start;		/* nsecs, measuring window */
+	uint64_t end;
+	volatile int stop;
+};
+
+static struct bench bench;
+
+static char program_name[] = "tgtbench";
+
+static char *short_options = "hH:p:T:I:l:n:j:q:b:r:P:d:t:w:xe";
+
+struct option const long_options[] = {
+	{"help", no_argument, NULL, 'h'},
+	{"host", required_argument, NULL, 'H'},
+	{"port", required_argument, NULL, 'p'},
+	{"targetname", required_argument, NULL, 'T'},
+	{"initiator-name", required_argument, NULL, 'I'},
+	{"lun", required_argument, NULL, 'l'},
+	{"sessions", required_argument, NULL, 'n'},
+	{"threads", required_argument, NULL, 'j'},
+	{"queue-depth", required_argument, NULL, 'q'},
+	{"block-size", required_argument, NULL, 'b'},
+	{"read-pct", required_argument, NULL, 'r'},
+	{"pattern", required_argument, NULL, 'P'},
+	{"digest", required_argument, NULL, 'd'},
+	{"runtime", required_argument, NULL, 't'},
+	{"ramp", required_argument, NULL, 'w'},
+	{"csv", no_argument, NULL, 'x'},
+	{"erl-check", no_argument, NULL, 'e'},
+	{NULL, 0, NULL, 0},
+};
+
+static void usage(int status)
+{
+	if (status != 0)
+		fprintf(stderr, "Try `%s --help' for more information.\n", program_name);
+	else {
+		printf("Usage: %s [OPTION]\n", program_name);
+		printf("\
+Linux SCSI Target Framework iSCSI Load Generator, version %s\n\
+\n\
+  --targetname=[name] [--host=[host]] [--port=[port]] [--lun=[lun]]\n\
+	[--initiator-name=[name]] [--sessions=[n]] [--threads=[n]]\n\
+	[--queue-depth=[n]] [--block-size=[bytes]] [--read-pct=[pct]]\n\
+	[--pattern=[pattern]] [--digest=[digest]] [--runtime=[secs]]\n\
+	[--ramp=[secs]] [--csv]\n\
+			log [n] sessions into the target at [host]\n\
+			(default 127.0.0.1) and [port] (default 3260)\n\
+			and drive [lun] (default 1) for [secs]\n\
+			(default 10) after [ramp] (default 0).\n\
+			DATA ON THE LUN IS OVERWRITTEN UNLESS\n\
+			--read-pct IS 100.\n\
+			--queue-depth is per session (default 32),\n\
+			--block-size defaults to 4096.\n\
+			[pct] is the share of reads (default 100).\n\
+			[pattern] is rand (default) or seq.\n\
+			[digest] is none (default), header, data\n\
+				or all.\n\
+			--csv prints a single line: iops, MB/s and,\n\
+				per direction, iops, avg, p50, p99,\n\
+				p99.9 and max usecs, then errors.\n\
+  --targetname=[name] --erl-check [--host=[host]] [--port=[port]]\n\
+	[--lun=[lun]] [--initiator-name=[name]] [--digest=[digest]]\n\
+			check the target's recovery at\n\
+			ErrorRecoveryLevel 2 from a data digest\n\
+			error, lost PDUs and a dropped connection.\n\
+			The data digest is always on. The first\n\
+			896KiB of [lun] are overwritten.\n\
+  --help                display this help and exit\n\
+\n\
+Report bugs to <stgt@vger.kernel.org>.\n", TGT_VERSION);
+	}
+	exit(status == 0 ? 0 : EINVAL);
+}
+
+static uint64_t now_nsecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static uint64_t xorshift64(uint64_t *s)
+{
+	uint64_t x = *s;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *s = x;
+}
+
+static inline int sn_before(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+/* log-linear, the error is below 1/16 of the value */
+static unsigned int hist_index(uint64_t v)
+{
+	unsigned int msb;
+
+	if (v < (1U << HIST_SUB_BITS))
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+		((v >> (msb - HIST_SUB_BITS)) & ((1U << HIST_SUB_BITS) - 1));
+}
+
+static uint64_t hist_value(unsigned int idx)
+{
+	unsigned int group = idx >> HIST_SUB_BITS;
+	uint64_t sub = idx & ((1U << HIST_SUB_BITS) - 1);
+
+	if (!group)
+		return sub;
+	return (sub | (1ULL << HIST_SUB_BITS)) << (group - 1);
+}
+
+static void hist_add(struct bench_hist *h, uint64_t v)
+{
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+	h->bucket[hist_index(v)]++;
+}
+
+static void hist_merge(struct bench_hist *to, struct bench_hist *from)
+{
+	int i;
+
+	to->count += from->count;
+	to->sum += from->sum;
+	if (from->max > to->max)
+		to->max = from->max;
+	for (i = 0; i < HIST_BUCKETS; i++)
+		to->bucket[i] += from->bucket[i];
+}
+
+/* middle of the bucket holding the pct-th percentile */
+static uint64_t hist_percentile(struct bench_hist *h, double pct)
+{
+	uint64_t seen = 0, rank;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	rank = h->count * pct / 100;
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		seen += h->bucket[i];
+		if (seen >= rank)
+			break;
+	}
+	return min_t(uint64_t, (hist_value(i) + hist_value(i + 1)) / 2,
+		     h->max);
+}
+
+static void lun_to_id(uint64_t lun, uint8_t *id)
+{
+	memset(id, 0, 8);
+	if (lun < 256)
+		id[1] = lun;
+	else {
+		/* flat space addressing */
+		id[0] = 0x40 | ((lun >> 8) & 0x3f);
+		id[1] = lun & 0xff;
+	}
+}
+
+static uint32_t digest(const void *p1, size_t len1, const void *p2,
+		       size_t len2)
+{
+	uint32_t crc = ~0;
+
+	crc = crc32c(crc, p1, len1);
+	if (len2)
+		crc = crc32c(crc, p2, len2);
+	return ~crc;
+}
+
+/*
+ * Transmit side: a ring of PDUs whose data segment points into the
+ * shared write buffer, sent with writev() without copying.
+ */
+static struct tx_pdu *pdu_new(struct bench_session *s)
+{
+	struct tx_pdu *pdu;
+
+	if (s->tx_tail - s->tx_head == s->tx_size) {
+		unsigned int i, n = s->tx_tail - s->tx_head;
+		struct tx_pdu *tx;
+
+		tx = malloc(sizeof(*tx) * s->tx_size * 2);
+		if (!tx) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		for (i = 0; i < n; i++)
+			tx[i] = s->tx[(s->tx_head + i) & (s->tx_size - 1)];
+		free(s->tx);
+		s->tx = tx;
+		s->tx_size *= 2;
+		s->tx_head = 0;
+		s->tx_tail = n;
+	}
+
+	pdu = &s->tx[s->tx_tail & (s->tx_size - 1)];
+	memset(pdu->hdr, 0, BHS_LEN);
+	return pdu;
+}
+
+static void pdu_commit(struct bench_session *s, struct tx_pdu *pdu,
+		       const void *data, uint32_t len, int login)
+{
+	struct iscsi_hdr *hdr = (struct iscsi_hdr *)pdu->hdr;
+	uint32_t pad = roundup(len, PAD_WORD_LEN) - len, crc;
+
+	hton24(hdr->dlength, len);
+	pdu->hdr_len = BHS_LEN;
+	if (s->hdigest && !login) {
+		crc = digest(hdr, BHS_LEN, NULL, 0);
+		memcpy(pdu->hdr + BHS_LEN, &crc, DIGEST_LEN);
+		pdu->hdr_len += DIGEST_LEN;
+	}
+
+	pdu->data = data;
+	pdu->data_len = len;
+	pdu->trailer_len = pad;
+	memset(pdu->trailer, 0, pad);
+	if (s->ddigest && !login && len) {
+		crc = digest(data, len, pdu->trailer, pad);
+		memcpy(pdu->trailer + pad, &crc, DIGEST_LEN);
+		pdu->trailer_len += DIGEST_LEN;
+	}
+
+	s->tx_tail++;
+}
+
+static void iov_add(struct iovec *iov, int *nr, const void *base, size_t len,
+		    size_t *skip)
+{
+	if (*skip >= len) {
+		*skip -= len;
+		return;
+	}
+	iov[*nr].iov_base = (char *)base + *skip;
+	iov[*nr].iov_len = len - *skip;
+	(*nr)++;
+	*skip = 0;
+}
+
+/* 1 if everything went out, 0 if the socket is full, -1 on error */
+static int session_flush(struct bench_session *s)
+{
+	struct iovec iov[TX_IOV];
+	struct tx_pdu *pdu;
+	unsigned int i;
+	size_t skip, len;
+	ssize_t ret;
+	int nr;
+
+	while (s->tx_head != s->tx_tail) {
+		nr = 0;
+		skip = s->tx_off;
+		for (i = s->tx_head; i != s->tx_tail && nr <= TX_IOV - 3; i++) {
+			pdu = &s->tx[i & (s->tx_size - 1)];
+			iov_add(iov, &nr, pdu->hdr, pdu->hdr_len, &skip);
+			if (pdu->data_len)
+				iov_add(iov, &nr, pdu->data, pdu->data_len,
+					&skip);
+			if (pdu->trailer_len)
+				iov_add(iov, &nr, pdu->trailer,
+					pdu->trailer_len, &skip);
+		}
+
+		ret = writev(s->fd, iov, nr);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				return 0;
+			fprintf(stderr, "session %d: send: %m\n", s->id);
+			return -1;
+		}
+
+		while (ret) {
+			pdu = &s->tx[s->tx_head & (s->tx_size - 1)];
+			len = pdu->hdr_len + pdu->data_len + pdu->trailer_len -
+				s->tx_off;
+			if (ret < len) {
+				s->tx_off += ret;
+				break;
+			}
+			ret -= len;
+			s->tx_off = 0;
+			s->tx_head++;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Receive side: PDUs are parsed in place, Data-In payloads are checked
+ * against the data digest and dropped.
+ */
+static ssize_t rx_pdu_len(struct bench_session *s, int login)
+{
+	struct iscsi_hdr *hdr = (struct iscsi_hdr *)(s->rx + s->rx_pos);
+	size_t avail = s->rx_len - s->rx_pos, len;
+	uint32_t dlen;
+
+	if (avail < BHS_LEN)
+		return 0;
+
+	dlen = ntoh24(hdr->dlength);
+	len = BHS_LEN + hdr->hlength * 4 + roundup(dlen, PAD_WORD_LEN);
+	if (!login) {
+		if (s->hdigest)
+			len += DIGEST_LEN;
+		if (s->ddigest && dlen)
+			len += DIGEST_LEN;
+	}
+	if (len > s->rx_size) {
+		fprintf(stderr, "session %d: PDU of %zu bytes, opcode 0x%x\n",
+			s->id, len, hdr->opcode);
+		return -1;
+	}
+	return avail < len ? 0 : len;
+}
+
+static int rx_pdu_check(struct bench_session *s, struct iscsi_hdr **hdrp,
+			uint8_t **datap, uint32_t *dlenp, int login)
+{
+	struct iscsi_hdr *hdr = (struct iscsi_hdr *)(s->rx + s->rx_pos);
+	uint32_t ahs = hdr->hlength * 4, dlen = ntoh24(hdr->dlength);
+	uint8_t *p = s->rx + s->rx_pos + BHS_LEN + ahs;
+	uint32_t crc;
+
+	if (s->hdigest && !login) {
+		crc = digest(hdr, BHS_LEN + ahs, NULL, 0);
+		if (memcmp(&crc, p, DIGEST_LEN)) {
+			fprintf(stderr, "session %d: header digest error\n",
+				s->id);
+			return -1;
+		}
+		p += DIGEST_LEN;
+	}
+
+	if (s->ddigest && !login && dlen) {
+		crc = digest(p, roundup(dlen, PAD_WORD_LEN), NULL, 0);
+		if (memcmp(&crc, p + roundup(dlen, PAD_WORD_LEN), DIGEST_LEN)) {
+			fprintf(stderr, "session %d: data digest error\n",
+				s->id);
+			return -1;
+		}
+	}
+
+	*hdrp = hdr;
+	*datap = p;
+	*dlenp = dlen;
+	return 0;
+}
+
+static void rx_compact(struct bench_session *s)
+{
+	if (!s->rx_pos)
+		return;
+	memmove(s->rx, s->rx + s->rx_pos, s->rx_len - s->rx_pos);
+	s->rx_len -= s->rx_pos;
+	s->rx_pos = 0;
+}
+
+/* blocking, for login, setup and logout */
+static int session_recv_pdu(struct bench_session *s, struct iscsi_hdr **hdr,
+			    uint8_t **data, uint32_t *dlen, int login)
+{
+	ssize_t len, ret;
+
+	while (!(len = rx_pdu_len(s, login))) {
+		rx_compact(s);
+		ret = recv(s->fd, s->rx + s->rx_len, s->rx_size - s->rx_len, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			fprintf(stderr, "session %d: %s\n", s->id,
+				!ret ? "connection closed" : errno == EAGAIN ?
+				"timed out" : strerror(errno));
+			return -1;
+		}
+		s->rx_len += ret;
+	}
+	if (len < 0 || rx_pdu_check(s, hdr, data, dlen, login))
+		return -1;
+	s->rx_pos += len;
+	return 0;
+}
+
+static void session_update_sn(struct bench_session *s, uint32_t exp_cmdsn,
+			      uint32_t max_cmdsn)
+{
+	exp_cmdsn = __be32_to_cpu(exp_cmdsn);
+	max_cmdsn = __be32_to_cpu(max_cmdsn);
+
+	/* a MaxCmdSN below ExpCmdSN - 1 is to be ignored */
+	if (sn_before(max_cmdsn, exp_cmdsn - 1))
+		return;
+	if (sn_before(s->max_cmdsn, max_cmdsn))
+		s->max_cmdsn = max_cmdsn;
+}
+
+static void session_data_out(struct bench_session *s, uint32_t itt,
+			     uint32_t ttt, uint32_t offset, uint32_t length)
+{
+	struct iscsi_data *hdr;
+	struct tx_pdu *pdu;
+	uint32_t datasn = 0, len;
+
+	while (length) {
+		len = min_t(uint32_t, length, s->max_xmit);
+		pdu = pdu_new(s);
+		hdr = (struct iscsi_data *)pdu->hdr;
+		hdr->opcode = ISCSI_OP_SCSI_DATA_OUT;
+		if (len == length)
+			hdr->flags = ISCSI_FLAG_CMD_FINAL;
+		memcpy(hdr->lun, bench.lun_id, sizeof(hdr->lun));
+		hdr->itt = __cpu_to_be32(itt);
+		hdr->ttt = ttt;
+		hdr->exp_statsn = __cpu_to_be32(s->exp_statsn);
+		hdr->datasn = __cpu_to_be32(datasn++);
+		hdr->offset = __cpu_to_be32(offset);
+		pdu_commit(s, pdu, s->wbuf + offset, len, 0);
+
+		offset += len;
+		length -= len;
+	}
+}
+
+static void session_send_cmd(struct bench_session *s, uint32_t itt,
+			     uint8_t *cdb, int write, uint32_t length)
+{
+	struct iscsi_cmd *hdr;
+	struct tx_pdu *pdu;
+	uint32_t imm = 0, unsol = 0;
+
+	if (write) {
+		if (!s->initial_r2t)
+			unsol = min_t(uint32_t, length, s->first_burst);
+		if (s->imm_data)
+			imm = min(min(length, s->first_burst), s->max_xmit);
+		unsol = max(unsol, imm);
+	}
+
+	pdu = pdu_new(s);
+	hdr = (struct iscsi_cmd *)pdu->hdr;
+	hdr->opcode = ISCSI_OP_SCSI_CMD;
+	hdr->flags = ISCSI_ATTR_SIMPLE;
+	if (unsol == imm)
+		hdr->flags |= ISCSI_FLAG_CMD_FINAL;
+	if (length)
+		hdr->flags |= write ? ISCSI_FLAG_CMD_WRITE :
+			ISCSI_FLAG_CMD_READ;
+	memcpy(hdr->lun, bench.lun_id, sizeof(hdr->lun));
+	hdr->itt = __cpu_to_be32(itt);
+	hdr->data_length = __cpu_to_be32(length);
+	hdr->cmdsn = __cpu_to_be32(s->cmdsn++);
+	hdr->exp_statsn = __cpu_to_be32(s->exp_statsn);
+	memcpy(hdr->cdb, cdb, sizeof(hdr->cdb));
+	pdu_commit(s, pdu, s->wbuf, imm, 0);
+
+	if (unsol > imm)
+		session_data_out(s, itt, ISCSI_RESERVED_TAG, imm, unsol - imm);
+}
+
+static void session_nop_reply(struct bench_session *s, struct iscsi_nopin *in)
+{
+	struct iscsi_nopout *hdr;
+	struct tx_pdu *pdu;
+
+	pdu = pdu_new(s);
+	hdr = (struct iscsi_nopout *)pdu->hdr;
+	hdr->opcode = ISCSI_OP_NOOP_OUT | ISCSI_OP_IMMEDIATE;
+	hdr->flags = ISCSI_FLAG_CMD_FINAL;
+	memcpy(hdr->lun, in->lun, sizeof(hdr->lun));
+	hdr->itt = ISCSI_RESERVED_TAG;
+	hdr->ttt = in->ttt;
+	hdr->cmdsn = __cpu_to_be32(s->cmdsn);
+	hdr->exp_statsn = __cpu_to_be32(s->exp_statsn);
+	pdu_commit(s, pdu, NULL, 0, 0);
+}
+
+static void task_done(struct bench_session *s, uint32_t itt, int status)
+{
+	struct bench_task *task = &s->tasks[itt];
+	struct bench_thread *th = s->th;
+	uint64_t now = now_nsecs();
+
+	task->busy = 0;
+	task->status = status;
+	s->inflight--;
+	s->free_tasks[s->nr_free++] = itt;
+	s->last_done = now;
+
+	if (task->sync)
+		return;
+
+	if (status != SAM_STAT_GOOD) {
+		th->errors++;
+		return;
+	}
+	if (now < bench.start || now >= bench.end)
+		return;
+	hist_add(&th->hist[task->write], now - task->issue);
+	th->bytes[task->write] += task->length;
+}
+
+static struct bench_task *task_lookup(struct bench_session *s, uint32_t itt)
+{
+	itt = __be32_to_cpu(itt);
+	if (itt >= bench.depth || !s->tasks[itt].busy) {
+		fprintf(stderr, "session %d: unknown task tag 0x%x\n", s->id,
+			itt);
+		return NULL;
+	}
+	return &s->tasks[itt];
+}
+
+static int session_rx_pdu(struct bench_session *s, struct iscsi_hdr *hdr,
+			  uint8_t *data, uint32_t dlen)
+{
+	struct iscsi_data_rsp *din;
+	struct iscsi_cmd_rsp *rsp;
+	struct iscsi_r2t_rsp *r2t;
+	struct bench_task *task;
+	uint32_t offset, length;
+
+	switch (hdr->opcode & ISCSI_OPCODE_MASK) {
+	case ISCSI_OP_SCSI_DATA_IN:
+		din = (struct iscsi_data_rsp *)hdr;
+		task = task_lookup(s, din->itt);
+		if (!task)
+			return -1;
+		offset = __be32_to_cpu(din->offset);
+		if (task->write || offset + dlen > task->length) {
+			fprintf(stderr, "session %d: bad Data-In\n", s->id);
+			return -1;
+		}
+		if (task->buf && offset < task->buf_len)
+			memcpy(task->buf + offset, data,
+			       min(dlen, task->buf_len - offset));
+		session_update_sn(s, din->exp_cmdsn, din->max_cmdsn);
+		if (din->flags & ISCSI_FLAG_DATA_STATUS) {
+			s->exp_statsn = __be32_to_cpu(din->statsn) + 1;
+			task_done(s, task - s->tasks, din->cmd_status);
+		}
+		break;
+	case ISCSI_OP_SCSI_CMD_RSP:
+		rsp = (struct iscsi_cmd_rsp *)hdr;
+		task = task_lookup(s, rsp->itt);
+		if (!task)
+			return -1;
+		s->exp_statsn = __be32_to_cpu(rsp->statsn) + 1;
+		session_update_sn(s, rsp->exp_cmdsn, rsp->max_cmdsn);
+		task_done(s, task - s->tasks,
+			  rsp->response ? -1 : rsp->cmd_status);
+		break;
+	case ISCSI_OP_R2T:
+		r2t = (struct iscsi_r2t_rsp *)hdr;
+		task = task_lookup(s, r2t->itt);
+		if (!task)
+			return -1;
+		session_update_sn(s, r2t->exp_cmdsn, r2t->max_cmdsn);
+		offset = __be32_to_cpu(r2t->data_offset);
+		length = __be32_to_cpu(r2t->data_length);
+		if (!task->write || offset + length > task->length) {
+			fprintf(stderr, "session %d: bad R2T\n", s->id);
+			return -1;
+		}
+		session_data_out(s, task - s->tasks, r2t->ttt, offset, length);
+		break;
+	case ISCSI_OP_NOOP_IN:
+		session_update_sn(s, ((struct iscsi_nopin *)hdr)->exp_cmdsn,
+				  ((struct iscsi_nopin *)hdr)->max_cmdsn);
+		if (hdr->ttt != ISCSI_RESERVED_TAG)
+			session_nop_reply(s, (struct iscsi_nopin *)hdr);
+		break;
+	case ISCSI_OP_ASYNC_EVENT:
+		fprintf(stderr, "session %d: async event %u\n", s->id,
+			((struct iscsi_async *)hdr)->async_event);
+		return -1;
+	case ISCSI_OP_REJECT:
+		fprintf(stderr, "session %d: reject, reason 0x%x\n", s->id,
+			((struct iscsi_reject *)hdr)->reason);
+		return -1;
+	default:
+		fprintf(stderr, "session %d: unexpected opcode 0x%x\n", s->id,
+			hdr->opcode);
+		return -1;
+	}
+	return 0;
+}
+
+static void build_cdb(uint8_t *cdb, int write, uint64_t lba, uint32_t blocks)
+{
+	memset(cdb, 0, 16);
+	cdb[0] = write ? WRITE_16 : READ_16;
+	__put_unaligned_be64(lba, cdb + 2);
+	__put_unaligned_be32(blocks, cdb + 10);
+}
+
+static void session_issue(struct bench_session *s)
+{
+	struct bench_thread *th = s->th;
+	uint64_t blocks = bench.block_size / bench.lu_blk_size;
+	uint64_t slots = bench.lu_blocks / blocks, lba;
+	struct bench_task *task;
+	uint32_t itt;
+	uint8_t cdb[16];
+
+	if (bench.seq) {
+		lba = s->next_lba;
+		s->next_lba = (s->next_lba + blocks) % (slots * blocks);
+	} else
+		lba = (xorshift64(&th->rnd) % slots) * blocks;
+
+	itt = s->free_tasks[--s->nr_free];
+	task = &s->tasks[itt];
+	task->busy = 1;
+	task->write = (int)(xorshift64(&th->rnd) % 100) >= bench.read_pct;
+	task->length = bench.block_size;
+	task->issue = now_nsecs();
+	s->inflight++;
+
+	build_cdb(cdb, task->write, lba, blocks);
+	session_send_cmd(s, itt, cdb, task->write, task->length);
+}
+
+static void session_fill(struct bench_session *s)
+{
+	while (!bench.stop && s->nr_free && !sn_before(s->max_cmdsn, s->cmdsn))
+		session_issue(s);
+}
+
+/*
+ * Login, straight to the operational stage. Keys the target proposes
+ * on its own are accepted as they are.
+ */
+static int text_add(char *buf, size_t *len, const char *key, const char *val)
+{
+	int ret;
+
+	ret = snprintf(buf + *len, LOGIN_DLENGTH - *len, "%s=%s", key, val);
+	if (ret < 0 || *len + ret + 1 > LOGIN_DLENGTH)
+		return -1;
+	*len += ret + 1;
+	return 0;
+}
+
+static const char *offered_keys[] = {
+	"InitiatorName", "TargetName", "SessionType", "HeaderDigest",
+	"DataDigest", "MaxRecvDataSegmentLength", "InitialR2T",
+	"ImmediateData", "FirstBurstLength", "MaxBurstLength",
+	"MaxOutstandingR2T", "ErrorRecoveryLevel", "DataPDUInOrder",
+	"DataSequenceInOrder", "MaxConnections",
+	/* declarative, the target's own */
+	"TargetPortalGroupTag", "TargetAlias", "TargetAddress",
+	NULL,
+};
+
+static int key_offered(const char *key, size_t len)
+{
+	int i;
+
+	for (i = 0; offered_keys[i]; i++)
+		if (strlen(offered_keys[i]) == len &&
+		    !strncmp(offered_keys[i], key, len))
+			return 1;
+	return 0;
+}
+
+static void login_keys(struct bench_session *s, char *buf, size_t *len)
+{
+	char val[32];
+
+	text_add(buf, len, "InitiatorName", bench.initiator);
+	text_add(buf, len, "TargetName", bench.target);
+	text_add(buf, len, "SessionType", "Normal");
+	text_add(buf, len, "HeaderDigest", bench.hdigest ? "CRC32C" : "None");
+	text_add(buf, len, "DataDigest", bench.ddigest ? "CRC32C" : "None");
+	/* the erl checks have every byte of a WRITE asked for */
+	sprintf(val, "%d", bench.erl ? ERL_DLENGTH : MAX_RECV_DLENGTH);
+	text_add(buf, len, "MaxRecvDataSegmentLength", val);
+	text_add(buf, len, "InitialR2T", bench.erl ? "Yes" : "No");
+	text_add(buf, len, "ImmediateData", bench.erl ? "No" : "Yes");
+	sprintf(val, "%d", MAX_BURST);
+	text_add(buf, len, "FirstBurstLength", val);
+	text_add(buf, len, "MaxBurstLength", val);
+	text_add(buf, len, "MaxOutstandingR2T", "1");
+	text_add(buf, len, "ErrorRecoveryLevel", bench.erl ? "2" : "0");
+	text_add(buf, len, "DataPDUInOrder", "Yes");
+	text_add(buf, len, "DataSequenceInOrder", "Yes");
+	text_add(buf, len, "MaxConnections", "1");
+}
+
+static void login_param(struct bench_session *s, char *key, char *val)
+{
+	unsigned long v = strtoul(val, NULL, 0);
+
+	if (!strcmp(key, "HeaderDigest"))
+		s->hdigest = !strcmp(val, "CRC32C");
+	else if (!strcmp(key, "DataDigest"))
+		s->ddigest = !strcmp(val, "CRC32C");
+	else if (!strcmp(key, "MaxRecvDataSegmentLength") && v)
+		s->max_xmit = v;
+	else if (!strcmp(key, "FirstBurstLength") && v)
+		s->first_burst = v;
+	else if (!strcmp(key, "MaxBurstLength") && v)
+		s->max_burst = v;
+	else if (!strcmp(key, "InitialR2T"))
+		s->initial_r2t = strcmp(val, "No");
+	else if (!strcmp(key, "ImmediateData"))
+		s->imm_data = !strcmp(val, "Yes");
+	else if (!strcmp(key, "ErrorRecoveryLevel"))
+		s->erl = v;
+}
+
+static int session_login(struct bench_session *s)
+{
+	struct iscsi_login_rsp *rsp = NULL;
+	struct iscsi_login *hdr;
+	struct iscsi_hdr *rhdr;
+	struct tx_pdu *pdu;
+	char text[LOGIN_DLENGTH];
+	size_t len = 0;
+	uint8_t *data;
+	uint32_t dlen, i;
+	int round;
+	char *p, *eq;
+
+	s->max_xmit = 8192;
+	s->first_burst = 65536;
+	s->max_burst = 262144;
+	s->initial_r2t = 1;
+	s->imm_data = 1;
+
+	login_keys(s, text, &len);
+
+	for (round = 0; round < LOGIN_ROUNDS; round++) {
+		pdu = pdu_new(s);
+		hdr = (struct iscsi_login *)pdu->hdr;
+		hdr->opcode = ISCSI_OP_LOGIN | ISCSI_OP_IMMEDIATE;
+		hdr->flags = ISCSI_FLAG_LOGIN_TRANSIT |
+			(ISCSI_OP_PARMS_NEGOTIATION_STAGE << 2) |
+			ISCSI_FULL_FEATURE_PHASE;
+		memcpy(hdr->isid, s->isid, sizeof(hdr->isid));
+		hdr->tsih = s->tsih;
+		hdr->cmdsn = __cpu_to_be32(s->cmdsn);
+		hdr->exp_statsn = __cpu_to_be32(s->exp_statsn);
+		pdu_commit(s, pdu, text, len, 1);
+		if (session_flush(s) != 1)
+			return -1;
+
+		if (session_recv_pdu(s, &rhdr, &data, &dlen, 1))
+			return -1;
+		rsp = (struct iscsi_login_rsp *)rhdr;
+		if ((rsp->opcode & ISCSI_OPCODE_MASK) != ISCSI_OP_LOGIN_RSP) {
+			fprintf(stderr, "session %d: unexpected opcode 0x%x\n",
+				s->id, rsp->opcode);
+			return -1;
+		}
+		if (rsp->status_class) {
+			fprintf(stderr, "session %d: login failed, "
+				"status class %u detail %u\n", s->id,
+				rsp->status_class, rsp->status_detail);
+			return -1;
+		}
+		s->tsih = rsp->tsih;
+		s->exp_statsn = __be32_to_cpu(rsp->statsn) + 1;
+
+		/* answer whatever the target brought up by itself */
+		len = 0;
+		for (i = 0; i < dlen; i += strlen(p) + 1) {
+			p = (char *)data + i;
+			eq = strchr(p, '=');
+			if (!eq)
+				continue;
+			*eq = '\0';
+			login_param(s, p, eq + 1);
+			if (!key_offered(p, eq - p))
+				text_add(text, &len, p, eq + 1);
+			*eq = '=';
+		}
+
+		if (rsp->flags & ISCSI_FLAG_LOGIN_TRANSIT &&
+		    ISCSI_LOGIN_NEXT_STAGE(rsp->flags) ==
+		    ISCSI_FULL_FEATURE_PHASE)
+			break;
+	}
+
+	if (round == LOGIN_ROUNDS) {
+		fprintf(stderr, "session %d: login does not converge\n", s->id);
+		return -1;
+	}
+
+	/* numbers taken without the digests asked for would mislead */
+	if (s->hdigest != bench.hdigest || s->ddigest != bench.ddigest) {
+		fprintf(stderr, "session %d: the target refused the %s "
+			"digest\n", s->id,
+			s->hdigest != bench.hdigest ? "header" : "data");
+		return -1;
+	}
+
+	if (bench.erl && s->erl != 2) {
+		fprintf(stderr, "session %d: the target refused "
+			"ErrorRecoveryLevel 2\n", s->id);
+		return -1;
+	}
+
+	s->cmdsn = __be32_to_cpu(rsp->exp_cmdsn);
+	s->max_cmdsn = __be32_to_cpu(rsp->max_cmdsn);
+	s->max_xmit = min(s->max_xmit, s->max_burst);
+	s->first_burst = min(s->first_burst, s->max_burst);
+	return 0;
+}
+
+static int session_logout(struct bench_session *s)
+{
+	struct iscsi_logout *hdr;
+	struct iscsi_hdr *rhdr;
+	struct tx_pdu *pdu;
+	uint8_t *data;
+	uint32_t dlen;
+
+	pdu = pdu_new(s);
+	hdr = (struct iscsi_logout *)pdu->hdr;
+	hdr->opcode = ISCSI_OP_LOGOUT | ISCSI_OP_IMMEDIATE;
+	hdr->flags = ISCSI_FLAG_CMD_FINAL | ISCSI_LOGOUT_REASON_CLOSE_SESSION;
+	hdr->itt = __cpu_to_be32(bench.depth);
+	hdr->cmdsn = __cpu_to_be32(s->cmdsn);
+	hdr->exp_statsn = __cpu_to_be32(s->exp_statsn);
+	pdu_commit(s, pdu, NULL, 0, 0);
+	if (session_flush(s) != 1)
+		return -1;
+
+	for (;;) {
+		if (session_recv_pdu(s, &rhdr, &data, &dlen, 0))
+			return -1;
+		if ((rhdr->opcode & ISCSI_OPCODE_MASK) == ISCSI_OP_LOGOUT_RSP)
+			return 0;
+		if (session_rx_pdu(s, rhdr, data, dlen))
+			return -1;
+		if (session_flush(s) != 1)
+			return -1;
+	}
+}
+
+/* a command outside the load, waited for; returns the SAM status */
+static int session_sync_cmd(struct bench_session *s, uint8_t *cdb,
+			    uint8_t *buf, uint32_t len)
+{
+	struct bench_task *task;
+	struct iscsi_hdr *hdr;
+	uint8_t *data;
+	uint32_t itt, dlen;
+
+	itt = s->free_tasks[--s->nr_free];
+	task = &s->tasks[itt];
+	task->busy = 1;
+	task->sync = 1;
+	task->write = 0;
+	task->length = len;
+	task->buf = buf;
+	task->buf_len = len;
+	s->inflight++;
+
+	session_send_cmd(s, itt, cdb, 0, len);
+	if (session_flush(s) != 1)
+		return -1;
+
+	while (task->busy) {
+		if (session_recv_pdu(s, &hdr, &data, &dlen, 0) ||
+		    session_rx_pdu(s, hdr, data, dlen) ||
+		    session_flush(s) != 1)
+			return -1;
+	}
+	task->sync = 0;
+	task->buf = NULL;
+	return task->status;
+}
+
+/* clears the power on unit attention and gets the capacity */
+static int session_setup(struct bench_session *s, int capacity)
+{
+	uint8_t cdb[16], buf[32];
+	int i, status;
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = TEST_UNIT_READY;
+	for (i = 0; i < 4; i++) {
+		status = session_sync_cmd(s, cdb, NULL, 0);
+		if (status != SAM_STAT_CHECK_CONDITION)
+			break;
+	}
+	if (status != SAM_STAT_GOOD) {
+		fprintf(stderr, "session %d: lun %" PRIu64 " is not ready\n",
+			s->id, bench.lun);
+		return -1;
+	}
+
+	if (!capacity)
+		return 0;
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = SERVICE_ACTION_IN;
+	cdb[1] = SAI_READ_CAPACITY_16;
+	__put_unaligned_be32(sizeof(buf), cdb + 10);
+	memset(buf, 0, sizeof(buf));
+	if (session_sync_cmd(s, cdb, buf, sizeof(buf)) != SAM_STAT_GOOD) {
+		fprintf(stderr, "session %d: READ CAPACITY failed\n", s->id);
+		return -1;
+	}
+	bench.lu_blocks = __get_unaligned_be64(buf) + 1;
+	bench.lu_blk_size = __get_unaligned_be32(buf + 8);
+	return 0;
+}
+
+/* a new session, or a connection taking the place of @old's */
+static struct bench_session *session_open(int id, struct addrinfo *ai,
+					  struct bench_session *old)
+{
+	struct timeval tv = { .tv_sec = ERL_TIMEOUT };
+	struct bench_session *s;
+	unsigned int i;
+	int one = 1;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->id = id;
+	s->wbuf = bench.wbuf;
+	s->tasks = calloc(bench.depth, sizeof(*s->tasks));
+	s->free_tasks = malloc(sizeof(*s->free_tasks) * bench.depth);
+	s->rx_size = 2 * (BHS_LEN + 2 * DIGEST_LEN + MAX_RECV_DLENGTH) +
+		LOGIN_DLENGTH;
+	s->rx = malloc(s->rx_size);
+	s->tx_size = 64;
+	s->tx = malloc(sizeof(*s->tx) * s->tx_size);
+	if (!s->tasks || !s->free_tasks || !s->rx || !s->tx)
+		goto out;
+	for (i = 0; i < bench.depth; i++)
+		s->free_tasks[s->nr_free++] = bench.depth - 1 - i;
+
+	/* random qualifier format, unique per session */
+	s->isid[0] = 0x80;
+	s->isid[1] = getpid() >> 8;
+	s->isid[2] = getpid();
+	s->isid[3] = time(NULL);
+	s->isid[4] = id >> 8;
+	s->isid[5] = id;
+	s->cmdsn = 1;
+
+	/* same ISID, TSIH and CID reinstate the connection */
+	if (old) {
+		memcpy(s->isid, old->isid, sizeof(s->isid));
+		s->tsih = old->tsih;
+		s->cmdsn = old->cmdsn;
+		s->exp_statsn = old->exp_statsn;
+	}
+
+	s->fd = socket(ai->ai_family, SOCK_STREAM, IPPROTO_TCP);
+	if (s->fd < 0) {
+		fprintf(stderr, "socket: %m\n");
+		goto out;
+	}
+	setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	/* the erl checks wait for each answer, not forever */
+	if (bench.erl) {
+		setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	}
+	if (connect(s->fd, ai->ai_addr, ai->ai_addrlen)) {
+		fprintf(stderr, "connect to %s:%s: %m\n", bench.host,
+			bench.port);
+		goto out_close;
+	}
+
+	if (session_login(s))
+		goto out_close;
+	return s;
+out_close:
+	close(s->fd);
+out:
+	free(s->tasks);
+	free(s->free_tasks);
+	free(s->rx);
+	free(s->tx);
+	free(s);
+	return NULL;
+}
+
+static void session_close(struct bench_session *s)
+{
+	int flags = fcntl(s->fd, F_GETFL);
+	struct timeval tv = { .tv_sec = 5 };
+
+	fcntl(s->fd, F_SETFL, flags & ~O_NONBLOCK);
+	setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(s->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (!s->dead && !s->inflight)
+		session_logout(s);
+
+	close(s->fd);
+	free(s->tasks);
+	free(s->free_tasks);
+	free(s->rx);
+	free(s->tx);
+	free(s);
+}
+
+static int session_tx(struct bench_session *s)
+{
+	struct epoll_event ev;
+	int ret;
+
+	ret = session_flush(s);
+	if (ret < 0)
+		return -1;
+	if (ret == s->tx_wait) {
+		ev.events = EPOLLIN | (ret ? 0 : EPOLLOUT);
+		ev.data.ptr = s;
+		epoll_ctl(s->th->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+		s->tx_wait = !ret;
+	}
+	return 0;
+}
+
+static int session_rx(struct bench_session *s)
+{
+	struct iscsi_hdr *hdr;
+	uint8_t *data;
+	uint32_t dlen;
+	ssize_t ret, len;
+
+	/* one read per wakeup, so that busy sessions don't starve others */
+	rx_compact(s);
+	ret = recv(s->fd, s->rx + s->rx_len, s->rx_size - s->rx_len, 0);
+	if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+	if (ret <= 0) {
+		fprintf(stderr, "session %d: %s\n", s->id,
+			ret ? strerror(errno) : "connection closed");
+		return -1;
+	}
+	s->rx_len += ret;
+
+	while ((len = rx_pdu_len(s, 0))) {
+		if (len < 0 || rx_pdu_check(s, &hdr, &data, &dlen, 0))
+			return -1;
+		s->rx_pos += len;
+		if (session_rx_pdu(s, hdr, data, dlen))
+			return -1;
+	}
+	session_fill(s);
+	return session_tx(s);
+}
+
+static void session_fail(struct bench_session *s)
+{
+	struct bench_thread *th = s->th;
+
+	epoll_ctl(th->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+	th->errors += s->inflight;
+	s->dead = 1;
+	th->failed = 1;
+}
+
+static void *bench_thread_fn(void *arg)
+{
+	struct bench_thread *th = arg;
+	struct epoll_event events[64], ev;
+	struct bench_session *s;
+	uint64_t now, quiet;
+	int i, nr, active;
+
+	for (i = 0; i < th->nr_sessions; i++) {
+		s = th->sessions[i];
+		fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+		ev.events = EPOLLIN;
+		ev.data.ptr = s;
+		epoll_ctl(th->epfd, EPOLL_CTL_ADD, s->fd, &ev);
+		s->last_done = now_nsecs();
+		session_fill(s);
+		if (session_tx(s))
+			session_fail(s);
+	}
+
+	for (;;) {
+		nr = epoll_wait(th->epfd, events, ARRAY_SIZE(events), 100);
+		if (nr < 0 && errno != EINTR) {
+			fprintf(stderr, "epoll_wait: %m\n");
+			break;
+		}
+		for (i = 0; i < nr; i++) {
+			s = events[i].data.ptr;
+			if (s->dead)
+				continue;
+			if ((events[i].events & EPOLLOUT && session_tx(s)) ||
+			    (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP) &&
+			     session_rx(s)))
+				session_fail(s);
+		}
+
+		now = now_nsecs();
+		active = 0;
+		for (i = 0; i < th->nr_sessions; i++) {
+			s = th->sessions[i];
+			if (s->dead || !s->inflight)
+				continue;
+			quiet = now - s->last_done;
+			if (quiet > STALL_SECS * NSEC_PER_SEC) {
+				fprintf(stderr, "session %d: %u commands "
+					"stalled\n", s->id, s->inflight);
+				session_fail(s);
+				continue;
+			}
+			active++;
+		}
+		if (bench.stop && !active)
+			break;
+	}
+
+	for (i = 0; i < th->nr_sessions; i++)
+		session_close(th->sessions[i]);
+	return NULL;
+}
+
+static void print_dir(const char *name, struct bench_hist *h, uint64_t bytes,
+		      double secs)
+{
+	printf("%-6s %10.0f %9.2f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+	       name, h->count / secs, bytes / secs / 1000000,
+	       h->count ? (double)h->sum / h->count / 1000 : 0.0,
+	       hist_percentile(h, 50) / 1000.0,
+	       hist_percentile(h, 90) / 1000.0,
+	       hist_percentile(h, 99) / 1000.0,
+	       hist_percentile(h, 99.9) / 1000.0,
+	       hist_percentile(h, 99.99) / 1000.0,
+	       h->max / 1000.0);
+}
+
+static void bench_report(struct bench_thread *threads)
+{
+	struct bench_hist *hist, total;
+	uint64_t bytes[DIRS] = { 0 }, errors = 0;
+	double secs = bench.runtime;
+	static const char *digests[] = { "none", "header", "data", "all" };
+	int i, d;
+
+	hist = calloc(DIRS, sizeof(*hist));
+	if (!hist) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	memset(&total, 0, sizeof(total));
+	for (i = 0; i < bench.threads; i++) {
+		for (d = 0; d < DIRS; d++) {
+			hist_merge(&hist[d], &threads[i].hist[d]);
+			bytes[d] += threads[i].bytes[d];
+		}
+		errors += threads[i].errors;
+	}
+	for (d = 0; d < DIRS; d++)
+		hist_merge(&total, &hist[d]);
+
+	if (bench.csv) {
+		printf("%.0f,%.2f", total.count / secs,
+		       (bytes[DIR_READ] + bytes[DIR_WRITE]) / secs / 1000000);
+		for (d = 0; d < DIRS; d++)
+			printf(",%.0f,%.1f,%.1f,%.1f,%.1f,%.1f",
+			       hist[d].count / secs,
+			       hist[d].count ?
+			       (double)hist[d].sum / hist[d].count / 1000 : 0.0,
+			       hist_percentile(&hist[d], 50) / 1000.0,
+			       hist_percentile(&hist[d], 99) / 1000.0,
+			       hist_percentile(&hist[d], 99.9) / 1000.0,
+			       hist[d].max / 1000.0);
+		printf(",%" PRIu64 "\n", errors);
+		free(hist);
+		return;
+	}
+
+	printf("%s lun %" PRIu64 ", %d sessions on %d threads, queue depth %u\n",
+	       bench.target, bench.lun, bench.sessions, bench.threads,
+	       bench.depth);
+	printf("%u byte %s, %d%% reads, digest %s, %d seconds\n\n",
+	       bench.block_size, bench.seq ? "sequential" : "random",
+	       bench.read_pct, digests[bench.hdigest | bench.ddigest << 1],
+	       bench.runtime);
+	printf("%-6s %10s %9s %9s %9s %9s %9s %9s %9s %9s\n", "", "IOPS",
+	       "MB/s", "avg(us)", "p50", "p90", "p99", "p99.9", "p99.99",
+	       "max");
+	for (d = 0; d < DIRS; d++)
+		if (hist[d].count)
+			print_dir(dir_name[d], &hist[d], bytes[d], secs);
+	print_dir("total", &total, bytes[DIR_READ] + bytes[DIR_WRITE], secs);
+	if (errors)
+		printf("\n%" PRIu64 " commands failed\n", errors);
+	free(hist);
+}
+
+static int bench_run(void)
+{
+	struct addrinfo hints, *ai;
+	struct bench_thread *threads;
+	struct bench_session **sessions;
+	struct timespec ts;
+	int i, ret, failed = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(bench.host, bench.port, &hints, &ai);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", bench.host, gai_strerror(ret));
+		return -1;
+	}
+
+	sessions = calloc(bench.sessions, sizeof(*sessions));
+	threads = calloc(bench.threads, sizeof(*threads));
+	if (!sessions || !threads) {
+		fprintf(stderr, "out of memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < bench.sessions; i++) {
+		sessions[i] = session_open(i, ai, NULL);
+		if (!sessions[i] || session_setup(sessions[i], !i))
+			return -1;
+		if (!i) {
+			if (!bench.lu_blk_size ||
+			    bench.block_size % bench.lu_blk_size) {
+				fprintf(stderr, "block size %u is not a "
+					"multiple of the LU block size %u\n",
+					bench.block_size, bench.lu_blk_size);
+				return -1;
+			}
+			if (bench.lu_blocks * bench.lu_blk_size <
+			    bench.block_size) {
+				fprintf(stderr, "block size %u is larger "
+					"than the LU\n", bench.block_size);
+				return -1;
+			}
+		}
+		/* sequential streams start spread over the LU */
+		sessions[i]->next_lba = bench.lu_blocks / bench.sessions * i;
+		sessions[i]->next_lba -= sessions[i]->next_lba %
+			(bench.block_size / bench.lu_blk_size);
+	}
+	freeaddrinfo(ai);
+
+	for (i = 0; i < bench.threads; i++) {
+		threads[i].id = i;
+		threads[i].rnd = now_nsecs() ^ ((uint64_t)(i + 1) << 32);
+		threads[i].epfd = epoll_create(bench.sessions);
+		threads[i].sessions = calloc(bench.sessions,
+					     sizeof(*threads[i].sessions));
+		if (threads[i].epfd < 0 || !threads[i].sessions) {
+			fprintf(stderr, "thread setup: %m\n");
+			return -1;
+		}
+	}
+	for (i = 0; i < bench.sessions; i++) {
+		struct bench_thread *th = &threads[i % bench.threads];
+
+		sessions[i]->th = th;
+		th->sessions[th->nr_sessions++] = sessions[i];
+	}
+
+	bench.start = now_nsecs() + bench.ramp * NSEC_PER_SEC;
+	bench.end = bench.start + bench.runtime * NSEC_PER_SEC;
+
+	for (i = 0; i < bench.threads; i++) {
+		ret = pthread_create(&threads[i].thread, NULL, bench_thread_fn,
+				     &threads[i]);
+		if (ret) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+			exit(1);
+		}
+	}
+
+	ts.tv_sec = bench.end / NSEC_PER_SEC;
+	ts.tv_nsec = bench.end % NSEC_PER_SEC;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+		;
+	bench.stop = 1;
+
+	for (i = 0; i < bench.threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+		close(threads[i].epfd);
+		failed |= threads[i].failed;
+	}
+
+	bench_report(threads);
+
+	for (i = 0; i < bench.threads; i++)
+		free(threads[i].sessions);
+	free(threads);
+	free(sessions);
+	return failed ? -1 : 0;
+}
+
+/*
+ * Error recovery checks, --erl-check
+ *
+ * Each check gets a session of its own at ErrorRecoveryLevel 2 and two
+ * ERL_LEN regions of the LU. It corrupts a data digest, loses PDUs on
+ * purpose or drops the connection, and expects the target to recover
+ * the way RFC 7143 says, down to the data read back. Everything is
+ * sent and received in order and waited for. The write buffer holds
+ * two patterns: the first is what the checks write, the second primes
+ * a region so that a WRITE which never lands can't pass.
+ */
+#define ERL_REGION		(2 * ERL_LEN)
+#define ERL_REASSIGN_DATASN	3	/* Data-In seen before the drop */
+
+static struct addrinfo *erl_ai;
+static uint32_t erl_itt;
+
+/* the next PDU but the target's pings, which must be @opcode */
+static struct iscsi_hdr *erl_recv(struct bench_session *s, uint8_t opcode,
+				  uint8_t **data, uint32_t *dlen)
+{
+	struct iscsi_hdr *hdr;
+
+	for (;;) {
+		if (session_recv_pdu(s, &hdr, data, dlen, 0))
+			return NULL;
+		if ((hdr->opcode & ISCSI_OPCODE_MASK) != ISCSI_OP_NOOP_IN ||
+		    hdr->itt != ISCSI_RESERVED_TAG)
+			break;
+		if (session_rx_pdu(s, hdr, *data, *dlen) ||
+		    session_flush(s) != 1)
+			return NULL;
+	}
+
+	if ((hdr->opcode & ISCSI_OPCODE_MASK) == opcode)
+		return hdr;
+	if ((hdr->opcode & ISCSI_OPCODE_MASK) == ISCSI_OP_REJECT)
+		fprintf(stderr, "session %d: reject, reason 0x%x\n", s->id,
+			((struct iscsi_reject *)hdr)->reason);
+	else
+		fprintf(stderr, "session %d: opcode 0x%x, expected 0x%x\n",
+			s->id, hdr->opcode & ISCSI_OPCODE_MASK, opcode);
+	return NULL;
+}
+
+static int erl_cmd(struct bench_session *s, uint32_t itt, int write,
+		   uint64_t offset)
+{
+	uint8_t cdb[16];
+
+	build_cdb(cdb, write, offset / bench.lu_blk_size,
+		  ERL_LEN / bench.lu_blk_size);
+	session_send_cmd(s, itt, cdb, write, ERL_LEN);
+	return session_flush(s) == 1 ? 0 : -1;
+}
+
+/* an R2T for @itt, its fields in host order */
+static int erl_r2t(struct bench_session *s, uint32_t itt, uint32_t *ttt,
+		   uint32_t *r2tsn, uint32_t *offset, uint32_t *length)
+{
+	struct iscsi_r2t_rsp *r2t;
+	uint8_t *data;
+	uint32_t dlen;
+
+	r2t = (struct iscsi_r2t_rsp *)erl_recv(s, ISCSI_OP_R2T, &data, &dlen);
+	if (!r2t)
+		return -1;
+	session_update_sn(s, r2t->exp_cmdsn, r2t->max_cmdsn);
+	*ttt = r2t->ttt;
+	*r2tsn = __be32_to_cpu(r2t->r2tsn);
+	*offset = __be32_to_cpu(r2t->data_offset);
+	*length = __be32_to_cpu(r2t->data_length);
+	if (__be32_to_cpu(r2t->itt) != itt ||
+	    *offset + *length > ERL_LEN || !*length) {
+		fprintf(stderr, "session %d: R2T 0x%x for %u+%u, expected "
+			"0x%x\n", s->id, __be32_to_cpu(r2t->itt), *offset,
+			*length, itt);
+		return -1;
+	}
+	return 0;
+}
+
+/* the SCSI Response, GOOD; its StatSN is acknowledged unless asked for */
+static int erl_status(struct bench_session *s, uint32_t itt, uint32_t *statsn)
+{
+	struct iscsi_cmd_rsp *rsp;
+	uint8_t *data;
+	uint32_t dlen;
+
+	rsp = (struct iscsi_cmd_rsp *)erl_recv(s, ISCSI_OP_SCSI_CMD_RSP, &data,
+					       &dlen);
+	if (!rsp)
+		return -1;
+	session_update_sn(s, rsp->exp_cmdsn, rsp->max_cmdsn);
+	if (__be32_to_cpu(rsp->itt) != itt || rsp->response ||
+	    rsp->cmd_status != SAM_STAT_GOOD) {
+		fprintf(stderr, "session %d: task 0x%x ended with 0x%x/0x%x, "
+			"expected 0x%x\n", s->id, __be32_to_cpu(rsp->itt),
+			rsp->response, rsp->cmd_status, itt);
+		return -1;
+	}
+	if (statsn)
+		*statsn = __be32_to_cpu(rsp->statsn);
+	else
+		s->exp_statsn = __be32_to_cpu(rsp->statsn) + 1;
+	return 0;
+}
+
+/* answers R2Ts until all of a WRITE from @done on went out */
+static int erl_write_data(struct bench_session *s, uint32_t itt,
+			  uint32_t done)
+{
+	uint32_t ttt, r2tsn, offset, length;
+
+	for (; done < ERL_LEN; done += length) {
+		if (erl_r2t(s, itt, &ttt, &r2tsn, &offset, &length))
+			return -1;
+		session_data_out(s, itt, ttt, offset, length);
+		if (session_flush(s) != 1)
+			return -1;
+	}
+	return 0;
+}
+
+static int erl_write(struct bench_session *s, uint64_t offset)
+{
+	uint32_t itt = erl_itt++;
+
+	if (erl_cmd(s, itt, 1, offset) || erl_write_data(s, itt, 0))
+		return -1;
+	return erl_status(s, itt, NULL);
+}
+
+/* writes the second pattern to a region */
+static int erl_prime(struct bench_session *s, uint64_t offset)
+{
+	int ret;
+
+	s->wbuf = bench.wbuf + ERL_LEN;
+	ret = erl_write(s, offset);
+	s->wbuf = bench.wbuf;
+	return ret;
+}
+
+/*
+ * Data-In of a READ, DataSN @first up to @end, checked against the
+ * write buffer but for those in @lost, which never arrived as far as
+ * the caller is concerned. The StatSN is left to the caller.
+ */
+static int erl_data_in(struct bench_session *s, uint32_t itt, uint32_t first,
+		       uint32_t end, uint32_t lost, uint32_t *statsn)
+{
+	struct iscsi_data_rsp *din;
+	uint32_t sn, offset, dlen;
+	uint8_t *data;
+
+	for (sn = first; sn < end; sn++) {
+		din = (struct iscsi_data_rsp *)erl_recv(s,
+				ISCSI_OP_SCSI_DATA_IN, &data, &dlen);
+		if (!din)
+			return -1;
+		session_update_sn(s, din->exp_cmdsn, din->max_cmdsn);
+		offset = __be32_to_cpu(din->offset);
+		if (__be32_to_cpu(din->itt) != itt ||
+		    __be32_to_cpu(din->datasn) != sn ||
+		    offset != sn * ERL_DLENGTH || dlen != ERL_DLENGTH) {
+			fprintf(stderr, "session %d: Data-In 0x%x/%u for "
+				"%u+%u, expected 0x%x/%u\n", s->id,
+				__be32_to_cpu(din->itt),
+				__be32_to_cpu(din->datasn), offset, dlen, itt,
+				sn);
+			return -1;
+		}
+		if (!(lost & (1U << sn)) &&
+		    memcmp(data, bench.wbuf + offset, dlen)) {
+			fprintf(stderr, "session %d: Data-In %u has the wrong "
+				"data\n", s->id, sn);
+			return -1;
+		}
+
+		/* the last one carries the status, the others don't */
+		if (!(din->flags & ISCSI_FLAG_DATA_STATUS) !=
+		    (sn != ERL_SEGS - 1) ||
+		    (sn == ERL_SEGS - 1 && din->cmd_status != SAM_STAT_GOOD)) {
+			fprintf(stderr, "session %d: Data-In %u with flags "
+				"0x%x, status 0x%x\n", s->id, sn, din->flags,
+				din->cmd_status);
+			return -1;
+		}
+		if (statsn && sn == ERL_SEGS - 1)
+			*statsn = __be32_to_cpu(din->statsn);
+	}
+	return 0;
+}
+
+/* READs a region back and checks it */
+static int erl_verify(struct bench_session *s, uint64_t offset)
+{
+	uint32_t itt = erl_itt++, statsn;
+
+	if (erl_cmd(s, itt, 0, offset) ||
+	    erl_data_in(s, itt, 0, ERL_SEGS, 0, &statsn))
+		return -1;
+	s->exp_statsn = statsn + 1;
+	return 0;
+}
+
+static int erl_snack(struct bench_session *s, int type, uint32_t itt,
+		     uint32_t begrun, uint32_t runlength)
+{
+	struct iscsi_snack *hdr;
+	struct tx_pdu *pdu;
+
+	pdu = pdu_new(s);
+	hdr = (struct iscsi_snack *)pdu->hdr;
+	hdr->opcode = ISCSI_OP_SNACK;
+	hdr->flags = ISCSI_FLAG_CMD_FINAL | type;
+	memcpy(hdr->lun, bench.lun_id, sizeof(hdr->lun));
+	hdr->itt = __cpu_to_be32(itt);
+	hdr->ttt = ISCSI_RESERVED_TAG;
+	hdr->exp_statsn = __cpu_to_be32(s->exp_statsn);
+	hdr->begrun = __cpu_to_be32(begrun);
+	hdr->runlength = __cpu_to_be32(runlength);
+	pdu_commit(s, pdu, NULL, 0, 0);
+	return session_flush(s) == 1 ? 0 : -1;
+}
+
+/* a NOP-Out ping, which must be the next thing answered */
+static int erl_ping(struct bench_session *s)
+{
+	struct iscsi_nopout *hdr;
+	struct iscsi_nopin *in;
+	struct tx_pdu *pdu;
+	uint32_t itt = erl_itt++, dlen;
+	uint8_t *data;
+
+	pdu = pdu_new(s);
+	hdr = (struct iscsi_nopout *)pdu->hdr;
+	hdr->opcode = ISCSI_OP_NOOP_OUT | ISCSI_OP_IMMEDIATE;
+	hdr->flags = ISCSI_FLAG_CMD_FINAL;
+	hdr->itt = __cpu_to_be32(itt);
+	hdr->ttt = ISCSI_RESERVED_TAG;
+	hdr->cmdsn = __cpu_to_be32(s->cmdsn);
+	hdr->exp_statsn = __cpu_to_be32(s->exp_statsn);
+	pdu_commit(s, pdu, NULL, 0, 0);
+	if (session_flush(s) != 1)
+		return -1;
+
+	in = (struct iscsi_nopin *)erl_recv(s, ISCSI_OP_NOOP_IN, &data, &dlen);
+	if (!in)
+		return -1;
+	session_update_sn(s, in->exp_cmdsn, in->max_cmdsn);
+	if (__be32_to_cpu(in->itt) != itt) {
+		fprintf(stderr, "session %d: NOP-In 0x%x, expected 0x%x\n",
+			s->id, __be32_to_cpu(in->itt), itt);
+		return -1;
+	}
+	return 0;
+}
+
+static int erl_reassign(struct bench_session *s, uint32_t rtt,
+			uint32_t exp_datasn)
+{
+	struct iscsi_tm_rsp *rsp;
+	struct iscsi_tm *hdr;
+	struct tx_pdu *pdu;
+	uint32_t itt = erl_itt++, dlen;
+	uint8_t *data;
+
+	pdu = pdu_new(s);
+	hdr = (struct iscsi_tm *)pdu->hdr;
+	hdr->opcode = ISCSI_OP_SCSI_TMFUNC | ISCSI_OP_IMMEDIATE;
+	hdr->flags = ISCSI_FLAG_CMD_FINAL | ISCSI_TM_FUNC_TASK_REASSIGN;
+	memcpy(hdr->lun, bench.lun_id, sizeof(hdr->lun));
+	hdr->itt = __cpu_to_be32(itt);
+	hdr->rtt = __cpu_to_be32(rtt);
+	hdr->cmdsn = __cpu_to_be32(s->cmdsn);
+	hdr->exp_statsn = __cpu_to_be32(s->exp_statsn);
+	hdr->exp_datasn = __cpu_to_be32(exp_datasn);
+	pdu_commit(s, pdu, NULL, 0, 0);
+	if (session_flush(s) != 1)
+		return -1;
+
+	rsp = (struct iscsi_tm_rsp *)erl_recv(s, ISCSI_OP_SCSI_TMFUNC_RSP,
+					      &data, &dlen);
+	if (!rsp)
+		return -1;
+	session_update_sn(s, rsp->exp_cmdsn, rsp->max_cmdsn);
+	if (__be32_to_cpu(rsp->itt) != itt ||
+	    rsp->response != ISCSI_TMF_RSP_COMPLETE) {
+		fprintf(stderr, "session %d: TASK REASSIGN of 0x%x answered "
+			"0x%x\n", s->id, rtt, rsp->response);
+		return -1;
+	}
+	s->exp_statsn = __be32_to_cpu(rsp->statsn) + 1;
+	return 0;
+}
+
+/* a Reject for the Data-Out with a bad digest, then an R2T for it */
+static int erl_check_digest(struct bench_session *s, uint64_t offset)
+{
+	uint32_t itt = erl_itt++, ttt, r2tsn, r2t_off, r2t_len, bad_len;
+	uint32_t ttt2, off2, len2, dlen;
+	struct iscsi_reject *rej;
+	struct tx_pdu *pdu;
+	uint8_t *data;
+
+	if (erl_prime(s, offset) || erl_cmd(s, itt, 1, offset) ||
+	    erl_r2t(s, itt, &ttt, &r2tsn, &r2t_off, &r2t_len))
+		return -1;
+	if (r2t_off || r2t_len <= s->max_xmit) {
+		fprintf(stderr, "session %d: R2T for %u+%u has a single "
+			"Data-Out\n", s->id, r2t_off, r2t_len);
+		return -1;
+	}
+
+	/* flip the data digest of the second Data-Out */
+	session_data_out(s, itt, ttt, 0, r2t_len);
+	pdu = &s->tx[(s->tx_head + 1) & (s->tx_size - 1)];
+	pdu->trailer[pdu->trailer_len - 1] ^= 0xff;
+	if (session_flush(s) != 1)
+		return -1;
+
+	rej = (struct iscsi_reject *)erl_recv(s, ISCSI_OP_REJECT, &data,
+					      &dlen);
+	if (!rej)
+		return -1;
+	if (rej->reason != ISCSI_REASON_DATA_DIGEST_ERROR) {
+		fprintf(stderr, "session %d: reject, reason 0x%x\n", s->id,
+			rej->reason);
+		return -1;
+	}
+
+	bad_len = min(s->max_xmit, r2t_len - s->max_xmit);
+	if (erl_r2t(s, itt, &ttt2, &r2tsn, &off2, &len2))
+		return -1;
+	if (ttt2 == ttt || off2 != s->max_xmit || len2 != bad_len) {
+		fprintf(stderr, "session %d: R2T for %u+%u, expected %u+%u "
+			"under a new TTT\n", s->id, off2, len2, s->max_xmit,
+			bad_len);
+		return -1;
+	}
+	session_data_out(s, itt, ttt2, off2, len2);
+	if (session_flush(s) != 1 || erl_write_data(s, itt, r2t_len) ||
+	    erl_status(s, itt, NULL))
+		return -1;
+	return erl_verify(s, offset);
+}
+
+/* a Data SNACK for each Data-In lost, with ExpStatSN held back */
+static int erl_check_snack_data(struct bench_session *s, uint64_t offset)
+{
+	uint32_t itt, statsn, sn, lost = 1U << 2 | 1U << 5;
+
+	if (erl_write(s, offset))
+		return -1;
+	itt = erl_itt++;
+	if (erl_cmd(s, itt, 0, offset) ||
+	    erl_data_in(s, itt, 0, ERL_SEGS, lost, &statsn))
+		return -1;
+
+	for (sn = 0; sn < ERL_SEGS; sn++) {
+		if (!(lost & (1U << sn)))
+			continue;
+		if (erl_snack(s, ISCSI_FLAG_SNACK_TYPE_DATA, itt, sn, 1) ||
+		    erl_data_in(s, itt, sn, sn + 1, 0, NULL))
+			return -1;
+	}
+	s->exp_statsn = statsn + 1;
+	return erl_ping(s);
+}
+
+/* an R2T SNACK for a lost R2T, which comes again unchanged */
+static int erl_check_snack_r2t(struct bench_session *s, uint64_t offset)
+{
+	uint32_t itt = erl_itt++, ttt, r2tsn, r2t_off, r2t_len;
+	uint32_t ttt2, sn2, off2, len2;
+
+	if (erl_prime(s, offset) || erl_cmd(s, itt, 1, offset) ||
+	    erl_r2t(s, itt, &ttt, &r2tsn, &r2t_off, &r2t_len))
+		return -1;
+
+	if (erl_snack(s, ISCSI_FLAG_SNACK_TYPE_R2T, itt, r2tsn, 1) ||
+	    erl_r2t(s, itt, &ttt2, &sn2, &off2, &len2))
+		return -1;
+	if (ttt2 != ttt || sn2 != r2tsn || off2 != r2t_off ||
+	    len2 != r2t_len) {
+		fprintf(stderr, "session %d: R2T %u for %u+%u came again as "
+			"%u for %u+%u\n", s->id, r2tsn, r2t_off, r2t_len, sn2,
+			off2, len2);
+		return -1;
+	}
+
+	session_data_out(s, itt, ttt, r2t_off, r2t_len);
+	if (session_flush(s) != 1 || erl_write_data(s, itt, r2t_len) ||
+	    erl_status(s, itt, NULL))
+		return -1;
+	return erl_verify(s, offset);
+}
+
+/* a Status SNACK for the first of two statuses, which keeps its StatSN */
+static int erl_check_snack_status(struct bench_session *s, uint64_t offset)
+{
+	uint32_t itt = erl_itt, statsn[2], again;
+	uint8_t cdb[16];
+	int i;
+
+	memset(cdb, 0, sizeof(cdb));
+	cdb[0] = TEST_UNIT_READY;
+	for (i = 0; i < 2; i++) {
+		session_send_cmd(s, erl_itt++, cdb, 0, 0);
+		if (session_flush(s) != 1 ||
+		    erl_status(s, itt + i, &statsn[i]))
+			return -1;
+	}
+
+	if (erl_snack(s, ISCSI_FLAG_SNACK_TYPE_STATUS, ISCSI_RESERVED_TAG,
+		      statsn[0], 1) ||
+	    erl_status(s, itt, &again))
+		return -1;
+	if (again != statsn[0]) {
+		fprintf(stderr, "session %d: StatSN %u came again as %u\n",
+			s->id, statsn[0], again);
+		return -1;
+	}
+	s->exp_statsn = statsn[1] + 1;
+	return erl_ping(s);
+}
+
+/* a DataACK SNACK, which is never asked for and gets no answer */
+static int erl_check_snack_dataack(struct bench_session *s, uint64_t offset)
+{
+	if (erl_write(s, offset) || erl_verify(s, offset) ||
+	    erl_snack(s, ISCSI_FLAG_SNACK_TYPE_DATA_ACK, ISCSI_RESERVED_TAG,
+		      ERL_SEGS, 0))
+		return -1;
+	return erl_ping(s);
+}
+
+/* an R-Data SNACK, which has all Data-In and the status sent again */
+static int erl_check_snack_rdata(struct bench_session *s, uint64_t offset)
+{
+	uint32_t itt, statsn, statsn2;
+
+	if (erl_write(s, offset))
+		return -1;
+	itt = erl_itt++;
+	if (erl_cmd(s, itt, 0, offset) ||
+	    erl_data_in(s, itt, 0, ERL_SEGS, 0, &statsn))
+		return -1;
+
+	if (erl_snack(s, ISCSI_FLAG_SNACK_TYPE_RDATA, itt, 0, 0) ||
+	    erl_data_in(s, itt, 0, ERL_SEGS, 0, &statsn2))
+		return -1;
+	if (statsn2 != statsn) {
+		fprintf(stderr, "session %d: StatSN %u came again as %u\n",
+			s->id, statsn, statsn2);
+		return -1;
+	}
+	s->exp_statsn = statsn + 1;
+	return erl_ping(s);
+}
+
+/*
+ * The connection drops with a WRITE waiting for its data and a READ
+ * part way through its Data-In. A connection taking its place gets
+ * both with TASK REASSIGN: the rest of the READ, and an R2T for all
+ * of the WRITE.
+ */
+static int erl_check_reassign(struct bench_session *s, uint64_t offset)
+{
+	uint32_t witt, ritt, ttt, r2tsn, r2t_off, r2t_len, statsn;
+	uint64_t woffset = offset + ERL_LEN;
+	struct bench_session *n;
+	int ret = -1;
+
+	if (erl_write(s, offset) || erl_prime(s, woffset))
+		return -1;
+	witt = erl_itt++;
+	if (erl_cmd(s, witt, 1, woffset) ||
+	    erl_r2t(s, witt, &ttt, &r2tsn, &r2t_off, &r2t_len))
+		return -1;
+	ritt = erl_itt++;
+	if (erl_cmd(s, ritt, 0, offset) ||
+	    erl_data_in(s, ritt, 0, ERL_REASSIGN_DATASN, 0, NULL))
+		return -1;
+
+	shutdown(s->fd, SHUT_RDWR);
+	s->dead = 1;
+	n = session_open(s->id, erl_ai, s);
+	if (!n)
+		return -1;
+
+	if (erl_reassign(n, ritt, ERL_REASSIGN_DATASN) ||
+	    erl_data_in(n, ritt, ERL_REASSIGN_DATASN, ERL_SEGS, 0, &statsn))
+		goto out;
+	n->exp_statsn = statsn + 1;
+
+	if (erl_reassign(n, witt, 0) || erl_write_data(n, witt, 0) ||
+	    erl_status(n, witt, NULL) || erl_verify(n, woffset))
+		goto out;
+	ret = 0;
+out:
+	n->dead = !!ret;
+	session_close(n);
+	return ret;
+}
+
+static struct {
+	const char *name;
+	int (*check)(struct bench_session *, uint64_t);
+} erl_checks[] = {
+	{"data_digest", erl_check_digest},
+	{"snack_data", erl_check_snack_data},
+	{"snack_r2t", erl_check_snack_r2t},
+	{"snack_status", erl_check_snack_status},
+	{"snack_dataack", erl_check_snack_dataack},
+	{"snack_rdata", erl_check_snack_rdata},
+	{"task_reassign", erl_check_reassign},
+};
+
+static int erl_run(void)
+{
+	struct addrinfo hints;
+	struct bench_session *s;
+	unsigned int i;
+	int ret, failed = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(bench.host, bench.port, &hints, &erl_ai);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", bench.host, gai_strerror(ret));
+		return -1;
+	}
+
+	s = session_open(0, erl_ai, NULL);
+	if (!s)
+		return -1;
+	ret = session_setup(s, 1);
+	session_close(s);
+	if (ret)
+		return -1;
+	if (!bench.lu_blk_size || ERL_LEN % bench.lu_blk_size ||
+	    bench.lu_blocks * bench.lu_blk_size <
+	    ARRAY_SIZE(erl_checks) * ERL_REGION) {
+		fprintf(stderr, "the LU must have blocks of up to %u bytes "
+			"and hold %u\n", ERL_LEN,
+			(unsigned int)ARRAY_SIZE(erl_checks) * ERL_REGION);
+		return -1;
+	}
+
+	/* past those of session_sync_cmd() and session_logout() */
+	erl_itt = bench.depth + 1;
+	for (i = 0; i < ARRAY_SIZE(erl_checks); i++) {
+		s = session_open(i + 1, erl_ai, NULL);
+		ret = -1;
+		if (s) {
+			ret = session_setup(s, 0) ? -1 :
+				erl_checks[i].check(s, (uint64_t)i * ERL_REGION);
+			s->dead |= !!ret;
+			session_close(s);
+		}
+		printf("%-16s %s\n", erl_checks[i].name, ret ? "FAILED" : "ok");
+		failed |= ret;
+	}
+
+	freeaddrinfo(erl_ai);
+	return failed ? -1 : 0;
+}
+
+static int str_to_digest(char *str)
+{
+	if (!strcmp(str, "none"))
+		return 0;
+	if (!strcmp(str, "header"))
+		return 1;
+	if (!strcmp(str, "data"))
+		return 2;
+	if (!strcmp(str, "all"))
+		return 3;
+	fprintf(stderr, "unknown digest: %s\n", str);
+	exit(EINVAL);
+}
+
+static long str_to_num(char *str, const char *name, long min, long max)
+{
+	char *end;
+	long v;
+
+	errno = 0;
+	v = strtol(str, &end, 0);
+	if (errno || *end || v < min || v > max) {
+		fprintf(stderr, "%s must be between %ld and %ld\n", name, min,
+			max);
+		exit(EINVAL);
+	}
+	return v;
+}
+
+int main(int argc, char **argv)
+{
+	int ch, longindex, digest = 0;
+	char host[256], initiator[300];
+	uint64_t rnd = now_nsecs() | 1;
+	uint32_t i, size;
+
+	bench.host = "127.0.0.1";
+	bench.port = "3260";
+	bench.lun = 1;
+	bench.sessions = 1;
+	bench.threads = 1;
+	bench.depth = 32;
+	bench.block_size = 4096;
+	bench.read_pct = 100;
+	bench.runtime = 10;
+
+	while ((ch = getopt_long(argc, argv, short_options,
+				 long_options, &longindex)) >= 0) {
+		switch (ch) {
+		case 'H':
+			bench.host = optarg;
+			break;
+		case 'p':
+			bench.port = optarg;
+			break;
+		case 'T':
+			bench.target = optarg;
+			break;
+		case 'I':
+			bench.initiator = optarg;
+			break;
+		case 'l':
+			bench.lun = str_to_num(optarg, "lun", 0, 16383);
+			break;
+		case 'n':
+			bench.sessions = str_to_num(optarg, "sessions", 1,
+						    65535);
+			break;
+		case 'j':
+			bench.threads = str_to_num(optarg, "threads", 1, 1024);
+			break;
+		case 'q':
+			bench.depth = str_to_num(optarg, "queue depth", 1,
+						 65536);
+			break;
+		case 'b':
+			bench.block_size = str_to_num(optarg, "block size",
+						      512, MAX_BURST);
+			break;
+		case 'r':
+			bench.read_pct = str_to_num(optarg, "read-pct", 0, 100);
+			break;
+		case 'P':
+			if (!strcmp(optarg, "seq"))
+				bench.seq = 1;
+			else if (strcmp(optarg, "rand")) {
+				fprintf(stderr, "unknown pattern: %s\n",
+					optarg);
+				exit(EINVAL);
+			}
+			break;
+		case 'd':
+			digest = str_to_digest(optarg);
+			break;
+		case 't':
+			bench.runtime = str_to_num(optarg, "runtime", 1,
+						   86400);
+			break;
+		case 'w':
+			bench.ramp = str_to_num(optarg, "ramp", 0, 3600);
+			break;
+		case 'x':
+			bench.csv = 1;
+			break;
+		case 'e':
+			bench.erl = 1;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+
+	if (optind < argc) {
+		fprintf(stderr, "unrecognized option '%s'\n", argv[optind]);
+		usage(1);
+	}
+
+	if (!bench.target) {
+		fprintf(stderr, "'targetname' option is necessary\n");
+		usage(1);
+	}
+
+	if (!bench.initiator) {
+		if (gethostname(host, sizeof(host)))
+			strcpy(host, "localhost");
+		host[sizeof(host) - 1] = '\0';
+		snprintf(initiator, sizeof(initiator),
+			 "iqn.2007-03.org.tgt:%s:%s", program_name, host);
+		bench.initiator = initiator;
+	}
+
+	/* one check corrupts a data digest */
+	if (bench.erl)
+		digest |= 2;
+	bench.hdigest = digest & 1;
+	bench.ddigest = !!(digest & 2);
+	if (bench.threads > bench.sessions)
+		bench.threads = bench.sessions;
+	lun_to_id(bench.lun, bench.lun_id);
+
+	size = bench.erl ? 2 * ERL_LEN : bench.block_size;
+	if (posix_memalign((void **)&bench.wbuf, 4096, size)) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	/* the erl checks want data read from the wrong offset to show */
+	for (i = 0; i < size; i++)
+		bench.wbuf[i] = bench.erl ? xorshift64(&rnd) : i * 131 + 7;
+
+	return (bench.erl ? erl_run() : bench_run()) ? 1 : 0;
+}
@@ -60,6 +60,8 @@ static int ep_fd;
 static char program_name[] = "tgtd";
 static LIST_HEAD(tgt_events_list);
 static LIST_HEAD(tgt_sched_events_list);
+/* deleted while an epoll batch may still point at them */
+static LIST_HEAD(tgt_dead_events_list);
 
 static pthread_t ha_hb_tid;
 static struct _ha_instance *ha;
@@ -242,8 +244,6 @@ static struct event_data *tgt_event_lookup(int fd)
 	return NULL;
 }
 
-static int event_need_refresh;
-
 void tgt_event_del(int fd)
 {
 	struct event_data *tev;
@@ -259,10 +259,24 @@ void tgt_event_del(int fd)
 	if (ret < 0)
 		eprintf("fail to remove epoll event, %s\n", strerror(errno));
 
+	/*
+	 * Later entries of the batch event_loop() is walking may still
+	 * refer to tev, so leave a tombstone that is freed once the batch
+	 * is done.
+	 */
+	tev->handler = NULL;
 	list_del(&tev->e_list);
-	free(tev);
+	list_add(&tev->e_list, &tgt_dead_events_list);
+}
 
-	event_need_refresh = 1;
+static void tgt_event_reap(void)
+{
+	struct event_data *tev, *tevn;
+
+	list_for_each_entry_safe(tev, tevn, &tgt_dead_events_list, e_list) {
+		list_del(&tev->e_list);
+		free(tev);
+	}
 }
 
 int tgt_event_modify(int fd, int events)
@@ -333,8 +347,8 @@ void str_spacecpy(char **dest, const char *src)
 	*d = '\0';
 }
 
-int call_program(const char *cmd, void (*callback)(void *data, int result),
-		void *data, char *output, int op_len, int flags)
+/* fork and exec cmd with its stdout on a pipe, read end in *fd */
+static pid_t program_spawn(const char *cmd, int *fd)
 {
 	pid_t pid;
 	int fds[2], ret, i;
@@ -379,70 +393,196 @@ int call_program(const char *cmd, void (*callback)(void *data, int result),
 
 		eprintf("execv failed for: %s, %m\n", cmd);
 		exit(-1);
-	} else {
-		struct timeval tv;
-		fd_set rfds;
-		int ret_sel;
+	}
 
-		close(fds[1]);
-		/* 0.1 second is okay, as the initiator will retry anyway */
-		do {
-			FD_ZERO(&rfds);
-			FD_SET(fds[0], &rfds);
-			tv.tv_sec = 0;
-			tv.tv_usec = 100000;
-			ret_sel = select(fds[0]+1, &rfds, NULL, NULL, &tv);
-		} while (ret_sel < 0 && errno == EINTR);
-		if (ret_sel <= 0) { /* error or timeout */
-			eprintf("timeout on redirect callback, terminating "
-				"child pid %d\n", pid);
-			kill(pid, SIGTERM);
-		}
-		do {
-			ret = waitpid(pid, &i, 0);
-		} while (ret < 0 && errno == EINTR);
+	close(fds[1]);
+	*fd = fds[0];
+	return pid;
+}
+
+int call_program(const char *cmd, void (*callback)(void *data, int result),
+		void *data, char *output, int op_len, int flags)
+{
+	struct timeval tv;
+	fd_set rfds;
+	pid_t pid;
+	int fd, ret, ret_sel, i;
+
+	pid = program_spawn(cmd, &fd);
+	if (pid < 0)
+		return pid;
+
+	/* 0.1 second is okay, as the initiator will retry anyway */
+	do {
+		FD_ZERO(&rfds);
+		FD_SET(fd, &rfds);
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		ret_sel = select(fd + 1, &rfds, NULL, NULL, &tv);
+	} while (ret_sel < 0 && errno == EINTR);
+	if (ret_sel <= 0) { /* error or timeout */
+		eprintf("timeout on redirect callback, terminating "
+			"child pid %d\n", pid);
+		kill(pid, SIGTERM);
+	}
+	do {
+		ret = waitpid(pid, &i, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		eprintf("waitpid failed for: %s, %m\n", cmd);
+		close(fd);
+		return ret;
+	}
+	if (ret_sel > 0) {
+		ret = read(fd, output, op_len);
 		if (ret < 0) {
-			eprintf("waitpid failed for: %s, %m\n", cmd);
-			close(fds[0]);
+			eprintf("failed to get output from: %s\n", cmd);
+			close(fd);
 			return ret;
 		}
-		if (ret_sel > 0) {
-			ret = read(fds[0], output, op_len);
-			if (ret < 0) {
-				eprintf("failed to get output from: %s\n", cmd);
-				close(fds[0]);
-				return ret;
-			}
+	}
+
+	if (callback)
+		callback(data, WEXITSTATUS(i));
+	close(fd);
+
+	return 0;
+}
+
+struct tgt_program {
+	pid_t pid;
+	int fd;
+	int len;
+	unsigned int timeout;	/* seconds left */
+	char output[1024];
+	void (*callback)(void *data, char *output);
+	void *data;
+	struct tgt_work work;
+};
+
+static void program_finish(struct tgt_program *prog, int ok)
+{
+	tgt_event_del(prog->fd);
+	close(prog->fd);
+	prog->fd = -1;
+
+	prog->output[prog->len] = '\0';
+	prog->callback(prog->data, ok ? prog->output : NULL);
+
+	if (waitpid(prog->pid, NULL, WNOHANG) == prog->pid) {
+		del_work(&prog->work);
+		free(prog);
+		return;
+	}
+
+	/* reaped from the work handler */
+	if (list_empty(&prog->work.entry))
+		add_work(&prog->work, 1);
+}
+
+static void program_event_handler(int fd, int events, void *data)
+{
+	struct tgt_program *prog = data;
+	ssize_t ret;
+
+	ret = read(fd, prog->output + prog->len,
+		   sizeof(prog->output) - 1 - prog->len);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		eprintf("failed to get output from pid %d, %m\n", prog->pid);
+		program_finish(prog, 0);
+		return;
+	}
+
+	prog->len += ret;
+	if (!ret || prog->len == sizeof(prog->output) - 1)
+		program_finish(prog, 1);
+}
+
+static void program_work_handler(void *data)
+{
+	struct tgt_program *prog = data;
+
+	if (prog->fd >= 0) {
+		if (--prog->timeout) {
+			add_work(&prog->work, 1);
+			return;
 		}
+		eprintf("timeout on callback, terminating child pid %d\n",
+			prog->pid);
+		kill(prog->pid, SIGTERM);
+		program_finish(prog, 0);
+		return;
+	}
 
-		if (callback)
-			callback(data, WEXITSTATUS(i));
-		close(fds[0]);
+	/* output is in, the child has yet to exit */
+	if (waitpid(prog->pid, NULL, WNOHANG) == prog->pid) {
+		free(prog);
+		return;
 	}
+	kill(prog->pid, SIGKILL);
+	add_work(&prog->work, 1);
+}
+
+/*
+ * Like call_program() but never blocks the event loop: the output is
+ * collected from an event handler and callback gets it, NUL terminated,
+ * or NULL if the program could not be run or ran past timeout seconds.
+ */
+int call_program_async(const char *cmd, unsigned int timeout,
+		       void (*callback)(void *data, char *output),
+		       void *data)
+{
+	struct tgt_program *prog;
+	int ret;
+
+	prog = zalloc(sizeof(*prog));
+	if (!prog)
+		return -ENOMEM;
+
+	prog->pid = program_spawn(cmd, &prog->fd);
+	if (prog->pid < 0) {
+		free(prog);
+		return -EINVAL;
+	}
+
+	set_non_blocking(prog->fd);
+	ret = tgt_event_add(prog->fd, EPOLLIN, program_event_handler, prog);
+	if (ret) {
+		kill(prog->pid, SIGTERM);
+		close(prog->fd);
+		waitpid(prog->pid, NULL, 0);
+		free(prog);
+		return ret;
+	}
+
+	prog->timeout = timeout ? timeout : 1;
+	prog->callback = callback;
+	prog->data = data;
+	prog->work.func = program_work_handler;
+	prog->work.data = prog;
+	add_work(&prog->work, 1);
 
 	return 0;
 }
 
 static int tgt_exec_scheduled(void)
 {
-	struct list_head *last_sched;
-	struct event_data *tev, *tevn;
-	int work_remains = 0;
-
-	if (!list_empty(&tgt_sched_events_list)) {
-		/* execute only work scheduled till now */
-		last_sched = tgt_sched_events_list.prev;
-		list_for_each_entry_safe(tev, tevn, &tgt_sched_events_list,
-					 e_list) {
-			tgt_remove_sched_event(tev);
-			tev->sched_handler(tev);
-			if (&tev->e_list == last_sched)
-				break;
-		}
-		if (!list_empty(&tgt_sched_events_list))
-			work_remains = 1;
+	LIST_HEAD(sched);
+	struct event_data *tev;
+
+	/*
+	 * execute only work scheduled till now; a handler may remove or
+	 * free any other event, so always take the first one left
+	 */
+	list_splice_init(&tgt_sched_events_list, &sched);
+	while (!list_empty(&sched)) {
+		tev = list_first_entry(&sched, struct event_data, e_list);
+		tgt_remove_sched_event(tev);
+		tev->sched_handler(tev);
 	}
-	return work_remains;
+	return !list_empty(&tgt_sched_events_list);
 }
 
 static void event_loop(void)
@@ -464,14 +604,12 @@ retry:
 	} else if (nevent) {
 		for (i = 0; i < nevent; i++) {
 			tev = (struct event_data *) events[i].data.ptr;
-			tev->handler(tev->fd, events[i].events, tev->data);
-
-			if (event_need_refresh) {
-				event_need_refresh = 0;
-				goto retry;
-			}
+			if (tev->handler)
+				tev->handler(tev->fd, events[i].events,
+					     tev->data);
 		}
 	}
+	tgt_event_reap();
 
 	if (system_active)
 		goto retry;
@@ -596,6 +734,11 @@ enum tgt_svc_err {
 	TGT_ERR_HA_MAX_LIMIT,
 	TGT_ERR_GET_COMPONENT_STATS_FAILED,
 	TGT_ERR_TARGET_UNBIND,
+	TGT_ERR_INVALID_READ_CACHE,
+	TGT_ERR_INVALID_WRITE_BACK,
+	TGT_ERR_INVALID_QOS,
+	TGT_ERR_LUN_QOS,
+	TGT_ERR_LUN_ANALYTICS,
 };
 
 static void set_err_msg(_ha_response *resp, enum tgt_svc_err err,
@@ -627,6 +770,33 @@ static int exec(char *cmd)
 	return status;
 }
 
+/* like exec(), but keeps up to size - 1 bytes of the command's stdout */
+static int exec_output(char *cmd, char *buf, size_t size)
+{
+	FILE *filp = NULL;
+	size_t len = 0, n;
+	int ret = 0;
+	int status = 0;
+
+	eprintf("Executing command: %s\n", cmd);
+	filp = popen(cmd, "r");
+	if (filp == NULL) {
+		return -1;
+	}
+
+	while (len < size - 1 &&
+	       (n = fread(buf + len, 1, size - 1 - len, filp)) > 0)
+		len += n;
+	buf[len] = '\0';
+
+	status = WEXITSTATUS(ret = pclose(filp));
+	if (!(ret < 0 || (status != 0 && status != 128+SIGPIPE))) {
+		status = 0;
+	}
+
+	return status;
+}
+
 static int disallow_rest_call()
 {
 	int rc = 0;
@@ -847,11 +1017,56 @@ static int lun_create(const _ha_request *reqp,
 		return HA_CALLBACK_CONTINUE;
 	}
 
-	memset(cmd, 0, sizeof(cmd));
+	/* Optional local read cache in the sparse file */
+	char rcache_opts[64] = "";
+	char wb_opts[600] = "";
+	json_t *read_cache = json_object_get(root, "ReadCache");
+	if (read_cache && !json_is_boolean(read_cache)) {
+		set_err_msg(resp, TGT_ERR_INVALID_READ_CACHE,
+			"ReadCache is not boolean");
+		return HA_CALLBACK_CONTINUE;
+	}
+	if (json_is_true(read_cache)) {
+		json_t *read_cache_size = json_object_get(root, "ReadCacheSize");
+		if (read_cache_size && !json_is_string(read_cache_size)) {
+			set_err_msg(resp, TGT_ERR_INVALID_READ_CACHE,
+				"ReadCacheSize is not string");
+			return HA_CALLBACK_CONTINUE;
+		}
+		snprintf(rcache_opts, sizeof(rcache_opts), ":rcache=1");
+		if (read_cache_size &&
+		    snprintf(rcache_opts, sizeof(rcache_opts),
+				":rcache=1:rcache_size=%llu",
+				(unsigned long long) atoll(json_string_value(
+						read_cache_size))) >=
+				sizeof(rcache_opts)) {
+			set_err_msg(resp, TGT_ERR_TOO_LONG,
+				"ReadCacheSize too long");
+			return HA_CALLBACK_CONTINUE;
+		}
+	}
 
 	/* Create sparse file directory if not already created */
 	const char *hyc_sparse_files_loc = "/var/hyc";
 
+	/* Optional write-back journal next to the sparse file */
+	json_t *write_back = json_object_get(root, "WriteBack");
+	if (write_back && !json_is_boolean(write_back)) {
+		set_err_msg(resp, TGT_ERR_INVALID_WRITE_BACK,
+			"WriteBack is not boolean");
+		return HA_CALLBACK_CONTINUE;
+	}
+	if (json_is_true(write_back) &&
+	    snprintf(wb_opts, sizeof(wb_opts), ":wb_journal=%s/%s.journal",
+			hyc_sparse_files_loc, json_string_value(dev_name)) >=
+			sizeof(wb_opts)) {
+		set_err_msg(resp, TGT_ERR_TOO_LONG,
+			"journal path too long");
+		return HA_CALLBACK_CONTINUE;
+	}
+
+	memset(cmd, 0, sizeof(cmd));
+
 	int len = snprintf(cmd, sizeof(cmd),
 		"mkdir -p %s", hyc_sparse_files_loc);
 	if (len >= sizeof(cmd)) {
@@ -931,9 +1146,9 @@ static int lun_create(const _ha_request *reqp,
 	len = 0;
 	len = snprintf(cmd, sizeof(cmd),
 		"tgtadm --lld iscsi --mode logicalunit --op new"
-		" --tid=%s --lun=%s -b %s --bstype hyc --bsopts vmid=%s:vmdkid=%s",
+		" --tid=%s --lun=%s -b %s --bstype hyc --bsopts vmid=%s:vmdkid=%s%s%s",
 		tid, lid, dev_path, json_string_value(vmid),
-		json_string_value(vmdkid));
+		json_string_value(vmdkid), rcache_opts, wb_opts);
 	if (len >= sizeof(cmd)) {
 		set_err_msg(resp, TGT_ERR_TOO_LONG,
 			"tgt cmd too long");
@@ -1459,6 +1674,123 @@ static int lun_delete(const _ha_request *reqp,
 	return HA_CALLBACK_CONTINUE;
 }
 
+/*
+ * Set the QoS limits of a LUN, e.g.
+ * {"ReadIops": "5000", "WriteBps": "104857600", "WriteBpsBurst": "..."}.
+ * Only the limits given are changed, "0" removes one.
+ */
+static int lun_qos(const _ha_request *reqp,
+	_ha_response *resp, void *userp)
+{
+	static const struct {
+		const char *key;
+		const char *param;
+	} qos_keys[] = {
+		{"ReadIops", "qos_read_iops"},
+		{"ReadIopsBurst", "qos_read_iops_burst"},
+		{"WriteIops", "qos_write_iops"},
+		{"WriteIopsBurst", "qos_write_iops_burst"},
+		{"ReadBps", "qos_read_bps"},
+		{"ReadBpsBurst", "qos_read_bps_burst"},
+		{"WriteBps", "qos_write_bps"},
+		{"WriteBpsBurst", "qos_write_bps_burst"},
+	};
+	char cmd[512];
+	char params[400] = "";
+	const char *tid = ha_parameter_get(reqp, "tid");
+	const char *lid = ha_parameter_get(reqp, "lid");
+	char *data = NULL;
+	uint64_t val;
+	int rc, len, plen = 0, i;
+
+	if (tid == NULL) {
+		set_err_msg(resp, TGT_ERR_INVALID_PARAM,
+			"tid param not given");
+		return HA_CALLBACK_CONTINUE;
+	}
+
+	if (lid == NULL) {
+		set_err_msg(resp, TGT_ERR_INVALID_PARAM,
+			"lid param not given");
+		return HA_CALLBACK_CONTINUE;
+	}
+
+	data = ha_get_data(reqp);
+	if (data == NULL) {
+		set_err_msg(resp, TGT_ERR_NO_DATA,
+			"json config not given");
+		return HA_CALLBACK_CONTINUE;
+	}
+
+	json_error_t error;
+	json_auto_t *root = json_loads(data, 0, &error);
+
+	free(data);
+	if (root == NULL) {
+		set_err_msg(resp, TGT_ERR_INVALID_JSON,
+			"json config is incorrect");
+		return HA_CALLBACK_CONTINUE;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(qos_keys); i++) {
+		json_t *limit = json_object_get(root, qos_keys[i].key);
+		const char *str;
+
+		if (!limit)
+			continue;
+		if (!json_is_string(limit)) {
+			set_err_msg(resp, TGT_ERR_INVALID_QOS,
+				"QoS limit is not string");
+			return HA_CALLBACK_CONTINUE;
+		}
+		str = json_string_value(limit);
+		if (str_to_int(str, val)) {
+			set_err_msg(resp, TGT_ERR_INVALID_QOS,
+				"QoS limit is not a number");
+			return HA_CALLBACK_CONTINUE;
+		}
+		plen += snprintf(params + plen, sizeof(params) - plen,
+			"%s%s=%" PRIu64, plen ? "," : "",
+			qos_keys[i].param, val);
+	}
+	if (!plen) {
+		set_err_msg(resp, TGT_ERR_INVALID_QOS,
+			"no QoS limit given");
+		return HA_CALLBACK_CONTINUE;
+	}
+
+	memset(cmd, 0, sizeof(cmd));
+	len = snprintf(cmd, sizeof(cmd),
+		"tgtadm --lld iscsi --mode logicalunit --op update"
+		" --tid=%s --lun=%s --params %s", tid, lid, params);
+	if (len >= sizeof(cmd)) {
+		set_err_msg(resp, TGT_ERR_TOO_LONG,
+			"tgt cmd too long");
+		return HA_CALLBACK_CONTINUE;
+	}
+
+	if (disallow_rest_call()) {
+		set_err_msg(resp, TGT_ERR_HA_MAX_LIMIT,
+		"Too many pending requests at TGT. Retry after some time");
+		return HA_CALLBACK_CONTINUE;
+	}
+
+	pthread_mutex_lock(&ha_rest_mutex);
+	rc = exec(cmd);
+	if (rc) {
+		set_err_msg(resp, TGT_ERR_LUN_QOS, "TGT lun QoS update failed");
+		pthread_mutex_unlock(&ha_rest_mutex);
+		remove_rest_call();
+		return HA_CALLBACK_CONTINUE;
+	}
+
+	ha_set_empty_response_body(resp, HTTP_STATUS_OK);
+
+	pthread_mutex_unlock(&ha_rest_mutex);
+	remove_rest_call();
+	return HA_CALLBACK_CONTINUE;
+}
+
 static int get_vmdk_stats(const _ha_request *reqp,
 	_ha_response *resp, void *userp)
 {
@@ -1620,6 +1952,54 @@ int tgt_ha_stop_cb(const _ha_request *reqp,
 	return HA_CALLBACK_CONTINUE;
 }
 
+static int lun_analytics(const _ha_request *reqp,
+	_ha_response *resp, void *userp)
+{
+	char cmd[256];
+	char out[8192];
+	const char *tid = ha_parameter_get(reqp, "tid");
+	const char *lid = ha_parameter_get(reqp, "lid");
+	uint64_t val;
+	int rc;
+
+	if (tid == NULL || str_to_int(tid, val)) {
+		set_err_msg(resp, TGT_ERR_INVALID_PARAM,
+			"tid param not given or invalid");
+		return HA_CALLBACK_CONTINUE;
+	}
+
+	if (lid == NULL || str_to_int(lid, val)) {
+		set_err_msg(resp, TGT_ERR_INVALID_LUNID,
+			"lid param not given or invalid");
+		return HA_CALLBACK_CONTINUE;
+	}
+
+	snprintf(cmd, sizeof(cmd),
+		"tgtadm --lld iscsi --mode logicalunit --op stat"
+		" --tid=%s --lun=%s --name analytics --value json", tid, lid);
+
+	if (disallow_rest_call()) {
+		set_err_msg(resp, TGT_ERR_HA_MAX_LIMIT,
+		"Too many pending requests at TGT. Retry after some time");
+		return HA_CALLBACK_CONTINUE;
+	}
+
+	pthread_mutex_lock(&ha_rest_mutex);
+	rc = exec_output(cmd, out, sizeof(out));
+	if (rc || !out[0]) {
+		set_err_msg(resp, TGT_ERR_LUN_ANALYTICS,
+			"TGT lun analytics query failed");
+		goto out;
+	}
+
+	ha_set_response_body(resp, HTTP_STATUS_OK, out, strlen(out));
+
+out:
+	pthread_mutex_unlock(&ha_rest_mutex);
+	remove_rest_call();
+	return HA_CALLBACK_CONTINUE;
+}
+
 struct EndPoint {
 	int method;
 	char* url;
@@ -1631,12 +2011,14 @@ struct EndPoint {
 	{POST, "target_bind", target_bind},
 	{POST, "target_unbind", target_unbind},
 	{POST, "lun_delete", lun_delete},
+	{POST, "lun_qos", lun_qos},
 	{POST, "target_delete", target_delete},
 	{POST, "set_batching_attributes", set_batching_attributes},
 	{POST, "set_deployment_target", set_deployement_target},
 
 	{GET, "get_component_stats", get_component_stats},
 	{GET, "vmdk_stats", get_vmdk_stats},
+	{GET, "lun_analytics", lun_analytics},
 };
 
 int main(int argc, char **argv)
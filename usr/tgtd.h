@@ -49,11 +49,79 @@ enum scsi_target_state {
 
 struct tgt_cmd_queue {
 	int active_cmd;
+	/* answered outside the queue, only to keep the LU around */
+	int bypass_cmd;
 	unsigned long state;
 	struct list_head queue;
 };
 
+/* token bucket, a zero rate means no limit */
+struct tgt_qos_bucket {
+	uint64_t rate;		/* per second */
+	uint64_t burst;		/* bucket depth, 0: one second of rate */
+	int64_t tokens;		/* negative after an oversized command */
+	uint64_t stamp;		/* usecs of the last refill */
+};
+
+enum {
+	TGT_QOS_READ,
+	TGT_QOS_WRITE,
+	TGT_QOS_DIRS,
+};
+
+/*
+ * Per LU and per target I/O limits. Commands over budget stay in the
+ * LU's cmd_queue until their buckets have refilled.
+ */
+struct tgt_qos {
+	int enabled;
+	struct tgt_qos_bucket iops[TGT_QOS_DIRS];
+	struct tgt_qos_bucket bps[TGT_QOS_DIRS];
+
+	/* LU only */
+	uint64_t throttled_cmds[TGT_QOS_DIRS];
+	uint64_t throttled_usecs;
+	uint64_t throttle_start;
+	struct list_head throttled_siblings;
+};
+
+enum {
+	LU_AN_READ,
+	LU_AN_WRITE,
+	LU_AN_DIRS,
+};
+
+#define LU_AN_SIZE_BUCKETS	12	/* <1K, 1K, 2K, ... 1M+ */
+#define LU_AN_GAP_BUCKETS	7	/* <10us, <100us, ... 1s+ */
+#define LU_AN_HEAT_BUCKETS	128
+#define LU_AN_STREAMS		4
+
+/*
+ * Per LU I/O profile, see usr/analytics.c. All counters are halved
+ * once per half-life so they describe the recent workload.
+ */
+struct lu_analytics {
+	uint64_t decay_stamp;	/* usecs of the last halving */
+	uint64_t last_arrival;	/* usecs */
+
+	uint64_t cmds[LU_AN_DIRS];
+	uint64_t bytes[LU_AN_DIRS];
+	uint64_t seq_cmds[LU_AN_DIRS];
+	uint64_t size_hist[LU_AN_DIRS][LU_AN_SIZE_BUCKETS];
+	uint64_t gap_hist[LU_AN_GAP_BUCKETS];
+
+	/* the LU is cut into LU_AN_HEAT_BUCKETS regions of 1 << heat_shift */
+	uint64_t heat_size;
+	unsigned int heat_shift;
+	uint64_t heat[LU_AN_HEAT_BUCKETS][LU_AN_DIRS];
+
+	/* end offsets of the last few commands, for sequential detection */
+	uint64_t stream_end[LU_AN_DIRS][LU_AN_STREAMS];
+	unsigned int stream_next[LU_AN_DIRS];
+};
+
 struct scsi_lu;
+struct lu_capture;
 
 struct vpd {
 	uint16_t size;
@@ -156,6 +224,8 @@ struct device_type_template {
 	tgtadm_err (*lu_online)(struct scsi_lu *lu);
 	tgtadm_err (*lu_offline)(struct scsi_lu *lu);
 	int (*cmd_passthrough)(int, struct scsi_cmd *);
+	/* READ/WRITE 10/16 when the LU's fastpath allows them */
+	int (*cmd_fastpath)(int, struct scsi_cmd *);
 
 	struct device_type_operations ops[NR_SCSI_OPCODES];
 
@@ -172,6 +242,8 @@ struct backingstore_template {
 	int (*bs_cmd_submit)(struct scsi_cmd *cmd);
 	int (*bs_cmd_abort)(struct scsi_cmd* cmd);
 	int (*bs_stop)(struct scsi_lu *dev);
+	/* optional, appends backing store specific lines to "show" */
+	void (*bs_show)(struct scsi_lu *dev, struct concat_buf *b);
 	int bs_oflags_supported;
 	unsigned long bs_supported_ops[NR_SCSI_OPCODES / __WORDSIZE];
 
@@ -196,6 +268,9 @@ struct registration {
 	uint8_t pr_type;
 };
 
+#define LU_FASTPATH_READ	(1U << 0)
+#define LU_FASTPATH_WRITE	(1U << 1)
+
 struct scsi_lu {
 	int fd;
 	uint64_t addr; /* persistent mapped address */
@@ -211,6 +286,16 @@ struct scsi_lu {
 	struct list_head lu_itl_info_list;
 
 	struct tgt_cmd_queue cmd_queue;
+	struct tgt_qos qos;
+	struct lu_analytics analytics;
+	struct lu_capture *capture;
+
+	/* LU_FASTPATH_* bits, see scsi_lu_fastpath_update() */
+	unsigned int fastpath;
+	/* lu_analytics_record() runs only when set, see analytics=on|off */
+	unsigned int analytics_on;
+	/* pre-encoded INQUIRY data, see spc_inquiry() */
+	struct lu_inq_resp *inq_cache;
 
 	uint64_t reserve_id;
 
@@ -332,6 +417,7 @@ extern int lu_prevent_removal(struct scsi_lu *lu);
 
 extern uint64_t scsi_get_devid(int lid, uint8_t *pdu);
 extern int scsi_cmd_perform(int host_no, struct scsi_cmd *cmd);
+extern void scsi_lu_fastpath_update(struct scsi_lu *lu);
 extern void sense_data_build(struct scsi_cmd *cmd, uint8_t key, uint16_t asc);
 extern uint64_t scsi_rw_offset(uint8_t *scb);
 extern uint32_t scsi_rw_count(uint8_t *scb);
@@ -344,6 +430,8 @@ extern const unsigned char *get_scsi_cdb_usage_data(unsigned char op,
 
 extern enum scsi_target_state tgt_get_target_state(int tid);
 extern tgtadm_err tgt_set_target_state(int tid, char *str);
+extern tgtadm_err tgt_set_target_qos(int tid, char *name, char *value);
+extern tgtadm_err tgt_qos_update(struct tgt_qos *qos, char *name, char *value);
 
 extern tgtadm_err acl_add(int tid, char *address);
 extern tgtadm_err acl_del(int tid, char *address);
@@ -361,6 +449,19 @@ extern tgtadm_err tgt_stat_device_by_id(int tid, uint64_t dev_id, struct concat_
 extern tgtadm_err tgt_stat_target(struct target *target, struct concat_buf *b);
 extern tgtadm_err tgt_stat_target_by_id(int tid, struct concat_buf *b);
 extern tgtadm_err tgt_stat_system(struct concat_buf *b);
+extern tgtadm_err tgt_stat_analytics_by_id(int tid, uint64_t dev_id, char *value,
+					   struct concat_buf *b);
+
+extern tgtadm_err lu_capture_start(struct scsi_lu *lu, char *path);
+extern void lu_capture_stop(struct scsi_lu *lu);
+extern void lu_capture_submit(struct scsi_cmd *cmd);
+extern void lu_capture_done(struct scsi_cmd *cmd, int result);
+extern void lu_capture_show(struct scsi_lu *lu, struct concat_buf *b);
+
+extern void lu_analytics_record(struct scsi_cmd *cmd);
+extern tgtadm_err lu_analytics_enable(struct scsi_lu *lu, char *value);
+extern tgtadm_err lu_analytics_show(struct scsi_lu *lu, char *value,
+				    struct concat_buf *b);
 
 extern int account_lookup(int tid, int type, char *user, int ulen, char *password, int plen);
 extern tgtadm_err account_add(char *user, char *password);
@@ -407,6 +508,9 @@ struct event_data {
 int call_program(const char *cmd,
 		    void (*callback)(void *data, int result), void *data,
 		    char *output, int op_len, int flags);
+int call_program_async(const char *cmd, unsigned int timeout,
+		       void (*callback)(void *data, char *output),
+		       void *data);
 
 void update_lbppbe(struct scsi_lu *lu, int blksize);
 
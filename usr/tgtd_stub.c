@@ -0,0 +1,209 @@
+/*
+ * tgtd's event loop for in process tools
+ *
+ * What target.c, the backing stores and the work timer reach into
+ * tgtd.c, mgmt.c and the iscsi driver for: the event loop, done the
+ * way tgtd does it, and a few stubs that aren't on the command path.
+ * Used by tgtreplay and hyc_check, which link the SCSI core and the
+ * backing stores without tgtd.o.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+#include "work.h"
+#include "log.h"
+#include "iscsi/iscsid.h"
+#include "tgtd_stub.h"
+
+unsigned long pagesize, pageshift;
+char mgmt_path[256];
+
+static int ep_fd = -1;
+static LIST_HEAD(stub_events_list);
+static LIST_HEAD(stub_dead_events_list);
+static LIST_HEAD(stub_sched_events_list);
+
+int tgt_event_add(int fd, int events, event_handler_t handler, void *data)
+{
+	struct epoll_event ev;
+	struct event_data *tev;
+	int err;
+
+	tev = zalloc(sizeof(*tev));
+	if (!tev)
+		return -ENOMEM;
+
+	tev->data = data;
+	tev->handler = handler;
+	tev->fd = fd;
+	tev->events = events;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = tev;
+	err = epoll_ctl(ep_fd, EPOLL_CTL_ADD, fd, &ev);
+	if (err) {
+		eprintf("Cannot add fd, %m\n");
+		free(tev);
+	} else
+		list_add(&tev->e_list, &stub_events_list);
+
+	return err;
+}
+
+static struct event_data *stub_event_lookup(int fd)
+{
+	struct event_data *tev;
+
+	list_for_each_entry(tev, &stub_events_list, e_list) {
+		if (tev->fd == fd)
+			return tev;
+	}
+	return NULL;
+}
+
+void tgt_event_del(int fd)
+{
+	struct event_data *tev;
+
+	tev = stub_event_lookup(fd);
+	if (!tev) {
+		eprintf("Cannot find event %d\n", fd);
+		return;
+	}
+
+	epoll_ctl(ep_fd, EPOLL_CTL_DEL, fd, NULL);
+
+	/* the batch tgtd_stub_poll() is walking may still refer to tev */
+	tev->handler = NULL;
+	list_del(&tev->e_list);
+	list_add(&tev->e_list, &stub_dead_events_list);
+}
+
+int tgt_event_modify(int fd, int events)
+{
+	struct epoll_event ev;
+	struct event_data *tev;
+
+	tev = stub_event_lookup(fd);
+	if (!tev) {
+		eprintf("Cannot find event %d\n", fd);
+		return -EINVAL;
+	}
+
+	if (tev->events == events)
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = tev;
+	tev->events = events;
+
+	return epoll_ctl(ep_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void tgt_init_sched_event(struct event_data *evt,
+			  sched_event_handler_t sched_handler, void *data)
+{
+	evt->sched_handler = sched_handler;
+	evt->scheduled = 0;
+	evt->data = data;
+	INIT_LIST_HEAD(&evt->e_list);
+}
+
+void tgt_add_sched_event(struct event_data *evt)
+{
+	if (!evt->scheduled) {
+		evt->scheduled = 1;
+		list_add_tail(&evt->e_list, &stub_sched_events_list);
+	}
+}
+
+void tgt_remove_sched_event(struct event_data *evt)
+{
+	if (evt->scheduled) {
+		evt->scheduled = 0;
+		list_del_init(&evt->e_list);
+	}
+}
+
+void iscsi_print_nop_settings(struct concat_buf *b, int tid)
+{
+}
+
+tgtadm_err conn_close_all(uint32_t tid)
+{
+	return TGTADM_SUCCESS;
+}
+
+/* one pass of tgtd's event_loop(), waiting at most timeout msecs */
+void tgtd_stub_poll(int timeout)
+{
+	struct epoll_event events[1024];
+	struct event_data *tev, *tevn;
+	LIST_HEAD(sched);
+	int nevent, i;
+
+	list_splice_init(&stub_sched_events_list, &sched);
+	while (!list_empty(&sched)) {
+		tev = list_first_entry(&sched, struct event_data, e_list);
+		tgt_remove_sched_event(tev);
+		tev->sched_handler(tev);
+	}
+	if (!list_empty(&stub_sched_events_list))
+		timeout = 0;
+
+	nevent = epoll_wait(ep_fd, events, ARRAY_SIZE(events), timeout);
+	if (nevent < 0 && errno != EINTR) {
+		eprintf("%m\n");
+		exit(1);
+	}
+	for (i = 0; i < nevent; i++) {
+		tev = (struct event_data *) events[i].data.ptr;
+		if (tev->handler)
+			tev->handler(tev->fd, events[i].events, tev->data);
+	}
+
+	list_for_each_entry_safe(tev, tevn, &stub_dead_events_list, e_list) {
+		list_del(&tev->e_list);
+		free(tev);
+	}
+}
+
+int tgtd_stub_init(char *program_name)
+{
+	pagesize = sysconf(_SC_PAGESIZE);
+	for (pageshift = 0;; pageshift++)
+		if (1UL << pageshift == pagesize)
+			break;
+
+	ep_fd = epoll_create(4096);
+	if (ep_fd < 0) {
+		fprintf(stderr, "can't create epoll fd, %m\n");
+		return -1;
+	}
+
+	log_init(program_name, 0, 0, 0);
+	if (work_timer_start() || bs_init()) {
+		fprintf(stderr, "can't start the backing store threads\n");
+		return -1;
+	}
+	return 0;
+}
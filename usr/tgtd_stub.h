@@ -0,0 +1,12 @@
+#ifndef __TGTD_STUB_H__
+#define __TGTD_STUB_H__
+
+/*
+ * The event loop and the parts of tgtd.c, mgmt.c and the iscsi driver
+ * that target.c, the backing stores and the work timer reach into, for
+ * in process tools that drive the SCSI core through a fake LLD.
+ */
+extern int tgtd_stub_init(char *program_name);
+extern void tgtd_stub_poll(int timeout);
+
+#endif
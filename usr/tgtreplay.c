@@ -0,0 +1,793 @@
+/*
+ *	Replay LU workload captures
+ *
+ * Plays a capture written by tgtd (the capture=<path> LU parameter)
+ * back through the SCSI layer and backing store templates of tgtd
+ * itself, at the original pace, a scaled one or flat out, and reports
+ * the latency distribution next to the captured one. A fake low level
+ * driver stands in for iscsi like in pipe_bench, and a minimal event
+ * loop stands in for tgtd's, so any bstype tgtd has can be replayed;
+ * bs_hyc too when built against hyc_sim (make HYC_SIM=1).
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "list.h"
+#include "util.h"
+#include "tgtd.h"
+#include "driver.h"
+#include "scsi.h"
+#include "target.h"
+#include "work.h"
+#include "log.h"
+#include "capture.h"
+#include "tgtd_stub.h"
+#include "TgtInterface.h"
+
+#define USEC_PER_SEC	1000000ULL
+#define LATE_USECS	1000
+#define HIST_BUCKETS	24	/* 1us .. 8s, power of two */
+
+#define REPLAY_TID	1
+#define REPLAY_LUN	1
+#define REPLAY_TARGET	"iqn.2007-03.org.tgt:replay"
+
+enum {
+	OP_REPLAY,
+	OP_SHOW,
+};
+
+enum {
+	IO_READ,
+	IO_WRITE,
+	IO_SYNC,
+	IO_DISCARD,
+	IO_CLASSES,
+};
+
+static const char *class_name[IO_CLASSES] = {
+	"read", "write", "sync", "discard",
+};
+
+struct replay_io {
+	uint64_t stamp;
+	uint64_t offset;
+	uint64_t length;
+	uint32_t orig_latency;
+	uint8_t opcode;
+	uint8_t flags;
+	int result;
+
+	uint64_t issue;		/* usecs */
+	uint64_t done;
+};
+
+struct replay_cmd {
+	struct scsi_cmd scmd;
+	uint8_t cdb[16];
+	uint8_t unmap[24];	/* UNMAP header and one block descriptor */
+	struct replay_io *io;
+	struct list_head list;	/* free_cmds or done_cmds */
+};
+
+struct replay {
+	char *bstype;
+	char *bsopts;
+	char *bsoflags;
+	char *stord;
+	unsigned int depth;
+	double speed;
+	void *buf;		/* shared by every command, contents don't matter */
+
+	struct replay_io *ios;
+	size_t nr_ios;
+	uint64_t max_length;	/* of a READ or WRITE, sizes buf */
+	int discards;
+
+	struct scsi_lu *lu;
+	uint64_t size;
+	uint64_t tag;
+	unsigned int inflight;
+	struct list_head free_cmds;
+	struct list_head done_cmds;
+};
+
+static char program_name[] = "tgtreplay";
+
+static char *short_options = "ho:f:b:E:S:O:H:s:q:";
+
+struct option const long_options[] = {
+	{"help", no_argument, NULL, 'h'},
+	{"op", required_argument, NULL, 'o'},
+	{"file", required_argument, NULL, 'f'},
+	{"backing-store", required_argument, NULL, 'b'},
+	{"bstype", required_argument, NULL, 'E'},
+	{"bsopts", required_argument, NULL, 'S'},
+	{"bsoflags", required_argument, NULL, 'O'},
+	{"stord", required_argument, NULL, 'H'},
+	{"speed", required_argument, NULL, 's'},
+	{"queue-depth", required_argument, NULL, 'q'},
+	{NULL, 0, NULL, 0},
+};
+
+static void usage(int status)
+{
+	if (status != 0)
+		fprintf(stderr, "Try `%s --help' for more information.\n", program_name);
+	else {
+		printf("Usage: %s [OPTION]\n", program_name);
+		printf("\
+Linux SCSI Target Framework Workload Replay Utility, version %s\n\
+\n\
+  --op replay --file=[capture] --backing-store=[path] [--bstype=[type]]\n\
+	[--bsopts=[options]] [--bsoflags=[flags]] [--stord=[ip:port]]\n\
+	[--speed=[factor]] [--queue-depth=[n]]\n\
+			replay a LU capture against [path] through\n\
+			the tgtd backing store [type] (default\n\
+			rdwr), set up with [options] and [flags]\n\
+			as by tgtadm.\n\
+			DATA ON [path] IS OVERWRITTEN.\n\
+			[ip:port] is the stord to connect hyc to.\n\
+			[factor] scales the captured pace, 2 replays\n\
+				twice as fast, 0 as fast as possible\n\
+				(default 1).\n\
+			[n] is the most commands in flight\n\
+				(default 16).\n\
+  --op show --file=[capture]\n\
+			dump the capture records.\n\
+  --help                display this help and exit\n\
+\n\
+Report bugs to <stgt@vger.kernel.org>.\n", TGT_VERSION);
+	}
+	exit(status == 0 ? 0 : EINVAL);
+}
+
+static uint64_t now_usecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static int io_class(struct replay_io *io)
+{
+	if (io->flags & CAPTURE_SYNC)
+		return IO_SYNC;
+	if (io->flags & CAPTURE_DISCARD)
+		return IO_DISCARD;
+	if (io->flags & CAPTURE_WRITE)
+		return IO_WRITE;
+	return IO_READ;
+}
+
+static int cmp_stamp(const void *a, const void *b)
+{
+	const struct replay_io *x = a, *y = b;
+
+	return x->stamp < y->stamp ? -1 : x->stamp > y->stamp;
+}
+
+static int capture_load(struct replay *r, char *path, struct capture_hdr *hdr)
+{
+	struct capture_rec rec;
+	struct stat st;
+	uint32_t rec_size;
+	char *recbuf;
+	FILE *fp;
+	size_t i;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "can't open %s: %m\n", path);
+		return -1;
+	}
+
+	if (fread(hdr, sizeof(*hdr), 1, fp) != 1 ||
+	    memcmp(hdr->magic, CAPTURE_MAGIC, sizeof(hdr->magic))) {
+		fprintf(stderr, "%s is not a tgtd capture\n", path);
+		goto fail;
+	}
+	if (le32toh(hdr->version) != CAPTURE_VERSION) {
+		fprintf(stderr, "%s: capture version %u, expected %u\n", path,
+			le32toh(hdr->version), CAPTURE_VERSION);
+		goto fail;
+	}
+	rec_size = le32toh(hdr->rec_size);
+	if (rec_size < sizeof(rec)) {
+		fprintf(stderr, "%s: bad record size %u\n", path, rec_size);
+		goto fail;
+	}
+
+	fstat(fileno(fp), &st);
+	r->nr_ios = (st.st_size - sizeof(*hdr)) / rec_size;
+	r->ios = calloc(r->nr_ios ? : 1, sizeof(*r->ios));
+	recbuf = malloc(rec_size);
+	if (!r->ios || !recbuf) {
+		fprintf(stderr, "out of memory for %zu records\n", r->nr_ios);
+		goto fail;
+	}
+
+	for (i = 0; i < r->nr_ios; i++) {
+		struct replay_io *io = &r->ios[i];
+
+		if (fread(recbuf, rec_size, 1, fp) != 1)
+			break;
+		memcpy(&rec, recbuf, sizeof(rec));
+
+		io->stamp = le64toh(rec.stamp);
+		io->offset = le64toh(rec.offset);
+		io->length = le64toh(rec.length);
+		io->orig_latency = le32toh(rec.latency);
+		io->opcode = rec.opcode;
+		io->flags = rec.flags;
+		io->result = rec.status;
+		if (io_class(io) <= IO_WRITE && io->length > r->max_length)
+			r->max_length = io->length;
+	}
+	r->nr_ios = i;
+	free(recbuf);
+	fclose(fp);
+
+	/* records are written as commands complete */
+	qsort(r->ios, r->nr_ios, sizeof(*r->ios), cmp_stamp);
+	return 0;
+fail:
+	fclose(fp);
+	return -1;
+}
+
+static void capture_show(struct replay *r, struct capture_hdr *hdr)
+{
+	time_t start = le64toh(hdr->start);
+	size_t i;
+
+	printf("Started: %s", ctime(&start));
+	printf("LU size: %" PRIu64 ", block size: %u, records: %zu\n",
+	       le64toh(hdr->lu_size), 1U << le32toh(hdr->blk_shift),
+	       r->nr_ios);
+	printf("%12s %4s %16s %10s %10s %-7s %s\n", "usecs", "op", "offset",
+	       "length", "latency", "class", "status");
+
+	for (i = 0; i < r->nr_ios; i++) {
+		struct replay_io *io = &r->ios[i];
+
+		printf("%12" PRIu64 " 0x%02x %16" PRIu64 " %10" PRIu64
+		       " %10u %-7s%s 0x%x\n", io->stamp, io->opcode, io->offset, io->length,
+		       io->orig_latency, class_name[io_class(io)],
+		       io->flags & CAPTURE_FUA ? "F" : " ", io->result);
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void print_percentiles(const char *label, uint64_t *v, size_t nr)
+{
+	static const double pct[] = {50, 90, 99, 99.9};
+	uint64_t sum = 0;
+	size_t i;
+
+	qsort(v, nr, sizeof(*v), cmp_u64);
+	for (i = 0; i < nr; i++)
+		sum += v[i];
+
+	printf("    %-8s avg %8" PRIu64, label, sum / nr);
+	for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++)
+		printf("  p%-4g %8" PRIu64, pct[i],
+		       v[(size_t)(pct[i] / 100 * (nr - 1))]);
+	printf("  max %8" PRIu64 "\n", v[nr - 1]);
+}
+
+static void print_histogram(uint64_t *v, size_t nr)
+{
+	uint64_t hist[HIST_BUCKETS] = {0};
+	size_t i;
+	int b;
+
+	for (i = 0; i < nr; i++) {
+		b = v[i] ? 64 - __builtin_clzll(v[i]) : 0;
+		hist[b < HIST_BUCKETS ? b : HIST_BUCKETS - 1]++;
+	}
+
+	for (b = 0; b < HIST_BUCKETS; b++)
+		if (hist[b])
+			printf("    <%-10llu %10" PRIu64 " %5.1f%%\n",
+			       1ULL << b, hist[b], hist[b] * 100.0 / nr);
+}
+
+static void replay_report(struct replay *r, uint64_t elapsed, size_t late)
+{
+	uint64_t *lat, *orig;
+	size_t i, nr, errors;
+	int c;
+
+	printf("Replayed %zu commands in %.3fs with %s, speed %g, "
+	       "%zu issued over %ums late\n", r->nr_ios,
+	       (double)elapsed / USEC_PER_SEC, r->bstype, r->speed, late,
+	       LATE_USECS / 1000);
+
+	lat = calloc(r->nr_ios ? : 1, sizeof(*lat));
+	orig = calloc(r->nr_ios ? : 1, sizeof(*orig));
+	if (!lat || !orig) {
+		fprintf(stderr, "out of memory for the report\n");
+		return;
+	}
+
+	for (c = 0; c < IO_CLASSES; c++) {
+		for (i = nr = errors = 0; i < r->nr_ios; i++) {
+			struct replay_io *io = &r->ios[i];
+
+			if (io_class(io) != c)
+				continue;
+			lat[nr] = io->done - io->issue;
+			orig[nr] = io->orig_latency;
+			if (io->result)
+				errors++;
+			nr++;
+		}
+		if (!nr)
+			continue;
+
+		printf("%s: %zu commands, %zu errors, latency in usecs\n",
+		       class_name[c], nr, errors);
+		print_percentiles("capture", orig, nr);
+		print_percentiles("replay", lat, nr);
+		print_histogram(lat, nr);
+	}
+
+	free(lat);
+	free(orig);
+}
+
+/*
+ * Like iscsi, the command goes back to the SCSI layer only from the
+ * main loop, after its completion has been accounted.
+ */
+static struct replay *replay;
+
+static int replay_cmd_end_notify(uint64_t nid, int result,
+				 struct scsi_cmd *scmd)
+{
+	struct replay_cmd *rc = container_of(scmd, struct replay_cmd, scmd);
+
+	rc->io->done = now_usecs();
+	rc->io->result = result;
+	list_add_tail(&rc->list, &replay->done_cmds);
+	return 0;
+}
+
+static int replay_mgmt_end_notify(struct mgmt_req *mreq)
+{
+	return 0;
+}
+
+static struct tgt_driver replay_drv = {
+	.name			= "replay",
+	.cmd_end_notify		= replay_cmd_end_notify,
+	.mgmt_end_notify	= replay_mgmt_end_notify,
+	.default_bst		= "rdwr",
+};
+
+__attribute__((constructor)) static void replay_driver_constructor(void)
+{
+	register_driver(&replay_drv);
+}
+
+static void replay_reap(struct replay *r)
+{
+	struct replay_cmd *rc;
+
+	while (!list_empty(&r->done_cmds)) {
+		rc = list_first_entry(&r->done_cmds, struct replay_cmd, list);
+		list_del(&rc->list);
+		target_cmd_done(&rc->scmd);
+		list_add(&rc->list, &r->free_cmds);
+		r->inflight--;
+	}
+}
+
+static void replay_io_clamp(struct replay *r, struct replay_io *io)
+{
+	uint64_t mask = (1ULL << r->lu->blk_shift) - 1;
+
+	/* the capture may come from a bigger LU */
+	io->offset = (io->offset % r->size) & ~mask;
+	io->length = (io->length + mask) & ~mask;
+	if (io->length > r->size - io->offset)
+		io->length = r->size - io->offset;
+	/* a CDB or UNMAP descriptor holds a 32 bit block count */
+	if (io->length > (uint64_t)UINT32_MAX << r->lu->blk_shift)
+		io->length = (uint64_t)UINT32_MAX << r->lu->blk_shift;
+}
+
+static void replay_cdb_rw(uint8_t *cdb, uint8_t opcode, uint64_t lba,
+			  uint32_t blocks)
+{
+	cdb[0] = opcode;
+	put_unaligned_be64(lba, cdb + 2);
+	put_unaligned_be32(blocks, cdb + 10);
+}
+
+static int replay_submit(struct replay *r, struct replay_io *io)
+{
+	struct replay_cmd *rc;
+	struct scsi_cmd *scmd;
+	unsigned int shift = r->lu->blk_shift;
+	int ret;
+
+	rc = list_first_entry(&r->free_cmds, struct replay_cmd, list);
+	list_del(&rc->list);
+	memset(rc, 0, sizeof(*rc));
+	rc->io = io;
+
+	scmd = &rc->scmd;
+	scmd->scb = rc->cdb;
+	scmd->scb_len = sizeof(rc->cdb);
+	scmd->cmd_itn_id = 1;
+	scmd->tag = r->tag++;
+	scmd->attribute = MSG_SIMPLE_TAG;
+	scmd->lun[1] = REPLAY_LUN;
+
+	switch (io_class(io)) {
+	case IO_SYNC:
+		rc->cdb[0] = SYNCHRONIZE_CACHE_16;
+		scsi_set_data_dir(scmd, DATA_NONE);
+		break;
+	case IO_DISCARD:
+		rc->cdb[0] = UNMAP;
+		put_unaligned_be16(sizeof(rc->unmap), rc->cdb + 7);
+		put_unaligned_be16(sizeof(rc->unmap) - 2, rc->unmap);
+		put_unaligned_be16(16, rc->unmap + 2);
+		put_unaligned_be64(io->offset >> shift, rc->unmap + 8);
+		put_unaligned_be32(io->length >> shift, rc->unmap + 16);
+		scsi_set_data_dir(scmd, DATA_WRITE);
+		scsi_set_out_buffer(scmd, rc->unmap);
+		scsi_set_out_length(scmd, sizeof(rc->unmap));
+		break;
+	case IO_WRITE:
+		replay_cdb_rw(rc->cdb, WRITE_16, io->offset >> shift,
+			      io->length >> shift);
+		scsi_set_data_dir(scmd, DATA_WRITE);
+		scsi_set_out_buffer(scmd, r->buf);
+		scsi_set_out_length(scmd, io->length);
+		break;
+	default:
+		replay_cdb_rw(rc->cdb, READ_16, io->offset >> shift,
+			      io->length >> shift);
+		scsi_set_data_dir(scmd, DATA_READ);
+		scsi_set_in_buffer(scmd, r->buf);
+		scsi_set_in_length(scmd, io->length);
+		break;
+	}
+	if (io->flags & CAPTURE_FUA)
+		rc->cdb[1] |= 0x08;
+
+	r->inflight++;
+	ret = target_cmd_queue(REPLAY_TID, scmd);
+	if (ret) {
+		eprintf("failed to queue command %" PRIu64 ", %d\n",
+			scmd->tag, ret);
+		io->done = now_usecs();
+		io->result = SAM_STAT_CHECK_CONDITION;
+		list_add_tail(&rc->list, &r->done_cmds);
+	}
+	return ret;
+}
+
+/* the nexus starts with a POWER ON unit attention */
+static int replay_clear_ua(struct replay *r)
+{
+	struct replay_io tur = { .flags = CAPTURE_SYNC };
+	struct replay_cmd *rc;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		rc = list_first_entry(&r->free_cmds, struct replay_cmd, list);
+		list_del(&rc->list);
+		memset(rc, 0, sizeof(*rc));
+		rc->io = &tur;
+		rc->cdb[0] = TEST_UNIT_READY;
+		rc->scmd.scb = rc->cdb;
+		rc->scmd.scb_len = sizeof(rc->cdb);
+		rc->scmd.cmd_itn_id = 1;
+		rc->scmd.tag = r->tag++;
+		rc->scmd.attribute = MSG_SIMPLE_TAG;
+		rc->scmd.lun[1] = REPLAY_LUN;
+		scsi_set_data_dir(&rc->scmd, DATA_NONE);
+
+		r->inflight++;
+		if (target_cmd_queue(REPLAY_TID, &rc->scmd))
+			return -EIO;
+		while (r->inflight) {
+			replay_reap(r);
+			if (r->inflight)
+				tgtd_stub_poll(-1);
+		}
+	}
+	return 0;
+}
+
+static int replay_stord_connect(char *stord)
+{
+	char *hyc_argv[] = {program_name, NULL};
+	char *port;
+	int ret;
+
+	port = strrchr(stord, ':');
+	if (!port) {
+		fprintf(stderr, "stord must be ip:port, not %s\n", stord);
+		return -EINVAL;
+	}
+	*port++ = '\0';
+
+	HycStorInitialize(1, hyc_argv, stord, atoi(port));
+	ret = HycStorRpcServerConnect();
+	if (ret) {
+		fprintf(stderr, "can't connect to stord %s:%s\n", stord, port);
+		return -EIO;
+	}
+	return 0;
+}
+
+static int replay_setup(struct replay *r, char *path)
+{
+	char args[] = "targetname=" REPLAY_TARGET;
+	char tp[] = "thin_provisioning=1";
+	struct replay_cmd *cmds;
+	struct target *target;
+	char *params;
+	int lld, ret;
+	unsigned int i;
+
+	if (r->stord && replay_stord_connect(r->stord))
+		return -1;
+
+	lld = get_driver_index("replay");
+	replay_drv.drv_state = DRIVER_INIT;
+	INIT_LIST_HEAD(&replay_drv.target_list);
+
+	ret = tgt_target_create(lld, REPLAY_TID, args);
+	if (ret) {
+		fprintf(stderr, "can't create the target, %d\n", ret);
+		return -1;
+	}
+
+	ret = asprintf(&params, "bstype=%s,path=%s%s%s%s%s", r->bstype, path,
+		       r->bsopts ? ",bsopts=" : "", r->bsopts ? : "",
+		       r->bsoflags ? ",bsoflags=" : "", r->bsoflags ? : "");
+	if (ret < 0)
+		return -1;
+	ret = tgt_device_create(REPLAY_TID, TYPE_DISK, REPLAY_LUN, params, 1);
+	free(params);
+	if (ret) {
+		fprintf(stderr, "can't open %s with %s, %d\n", path,
+			r->bstype, ret);
+		return -1;
+	}
+	if (r->discards && tgt_device_update(REPLAY_TID, REPLAY_LUN, tp))
+		fprintf(stderr, "can't enable UNMAP, discards will fail\n");
+
+	ret = it_nexus_create(REPLAY_TID, 1, 0, NULL);
+	if (ret) {
+		fprintf(stderr, "can't create the nexus, %d\n", ret);
+		return -1;
+	}
+
+	target = it_nexus_lookup(REPLAY_TID, 1)->nexus_target;
+	list_for_each_entry(r->lu, &target->device_list, device_siblings)
+		if (r->lu->lun == REPLAY_LUN)
+			break;
+	r->size = r->lu->size;
+	if (!r->size) {
+		fprintf(stderr, "%s is empty\n", path);
+		return -1;
+	}
+
+	cmds = calloc(r->depth, sizeof(*cmds));
+	if (!cmds) {
+		fprintf(stderr, "out of memory for %u commands\n", r->depth);
+		return -1;
+	}
+	for (i = 0; i < r->depth; i++)
+		list_add_tail(&cmds[i].list, &r->free_cmds);
+
+	/* all zero writes would be turned into discards by zero detection */
+	if (posix_memalign(&r->buf, pagesize, r->max_length + 4096)) {
+		fprintf(stderr, "out of memory for a %" PRIu64 " byte buffer\n",
+			r->max_length);
+		return -1;
+	}
+	memset(r->buf, 0xa5, r->max_length + 4096);
+
+	return replay_clear_ua(r);
+}
+
+static void replay_teardown(struct replay *r)
+{
+	it_nexus_destroy(REPLAY_TID, 1);
+	tgt_device_destroy(REPLAY_TID, REPLAY_LUN, 1);
+	tgt_target_destroy(get_driver_index("replay"), REPLAY_TID, 1);
+}
+
+static int replay_run(struct replay *r, char *path)
+{
+	uint64_t start, due, now, end;
+	size_t i, late = 0;
+	int timeout;
+
+	if (replay_setup(r, path))
+		return -1;
+
+	start = now_usecs();
+	for (i = 0; i < r->nr_ios; i++) {
+		struct replay_io *io = &r->ios[i];
+
+		replay_io_clamp(r, io);
+
+		/*
+		 * Paced commands count from when they were due, so falling
+		 * behind shows up as latency rather than as a slower pace.
+		 */
+		due = start + (r->speed ? io->stamp / r->speed : 0);
+		for (;;) {
+			replay_reap(r);
+			now = now_usecs();
+			if (r->inflight < r->depth && now >= due)
+				break;
+			/* epoll sleeps whole msecs, spin for the rest */
+			timeout = -1;
+			if (r->inflight < r->depth)
+				timeout = (due - now) / 1000;
+			tgtd_stub_poll(timeout);
+		}
+
+		if (r->speed) {
+			if (now - due > LATE_USECS)
+				late++;
+			io->issue = due;
+		} else
+			io->issue = now;
+		replay_submit(r, io);
+	}
+
+	while (r->inflight) {
+		replay_reap(r);
+		if (r->inflight)
+			tgtd_stub_poll(-1);
+	}
+	end = now_usecs();
+
+	replay_teardown(r);
+
+	replay_report(r, end - start, late);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int ch, longindex;
+	int op = -1;
+	char *file = NULL, *path = NULL;
+	struct capture_hdr hdr;
+	struct replay r;
+	size_t i;
+
+	memset(&r, 0, sizeof(r));
+	r.bstype = "rdwr";
+	r.speed = 1;
+	r.depth = 16;
+	INIT_LIST_HEAD(&r.free_cmds);
+	INIT_LIST_HEAD(&r.done_cmds);
+	replay = &r;
+
+	while ((ch = getopt_long(argc, argv, short_options,
+				 long_options, &longindex)) >= 0) {
+		switch (ch) {
+		case 'o':
+			if (!strcmp(optarg, "replay"))
+				op = OP_REPLAY;
+			else if (!strcmp(optarg, "show"))
+				op = OP_SHOW;
+			else {
+				fprintf(stderr, "unknown operation: %s\n",
+					optarg);
+				exit(EINVAL);
+			}
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'b':
+			path = optarg;
+			break;
+		case 'E':
+			r.bstype = optarg;
+			break;
+		case 'S':
+			r.bsopts = optarg;
+			break;
+		case 'O':
+			r.bsoflags = optarg;
+			break;
+		case 'H':
+			r.stord = optarg;
+			break;
+		case 's':
+			r.speed = strtod(optarg, NULL);
+			if (r.speed < 0) {
+				fprintf(stderr, "speed must not be negative\n");
+				exit(EINVAL);
+			}
+			break;
+		case 'q':
+			r.depth = strtoul(optarg, NULL, 0);
+			if (!r.depth) {
+				fprintf(stderr, "queue depth must not be 0\n");
+				exit(EINVAL);
+			}
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+
+	if (optind < argc) {
+		fprintf(stderr, "unrecognized option '%s'\n", argv[optind]);
+		usage(1);
+	}
+
+	if (op < 0 || !file) {
+		fprintf(stderr, "'op' and 'file' options are necessary\n");
+		usage(1);
+	}
+
+	if (capture_load(&r, file, &hdr))
+		exit(1);
+
+	if (op == OP_SHOW) {
+		capture_show(&r, &hdr);
+		return 0;
+	}
+
+	if (!path) {
+		fprintf(stderr, "'backing-store' option is necessary\n");
+		usage(1);
+	}
+
+	for (i = 0; i < r.nr_ios; i++)
+		if (io_class(&r.ios[i]) == IO_DISCARD)
+			r.discards = 1;
+
+	if (tgtd_stub_init(program_name))
+		exit(1);
+
+	return replay_run(&r, path) ? 1 : 0;
+}
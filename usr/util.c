@@ -30,6 +30,11 @@
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 #include <sys/sysmacros.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "log.h"
 #include "util.h"
@@ -214,3 +219,101 @@ int spc_memcpy(uint8_t *dst, uint32_t *dst_remain_len,
 	}
 	return copy_len;
 }
+
+/* the buffer is bytes, so words are loaded with memcpy, not through a cast */
+static inline unsigned long zero_scan_word(const unsigned char *p)
+{
+	unsigned long w;
+
+	memcpy(&w, p, sizeof(w));
+	return w;
+}
+
+/*
+ * Zero scan of write buffers. Non-zero data usually shows up in the
+ * first few bytes, so every variant bails out at the first non-zero
+ * chunk. The widest vector unit the CPU has is picked once at startup.
+ */
+static int zero_scan_scalar(const unsigned char *p, size_t len)
+{
+	const size_t w = sizeof(unsigned long);
+
+	for (; len >= 4 * w; p += 4 * w, len -= 4 * w)
+		if (zero_scan_word(p) | zero_scan_word(p + w) |
+		    zero_scan_word(p + 2 * w) | zero_scan_word(p + 3 * w))
+			return 0;
+	for (; len; p++, len--)
+		if (*p)
+			return 0;
+	return 1;
+}
+
+#if defined(__x86_64__)
+static int zero_scan_sse2(const unsigned char *p, size_t len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc;
+
+	for (; len >= 64; p += 64, len -= 64) {
+		acc = _mm_or_si128(
+			_mm_or_si128(_mm_loadu_si128((const __m128i *) p),
+				_mm_loadu_si128((const __m128i *) (p + 16))),
+			_mm_or_si128(_mm_loadu_si128((const __m128i *) (p + 32)),
+				_mm_loadu_si128((const __m128i *) (p + 48))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff)
+			return 0;
+	}
+	return zero_scan_scalar(p, len);
+}
+
+__attribute__((target("avx2")))
+static int zero_scan_avx2(const unsigned char *p, size_t len)
+{
+	__m256i acc;
+
+	for (; len >= 128; p += 128, len -= 128) {
+		acc = _mm256_or_si256(
+			_mm256_or_si256(
+				_mm256_loadu_si256((const __m256i *) p),
+				_mm256_loadu_si256((const __m256i *) (p + 32))),
+			_mm256_or_si256(
+				_mm256_loadu_si256((const __m256i *) (p + 64)),
+				_mm256_loadu_si256((const __m256i *) (p + 96))));
+		if (!_mm256_testz_si256(acc, acc))
+			return 0;
+	}
+	return zero_scan_scalar(p, len);
+}
+
+static int (*zero_scan)(const unsigned char *, size_t) = zero_scan_sse2;
+
+__attribute__((constructor)) static void zero_scan_init(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		zero_scan = zero_scan_avx2;
+}
+#elif defined(__aarch64__)
+static int zero_scan_neon(const unsigned char *p, size_t len)
+{
+	uint8x16_t acc;
+
+	for (; len >= 64; p += 64, len -= 64) {
+		acc = vorrq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16)),
+			vorrq_u8(vld1q_u8(p + 32), vld1q_u8(p + 48)));
+		if (vmaxvq_u8(acc))
+			return 0;
+	}
+	return zero_scan_scalar(p, len);
+}
+
+#define zero_scan zero_scan_neon
+#else
+#define zero_scan zero_scan_scalar
+#endif
+
+/* true if all len bytes at buf are zero */
+int is_zero_buf(const void *buf, size_t len)
+{
+	return zero_scan(buf, len);
+}
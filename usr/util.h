@@ -44,6 +44,18 @@
 #define	DEFDMODE	(S_IRUSR|S_IWUSR|S_IXUSR|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH)
 #define	DEFFMODE	(S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH)
 
+#define CACHELINE_SIZE	64
+
+/*
+ * Breaks the build unless member ends within the first n cache lines
+ * of type, so that hot fields stay where a layout put them.
+ */
+#define BUILD_BUG_ON_COLD(type, member, n)				\
+	_Static_assert(__builtin_offsetof(type, member) +		\
+		       sizeof(((type *)0)->member) <= (n) * CACHELINE_SIZE, \
+		       #type "." #member " is not in the first " #n	\
+		       " cache lines")
+
 #define min(x,y) ({ \
 	typeof(x) _x = (x);	\
 	typeof(y) _y = (y);	\
@@ -70,6 +82,7 @@ extern int str_to_open_flags(char *buf);
 extern char *open_flags_to_str(char *dest, int flags);
 extern int spc_memcpy(uint8_t *dst, uint32_t *dst_remain_len,
 		      uint8_t *src, uint32_t src_len);
+extern int is_zero_buf(const void *buf, size_t len);
 
 #define zalloc(size)			\
 ({					\
@@ -97,6 +110,12 @@ static inline int between(uint32_t seq1, uint32_t seq2, uint32_t seq3)
 	return seq3 - seq2 >= seq1 - seq2;
 }
 
+/* multiplicative hash, same constant as the kernel's hash_32() */
+static inline uint32_t hash_32(uint32_t val, unsigned int bits)
+{
+	return (uint32_t)(val * 0x9e370001U) >> (32 - bits);
+}
+
 extern unsigned long pagesize, pageshift;
 
 #if defined(__NR_signalfd) && defined(USE_SIGNALFD)
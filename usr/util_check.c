@@ -0,0 +1,145 @@
+/*
+ * Checks of the util.c helpers, run by make test
+ *
+ * util.c is included rather than linked so that every zero scan
+ * variant can be called, not only the one picked for this CPU. Each
+ * one the CPU can run is fed the same table of lengths, at every head
+ * misalignment within a cache line, zero and with a single non-zero
+ * byte at each interesting position. The bytes on both sides of the
+ * range are non-zero, so a scan that reads past either end fails too.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, version 2 of the
+ * License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ */
+#include "util.c"
+
+#include <stdlib.h>
+
+/* log.c reaches into tgtd.c for it */
+char mgmt_path[256];
+
+struct zero_variant {
+	const char *name;
+	int (*scan)(const unsigned char *, size_t);
+	int supported;
+};
+
+static struct zero_variant zero_variants[] = {
+	{"scalar", zero_scan_scalar, 1},
+#if defined(__x86_64__)
+	{"sse2", zero_scan_sse2, 1},
+	{"avx2", zero_scan_avx2, 0},
+#elif defined(__aarch64__)
+	{"neon", zero_scan_neon, 1},
+#endif
+};
+
+/* around each vector width and unrolled loop step, plus a few big ones */
+static const size_t zero_lengths[] = {
+	0, 1, 2, 3, 7, 8, 9, 15, 16, 17, 24, 31, 32, 33, 47, 48, 63, 64,
+	65, 96, 127, 128, 129, 191, 192, 255, 256, 257, 511, 512, 513,
+	4095, 4096, 4097, 65536 + 72,
+};
+
+#define ZERO_MAX_MISALIGN	64
+#define ZERO_GUARD		64
+
+/* every position of short buffers, the edges and the middle of long ones */
+static int zero_pos_checked(size_t pos, size_t len)
+{
+	if (len <= 520)
+		return 1;
+	return pos < 136 || pos >= len - 136 || pos == len / 2;
+}
+
+static int zero_check_one(struct zero_variant *v, unsigned char *base,
+			  size_t misalign, size_t len)
+{
+	unsigned char *p = base + ZERO_GUARD + misalign;
+	static const unsigned char bytes[] = {0x01, 0x80};
+	size_t pos, b;
+	int failed = 0;
+
+	memset(base, 0xff, ZERO_GUARD + misalign);
+	memset(p, 0, len);
+	memset(p + len, 0xff, ZERO_GUARD);
+
+	if (v->scan(p, len) != 1) {
+		fprintf(stderr, "%s: zero buffer of %zu at +%zu not zero\n",
+			v->name, len, misalign);
+		failed++;
+	}
+
+	for (pos = 0; pos < len; pos++) {
+		if (!zero_pos_checked(pos, len))
+			continue;
+		for (b = 0; b < sizeof(bytes); b++) {
+			p[pos] = bytes[b];
+			if (v->scan(p, len) != 0) {
+				fprintf(stderr, "%s: 0x%02x at %zu of %zu at "
+					"+%zu missed\n", v->name, bytes[b],
+					pos, len, misalign);
+				failed++;
+			}
+		}
+		p[pos] = 0;
+	}
+	return failed;
+}
+
+static int zero_check(struct zero_variant *v, unsigned char *base)
+{
+	size_t i, misalign;
+	int failed = 0;
+
+	for (i = 0; i < ARRAY_SIZE(zero_lengths); i++)
+		for (misalign = 0; misalign < ZERO_MAX_MISALIGN; misalign++)
+			failed += zero_check_one(v, base, misalign,
+						 zero_lengths[i]);
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	struct zero_variant dispatch = {"is_zero_buf", NULL, 1};
+	size_t i, size;
+	unsigned char *base;
+	int failed = 0, ret;
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	zero_variants[2].supported = __builtin_cpu_supports("avx2");
+#endif
+	dispatch.scan = (int (*)(const unsigned char *, size_t)) is_zero_buf;
+
+	size = ZERO_GUARD + ZERO_MAX_MISALIGN +
+		zero_lengths[ARRAY_SIZE(zero_lengths) - 1] + ZERO_GUARD;
+	if (posix_memalign((void **)&base, 64, size)) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i <= ARRAY_SIZE(zero_variants); i++) {
+		struct zero_variant *v = i < ARRAY_SIZE(zero_variants) ?
+			&zero_variants[i] : &dispatch;
+
+		if (!v->supported) {
+			printf("%-12s skipped, not supported by this CPU\n",
+			       v->name);
+			continue;
+		}
+		ret = zero_check(v, base);
+		printf("%-12s %s\n", v->name, ret ? "FAILED" : "ok");
+		failed += ret;
+	}
+
+	free(base);
+	return failed ? 1 : 0;
+}